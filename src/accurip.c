@@ -0,0 +1,442 @@
+/***************************************************************************
+ * accurip.c: AccurateRip checksums and database lookup.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "curlfetch.h"
+#include "accurip.h"
+#include "x_mem.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Stereo samples in a CD sector. */
+#define SECTOR_SAMPLES      588
+
+/** Samples excluded at the start of the first and end of the last track.
+ * Drive read offsets mean these cannot be read reliably by all drives.
+ */
+#define EDGE_SAMPLES        (SECTOR_SAMPLES * 5)
+
+/** Size of the header of each response in a database dump. */
+#define DUMP_HEADER_BYTES   13
+
+/** Size of each track entry in a database dump. */
+#define DUMP_TRACK_BYTES    9
+
+/** Most bytes accepted for a database dump.
+ * Each pressing of a disc takes under 1KB, and a disc has few pressings.
+ */
+#define DUMP_MAX_BYTES      (1024 * 1024)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** A checksum submitted for some track, and the count of submissions. */
+typedef struct
+{
+    uint32_t crc;
+    uint32_t frame450Crc;
+    uint8_t  confidence;
+}
+arentry_t;
+
+
+/** The submitted checksums of some track. */
+typedef struct
+{
+    arentry_t *entry;
+    uint16_t   entryCount;
+}
+artrack_t;
+
+
+struct accurip
+{
+    uint16_t   trackCount;
+    artrack_t *track;
+};
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static uint32_t readLe32(const uint8_t *b)
+{
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+           ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+
+/** Read a whole file into memory.
+ * \returns The file contents, or NULL if the file could not be read.
+ */
+static uint8_t *readFile(const char *path, size_t *size)
+{
+    FILE    *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long     len;
+
+    if(f == NULL)
+    {
+        return NULL;
+    }
+
+    if(fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        data = x_malloc(len);
+
+        if(fread(data, len, 1, f) == 1)
+        {
+            *size = len;
+        }
+        else
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(f);
+
+    return data;
+}
+
+
+/** Save a fetched dump into the cache directory.
+ * The dump is written under a temporary name then renamed, so that other
+ * rip processes never see a partial file.
+ */
+static void cacheSave(const char *path, const uint8_t *data, size_t size)
+{
+    char  tmpPath[strlen(path) + 16];
+    FILE *f;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%ld", path, (long)getpid());
+
+    f = fopen(tmpPath, "wb");
+    if(f == NULL)
+    {
+        LogWarn("Warning: Failed to cache AccurateRip data to %s: %m\n", tmpPath);
+        return;
+    }
+
+    if(fwrite(data, size, 1, f) != 1 || fclose(f) != 0 || rename(tmpPath, path) != 0)
+    {
+        LogWarn("Warning: Failed to cache AccurateRip data to %s: %m\n", path);
+        unlink(tmpPath);
+    }
+}
+
+
+/** Parse a database dump, keeping the checksums that match the disc.
+ * A dump holds one response per pressing, each formed of a header giving
+ * the track count and disc IDs, followed by the confidence, checksum and
+ * a frame 450 checksum for each track.
+ */
+static void parseDump(accurip_t *a, const uint8_t *data, size_t size,
+                      uint32_t discId1, uint32_t discId2, uint32_t cddbId)
+{
+    size_t off = 0;
+
+    while(off + DUMP_HEADER_BYTES <= size)
+    {
+        const uint8_t  trackCount = data[off];
+        const uint8_t *t = &data[off + DUMP_HEADER_BYTES];
+
+        if(off + DUMP_HEADER_BYTES + (size_t)trackCount * DUMP_TRACK_BYTES > size)
+        {
+            LogWarn("Warning: Truncated AccurateRip response\n");
+            return;
+        }
+
+        if(trackCount == a->trackCount &&
+           readLe32(&data[off + 1]) == discId1 &&
+           readLe32(&data[off + 5]) == discId2 &&
+           readLe32(&data[off + 9]) == cddbId)
+        {
+            for(uint16_t n = 0; n < trackCount; n++, t += DUMP_TRACK_BYTES)
+            {
+                artrack_t *at = &a->track[n];
+
+                /* Tracks with no submission have zero confidence */
+                if(t[0] != 0)
+                {
+                    at->entry = x_realloc(at->entry, sizeof(arentry_t) * (at->entryCount + 1));
+                    at->entry[at->entryCount].confidence = t[0];
+                    at->entry[at->entryCount].crc = readLe32(&t[1]);
+                    at->entry[at->entryCount].frame450Crc = readLe32(&t[5]);
+                    at->entryCount++;
+                }
+            }
+        }
+
+        off += DUMP_HEADER_BYTES + (size_t)trackCount * DUMP_TRACK_BYTES;
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Start the AccurateRip checksums of a track.
+ * \param[in] firstTrack    True if this is the first track of the disc.
+ * \param[in] lastTrack     True if this is the last audio track of the disc.
+ * \param[in] totalSamples  Count of stereo samples in the track.
+ */
+void AccuRipCrcInit(arcrc_t *c, bool firstTrack, bool lastTrack, uint32_t totalSamples)
+{
+    c->v1 = 0;
+    c->v2 = 0;
+    c->pos = 1;
+    c->from = firstTrack ? EDGE_SAMPLES : 0;
+    c->to = totalSamples;
+
+    if(lastTrack)
+    {
+        c->to = totalSamples > EDGE_SAMPLES ? totalSamples - EDGE_SAMPLES : 0;
+    }
+}
+
+
+/** Add some stereo samples of a track to its AccurateRip checksums.
+ * \param[in] pcm      Interleaved left and right samples, in host order.
+ * \param[in] samples  Count of stereo samples.
+ */
+void AccuRipCrcUpdate(arcrc_t *c, const int16_t *pcm, size_t samples)
+{
+    uint32_t v1 = c->v1, v2 = c->v2, pos = c->pos;
+
+    for(size_t s = 0; s < samples; s++, pos++)
+    {
+        if(pos >= c->from && pos <= c->to)
+        {
+            const uint32_t w = (uint16_t)pcm[s * 2] | ((uint32_t)(uint16_t)pcm[s * 2 + 1] << 16);
+            const uint64_t p = (uint64_t)w * pos;
+
+            v1 += (uint32_t)p;
+            v2 += (uint32_t)p + (uint32_t)(p >> 32);
+        }
+    }
+
+    c->v1 = v1;
+    c->v2 = v2;
+    c->pos = pos;
+}
+
+
+/** Compute the FreeDB disc ID, which forms part of the AccurateRip key.
+ * \param[in] trackCount  Count of tracks, including any data tracks.
+ * \param[in] trackLba    The first sector of each track.
+ * \param[in] leadOutLba  The first sector of the lead-out.
+ */
+uint32_t AccuRipCddbId(uint16_t trackCount, const uint32_t trackLba[], uint32_t leadOutLba)
+{
+    uint32_t n = 0;
+
+    for(uint16_t t = 0; t < trackCount; t++)
+    {
+        /* Sum of the digits of the start time in seconds, including the
+         *  2 second pre-gap.
+         */
+        for(uint32_t secs = (trackLba[t] + 150) / 75; secs > 0; secs /= 10)
+        {
+            n += secs % 10;
+        }
+    }
+
+    const uint32_t len = (leadOutLba + 150) / 75 - (trackLba[0] + 150) / 75;
+
+    return ((n % 0xff) << 24) | (len << 8) | trackCount;
+}
+
+
+/** Get the AccurateRip data for some disc.
+ * The dump is read from the cache directory if present, otherwise it is
+ * fetched from the AccurateRip server and saved to the cache directory.
+ * \param[in] trackCount  Count of audio tracks.
+ * \param[in] trackLba    The first sector of each audio track.
+ * \param[in] leadOutLba  The first sector after the last audio track.
+ * \param[in] cddbId      The FreeDB ID of the disc.
+ * \param[in] cacheDir    Directory in which dumps are cached, or NULL.
+ * \returns The data, or NULL if the disc is unknown to AccurateRip.
+ */
+accurip_t *AccuRipLoad(uint16_t trackCount, const uint32_t trackLba[], uint32_t leadOutLba,
+                       uint32_t cddbId, const char *cacheDir)
+{
+    uint32_t   discId1 = leadOutLba, discId2 = leadOutLba * (trackCount + 1);
+    char       name[64], path[1024];
+    uint8_t   *data = NULL;
+    size_t     size = 0;
+    accurip_t *a;
+
+    for(uint16_t t = 0; t < trackCount; t++)
+    {
+        discId1 += trackLba[t];
+        discId2 += (trackLba[t] ? trackLba[t] : 1) * (t + 1);
+    }
+
+    snprintf(name, sizeof(name), "dBAR-%03" PRIu16 "-%08" PRIx32 "-%08" PRIx32 "-%08" PRIx32 ".bin",
+             trackCount, discId1, discId2, cddbId);
+
+    if(cacheDir)
+    {
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, name);
+        data = readFile(path, &size);
+    }
+
+    if(data == NULL)
+    {
+        curlbuf_t b;
+
+        memset(&b, 0, sizeof(b));
+        b.limit = DUMP_MAX_BYTES;
+
+        if(!CurlFetchStream(CURL_CLASS_ACCURIP, CurlSinkBuf, &b, "http://www.accuraterip.com/accuraterip/%x/%x/%x/%s",
+                            discId1 & 0xf, (discId1 >> 4) & 0xf, (discId1 >> 8) & 0xf, name) ||
+           b.size == 0)
+        {
+            LogInf("No AccurateRip data for %s\n", name);
+            free(b.data);
+            return NULL;
+        }
+
+        data = (uint8_t *)b.data;
+        size = b.size;
+
+        if(cacheDir)
+        {
+            cacheSave(path, data, size);
+        }
+    }
+
+    a = x_calloc(sizeof(accurip_t), 1);
+    a->trackCount = trackCount;
+    a->track = x_calloc(sizeof(artrack_t), trackCount);
+
+    parseDump(a, data, size, discId1, discId2, cddbId);
+    free(data);
+
+    return a;
+}
+
+
+/** Check the checksums of some track against the database.
+ * \param[in] track  The audio track, counting from 1.
+ * \returns The count of matching submissions, or 0 if the track does not
+ *           match any submission.
+ */
+uint32_t AccuRipConfidence(const accurip_t *a, uint16_t track, const arcrc_t *c)
+{
+    uint32_t confidence = 0;
+
+    if(a == NULL || track < 1 || track > a->trackCount)
+    {
+        return 0;
+    }
+
+    const artrack_t *at = &a->track[track - 1];
+
+    for(uint16_t e = 0; e < at->entryCount; e++)
+    {
+        if(at->entry[e].crc == c->v1 || at->entry[e].crc == c->v2)
+        {
+            confidence += at->entry[e].confidence;
+        }
+    }
+
+    return confidence;
+}
+
+
+/** Check the checksum of sector 450 of some track against the database.
+ * This sector is checksummed separately so that the read offset of a drive
+ * can be found by trying offsets around it.
+ * \param[in] track  The audio track, counting from 1.
+ * \param[in] pcm    The 588 stereo samples of the sector, in host order.
+ * \returns The count of matching submissions, or 0 if none match.
+ */
+uint32_t AccuRipFrame450Confidence(const accurip_t *a, uint16_t track, const int16_t *pcm)
+{
+    uint32_t confidence = 0, crc = 0;
+
+    if(a == NULL || track < 1 || track > a->trackCount)
+    {
+        return 0;
+    }
+
+    for(uint32_t s = 0; s < SECTOR_SAMPLES; s++)
+    {
+        const uint32_t w = (uint16_t)pcm[s * 2] | ((uint32_t)(uint16_t)pcm[s * 2 + 1] << 16);
+
+        crc += w * (s + 1);
+    }
+
+    const artrack_t *at = &a->track[track - 1];
+
+    for(uint16_t e = 0; e < at->entryCount; e++)
+    {
+        if(at->entry[e].frame450Crc == crc)
+        {
+            confidence += at->entry[e].confidence;
+        }
+    }
+
+    return confidence;
+}
+
+
+void AccuRipFree(accurip_t *a)
+{
+    if(a)
+    {
+        for(uint16_t t = 0; t < a->trackCount; t++)
+        {
+            free(a->track[t].entry);
+        }
+
+        free(a->track);
+        free(a);
+    }
+}
+
+/* END OF FILE */
@@ -0,0 +1,70 @@
+/***************************************************************************
+ * accurip.h: Interface to AccurateRip checksums and database lookup.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef ACCURIP_H
+#define ACCURIP_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** Running AccurateRip v1 and v2 checksums of a track. */
+typedef struct
+{
+    uint32_t v1, v2;
+
+    /** Position of the next stereo sample, counting from 1. */
+    uint32_t pos;
+
+    /** Range of positions included in the checksums. */
+    uint32_t from, to;
+}
+arcrc_t;
+
+typedef struct accurip accurip_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+void       AccuRipCrcInit(arcrc_t *c, bool firstTrack, bool lastTrack, uint32_t totalSamples);
+void       AccuRipCrcUpdate(arcrc_t *c, const int16_t *pcm, size_t samples);
+
+uint32_t   AccuRipCddbId(uint16_t trackCount, const uint32_t trackLba[], uint32_t leadOutLba);
+accurip_t *AccuRipLoad(uint16_t trackCount, const uint32_t trackLba[], uint32_t leadOutLba,
+                       uint32_t cddbId, const char *cacheDir);
+uint32_t   AccuRipConfidence(const accurip_t *a, uint16_t track, const arcrc_t *c);
+uint32_t   AccuRipFrame450Confidence(const accurip_t *a, uint16_t track, const int16_t *pcm);
+void       AccuRipFree(accurip_t *a);
+
+#endif
+
+/* END OF FILE */
@@ -37,6 +37,9 @@
  * Manifest Constants
  **************************************************************************/
 
+/** Largest image accepted, beyond which a response is assumed to be bogus. */
+#define ART_MAX_BYTES (8 * 1024 * 1024)
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -61,8 +64,8 @@ struct art
 
 static const char *artUrl[] = { "http://images.amazon.com/images/P/%s.02._SCLZZZZZZZ_.jpg", /* UK */
                                 "http://images.amazon.com/images/P/%s.01._SCLZZZZZZZ_.jpg", /* US */
-                                "http://images.amazon.com/images/P/%s.03._SCLZZZZZZZ_.jpg"  /* DE */
-                                "http://images.amazon.com/images/P/%s.08._SCLZZZZZZZ_.jpg"  /* FR */
+                                "http://images.amazon.com/images/P/%s.03._SCLZZZZZZZ_.jpg", /* DE */
+                                "http://images.amazon.com/images/P/%s.08._SCLZZZZZZZ_.jpg", /* FR */
                                 "http://images.amazon.com/images/P/%s.09._SCLZZZZZZZ_.jpg"  /* JP */
                               };
 
@@ -85,6 +88,7 @@ art_t ArtGet(const char *asin)
 {
     uint8_t      attempt = 0;
     struct art  *art;
+    curlbuf_t    b;
 
     /* Bail if no ASIN has been supplied */
     if(asin == NULL || strlen(asin) == 0)
@@ -94,24 +98,22 @@ art_t ArtGet(const char *asin)
 
     art = x_calloc(sizeof(struct art),1);
 
+    /* The buffer is reused by each attempt, keeping its capacity */
+    memset(&b, 0, sizeof(b));
+    b.limit = ART_MAX_BYTES;
+
     do
     {
-        /* Free any previous attempt */
-        if(art->data)
-        {
-            free(art->data);
-        }
-
         /* Try to fetch the URL */
-        art->data = CurlFetch(&art->size, artUrl[attempt++], asin);
-        if(art->data)
+        b.size = 0;
+        if(CurlFetchStream(CURL_CLASS_ART, CurlSinkBuf, &b, artUrl[attempt++], asin) && b.size > 0)
         {
             MagickWand *mw;
 
             MagickWandGenesis();
             mw = NewMagickWand();
 
-            if(MagickReadImageBlob(mw, art->data, art->size))
+            if(MagickReadImageBlob(mw, b.data, b.size))
             {
                 art->width  = MagickGetImageWidth(mw);
                 art->height = MagickGetImageHeight(mw);
@@ -127,8 +129,9 @@ art_t ArtGet(const char *asin)
     while((art->width < 10 || art->height < 10) && attempt < M_ArraySize(artUrl));
 
     /* If not okay, free the memory */
-    if(attempt >= M_ArraySize(artUrl))
+    if(art->width < 10 || art->height < 10)
     {
+        free(b.data);
         ArtFree(art);
         art = NULL;
     }
@@ -138,6 +141,9 @@ art_t ArtGet(const char *asin)
 
         sprintf(format, "Product URL: %s\n", productUrl[attempt - 1]);
 
+        art->data = b.data;
+        art->size = b.size;
+
         /* Log the product URL if we got the art */
         LogInf(format, asin);
     }
@@ -172,6 +178,23 @@ struct art *ArtDup(struct art *art)
     return newArt;
 }
 
+/** Create art from image data and its properties.
+ * The data is copied, such as when art is received from another process.
+ */
+struct art *ArtNew(const void *data, size_t size, uint32_t width, uint32_t height, uint8_t depth)
+{
+    struct art *art = x_malloc(sizeof(struct art));
+
+    art->data = x_malloc(size);
+    memcpy(art->data, data, size);
+    art->size = size;
+    art->width = width;
+    art->height = height;
+    art->depth = depth;
+
+    return art;
+}
+
 size_t ArtGetSizeBytes(struct art *art)
 {
     return art->size;
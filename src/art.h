@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 /**************************************************************************
  * Macros
@@ -43,6 +44,7 @@ typedef struct art *art_t;
 
 art_t    ArtGet(const char *asin);
 art_t    ArtDup(struct art *art);
+art_t    ArtNew(const void *data, size_t size, uint32_t width, uint32_t height, uint8_t depth);
 size_t   ArtGetSizeBytes(struct art *art);
 void    *ArtGetData(struct art *art);
 uint32_t ArtGetWidth(struct art *art);
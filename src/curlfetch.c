@@ -25,10 +25,19 @@
 #include "config.h"
 #endif
 #include <curl/curl.h>
+#include <sys/file.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "curlfetch.h"
 #include "x_mem.h"
 #include "log.h"
@@ -37,6 +46,33 @@
  * Manifest Constants
  **************************************************************************/
 
+/** Most idle handles kept for reuse. */
+#define CURL_IDLE_HANDLES  8
+
+/** Longest host name that is told apart from others. */
+#define CURL_HOST_MAX      256
+
+/** Longest delay before a retry, whatever the backoff or server asks. */
+#define CURL_RETRY_MAX_MS  30000
+
+/** Requests to a host timed before its own latency is used for hedging. */
+#define CURL_HEDGE_SAMPLES 5
+
+/** Most recent request times kept for each host. */
+#define CURL_LATENCY_SAMPLES 64
+
+/** Least milliseconds before hedging, so fast hosts are not always hedged. */
+#define CURL_HEDGE_MIN_MS  100
+
+/** Least bytes reserved by a buffer sink when the response size is unknown. */
+#define CURL_BUF_MIN       16384
+
+/** Most bytes reserved by a buffer sink from the size given by a response.
+ * Larger responses grow the buffer as the data is received, so a bogus
+ * Content-Length cannot cause a huge allocation.
+ */
+#define CURL_BUF_RESERVE_MAX (16 * 1024 * 1024)
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -45,94 +81,1369 @@
  * Types
  **************************************************************************/
 
-struct cfetch
+struct cstream
 {
-    char    *data;
-    size_t   size;
+    curlsink_t  sink;
+    void       *param;
+
+    /** Set once any data has been passed to the sink. */
+    bool        started;
 };
 
+/** Microseconds spent in each phase of some request or requests.
+ * The phases are resolving the host name, connecting including any TLS
+ * handshake, waiting for the first byte of the response once the request
+ * is sent, and receiving the rest of the response.
+ */
+typedef struct
+{
+    uint64_t dnsUs, connectUs, ttfbUs, transferUs;
+}
+curlphases_t;
+
+/** Total milliseconds of recent successful requests, as a ring in which
+ * the next sample replaces the oldest once full.
+ */
+typedef struct
+{
+    uint32_t ms[CURL_LATENCY_SAMPLES], count, next;
+}
+curlsamples_t;
+
+/** A host to which requests have been made.
+ * Requests may be limited by a token bucket, in which each request takes a
+ * token and a token is added every interval, up to the burst size.  Tokens
+ * are counted as milliseconds of credit, which go negative to reserve the
+ * next free slots for waiting requests so that they are spaced out.
+ * If a state directory is set, the bucket is kept in a file there so that
+ * it is shared by every process, and the fields here are unused.
+ */
+typedef struct curlhost
+{
+    char            *name;
+
+    /** Milliseconds per token, or 0 if unlimited, and most tokens held. */
+    uint32_t         intervalMs, burst;
+    int64_t          creditMs;
+    uint64_t         lastMs;
+
+    /** Count of requests, those reusing a connection, and their timings. */
+    uint32_t         requests, reused;
+    curlphases_t     total;
+
+    /** Count of retries, and of duplicate requests made when hedging. */
+    uint32_t         retries, hedges;
+
+    /** Requests made by this process, from which the logged percentiles
+     * are found, and recent requests by any process, used for hedging.
+     */
+    curlsamples_t    own, recent;
+
+    /** 95th percentile of the recent requests, found when first needed. */
+    uint32_t         p95Ms;
+    bool             p95Valid;
+
+    /** Set once any recent requests kept in the state directory are read. */
+    bool             loaded;
+
+    struct curlhost *next;
+}
+curlhost_t;
+
 /**************************************************************************
  * Local Variables
  **************************************************************************/
 
+static pthread_once_t  initOnce = PTHREAD_ONCE_INIT;
+
+/** Share handle through which all requests share the DNS cache and TLS
+ * sessions.  Open connections are not shared, as libcurl does not support
+ * sharing them between threads, but are kept by each idle handle.
+ */
+static CURLSH         *share = NULL;
+static pthread_mutex_t shareLock[CURL_LOCK_DATA_LAST];
+
+/** Handles kept for reuse, each keeping its connections open.
+ * Multi handles used for hedging are kept in the same way, as requests
+ * made through a multi handle use its connections.
+ */
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static CURL           *idle[CURL_IDLE_HANDLES];
+static uint16_t        idleCount = 0;
+static CURLM          *idleMulti[CURL_IDLE_HANDLES];
+static uint16_t        idleMultiCount = 0;
+
+static pthread_mutex_t hostLock = PTHREAD_MUTEX_INITIALIZER;
+static curlhost_t     *hostList = NULL;
+
+/** Directory in which state shared between processes is kept, if any. */
+static const char     *stateDir = NULL;
+
+/** If set, log the timings of each request. */
+static bool            trace = false;
+
+static const char     *const className[CURL_CLASS_COUNT] = { "mb", "art", "accurip" };
+
+/** Deadlines and retries of each class of request. */
+static curlpolicy_t    policy[CURL_CLASS_COUNT] =
+{
+    /* MusicBrainz, which answers 503 when its rate limit is exceeded */
+    { .connectMs = 10000, .totalMs = 60000, .lowSpeedBytes = 64, .lowSpeedSecs = 20,
+      .retries = 3, .backoffMs = 2000, .hedge = false, .hedgeMs = 0 },
+
+    /* Cover art, which is optional so is given up quickly */
+    { .connectMs = 10000, .totalMs = 30000, .lowSpeedBytes = 64, .lowSpeedSecs = 15,
+      .retries = 1, .backoffMs = 1000, .hedge = false, .hedgeMs = 2000 },
+
+    /* AccurateRip */
+    { .connectMs = 10000, .totalMs = 30000, .lowSpeedBytes = 64, .lowSpeedSecs = 15,
+      .retries = 2, .backoffMs = 1000, .hedge = false, .hedgeMs = 0 }
+};
+
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
-/** Callback for fetching URLs via CURL.
- */
-static size_t curlCallback(void *ptr, size_t size, size_t nmemb, void *param)
+static void shareLockFunc(CURL *ch, curl_lock_data data, curl_lock_access access, void *param)
 {
-    struct cfetch *mbr = (struct cfetch *)param;
-    size_t realsize = size * nmemb;
+    (void)ch;
+    (void)access;
+    (void)param;
+
+    pthread_mutex_lock(&shareLock[data]);
+}
 
-    mbr->data = x_realloc(mbr->data, mbr->size + realsize + 1);
-    memcpy(&mbr->data[mbr->size], ptr, realsize);
-    mbr->size += realsize;
-    mbr->data[mbr->size] = '\0';
 
-    return realsize;
+static void shareUnlockFunc(CURL *ch, curl_lock_data data, void *param)
+{
+    (void)ch;
+    (void)param;
+
+    pthread_mutex_unlock(&shareLock[data]);
 }
 
-/**************************************************************************
- * Global Functions
- **************************************************************************/
 
-/** Fetch some URL and return the contents in a memory buffer.
- * \param[in,out] size    Pointer to fill with the length of returned data.
- * \param[in]     urlFmt  The URL, or a printf-style format string for the URL.
- * \returns A pointer to the read data, or NULL if the fetch failed in any way.
+/** Free the handles and hosts at exit.
  */
-void *CurlFetch(size_t *size, const char *urlFmt, ...)
+static void cleanup(void)
 {
-    char          buf[1024];
-    struct cfetch cfdata;
-    CURL         *ch;
-    void         *res;
-    va_list       ap;
+    while(idleCount > 0)
+    {
+        curl_easy_cleanup(idle[--idleCount]);
+    }
 
-    memset(&cfdata, 0, sizeof(cfdata));
+    while(idleMultiCount > 0)
+    {
+        curl_multi_cleanup(idleMulti[--idleMultiCount]);
+    }
 
-    /* Formulate the URL */
-    va_start(ap, urlFmt);
-    vsnprintf(buf, sizeof(buf), urlFmt, ap);
-    va_end(ap);
+    curl_share_cleanup(share);
+    curl_global_cleanup();
 
-    ch = curl_easy_init();
-    if(ch == NULL)
+    while(hostList != NULL)
+    {
+        curlhost_t *h = hostList;
+
+        hostList = h->next;
+        free(h->name);
+        free(h);
+    }
+}
+
+
+/** Initialise libcurl and the share handle.
+ * This is called once, before the first request from any thread.
+ */
+static void init(void)
+{
+    if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK || (share = curl_share_init()) == NULL)
     {
         LogErr("Error: Failed to initialise libcurl\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Try to get the data */
-    curl_easy_setopt(ch, CURLOPT_URL, buf);
-    curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curlCallback);
-    curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *)&cfdata);
-    curl_easy_setopt(ch, CURLOPT_USERAGENT, "ripright/" VERSION);
-    curl_easy_setopt(ch, CURLOPT_FAILONERROR, 1);
+    for(uint16_t t = 0; t < CURL_LOCK_DATA_LAST; t++)
+    {
+        pthread_mutex_init(&shareLock[t], NULL);
+    }
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, shareLockFunc);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, shareUnlockFunc);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    atexit(cleanup);
+}
+
+
+/** Get the monotonic time in milliseconds.
+ */
+static uint64_t nowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/** Sleep until some monotonic time in milliseconds.
+ */
+static void sleepUntil(uint64_t ms)
+{
+    struct timespec wait;
+
+    wait.tv_sec = ms / 1000;
+    wait.tv_nsec = (ms % 1000) * 1000000;
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL) != 0)
+        ;
+}
+
 
-    if(curl_easy_perform(ch) == 0)
+/** Find a host, adding it if not yet known.
+ * \note hostLock must be held.
+ */
+static curlhost_t *findHost(const char *name)
+{
+    curlhost_t *h;
+
+    for(h = hostList; h != NULL; h = h->next)
     {
-        res = cfdata.data;
-        if(size != NULL)
+        if(strcmp(h->name, name) == 0)
         {
-            *size = cfdata.size;
+            return h;
         }
     }
-    else
+
+    h = x_zalloc(sizeof(curlhost_t));
+    h->name = x_strdup(name);
+    h->next = hostList;
+    hostList = h;
+
+    return h;
+}
+
+
+/** Get the host of some URL.
+ */
+static curlhost_t *urlHost(const char *url)
+{
+    char        name[CURL_HOST_MAX];
+    const char *s = strstr(url, "://");
+    size_t      len;
+    curlhost_t *h;
+
+    s = s != NULL ? s + 3 : url;
+    len = strcspn(s, "/:?#");
+    if(len >= sizeof(name))
+    {
+        len = sizeof(name) - 1;
+    }
+
+    memcpy(name, s, len);
+    name[len] = '\0';
+
+    pthread_mutex_lock(&hostLock);
+    h = findHost(name);
+    pthread_mutex_unlock(&hostLock);
+
+    return h;
+}
+
+
+/** Take a token from a bucket, returning the time of the slot reserved.
+ * \param[in,out] creditMs  The credit of the bucket.
+ * \param[in,out] lastMs    The time at which the credit was last updated.
+ * \returns The monotonic time until which the request must wait, or 0.
+ */
+static uint64_t takeToken(int64_t *creditMs, uint64_t *lastMs, uint32_t intervalMs, uint32_t burst)
+{
+    const int64_t  maxMs = (int64_t)burst * intervalMs;
+    const uint64_t now = nowMs();
+
+    *creditMs += now - *lastMs;
+    if(*creditMs > maxMs)
+    {
+        *creditMs = maxMs;
+    }
+
+    *lastMs = now;
+    *creditMs -= intervalMs;
+
+    return *creditMs < 0 ? now - *creditMs : 0;
+}
+
+
+/** Open and lock the file keeping some state of a host in the state directory.
+ * Each disc is ripped by its own process, so the file is locked while it
+ * is updated, in the same way as the drive profiles.  The file is opened
+ * for each use as the lock is held by the open file, and so would not
+ * otherwise exclude other threads.
+ * \param[in] host    The name of the host.
+ * \param[in] suffix  The kind of state, used as the file extension.
+ * \returns The locked file descriptor, or -1 if the file could not be used.
+ */
+static int lockHostFile(const char *host, const char *suffix)
+{
+    char path[strlen(stateDir) + strlen(host) + strlen(suffix) + 3];
+    int  fd;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", stateDir, host, suffix);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd >= 0 && flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+
+static void unlockHostFile(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+
+/** Replace the contents of a file opened by lockHostFile().
+ */
+static void writeHostFile(int fd, const char *host, const char *suffix, const char *data, size_t len)
+{
+    if(pwrite(fd, data, len, 0) != (ssize_t)len || ftruncate(fd, len) != 0)
+    {
+        LogWarn("Warning: Failed to write %s/%s.%s: %m\n", stateDir, host, suffix);
+    }
+}
+
+
+/** Take a token from the bucket of a host kept in the state directory.
+ * The monotonic clock is shared by all processes, but restarts at boot,
+ * so a bucket from the future is discarded.
+ * \param[out] slotMs  Pointer to fill with the time until which to wait.
+ * \retval false  If the file could not be used.
+ */
+static bool takeSharedToken(const char *host, uint32_t intervalMs, uint32_t burst, uint64_t *slotMs)
+{
+    char     buf[64];
+    int64_t  creditMs;
+    uint64_t lastMs;
+    ssize_t  n;
+    int      fd;
+
+    if((fd = lockHostFile(host, "ratelimit")) < 0)
+    {
+        return false;
+    }
+
+    n = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+
+    if(sscanf(buf, "%" SCNd64 " %" SCNu64, &creditMs, &lastMs) != 2 || lastMs > nowMs())
+    {
+        creditMs = (int64_t)burst * intervalMs;
+        lastMs = nowMs();
+    }
+
+    *slotMs = takeToken(&creditMs, &lastMs, intervalMs, burst);
+
+    n = snprintf(buf, sizeof(buf), "%" PRId64 " %" PRIu64 "\n", creditMs, lastMs);
+    writeHostFile(fd, host, "ratelimit", buf, n);
+    unlockHostFile(fd);
+
+    return true;
+}
+
+
+/** Wait until a request to some host is allowed by its rate limit.
+ * Each caller takes the next free slot, so concurrent callers are
+ * spaced out rather than released together.  The limit is shared with
+ * other processes if a state directory is set.
+ */
+static void rateLimit(curlhost_t *h)
+{
+    uint32_t intervalMs, burst;
+    uint64_t slotMs = 0;
+
+    pthread_mutex_lock(&hostLock);
+    intervalMs = h->intervalMs;
+    burst = h->burst;
+    pthread_mutex_unlock(&hostLock);
+
+    if(intervalMs == 0)
+    {
+        return;
+    }
+
+    if(stateDir == NULL || !takeSharedToken(h->name, intervalMs, burst, &slotMs))
+    {
+        pthread_mutex_lock(&hostLock);
+        slotMs = takeToken(&h->creditMs, &h->lastMs, intervalMs, burst);
+        pthread_mutex_unlock(&hostLock);
+    }
+
+    if(slotMs != 0)
+    {
+        sleepUntil(slotMs);
+    }
+}
+
+
+static int compareU32(const void *a, const void *b)
+{
+    const uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+
+/** Get some percentile of the latency of requests, by the nearest rank.
+ * \note hostLock must be held, and there must be samples.
+ */
+static uint32_t percentile(const curlsamples_t *s, uint8_t pct)
+{
+    uint32_t sorted[CURL_LATENCY_SAMPLES];
+    uint32_t rank = (s->count * pct + 99) / 100;
+
+    memcpy(sorted, s->ms, sizeof(uint32_t) * s->count);
+    qsort(sorted, s->count, sizeof(uint32_t), compareU32);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+
+/** Get the latency of a host after which requests are hedged.
+ * This is the 95th percentile, which is kept until another sample is added.
+ * \note hostLock must be held, and the host must have samples.
+ */
+static uint32_t hedgeLatency(curlhost_t *h)
+{
+    if(!h->p95Valid)
+    {
+        h->p95Ms = percentile(&h->recent, 95);
+        h->p95Valid = true;
+    }
+
+    return h->p95Ms;
+}
+
+
+/** Add the time of a successful request to some samples.
+ * \note hostLock must be held.
+ */
+static void addSample(curlsamples_t *s, uint32_t ms)
+{
+    s->ms[s->next] = ms;
+    s->next = (s->next + 1) % CURL_LATENCY_SAMPLES;
+    if(s->count < CURL_LATENCY_SAMPLES)
+    {
+        s->count++;
+    }
+}
+
+
+/** Read the samples of a host kept in a file opened by lockHostFile().
+ * \param[out] sampleMs  Array to fill with the samples, oldest first.
+ * \returns The count of samples read.
+ */
+static uint32_t readSamples(int fd, uint32_t sampleMs[CURL_LATENCY_SAMPLES])
+{
+    char     buf[CURL_LATENCY_SAMPLES * 11 + 1], *s = buf, *end;
+    uint32_t count = 0;
+    ssize_t  n;
+
+    n = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+
+    while(count < CURL_LATENCY_SAMPLES)
     {
-        res = NULL;
-        if(size != NULL)
+        unsigned long ms = strtoul(s, &end, 10);
+
+        if(end == s)
         {
-            *size = 0;
+            break;
         }
-        free(cfdata.data);
+
+        sampleMs[count++] = (uint32_t)ms;
+        s = end;
+    }
+
+    return count;
+}
+
+
+/** Replace the recent requests of a host with those from the state directory.
+ * \note hostLock must be held.
+ */
+static void setSamples(curlhost_t *h, const uint32_t *sampleMs, uint32_t count)
+{
+    memcpy(h->recent.ms, sampleMs, sizeof(uint32_t) * count);
+    h->recent.count = count;
+    h->recent.next = count % CURL_LATENCY_SAMPLES;
+    h->p95Valid = false;
+    h->loaded = true;
+}
+
+
+/** Read any samples of a host kept in the state directory.
+ * Each disc is ripped by a new process, which would otherwise have too few
+ * samples of its own for hedging by the latency of the host.
+ */
+static void loadSamples(curlhost_t *h)
+{
+    uint32_t sampleMs[CURL_LATENCY_SAMPLES], count;
+    int      fd;
+
+    if((fd = lockHostFile(h->name, "latency")) < 0)
+    {
+        count = 0;
     }
+    else
+    {
+        count = readSamples(fd, sampleMs);
+        unlockHostFile(fd);
+    }
+
+    pthread_mutex_lock(&hostLock);
+    if(!h->loaded && count > 0)
+    {
+        setSamples(h, sampleMs, count);
+    }
+    h->loaded = true;
+    pthread_mutex_unlock(&hostLock);
+}
+
+
+/** Add the time of a successful request to the samples of a host kept in
+ * the state directory, so that they are shared by all processes.
+ * \retval false  If the file could not be used.
+ */
+static bool shareSample(curlhost_t *h, uint32_t ms)
+{
+    uint32_t sampleMs[CURL_LATENCY_SAMPLES], count;
+    char     buf[CURL_LATENCY_SAMPLES * 11 + 1];
+    size_t   len = 0;
+    int      fd;
+
+    if((fd = lockHostFile(h->name, "latency")) < 0)
+    {
+        return false;
+    }
+
+    count = readSamples(fd, sampleMs);
+    if(count == CURL_LATENCY_SAMPLES)
+    {
+        memmove(&sampleMs[0], &sampleMs[1], sizeof(uint32_t) * --count);
+    }
+
+    sampleMs[count++] = ms;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        len += snprintf(&buf[len], sizeof(buf) - len, "%" PRIu32 "%c", sampleMs[i], i + 1 < count ? ' ' : '\n');
+    }
+
+    writeHostFile(fd, h->name, "latency", buf, len);
+    unlockHostFile(fd);
+
+    pthread_mutex_lock(&hostLock);
+    setSamples(h, sampleMs, count);
+    pthread_mutex_unlock(&hostLock);
+
+    return true;
+}
+
+
+/** Get the microseconds between two times given in seconds.
+ */
+static uint64_t phaseUs(double from, double to)
+{
+    return to > from ? (uint64_t)((to - from) * 1000000) : 0;
+}
 
-    curl_easy_cleanup(ch);
 
-    return res;
+/** Add the timings of a completed request to the statistics of its host.
+ * The total time of recent successful requests is kept to find
+ * percentiles, and shared with other processes if a state directory is set.
+ */
+static void recordTimings(curlhost_t *h, CURL *ch, const char *url, bool ok)
+{
+    double       nameLookup = 0, connect = 0, appConnect = 0;
+    double       preTransfer = 0, startTransfer = 0, total = 0;
+    long         connects = 0;
+    curlphases_t p;
+
+    curl_easy_getinfo(ch, CURLINFO_NAMELOOKUP_TIME, &nameLookup);
+    curl_easy_getinfo(ch, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(ch, CURLINFO_APPCONNECT_TIME, &appConnect);
+    curl_easy_getinfo(ch, CURLINFO_PRETRANSFER_TIME, &preTransfer);
+    curl_easy_getinfo(ch, CURLINFO_STARTTRANSFER_TIME, &startTransfer);
+    curl_easy_getinfo(ch, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(ch, CURLINFO_NUM_CONNECTS, &connects);
+
+    /* Times are from the start of the request; the TLS handshake ends last */
+    p.dnsUs      = phaseUs(0, nameLookup);
+    p.connectUs  = phaseUs(nameLookup, appConnect > connect ? appConnect : connect);
+    p.ttfbUs     = phaseUs(preTransfer, startTransfer);
+    p.transferUs = phaseUs(startTransfer, total);
+
+    pthread_mutex_lock(&hostLock);
+
+    h->requests++;
+    if(connects == 0)
+    {
+        h->reused++;
+    }
+
+    h->total.dnsUs      += p.dnsUs;
+    h->total.connectUs  += p.connectUs;
+    h->total.ttfbUs     += p.ttfbUs;
+    h->total.transferUs += p.transferUs;
+
+    if(ok)
+    {
+        addSample(&h->own, (uint32_t)(total * 1000));
+    }
+
+    pthread_mutex_unlock(&hostLock);
+
+    if(ok && (stateDir == NULL || !shareSample(h, (uint32_t)(total * 1000))))
+    {
+        pthread_mutex_lock(&hostLock);
+        addSample(&h->recent, (uint32_t)(total * 1000));
+        h->p95Valid = false;
+        pthread_mutex_unlock(&hostLock);
+    }
+
+    if(trace)
+    {
+        LogInf("%s: dns %.1fms, connect %.1fms, ttfb %.1fms, transfer %.1fms%s\n", url,
+               p.dnsUs / 1000.0, p.connectUs / 1000.0, p.ttfbUs / 1000.0, p.transferUs / 1000.0,
+               connects == 0 ? " (reused)" : "");
+    }
+}
+
+
+/** Get a handle, reusing an idle one if possible.
+ */
+static CURL *getHandle(void)
+{
+    CURL *ch = NULL;
+
+    pthread_mutex_lock(&idleLock);
+    if(idleCount > 0)
+    {
+        ch = idle[--idleCount];
+    }
+    pthread_mutex_unlock(&idleLock);
+
+    if(ch == NULL)
+    {
+        ch = curl_easy_init();
+        if(ch == NULL)
+        {
+            LogErr("Error: Failed to initialise libcurl\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return ch;
+}
+
+
+/** Return a handle for reuse.
+ * Resetting the options keeps any open connections and caches.
+ */
+static void putHandle(CURL *ch)
+{
+    curl_easy_reset(ch);
+
+    pthread_mutex_lock(&idleLock);
+    if(idleCount < CURL_IDLE_HANDLES)
+    {
+        idle[idleCount++] = ch;
+        ch = NULL;
+    }
+    pthread_mutex_unlock(&idleLock);
+
+    if(ch != NULL)
+    {
+        curl_easy_cleanup(ch);
+    }
+}
+
+
+/** Get a multi handle, reusing an idle one if possible.
+ * \returns The handle, or NULL if one could not be made.
+ */
+static CURLM *getMulti(void)
+{
+    CURLM *m = NULL;
+
+    pthread_mutex_lock(&idleLock);
+    if(idleMultiCount > 0)
+    {
+        m = idleMulti[--idleMultiCount];
+    }
+    pthread_mutex_unlock(&idleLock);
+
+    return m != NULL ? m : curl_multi_init();
+}
+
+
+/** Return a multi handle for reuse, once all its requests are removed.
+ */
+static void putMulti(CURLM *m)
+{
+    pthread_mutex_lock(&idleLock);
+    if(idleMultiCount < CURL_IDLE_HANDLES)
+    {
+        idleMulti[idleMultiCount++] = m;
+        m = NULL;
+    }
+    pthread_mutex_unlock(&idleLock);
+
+    if(m != NULL)
+    {
+        curl_multi_cleanup(m);
+    }
+}
+
+
+/** Make sure a buffer can hold some bytes and a terminator.
+ */
+static void bufReserve(curlbuf_t *b, size_t cap)
+{
+    if(cap > b->cap)
+    {
+        b->data = x_realloc(b->data, cap);
+        b->cap = cap;
+    }
+}
+
+
+/** Callback for streaming URLs via CURL.
+ * Returning a short count aborts the transfer if the sink fails.
+ */
+static size_t curlStreamCallback(void *ptr, size_t size, size_t nmemb, void *param)
+{
+    struct cstream *cs = (struct cstream *)param;
+    size_t realsize = size * nmemb;
+
+    cs->started = true;
+
+    return cs->sink(ptr, realsize, cs->param) ? realsize : 0;
+}
+
+
+/** Callback for the headers of a response.
+ * A buffer sink is sized from any Content-Length, so the response can be
+ * received without copying.  This is only a lower bound for a compressed
+ * response, which then grows as needed.
+ */
+static size_t curlHeaderCallback(char *ptr, size_t size, size_t nmemb, void *param)
+{
+    const struct cstream *cs = (const struct cstream *)param;
+    static const char     field[] = "content-length:";
+    const size_t          realsize = size * nmemb;
+
+    if(cs->sink == CurlSinkBuf && realsize > sizeof(field) - 1 && realsize < 64 &&
+       strncasecmp(ptr, field, sizeof(field) - 1) == 0)
+    {
+        curlbuf_t *b = cs->param;
+        char       value[64];
+        uint64_t   length;
+
+        memcpy(value, &ptr[sizeof(field) - 1], realsize - (sizeof(field) - 1));
+        value[realsize - (sizeof(field) - 1)] = '\0';
+
+        length = strtoull(value, NULL, 10);
+        if(length > CURL_BUF_RESERVE_MAX)
+        {
+            length = CURL_BUF_RESERVE_MAX;
+        }
+
+        if(length > 0 && (b->limit == 0 || length <= b->limit))
+        {
+            bufReserve(b, b->size + length + 1);
+        }
+    }
+
+    return realsize;
+}
+
+
+/** Discard any data received by a failed attempt, ready to retry.
+ * A buffer can be emptied and used again, but data passed to any other
+ * sink cannot be taken back, so only a stream that failed before any data
+ * was received can be retried.
+ * \retval false  If the request cannot be retried.
+ */
+static bool resetSink(struct cstream *cs)
+{
+    if(cs->sink == CurlSinkBuf)
+    {
+        ((curlbuf_t *)cs->param)->size = 0;
+        return true;
+    }
+
+    return !cs->started;
+}
+
+
+/** Set the options of a handle for a request.
+ */
+static void setup(CURL *ch, const curlpolicy_t *p, const char *url, struct cstream *cs)
+{
+    cs->started = false;
+
+    curl_easy_setopt(ch, CURLOPT_URL, url);
+    curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curlStreamCallback);
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, cs);
+    curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, curlHeaderCallback);
+    curl_easy_setopt(ch, CURLOPT_HEADERDATA, cs);
+    curl_easy_setopt(ch, CURLOPT_USERAGENT, "ripright/" VERSION);
+    curl_easy_setopt(ch, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(ch, CURLOPT_SHARE, share);
+    curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    /* Bound the time a stalled server can hold the request */
+    curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT_MS, (long)p->connectMs);
+    curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, (long)p->totalMs);
+    curl_easy_setopt(ch, CURLOPT_LOW_SPEED_LIMIT, (long)p->lowSpeedBytes);
+    curl_easy_setopt(ch, CURLOPT_LOW_SPEED_TIME, (long)p->lowSpeedSecs);
+
+    /* Accept any compression libcurl can decode, and HTTP/2 over TLS */
+    curl_easy_setopt(ch, CURLOPT_ACCEPT_ENCODING, "");
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(ch, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#endif
+}
+
+
+/** Get the result of a finished request.
+ * \param[out] code          Pointer to fill with the HTTP status, if any.
+ * \param[out] retryAfterMs  Pointer to fill with any delay the server asked
+ *                            for before a retry, or 0.
+ */
+static void getResult(CURL *ch, long *code, uint64_t *retryAfterMs)
+{
+    *code = 0;
+    *retryAfterMs = 0;
+
+    curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, code);
+
+#if LIBCURL_VERSION_NUM >= 0x074200
+    {
+        curl_off_t retryAfter = 0;
+
+        if(curl_easy_getinfo(ch, CURLINFO_RETRY_AFTER, &retryAfter) == CURLE_OK && retryAfter > 0)
+        {
+            *retryAfterMs = (uint64_t)retryAfter * 1000;
+        }
+    }
+#endif
+}
+
+
+/** Make a single attempt at a request.
+ */
+static CURLcode attempt(curlhost_t *h, const curlpolicy_t *p, const char *url, struct cstream *cs,
+                        long *code, uint64_t *retryAfterMs)
+{
+    CURLcode r;
+    CURL    *ch;
+
+    ch = getHandle();
+    setup(ch, p, url, cs);
+
+    r = curl_easy_perform(ch);
+
+    getResult(ch, code, retryAfterMs);
+    recordTimings(h, ch, url, r == CURLE_OK);
+
+    putHandle(ch);
+
+    return r;
+}
+
+
+/** Make a single attempt at a request to a buffer, hedged by a duplicate if slow.
+ * Both requests are run by a multi handle, each into its own buffer, and
+ * the first to succeed is used while the other is abandoned.
+ */
+static CURLcode attemptHedged(curlhost_t *h, const curlpolicy_t *p, const char *url, struct cstream *cs,
+                              long *code, uint64_t *retryAfterMs)
+{
+    curlbuf_t     *b = cs->param, hb[2];
+    struct cstream hcs[2];
+    CURL          *ch[2] = { NULL, NULL };
+    CURLcode       res[2] = { CURLE_OK, CURLE_OK };
+    bool           done[2] = { false, false };
+    uint8_t        started = 1, won = 2;
+    uint64_t       startMs, hedgeAtMs;
+    CURLM         *m;
+
+    m = getMulti();
+    if(m == NULL)
+    {
+        return attempt(h, p, url, cs, code, retryAfterMs);
+    }
+
+    /* The first request uses the buffer, the duplicate a new one */
+    hb[0] = *b;
+    memset(&hb[1], 0, sizeof(curlbuf_t));
+    hb[1].limit = b->limit;
+
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        hcs[i].sink = CurlSinkBuf;
+        hcs[i].param = &hb[i];
+    }
+
+    /* Hedge once the request is slower than most to the host */
+    startMs = nowMs();
+
+    pthread_mutex_lock(&hostLock);
+    hedgeAtMs = h->recent.count >= CURL_HEDGE_SAMPLES ? hedgeLatency(h) : p->hedgeMs;
+    pthread_mutex_unlock(&hostLock);
+
+    hedgeAtMs = startMs + (hedgeAtMs > CURL_HEDGE_MIN_MS ? hedgeAtMs : CURL_HEDGE_MIN_MS);
+
+    ch[0] = getHandle();
+    setup(ch[0], p, url, &hcs[0]);
+    curl_multi_add_handle(m, ch[0]);
+
+    while(won > 1)
+    {
+        const CURLMsg *msg;
+        int            running, queued;
+        int            waitMs = 1000;
+
+        curl_multi_perform(m, &running);
+
+        while((msg = curl_multi_info_read(m, &queued)) != NULL)
+        {
+            if(msg->msg == CURLMSG_DONE)
+            {
+                const uint8_t i = msg->easy_handle == ch[0] ? 0 : 1;
+
+                done[i] = true;
+                res[i] = msg->data.result;
+                if(res[i] == CURLE_OK && won > 1)
+                {
+                    won = i;
+                }
+            }
+        }
+
+        /* Stop if every request made has failed */
+        if(won > 1 && done[0] && (started == 1 || done[1]))
+        {
+            break;
+        }
+
+        if(won > 1 && started == 1)
+        {
+            const uint64_t now = nowMs();
+
+            if(now >= hedgeAtMs)
+            {
+                pthread_mutex_lock(&hostLock);
+                h->hedges++;
+                pthread_mutex_unlock(&hostLock);
+
+                if(trace)
+                {
+                    LogInf("%s: hedging after %" PRIu64 "ms\n", url, now - startMs);
+                }
+
+                ch[1] = getHandle();
+                setup(ch[1], p, url, &hcs[1]);
+                curl_multi_add_handle(m, ch[1]);
+                started = 2;
+            }
+            else if(hedgeAtMs - now < (uint64_t)waitMs)
+            {
+                waitMs = (int)(hedgeAtMs - now);
+            }
+        }
+
+        if(won > 1)
+        {
+            curl_multi_wait(m, NULL, 0, waitMs, NULL);
+        }
+    }
+
+    /* Use the winner, or else the first request if all failed */
+    if(won > 1)
+    {
+        won = 0;
+    }
+
+    getResult(ch[won], code, retryAfterMs);
+    recordTimings(h, ch[won], url, res[won] == CURLE_OK);
+
+    for(uint8_t i = 0; i < started; i++)
+    {
+        curl_multi_remove_handle(m, ch[i]);
+        putHandle(ch[i]);
+    }
+
+    putMulti(m);
+
+    *b = hb[won];
+    free(hb[!won].data);
+
+    return res[won];
+}
+
+
+/** Check if a failed request might succeed if retried.
+ */
+static bool isTransient(CURLcode r, long code)
+{
+    switch(r)
+    {
+        case CURLE_HTTP_RETURNED_ERROR:
+            /* Server errors, including 503 when rate limited */
+            return code >= 500 || code == 429;
+
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+/** Fetch some URL, passing the data to a sink.
+ * The request waits for any rate limit of the host, and reuses any open
+ * connection to the host.  Requests failing with a server error or timeout
+ * are retried with exponential backoff, if the sink allows.
+ * \param[in] cls  The class of the request.
+ * \param[in] url  The URL to fetch.
+ * \param[in] cs   The sink to receive the data.
+ * \retval true  If the transfer completed successfully.
+ */
+static bool perform(curlclass_t cls, const char *url, struct cstream *cs)
+{
+    const curlpolicy_t *p = &policy[cls];
+    curlhost_t         *h;
+
+    pthread_once(&initOnce, init);
+
+    h = urlHost(url);
+    if(stateDir != NULL && !h->loaded)
+    {
+        loadSamples(h);
+    }
+
+    for(uint8_t a = 0; ; a++)
+    {
+        uint64_t retryAfterMs, delayMs;
+        long     code;
+        CURLcode r;
+
+        rateLimit(h);
+
+        /* Only hedge fetches to a buffer, as other sinks cannot be duplicated */
+        if(p->hedge && cs->sink == CurlSinkBuf && h->intervalMs == 0)
+        {
+            r = attemptHedged(h, p, url, cs, &code, &retryAfterMs);
+        }
+        else
+        {
+            r = attempt(h, p, url, cs, &code, &retryAfterMs);
+        }
+
+        if(r == CURLE_OK)
+        {
+            return true;
+        }
+
+        if(a >= p->retries || !isTransient(r, code) || !resetSink(cs))
+        {
+            return false;
+        }
+
+        delayMs = (uint64_t)p->backoffMs << a;
+        if(retryAfterMs > delayMs)
+        {
+            delayMs = retryAfterMs;
+        }
+
+        if(delayMs > CURL_RETRY_MAX_MS)
+        {
+            delayMs = CURL_RETRY_MAX_MS;
+        }
+
+        if(code != 0)
+        {
+            LogWarn("Warning: %s failed with HTTP %ld: retrying in %" PRIu64 "ms\n", url, code, delayMs);
+        }
+        else
+        {
+            LogWarn("Warning: %s failed (%s): retrying in %" PRIu64 "ms\n", url, curl_easy_strerror(r), delayMs);
+        }
+
+        pthread_mutex_lock(&hostLock);
+        h->retries++;
+        pthread_mutex_unlock(&hostLock);
+
+        sleepUntil(nowMs() + delayMs);
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Get the name of a class of request, as used in options.
+ */
+const char *CurlClassName(curlclass_t cls)
+{
+    return className[cls];
+}
+
+
+/** Get the deadlines and retries of a class of request.
+ */
+void CurlGetPolicy(curlclass_t cls, curlpolicy_t *p)
+{
+    *p = policy[cls];
+}
+
+
+/** Set the deadlines and retries of a class of request.
+ * This should be set before any requests are made.
+ */
+void CurlSetPolicy(curlclass_t cls, const curlpolicy_t *p)
+{
+    policy[cls] = *p;
+}
+
+
+/** Limit the rate of requests to some host.
+ * Up to \a burst requests may be made at once, after which requests are
+ * spaced at least \a intervalMs apart.  Setting the same limit again has
+ * no effect.
+ * \param[in] host        The host name, as it appears in URLs.
+ * \param[in] intervalMs  Least milliseconds between requests, or 0 for no limit.
+ * \param[in] burst       Most requests that may be made without waiting.
+ */
+void CurlSetRateLimit(const char *host, uint32_t intervalMs, uint32_t burst)
+{
+    curlhost_t *h;
+
+    pthread_mutex_lock(&hostLock);
+
+    h = findHost(host);
+    if(h->intervalMs != intervalMs || h->burst != burst)
+    {
+        h->intervalMs = intervalMs;
+        h->burst = burst > 0 ? burst : 1;
+        h->creditMs = (int64_t)h->burst * intervalMs;
+        h->lastMs = nowMs();
+    }
+
+    pthread_mutex_unlock(&hostLock);
+}
+
+
+/** Set the directory in which state shared between processes is kept.
+ * Rate limits and the recent latency of each host are then shared by all
+ * processes using the same directory.
+ * This should be set before any requests are made.
+ * \param[in] dir  The directory, which must exist and is not copied.
+ */
+void CurlSetStateDir(const char *dir)
+{
+    stateDir = dir;
+}
+
+
+/** Set whether the timings of each request are logged.
+ */
+void CurlSetTrace(bool enable)
+{
+    trace = enable;
+}
+
+
+/** Log the requests made to each host, their latency percentiles and
+ * mean timings.  The percentiles are of the last requests made by this
+ * process, not those shared with other processes for hedging.
+ */
+void CurlLogStats(void)
+{
+    pthread_mutex_lock(&hostLock);
+
+    for(const curlhost_t *h = hostList; h != NULL; h = h->next)
+    {
+        if(h->requests > 0)
+        {
+            const double n = h->requests * 1000.0;
+
+            LogInf("HTTP %s: %" PRIu32 " requests, %" PRIu32 " reusing a connection, "
+                   "%" PRIu32 " retries, %" PRIu32 " hedged\n",
+                   h->name, h->requests, h->reused, h->retries, h->hedges);
+
+            if(h->own.count > 0)
+            {
+                LogInf("HTTP %s: latency p50 %" PRIu32 "ms, p95 %" PRIu32 "ms, p99 %" PRIu32 "ms\n",
+                       h->name, percentile(&h->own, 50), percentile(&h->own, 95), percentile(&h->own, 99));
+            }
+
+            LogInf("HTTP %s: mean dns %.1fms, connect %.1fms, ttfb %.1fms, transfer %.1fms\n",
+                   h->name, h->total.dnsUs / n, h->total.connectUs / n, h->total.ttfbUs / n, h->total.transferUs / n);
+        }
+    }
+
+    pthread_mutex_unlock(&hostLock);
+}
+
+
+/** Sink appending data to a growable buffer.
+ * The buffer is reserved from the size of the response if known, and
+ * otherwise grows geometrically.  The data is kept nul terminated.
+ * \param[in] param  Pointer to the curlbuf_t, which should be zeroed
+ *                   other than its limit before the first use.
+ * \retval false  If the data would exceed the limit of the buffer.
+ */
+bool CurlSinkBuf(const void *data, size_t len, void *param)
+{
+    curlbuf_t *b = param;
+
+    if(b->limit != 0 && b->size + len > b->limit)
+    {
+        return false;
+    }
+
+    if(b->size + len + 1 > b->cap)
+    {
+        size_t cap = b->cap > CURL_BUF_MIN ? b->cap : CURL_BUF_MIN;
+
+        while(cap < b->size + len + 1)
+        {
+            cap *= 2;
+        }
+
+        bufReserve(b, cap);
+    }
+
+    memcpy(&b->data[b->size], data, len);
+    b->size += len;
+    b->data[b->size] = '\0';
+
+    return true;
+}
+
+
+/** Sink writing data to a file descriptor.
+ * \param[in] param  Pointer to the int file descriptor.
+ * \retval false  If the data could not be written.
+ */
+bool CurlSinkFd(const void *data, size_t len, void *param)
+{
+    const int      fd = *(const int *)param;
+    const uint8_t *d = data;
+
+    while(len > 0)
+    {
+        ssize_t n = write(fd, d, len);
+
+        if(n < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        else if(n > 0)
+        {
+            d += n;
+            len -= n;
+        }
+    }
+
+    return true;
+}
+
+
+/** Fetch some URL and return the contents in a memory buffer.
+ * \param[in]     cls     The class of the request.
+ * \param[in,out] size    Pointer to fill with the length of returned data.
+ * \param[in]     urlFmt  The URL, or a printf-style format string for the URL.
+ * \returns A pointer to the read data, or NULL if the fetch failed in any way.
+ */
+void *CurlFetch(curlclass_t cls, size_t *size, const char *urlFmt, ...)
+{
+    char           buf[1024];
+    curlbuf_t      b;
+    struct cstream csdata;
+    va_list        ap;
+
+    memset(&b, 0, sizeof(b));
+    csdata.sink = CurlSinkBuf;
+    csdata.param = &b;
+
+    /* Formulate the URL */
+    va_start(ap, urlFmt);
+    vsnprintf(buf, sizeof(buf), urlFmt, ap);
+    va_end(ap);
+
+    if(!perform(cls, buf, &csdata))
+    {
+        free(b.data);
+        b.data = NULL;
+        b.size = 0;
+    }
+
+    if(size != NULL)
+    {
+        *size = b.size;
+    }
+
+    return b.data;
+}
+
+
+/** Fetch some URL, passing the contents to a sink as they arrive.
+ * Nothing is buffered, so the sink may consume the data as it is received,
+ * such as by writing it to a file or passing it to a parser.  If the sink
+ * is CurlSinkBuf(), the buffer is sized from the response and the request
+ * may be retried or hedged just as CurlFetch().
+ * \param[in] cls     The class of the request.
+ * \param[in] sink    Function to call with each piece of data.
+ * \param[in] param   Parameter to pass to \a sink.
+ * \param[in] urlFmt  The URL, or a printf-style format string for the URL.
+ * \retval true   If all the data was fetched and accepted by the sink.
+ * \retval false  If the fetch failed, or the sink returned false.
+ */
+bool CurlFetchStream(curlclass_t cls, curlsink_t sink, void *param, const char *urlFmt, ...)
+{
+    char           buf[1024];
+    struct cstream csdata;
+    va_list        ap;
+
+    csdata.sink = sink;
+    csdata.param = param;
+
+    /* Formulate the URL */
+    va_start(ap, urlFmt);
+    vsnprintf(buf, sizeof(buf), urlFmt, ap);
+    va_end(ap);
+
+    return perform(cls, buf, &csdata);
 }
 
 /* END OF FILE */
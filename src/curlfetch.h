@@ -24,6 +24,10 @@
  * Includes
  **************************************************************************/
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -32,11 +36,74 @@
  * Types
  **************************************************************************/
 
+/** Classes of request, each with its own deadlines and retries. */
+typedef enum
+{
+    CURL_CLASS_MB,          /**< MusicBrainz web service. */
+    CURL_CLASS_ART,         /**< Cover art. */
+    CURL_CLASS_ACCURIP,     /**< AccurateRip checksums. */
+
+    CURL_CLASS_COUNT
+}
+curlclass_t;
+
+/** Deadlines, retries and hedging for a class of request. */
+typedef struct
+{
+    /** Most milliseconds to connect, and to complete each attempt, or 0 for no limit. */
+    uint32_t connectMs, totalMs;
+
+    /** Abort an attempt slower than \a lowSpeedBytes per second for \a lowSpeedSecs. */
+    uint32_t lowSpeedBytes, lowSpeedSecs;
+
+    /** Retries after server errors or timeouts, and the delay before the
+     *  first, which is doubled for each retry after.
+     */
+    uint8_t  retries;
+    uint32_t backoffMs;
+
+    /** If set, a duplicate request is made if the first takes longer than
+     *  the 95th percentile latency of the host, or \a hedgeMs until enough
+     *  requests to the host have been timed.  The first to complete is used.
+     */
+    bool     hedge;
+    uint32_t hedgeMs;
+}
+curlpolicy_t;
+
+/** Function to receive the data of a streamed fetch.
+ * \returns false to abort the fetch.
+ */
+typedef bool (*curlsink_t)(const void *data, size_t len, void *param);
+
+/** Growable buffer filled by CurlSinkBuf(). */
+typedef struct
+{
+    char    *data;
+    size_t   size, cap;
+
+    /** Most bytes accepted, or 0 for no limit. */
+    size_t   limit;
+}
+curlbuf_t;
+
 /**************************************************************************
  * Prototypes
  **************************************************************************/
 
-void *CurlFetch(size_t *size, const char *urlFmt, ...);
+const char *CurlClassName(curlclass_t cls);
+void  CurlGetPolicy(curlclass_t cls, curlpolicy_t *policy);
+void  CurlSetPolicy(curlclass_t cls, const curlpolicy_t *policy);
+void  CurlSetRateLimit(const char *host, uint32_t intervalMs, uint32_t burst);
+void  CurlSetStateDir(const char *dir);
+void  CurlSetTrace(bool enable);
+void  CurlLogStats(void);
+
+bool  CurlSinkBuf(const void *data, size_t len, void *param);
+bool  CurlSinkFd(const void *data, size_t len, void *param);
+
+void *CurlFetch(curlclass_t cls, size_t *size, const char *urlFmt, ...);
+bool  CurlFetchStream(curlclass_t cls, curlsink_t sink, void *param, const char *urlFmt, ...);
 
 #endif
 
@@ -0,0 +1,169 @@
+/***************************************************************************
+ * damage.c: Damage maps saved with each output.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "damage.h"
+#include "x_mem.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Suffix added to the output filename to give the damage map filename.
+ * The map is a text file of the form:
+ *
+ *   disc <musicbrainz disc id>
+ *   track <track number>
+ *   sectors <first>-<last>
+ *   ...
+ *
+ * Sectors are counted from the start of the disc, as read before the read
+ * offset is applied.
+ */
+#define DAMAGE_SUFFIX ".damage"
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Save the damage map for some output.
+ * If there is no damage, any map from an earlier rip is removed.
+ */
+void DamageSave(const char *outFilename, const char *discId, uint16_t track,
+                const ripdamage_t *damage, uint32_t count)
+{
+    char  path[strlen(outFilename) + sizeof(DAMAGE_SUFFIX)];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s" DAMAGE_SUFFIX, outFilename);
+
+    if(count == 0)
+    {
+        if(unlink(path) != 0 && errno != ENOENT)
+        {
+            LogWarn("Warning: Failed to remove damage map %s: %m\n", path);
+        }
+        return;
+    }
+
+    f = fopen(path, "w");
+    if(f == NULL)
+    {
+        LogWarn("Warning: Failed to write damage map %s: %m\n", path);
+        return;
+    }
+
+    fprintf(f, "disc %s\n", discId);
+    fprintf(f, "track %" PRIu16 "\n", track);
+
+    for(uint32_t d = 0; d < count; d++)
+    {
+        fprintf(f, "sectors %ld-%ld\n", damage[d].first, damage[d].last);
+    }
+
+    if(fclose(f) != 0)
+    {
+        LogWarn("Warning: Failed to write damage map %s: %m\n", path);
+    }
+    else
+    {
+        LogInf("Track%02" PRIu16 ": Damage map saved to %s\n", track, path);
+    }
+}
+
+
+/** Load the damage map for some output.
+ * \param[out] discId  Set to the disc ID, which must be freed by the caller.
+ * \param[out] track   Set to the track number.
+ * \param[out] count   Set to the count of damaged ranges.
+ * \returns The damaged ranges, which must be freed by the caller, or NULL
+ *           if there is no map.
+ */
+ripdamage_t *DamageLoad(const char *outFilename, char **discId, uint16_t *track, uint32_t *count)
+{
+    char         path[strlen(outFilename) + sizeof(DAMAGE_SUFFIX)];
+    char         line[128], id[64];
+    ripdamage_t *damage = NULL;
+    FILE        *f;
+
+    snprintf(path, sizeof(path), "%s" DAMAGE_SUFFIX, outFilename);
+
+    f = fopen(path, "r");
+    if(f == NULL)
+    {
+        LogErr("Error: Failed to open damage map %s: %m\n", path);
+        return NULL;
+    }
+
+    *discId = NULL;
+    *track = 0;
+    *count = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        long     first, last;
+        uint16_t t;
+
+        if(sscanf(line, "disc %63s", id) == 1)
+        {
+            free(*discId);
+            *discId = x_strdup(id);
+        }
+        else if(sscanf(line, "track %" SCNu16, &t) == 1)
+        {
+            *track = t;
+        }
+        else if(sscanf(line, "sectors %ld-%ld", &first, &last) == 2 && first <= last)
+        {
+            damage = x_realloc(damage, sizeof(ripdamage_t) * (*count + 1));
+            damage[*count].first = first;
+            damage[*count].last = last;
+            (*count)++;
+        }
+    }
+
+    fclose(f);
+
+    if(*discId == NULL || *track == 0 || *count == 0)
+    {
+        LogErr("Error: Damage map %s is incomplete\n", path);
+        free(*discId);
+        free(damage);
+        return NULL;
+    }
+
+    return damage;
+}
+
+/* END OF FILE */
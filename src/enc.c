@@ -22,6 +22,7 @@
  **************************************************************************/
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <FLAC/stream_encoder.h>
 #include <FLAC/metadata.h>
 #include <sys/prctl.h>
@@ -36,7 +37,10 @@
 #include <errno.h>
 #include "encodetask.h"
 #include "x_mem.h"
-#include "bbuf.h"
+#include "enclevel.h"
+#include "pcmconv.h"
+#include "encpar.h"
+#include "encq.h"
 #include "enc.h"
 #include "log.h"
 
@@ -49,10 +53,25 @@
  **************************************************************************/
 
 /** Count of samples to read and send to the encoder.
- * This is simply the number of samples per channel which are read and
- * passed to the decoder in one go.
+ * This is the number of samples over all channels which are read, converted
+ * and passed to the encoder in one go.  Large blocks amortise the per-call
+ * overhead of the encoder and let the conversion run at full vector width.
  */
-#define ENC_BLOCK_SAMPLES 4096
+#define ENC_BLOCK_SAMPLES (64 * 1024)
+
+/** Minimum track length in samples to split over several threads.
+ * Shorter tracks are better encoded one per thread, but a long track at the
+ * end of a disc would otherwise leave the other threads idle.
+ */
+#define ENC_PARALLEL_MIN_SAMPLES (600 * 44100)
+
+/** Set if libFLAC can encode a single stream on several threads.
+ * This was added in FLAC 1.5; older versions split the track into segments
+ * which are encoded separately and then stitched together.
+ */
+#if defined(FLAC_API_VERSION_CURRENT) && FLAC_API_VERSION_CURRENT >= 14
+#define ENC_FLAC_THREADS
+#endif
 
 /**************************************************************************
  * Types
@@ -66,179 +85,544 @@
  * Local Functions
  **************************************************************************/
 
-/** Process the passed pathFilename and create each path element.
- * e.g. passed a/b/file.flac, this will create a/ then a/b.
+/** Create a Vorbis comment block holding the tags for some output.
+ * \returns The block, which must be freed with FLAC__metadata_object_delete(),
+ *           or NULL if allocation failed.
  */
-static void createPath(char *pathFilename)
+static FLAC__StreamMetadata *newVorbisComment(const encodeoutput_t *eo)
 {
-    char *slash = pathFilename;
+    FLAC__StreamMetadata *vc;
 
-    while((slash = strstr(slash, "/")) != NULL)
+    vc = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    if(vc == NULL || !FLAC__metadata_object_vorbiscomment_resize_comments(vc, eo->metaTagCount))
     {
-        *slash = '\0';
-
-        if(mkdir(pathFilename, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
-           errno != EEXIST)
+        LogErr("Failed to allocate memory for tags");
+        if(vc)
         {
-            LogWarn("Warning: Could not create '%s': %m\n", pathFilename);
+            FLAC__metadata_object_delete(vc);
         }
+        return NULL;
+    }
 
-        *slash = '/';
-        slash++;
+    /* Setup each tag */
+    for(uint32_t t = 0; t < eo->metaTagCount; t++)
+    {
+        FLAC__StreamMetadata_VorbisComment_Entry entry;
+
+        entry.entry = (FLAC__byte *)eo->metaTags[t];
+        entry.length = strlen(eo->metaTags[t]);
+
+        FLAC__metadata_object_vorbiscomment_set_comment(vc, t, entry, true);
     }
+
+    return vc;
 }
 
 
-static void *encWorker(void *param)
+/** Setup a picture block for some cover art.
+ * The block references the art data and so must not outlive it.
+ */
+static void initPicture(FLAC__StreamMetadata *ca, art_t art)
 {
-    bbuf_t                bb = param;
-    struct timeval        timeStart, timeEnd;
+    memset(ca, 0, sizeof(FLAC__StreamMetadata));
+
+    ca->type = FLAC__METADATA_TYPE_PICTURE;
+    ca->length = (sizeof(uint32_t) * 8) + strlen("image/jpeg") + strlen("Cover image") +
+                 ArtGetSizeBytes(art);
+    ca->data.picture.type = FLAC__STREAM_METADATA_PICTURE_TYPE_FRONT_COVER;
+    ca->data.picture.mime_type = "image/jpeg";
+    ca->data.picture.description = (FLAC__byte*)"Cover image";
+    ca->data.picture.colors = 0;
+    ca->data.picture.width = ArtGetWidth(art);
+    ca->data.picture.height = ArtGetHeight(art);
+    ca->data.picture.depth = ArtGetDepth(art);
+    ca->data.picture.data_length = ArtGetSizeBytes(art);
+    ca->data.picture.data = ArtGetData(art);
+}
 
-    prctl(PR_SET_NAME, "ripright: enc");
 
-    while(1)
+/** Write a big-endian value of the given byte count. */
+static void writeBe(FILE *out, uint32_t v, uint8_t bytes)
+{
+    while(bytes-- > 0)
     {
-        FLAC__StreamEncoderInitStatus  status;
-        FLAC__StreamEncoder           *fse;
-        encodetask_t                  *et;
-        uint8_t                        mdCount;
-        FLAC__StreamMetadata          *md[2], *vc, ca;
+        fputc((v >> (bytes * 8)) & 0xff, out);
+    }
+}
 
-        /* Wait for an encoding task */
-        et = BBufGet(bb);
 
-        /* If a null is recieved, it means the thread should exit */
-        if(et == NULL)
+/** Write a little-endian 32-bit value. */
+static void writeLe32(FILE *out, uint32_t v)
+{
+    for(uint8_t b = 0; b < 4; b++)
+    {
+        fputc((v >> (b * 8)) & 0xff, out);
+    }
+}
+
+
+/** Write a FLAC metadata block header. */
+static void writeBlockHeader(FILE *out, bool last, FLAC__MetadataType type, uint32_t length)
+{
+    fputc((last ? 0x80 : 0x00) | type, out);
+    writeBe(out, length, 3);
+}
+
+
+/** Serialise a Vorbis comment block.
+ * Note that the Vorbis comment lengths are little-endian, unlike the rest
+ * of the FLAC format.
+ */
+static void writeVorbisComment(FILE *out, bool last, const FLAC__StreamMetadata *vc)
+{
+    const FLAC__StreamMetadata_VorbisComment *c = &vc->data.vorbis_comment;
+    uint32_t length = 4 + c->vendor_string.length + 4;
+
+    for(uint32_t t = 0; t < c->num_comments; t++)
+    {
+        length += 4 + c->comments[t].length;
+    }
+
+    writeBlockHeader(out, last, FLAC__METADATA_TYPE_VORBIS_COMMENT, length);
+
+    writeLe32(out, c->vendor_string.length);
+    fwrite(c->vendor_string.entry, 1, c->vendor_string.length, out);
+    writeLe32(out, c->num_comments);
+
+    for(uint32_t t = 0; t < c->num_comments; t++)
+    {
+        writeLe32(out, c->comments[t].length);
+        fwrite(c->comments[t].entry, 1, c->comments[t].length, out);
+    }
+}
+
+
+/** Serialise a picture block. */
+static void writePicture(FILE *out, bool last, const FLAC__StreamMetadata *ca)
+{
+    const FLAC__StreamMetadata_Picture *p = &ca->data.picture;
+    const uint32_t mimeLen = strlen(p->mime_type);
+    const uint32_t descLen = strlen((const char *)p->description);
+
+    writeBlockHeader(out, last, FLAC__METADATA_TYPE_PICTURE, ca->length);
+
+    writeBe(out, p->type, 4);
+    writeBe(out, mimeLen, 4);
+    fwrite(p->mime_type, 1, mimeLen, out);
+    writeBe(out, descLen, 4);
+    fwrite(p->description, 1, descLen, out);
+    writeBe(out, p->width, 4);
+    writeBe(out, p->height, 4);
+    writeBe(out, p->depth, 4);
+    writeBe(out, p->colors, 4);
+    writeBe(out, p->data_length, 4);
+    fwrite(p->data, 1, p->data_length, out);
+}
+
+
+/** Serialise the Vorbis comment and picture blocks of an output.
+ * The last block written is flagged as the last metadata block.
+ * \param[in] vc  The Vorbis comment block, or NULL.
+ * \param[in] ca  The picture block, or NULL.
+ */
+static void writeTags(FILE *out, const FLAC__StreamMetadata *vc, const FLAC__StreamMetadata *ca)
+{
+    if(vc)
+    {
+        writeVorbisComment(out, ca == NULL, vc);
+    }
+
+    if(ca)
+    {
+        writePicture(out, true, ca);
+    }
+}
+
+
+/** Encode the raw audio of a task to some file.
+ * \param[in] md       Metadata blocks to write, or NULL.
+ * \param[in] mdCount  Count of metadata blocks.
+ * \param[in] threads  Count of threads to use, if supported by libFLAC.
+ * \returns true if the encode was successful.
+ */
+static bool encodeToFile(encodetask_t *et, const char *filename, FLAC__StreamMetadata **md, uint8_t mdCount,
+                         uint32_t threads __attribute__((__unused__)))
+{
+    FLAC__StreamEncoderInitStatus  status;
+    FLAC__StreamEncoder           *fse;
+    uint64_t                       sampleCount = 0;
+    int16_t                       *buffer16;
+    FLAC__int32                   *buffer32;
+
+    /* Create and setup a new encoder */
+    fse = FLAC__stream_encoder_new();
+    FLAC__stream_encoder_set_channels(fse, et->nChannels);
+    FLAC__stream_encoder_set_bits_per_sample(fse, et->bitsPerSample);
+    FLAC__stream_encoder_set_sample_rate(fse, et->sampleRateHz);
+    FLAC__stream_encoder_set_total_samples_estimate(fse, et->totalSamples);
+    FLAC__stream_encoder_set_compression_level(fse, et->level);
+#ifdef ENC_FLAC_THREADS
+    if(threads > 1)
+    {
+        FLAC__stream_encoder_set_num_threads(fse, threads);
+    }
+#endif
+
+    /* Apply any meta-data */
+    if(mdCount > 0)
+    {
+        FLAC__stream_encoder_set_metadata(fse, md, mdCount);
+    }
+
+    status = FLAC__stream_encoder_init_file(fse, filename, NULL, NULL);
+    if(status != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+        LogErr("Error: Failed to setup FLAC encoder: %s\n",
+               FLAC__StreamEncoderInitStatusString[status]);
+        FLAC__stream_encoder_delete(fse);
+        return false;
+    }
+
+    buffer16 = x_malloc(sizeof(int16_t) * ENC_BLOCK_SAMPLES);
+    buffer32 = x_malloc(sizeof(FLAC__int32) * ENC_BLOCK_SAMPLES);
+
+    while(!feof(et->rawData) && !ferror(et->rawData))
+    {
+        size_t  n;
+
+        n = fread(buffer16, sizeof(int16_t) * et->nChannels, ENC_BLOCK_SAMPLES / et->nChannels, et->rawData);
+        if(n != 0)
         {
-            return NULL;
+            /* Convert from 16bits per sample to 32bits.
+             *  The ripper writes samples in host byte order.
+             */
+            PcmConvS16(buffer32, buffer16, n * et->nChannels, PCM_HOST_ENDIAN);
+
+            /* Now encode the data */
+            FLAC__stream_encoder_process_interleaved(fse, buffer32, n);
+
+            sampleCount += n;
         }
+    }
 
-        LogInf("Track%02" PRIu32 ": Encoding to '%s'\n", et->trackNum, et->outFilename);
+    free(buffer16);
+    free(buffer32);
 
-        mdCount = 0;
+    FLAC__stream_encoder_finish(fse);
+    FLAC__stream_encoder_delete(fse);
 
-        gettimeofday(&timeStart, NULL);
+    /* The stream ends early if the rip process failed */
+    if(sampleCount != et->totalSamples)
+    {
+        LogErr("Track%02" PRIu32 ": Error: Audio ended after %" PRIu64 " of %" PRIu64 " samples\n",
+               et->trackNum, sampleCount, et->totalSamples);
+        return false;
+    }
 
-        createPath(et->outFilename);
-#if 1
-        /* Create and setup a new decoder */
-        fse = FLAC__stream_encoder_new();
-        FLAC__stream_encoder_set_channels(fse, et->nChannels);
-        FLAC__stream_encoder_set_bits_per_sample(fse, et->bitsPerSample);
-        FLAC__stream_encoder_set_sample_rate(fse, et->sampleRateHz);
-        FLAC__stream_encoder_set_total_samples_estimate(fse, et->totalSamples);
-        FLAC__stream_encoder_set_compression_level(fse, 8);
-
-        /* Create the Vorbis comment block */
-        vc = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
-        if(vc == NULL || !FLAC__metadata_object_vorbiscomment_resize_comments(vc, et->metaTagCount))
+    return true;
+}
+
+
+/** Write a tagged output from another FLAC stream.
+ * The STREAMINFO block and audio frames are copied from \a encoded, with
+ * the output's Vorbis comment and picture blocks replacing any others.
+ * This avoids re-encoding the audio for each output.
+ */
+static bool writeTagged(const char *encoded, const encodeoutput_t *eo)
+{
+    FLAC__StreamMetadata *vc, ca;
+    uint8_t               streamInfo[FLAC__STREAM_METADATA_STREAMINFO_LENGTH];
+    uint8_t               hdr[FLAC__STREAM_METADATA_HEADER_LENGTH], buf[16384];
+    FILE                 *in, *out;
+    bool                  ok = true;
+    size_t                n;
+
+    in = fopen(encoded, "rb");
+    if(in == NULL)
+    {
+        LogErr("Error: Failed to open encoded audio: %m\n");
+        return false;
+    }
+
+    /* Check the stream marker, which is always followed by the STREAMINFO */
+    if(fread(hdr, 4, 1, in) != 1 || memcmp(hdr, "fLaC", 4) != 0 ||
+       fread(hdr, sizeof(hdr), 1, in) != 1 ||
+       (hdr[0] & 0x7f) != FLAC__METADATA_TYPE_STREAMINFO ||
+       fread(streamInfo, sizeof(streamInfo), 1, in) != 1)
+    {
+        LogErr("Error: Encoded audio has unexpected format\n");
+        fclose(in);
+        return false;
+    }
+
+    /* Skip any other metadata blocks to find the first frame */
+    while(!(hdr[0] & 0x80))
+    {
+        if(fread(hdr, sizeof(hdr), 1, in) != 1 ||
+           fseek(in, (hdr[1] << 16) | (hdr[2] << 8) | hdr[3], SEEK_CUR) != 0)
         {
-            LogErr("Failed to allocate memory for tags");
+            LogErr("Error: Encoded audio has unexpected format\n");
+            fclose(in);
+            return false;
         }
-        else
-        {
-            /* Setup each tag */
-            for(uint32_t t = 0; t < et->metaTagCount; t++)
-            {
-                FLAC__StreamMetadata_VorbisComment_Entry entry;
+    }
 
-                entry.entry = (FLAC__byte *)et->metaTags[t];
-                entry.length = strlen(et->metaTags[t]);
+    out = fopen(eo->outTempFilename, "wb");
+    if(out == NULL)
+    {
+        LogErr("Error: Failed to open output file: %m\n");
+        fclose(in);
+        return false;
+    }
 
-                FLAC__metadata_object_vorbiscomment_set_comment(vc, t,entry, true);
-            }
+    vc = newVorbisComment(eo);
+    if(eo->coverArt != NULL)
+    {
+        initPicture(&ca, eo->coverArt);
+    }
 
-            md[mdCount++] = vc;
-        }
+    /* Write the new metadata */
+    fwrite("fLaC", 4, 1, out);
+    writeBlockHeader(out, vc == NULL && eo->coverArt == NULL,
+                     FLAC__METADATA_TYPE_STREAMINFO, sizeof(streamInfo));
+    fwrite(streamInfo, sizeof(streamInfo), 1, out);
+
+    writeTags(out, vc, eo->coverArt ? &ca : NULL);
+
+    if(vc)
+    {
+        FLAC__metadata_object_delete(vc);
+    }
+
+    /* Copy the frames */
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        fwrite(buf, 1, n, out);
+    }
+
+    if(ferror(in) || ferror(out))
+    {
+        LogErr("Error: Failed to write output file\n");
+        ok = false;
+    }
+
+    fclose(in);
+    if(fclose(out) != 0)
+    {
+        ok = false;
+    }
+
+    return ok;
+}
+
+
+/** Encode the raw audio of a task to an output with its tags.
+ * The output is written to its temporary file.
+ */
+static bool encodeTagged(encodetask_t *et, const encodeoutput_t *eo, uint32_t threads)
+{
+    FLAC__StreamMetadata *md[2], *vc, ca;
+    uint8_t               mdCount = 0;
+    bool                  ok;
+
+    vc = newVorbisComment(eo);
+    if(vc)
+    {
+        md[mdCount++] = vc;
+    }
+
+    /* Create the cover art block if art is present */
+    if(eo->coverArt != NULL)
+    {
+        initPicture(&ca, eo->coverArt);
+        md[mdCount++] = &ca;
+    }
+
+#ifndef ENC_FLAC_THREADS
+    if(threads > 1)
+    {
+        /* Stitched segments are written with the tag blocks as serialised */
+        char  *tags = NULL;
+        size_t tagsLen = 0;
+        FILE  *f = open_memstream(&tags, &tagsLen);
 
-        /* Create the cover art block if art is present */
-        if(et->coverArt != NULL)
+        if(f == NULL)
         {
-            memset(&ca, 0, sizeof(ca));
-
-            ca.type = FLAC__METADATA_TYPE_PICTURE;
-            ca.length = (sizeof(uint32_t) * 8) + strlen("image/jpeg") + strlen("Cover image") +
-                        ArtGetSizeBytes(et->coverArt);
-            ca.data.picture.type = FLAC__STREAM_METADATA_PICTURE_TYPE_FRONT_COVER;
-            ca.data.picture.mime_type = "image/jpeg";
-            ca.data.picture.description = (FLAC__byte*)"Cover image";
-            ca.data.picture.colors = 0;
-            ca.data.picture.width = ArtGetWidth(et->coverArt);
-            ca.data.picture.height = ArtGetHeight(et->coverArt);
-            ca.data.picture.depth = ArtGetDepth(et->coverArt);
-            ca.data.picture.data_length = ArtGetSizeBytes(et->coverArt);
-            ca.data.picture.data = ArtGetData(et->coverArt);
-
-            md[mdCount++] = &ca;
+            LogErr("Error: Failed to serialise tags: %m\n");
+            ok = false;
         }
-
-        /* Apply any meta-data */
-        if(mdCount > 0)
+        else
         {
-            FLAC__stream_encoder_set_metadata(fse, md, mdCount);
+            writeTags(f, vc, eo->coverArt ? &ca : NULL);
+            fclose(f);
+
+            ok = EncParEncode(et, eo->outTempFilename, threads, (const uint8_t *)tags, tagsLen);
         }
 
-        status = FLAC__stream_encoder_init_file(fse, et->outTempFilename, NULL, NULL);
-        if(status != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+        free(tags);
+    }
+    else
+#endif
+    {
+        ok = encodeToFile(et, eo->outTempFilename, md, mdCount, threads);
+    }
+
+    if(vc)
+    {
+        FLAC__metadata_object_delete(vc);
+    }
+
+    return ok;
+}
+
+
+/** Decide how many threads should encode some task.
+ * Long tracks are split only if no other task is waiting, since otherwise
+ * the other encoder threads already have work.  The split uses only the
+ * encoder threads that are idle, so that tasks still being encoded by
+ * other threads do not leave the CPUs oversubscribed.
+ * \param[in] et     The task to encode.
+ * \param[in] depth  Count of tasks waiting for an encoder.
+ * \param[in] idle   Count of other encoder threads with no task, or
+ *                   UINT32_MAX if not encoding for the encoder threads.
+ */
+static uint32_t encThreads(const encodetask_t *et, uint32_t depth, uint32_t idle)
+{
+    long cpus;
+
+    if(et->totalSamples < ENC_PARALLEL_MIN_SAMPLES || depth > 0)
+    {
+        return 1;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus - 1 > (long)idle)
+    {
+        cpus = (long)idle + 1;
+    }
+
+    return cpus > 1 ? cpus : 1;
+}
+
+
+/** Move a completed output file into place.
+ */
+static void finishOutput(const encodeoutput_t *eo)
+{
+    if(rename(eo->outTempFilename, eo->outFilename) != 0)
+    {
+        LogErr("Error: Failed to rename encode output file: %m\n");
+    }
+
+    unlink(eo->outTempFilename);
+}
+
+
+/** Encode a task to each of its outputs.
+ * \param[in] threads  Count of threads to use for the encode.
+ * \returns true if all outputs were written.
+ */
+static bool encodeTask(encodetask_t *et, uint32_t threads)
+{
+    const encodeoutput_t *first = &et->output[0];
+    bool                  ok;
+
+    for(uint16_t o = 0; o < et->outputCount; o++)
+    {
+        LogInf("Track%02" PRIu32 ": Encoding to '%s'\n", et->trackNum, et->output[o].outFilename);
+        EncCreatePath(et->output[o].outFilename);
+    }
+
+    /* Encode the first output, then copy its audio to each other output */
+    ok = encodeTagged(et, first, threads);
+    if(!ok)
+    {
+        unlink(first->outTempFilename);
+        return false;
+    }
+
+    /* Write every output, but fail the task if any is missing */
+    for(uint16_t o = 1; o < et->outputCount; o++)
+    {
+        if(writeTagged(first->outTempFilename, &et->output[o]))
         {
-            LogErr("Error: Failed to setup FLAC encoder: %s\n",
-                   FLAC__StreamEncoderInitStatusString[status]);
+            finishOutput(&et->output[o]);
         }
         else
         {
-            uint64_t sampleCount = 0;
+            unlink(et->output[o].outTempFilename);
+            ok = false;
+        }
+    }
 
-            rewind(et->rawData);
-            while(!feof(et->rawData))
-            {
-                int16_t     buffer16[ENC_BLOCK_SAMPLES];
-                FLAC__int32 buffer32[ENC_BLOCK_SAMPLES];
-                size_t  n;
+    finishOutput(first);
+
+    return ok;
+}
 
-                n = fread(buffer16, sizeof(int16_t) * et->nChannels, ENC_BLOCK_SAMPLES / et->nChannels, et->rawData);
-                if(n != 0)
-                {
-                    /* Convert from 16bits per sample to 32bits */
-                    for(size_t c = 0; c < n * et->nChannels; c++)
-                    {
-                        buffer32[c] = buffer16[c];
-                    }
 
-                    /* Now encode the data */
-                    FLAC__stream_encoder_process_interleaved(fse, buffer32, n);
+static void *encWorker(void *param)
+{
+    encq_t                q = param;
+    struct timeval        timeStart, timeEnd;
+
+    prctl(PR_SET_NAME, "ripright: enc");
 
-                    sampleCount += n;
-                }
-            }
+    while(1)
+    {
+        encodetask_t *et;
+        uint32_t      threads, depth, idle;
+        bool          ok;
 
-            FLAC__stream_encoder_finish(fse);
+        /* Wait for an encoding task */
+        et = EncQGet(q);
+        depth = EncQDepth(q);
+        idle = EncQIdle(q);
+        EncLevelNoteQueueDepth(depth);
 
-            assert(sampleCount == et->totalSamples);
+        et->level = EncLevelGet();
+        threads = encThreads(et, depth, idle);
 
-            if(rename(et->outTempFilename, et->outFilename) != 0)
-            {
-                LogErr("Error: Failed to rename encode output file: %m\n");
-            }
+        gettimeofday(&timeStart, NULL);
 
-            unlink(et->outTempFilename);
+        ok = encodeTask(et, threads);
 
+        if(ok)
+        {
             gettimeofday(&timeEnd, NULL);
 
             long ripMs, trackMs;
 
-            /* Compute how long the rip took */
+            /* Compute how long the encode took */
             ripMs = (timeEnd.tv_sec - timeStart.tv_sec) * 1000;
             ripMs += timeEnd.tv_usec / 1000;
             ripMs -= timeStart.tv_usec / 1000;
 
             /* Compute track length */
-            trackMs = (sampleCount * 1000) / 44100;
+            trackMs = (et->totalSamples * 1000) / 44100;
 
-            LogInf("Track%02" PRIu32 ": Encoded at %3.1fx\n", et->trackNum, (float)trackMs / (float)ripMs);
+            LogInf("Track%02" PRIu32 ": Encoded at %3.1fx, level %" PRIu8 ", %" PRIu32 " thread%s\n",
+                   et->trackNum, (float)trackMs / (float)ripMs, et->level,
+                   threads, threads == 1 ? "" : "s");
+        }
+        else
+        {
+            char discard[4096];
+
+            LogErr("Track%02" PRIu32 ": Encoding failed\n", et->trackNum);
+
+            /* Consume any remaining audio so the ripper is not left blocked */
+            while(fread(discard, 1, sizeof(discard), et->rawData) > 0)
+                ;
+        }
+
+        EncQDone(q, et);
+
+        if(et->doneCb)
+        {
+            et->doneCb(et, et->doneParam);
         }
 
-        FLAC__metadata_object_delete(vc);
-#endif
         EncTaskFree(et);
     }
 
@@ -249,13 +633,36 @@ static void *encWorker(void *param)
  * Global Functions
  **************************************************************************/
 
-void EncNew(bbuf_t bbuf)
+/** Process the passed pathFilename and create each path element.
+ * e.g. passed a/b/file.flac, this will create a/ then a/b.
+ */
+void EncCreatePath(char *pathFilename)
+{
+    char *slash = pathFilename;
+
+    while((slash = strstr(slash, "/")) != NULL)
+    {
+        *slash = '\0';
+
+        if(mkdir(pathFilename, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+           errno != EEXIST)
+        {
+            LogWarn("Warning: Could not create '%s': %m\n", pathFilename);
+        }
+
+        *slash = '/';
+        slash++;
+    }
+}
+
+
+void EncNew(encq_t q)
 {
     struct sched_param scparam;
     int                policy;
     pthread_t          tid;
 
-    pthread_create(&tid, NULL, encWorker, bbuf);
+    pthread_create(&tid, NULL, encWorker, q);
 
     /* Get the scheduling for the thread and make it lower priority.
      *  We prefer the ripping thread to get the CPU if there is contention,
@@ -281,4 +688,16 @@ void EncNew(bbuf_t bbuf)
     pthread_setschedparam(tid, policy, &scparam);
 }
 
+
+/** Encode a task on the calling thread, such as to replace a repaired output.
+ * The task is not freed.
+ * \returns true if all outputs were written.
+ */
+bool EncEncode(encodetask_t *et)
+{
+    et->level = EncLevelGet();
+
+    return encodeTask(et, encThreads(et, 0, UINT32_MAX));
+}
+
 /* END OF FILE */
@@ -24,7 +24,10 @@
  * Includes
  **************************************************************************/
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "encodetask.h"
+#include "encq.h"
 
 /**************************************************************************
  * Macros
@@ -38,7 +41,9 @@
  * Prototypes
  **************************************************************************/
 
-void EncNew(bbuf_t bbuf);
+void EncNew(encq_t q);
+bool EncEncode(encodetask_t *et);
+void EncCreatePath(char *pathFilename);
 
 #endif
 
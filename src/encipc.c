@@ -0,0 +1,635 @@
+/***************************************************************************
+ * encipc.c: Passing of encoding tasks between processes.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "encodetask.h"
+#include "encipc.h"
+#include "x_mem.h"
+#include "art.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Upper limit on the size of a message.
+ * This is well above any real task, but stops a corrupt header causing a
+ * huge allocation.
+ */
+#define ENCIPC_MAX_MSG_BYTES (64 * 1024 * 1024)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** Header preceding each message on the socket.
+ * Both ends are the same binary on the same host, so native byte order and
+ * layout are used.  Any file descriptor is attached to the header.
+ */
+typedef struct
+{
+    uint32_t type;
+    uint32_t length;
+}
+msghdr_t;
+
+
+/** Buffer into which a message is serialised. */
+typedef struct
+{
+    uint8_t *data;
+    size_t   len, size;
+}
+msgbuf_t;
+
+
+/** Cursor for parsing a received message. */
+typedef struct
+{
+    const uint8_t *p;
+    size_t         remaining;
+    bool           ok;
+}
+msgreader_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static void putBytes(msgbuf_t *b, const void *data, size_t len)
+{
+    if(b->len + len > b->size)
+    {
+        b->size = (b->len + len) * 2;
+        b->data = x_realloc(b->data, b->size);
+    }
+
+    memcpy(&b->data[b->len], data, len);
+    b->len += len;
+}
+
+
+static void putU8(msgbuf_t *b, uint8_t v)
+{
+    putBytes(b, &v, sizeof(v));
+}
+
+
+static void putU32(msgbuf_t *b, uint32_t v)
+{
+    putBytes(b, &v, sizeof(v));
+}
+
+
+static void putU64(msgbuf_t *b, uint64_t v)
+{
+    putBytes(b, &v, sizeof(v));
+}
+
+
+static void putStr(msgbuf_t *b, const char *s)
+{
+    uint32_t len = strlen(s);
+
+    putU32(b, len);
+    putBytes(b, s, len);
+}
+
+
+static const void *getBytes(msgreader_t *r, size_t len)
+{
+    const void *p = r->p;
+
+    if(!r->ok || r->remaining < len)
+    {
+        r->ok = false;
+        return NULL;
+    }
+
+    r->p += len;
+    r->remaining -= len;
+
+    return p;
+}
+
+
+static uint8_t getU8(msgreader_t *r)
+{
+    const void *p = getBytes(r, sizeof(uint8_t));
+    uint8_t     v = 0;
+
+    if(p)
+    {
+        memcpy(&v, p, sizeof(v));
+    }
+
+    return v;
+}
+
+
+static uint32_t getU32(msgreader_t *r)
+{
+    const void *p = getBytes(r, sizeof(uint32_t));
+    uint32_t    v = 0;
+
+    if(p)
+    {
+        memcpy(&v, p, sizeof(v));
+    }
+
+    return v;
+}
+
+
+static uint64_t getU64(msgreader_t *r)
+{
+    const void *p = getBytes(r, sizeof(uint64_t));
+    uint64_t    v = 0;
+
+    if(p)
+    {
+        memcpy(&v, p, sizeof(v));
+    }
+
+    return v;
+}
+
+
+/** Get a string from the message.
+ * \returns A newly allocated copy of the string, or NULL on error.
+ */
+static char *getStr(msgreader_t *r)
+{
+    uint32_t    len = getU32(r);
+    const char *p = getBytes(r, len);
+    char       *s = NULL;
+
+    if(p)
+    {
+        s = x_malloc(len + 1);
+        memcpy(s, p, len);
+        s[len] = '\0';
+    }
+
+    return s;
+}
+
+
+/** Write all of some data, retrying on partial writes. */
+static bool writeAll(int sock, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if(n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+
+/** Read exactly len bytes, retrying on partial reads. */
+static bool readAll(int sock, void *data, size_t len)
+{
+    uint8_t *p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = recv(sock, p, len, 0);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if(n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+
+/** Send a message, optionally passing a file descriptor with it.
+ * \param[in] fd  The file descriptor to pass, or -1 if none.
+ */
+static bool sendMsg(int sock, encipcmsg_t type, const msgbuf_t *b, int fd)
+{
+    char           cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr  mh;
+    struct iovec   iov;
+    msghdr_t       hdr;
+    ssize_t        n;
+
+    hdr.type = type;
+    hdr.length = b ? b->len : 0;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if(fd != -1)
+    {
+        struct cmsghdr *cm;
+
+        memset(cbuf, 0, sizeof(cbuf));
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    do
+    {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    }
+    while(n < 0 && errno == EINTR);
+
+    if(n <= 0)
+    {
+        return false;
+    }
+
+    /* Complete any partially sent header, then the payload */
+    if(!writeAll(sock, (uint8_t *)&hdr + n, sizeof(hdr) - n))
+    {
+        return false;
+    }
+
+    return b == NULL || writeAll(sock, b->data, b->len);
+}
+
+
+/** Parse a task message.
+ * \returns The task, or NULL if the message was malformed.
+ */
+static encodetask_t *parseTask(msgreader_t *r)
+{
+    encodetask_t *et = EncTaskNew(NULL, 0, 0);
+    uint16_t      outputCount;
+
+    et->trackNum      = getU32(r);
+    et->nChannels     = getU8(r);
+    et->bitsPerSample = getU8(r);
+    et->sampleRateHz  = getU32(r);
+    et->totalSamples  = getU64(r);
+    outputCount       = getU32(r);
+
+    for(uint16_t o = 0; o < outputCount && r->ok; o++)
+    {
+        encodeoutput_t *eo = EncTaskAddOutput(et);
+        char           *s;
+        uint32_t        tagCount;
+
+        if((s = getStr(r)) != NULL)
+        {
+            EncOutSetFilename(eo, s);
+            free(s);
+        }
+
+        tagCount = getU32(r);
+        if(tagCount > MAX_ENCODE_TASK_TAGS)
+        {
+            r->ok = false;
+        }
+
+        for(uint32_t t = 0; t < tagCount && r->ok; t++)
+        {
+            if((s = getStr(r)) != NULL)
+            {
+                EncOutAddTag(eo, "%s", s);
+                free(s);
+            }
+        }
+
+        if(getU8(r))
+        {
+            uint32_t    width  = getU32(r);
+            uint32_t    height = getU32(r);
+            uint8_t     depth  = getU8(r);
+            uint32_t    size   = getU32(r);
+            const void *data   = getBytes(r, size);
+
+            if(data)
+            {
+                eo->coverArt = ArtNew(data, size, width, height, depth);
+            }
+        }
+    }
+
+    if(!r->ok || r->remaining != 0)
+    {
+        EncTaskFree(et);
+        return NULL;
+    }
+
+    return et;
+}
+
+/** Receive the payload of a task message.
+ * \param[in] fd  The passed file descriptor for the audio, which is closed
+ *                 if the task cannot be received.
+ * \returns The task, or NULL on error.
+ */
+static encodetask_t *recvTask(int sock, uint32_t length, int fd)
+{
+    uint8_t      *payload = x_malloc(length);
+    encodetask_t *et = NULL;
+    msgreader_t   r;
+
+    if(readAll(sock, payload, length))
+    {
+        r.p = payload;
+        r.remaining = length;
+        r.ok = true;
+
+        et = parseTask(&r);
+        if(et == NULL || fd == -1)
+        {
+            LogErr("Error: Malformed encoding task received\n");
+        }
+        else
+        {
+            et->rawData = fdopen(fd, "rb");
+        }
+    }
+
+    free(payload);
+
+    if(et && et->rawData == NULL)
+    {
+        EncTaskFree(et);
+        et = NULL;
+    }
+
+    if(et == NULL && fd != -1)
+    {
+        close(fd);
+    }
+
+    return et;
+}
+
+/** Receive the payload of a message that holds a single string.
+ * \returns The string, or NULL on error.
+ */
+static char *recvString(int sock, uint32_t length)
+{
+    uint8_t     *payload = x_malloc(length);
+    char        *str = NULL;
+    msgreader_t  r;
+
+    if(readAll(sock, payload, length))
+    {
+        r.p = payload;
+        r.remaining = length;
+        r.ok = true;
+
+        str = getStr(&r);
+    }
+
+    free(payload);
+
+    return str;
+}
+
+
+/** Receive the payload of a message that holds a single float.
+ */
+static bool recvFloat(int sock, uint32_t length, float *v)
+{
+    return length == sizeof(float) && readAll(sock, v, sizeof(float));
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Send an encoding task to the encoder process.
+ * \param[in] rawFd  File descriptor from which the encoder should read the
+ *                    audio.  The receiver gets its own copy, so the caller
+ *                    should close this once sent.
+ */
+bool EncIpcSendTask(int sock, const encodetask_t *et, int rawFd)
+{
+    msgbuf_t b = { NULL, 0, 0 };
+    bool     ok;
+
+    putU32(&b, et->trackNum);
+    putU8(&b, et->nChannels);
+    putU8(&b, et->bitsPerSample);
+    putU32(&b, et->sampleRateHz);
+    putU64(&b, et->totalSamples);
+    putU32(&b, et->outputCount);
+
+    for(uint16_t o = 0; o < et->outputCount; o++)
+    {
+        const encodeoutput_t *eo = &et->output[o];
+
+        putStr(&b, eo->outFilename);
+        putU32(&b, eo->metaTagCount);
+
+        for(uint32_t t = 0; t < eo->metaTagCount; t++)
+        {
+            putStr(&b, eo->metaTags[t]);
+        }
+
+        putU8(&b, eo->coverArt != NULL);
+        if(eo->coverArt)
+        {
+            putU32(&b, ArtGetWidth(eo->coverArt));
+            putU32(&b, ArtGetHeight(eo->coverArt));
+            putU8(&b, ArtGetDepth(eo->coverArt));
+            putU32(&b, ArtGetSizeBytes(eo->coverArt));
+            putBytes(&b, ArtGetData(eo->coverArt), ArtGetSizeBytes(eo->coverArt));
+        }
+    }
+
+    ok = sendMsg(sock, ENCIPC_TASK, &b, rawFd);
+
+    free(b.data);
+
+    return ok;
+}
+
+
+/** Note that all tasks for the disc have been sent.
+ * \param[in] trackLog  Filename of the disc's track log, or NULL if none.
+ */
+bool EncIpcSendEnd(int sock, const char *trackLog)
+{
+    msgbuf_t b = { NULL, 0, 0 };
+    bool     ok;
+
+    putStr(&b, trackLog ? trackLog : "");
+
+    ok = sendMsg(sock, ENCIPC_END, &b, -1);
+
+    free(b.data);
+
+    return ok;
+}
+
+
+/** Send the speed at which the last track was ripped.
+ */
+bool EncIpcSendRipSpeed(int sock, float speed)
+{
+    msgbuf_t b = { NULL, 0, 0 };
+    bool     ok;
+
+    putBytes(&b, &speed, sizeof(speed));
+
+    ok = sendMsg(sock, ENCIPC_RIP_SPEED, &b, -1);
+
+    free(b.data);
+
+    return ok;
+}
+
+
+/** Wait for and receive the next message.
+ * \param[out] data  Set with the content of the message.  Any task or
+ *                    track log filename is allocated and owned by the
+ *                    caller.
+ */
+encipcmsg_t EncIpcRecv(int sock, encipcdata_t *data)
+{
+    char           cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cm;
+    struct msghdr  mh;
+    struct iovec   iov;
+    msghdr_t       hdr;
+    ssize_t        n;
+    int            fd = -1;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    do
+    {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    }
+    while(n < 0 && errno == EINTR);
+
+    if(n <= 0)
+    {
+        return ENCIPC_ERROR;
+    }
+
+    for(cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm))
+    {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+
+    if(!readAll(sock, (uint8_t *)&hdr + n, sizeof(hdr) - n) ||
+       hdr.length > ENCIPC_MAX_MSG_BYTES)
+    {
+        hdr.type = ENCIPC_ERROR;
+    }
+    else if(hdr.type == ENCIPC_TASK)
+    {
+        data->task = recvTask(sock, hdr.length, fd);
+
+        return data->task ? ENCIPC_TASK : ENCIPC_ERROR;
+    }
+    else if(hdr.type == ENCIPC_END)
+    {
+        data->trackLog = recvString(sock, hdr.length);
+        if(data->trackLog == NULL)
+        {
+            hdr.type = ENCIPC_ERROR;
+        }
+        else if(*data->trackLog == '\0')
+        {
+            free(data->trackLog);
+            data->trackLog = NULL;
+        }
+    }
+    else if(hdr.type == ENCIPC_RIP_SPEED)
+    {
+        if(!recvFloat(sock, hdr.length, &data->ripSpeed))
+        {
+            hdr.type = ENCIPC_ERROR;
+        }
+    }
+    else
+    {
+        hdr.type = ENCIPC_ERROR;
+    }
+
+    if(fd != -1)
+    {
+        close(fd);
+    }
+
+    return hdr.type;
+}
+
+/* END OF FILE */
@@ -0,0 +1,84 @@
+/***************************************************************************
+ * encipc.h: Interface for passing encoding tasks between processes.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef ENCIPC_H
+#define ENCIPC_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include "encodetask.h"
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef enum
+{
+    /** The socket was closed or a malformed message was received. */
+    ENCIPC_ERROR,
+
+    /** An encoding task, with the stream from which to read the audio. */
+    ENCIPC_TASK,
+
+    /** Sent by a rip process once all tasks for the disc have been sent.
+     * This carries the name of the disc's track log, if any.
+     */
+    ENCIPC_END,
+
+    /** Sent by a rip process after each track with the speed of the rip. */
+    ENCIPC_RIP_SPEED
+}
+encipcmsg_t;
+
+
+/** Content of a received message. */
+typedef struct
+{
+    /** For ENCIPC_TASK, the task, whose rawData reads from the passed
+     *  file descriptor.
+     */
+    encodetask_t *task;
+
+    /** For ENCIPC_END, the track log filename, or NULL if none. */
+    char         *trackLog;
+
+    /** For ENCIPC_RIP_SPEED, the speed as a multiple of real time. */
+    float         ripSpeed;
+}
+encipcdata_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+bool        EncIpcSendTask(int sock, const encodetask_t *et, int rawFd);
+bool        EncIpcSendEnd(int sock, const char *trackLog);
+bool        EncIpcSendRipSpeed(int sock, float speed);
+encipcmsg_t EncIpcRecv(int sock, encipcdata_t *data);
+
+#endif
+
+/* END OF FILE */
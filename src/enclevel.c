@@ -0,0 +1,395 @@
+/***************************************************************************
+ * enclevel.c: Selection of the FLAC compression level from measured speeds.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <FLAC/stream_encoder.h>
+#include <sys/time.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "enclevel.h"
+#include "x_mem.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Highest FLAC compression level. */
+#define MAX_LEVEL               8
+
+/** Seconds of synthetic audio encoded at each level during calibration. */
+#define CAL_SECONDS             4
+
+/** Sample rate of the synthetic audio. */
+#define CAL_RATE_HZ             44100
+
+/** Rip speed assumed for each drive until a rip speed has been reported. */
+#define DEFAULT_RIP_SPEED       40.0f
+
+/** Seconds after which a drive's rip speed is no longer counted.
+ * This stops idle drives reserving encoder throughput.
+ */
+#define RIP_SPEED_STALE_SECS    600
+
+/** Seconds the queue must stay backlogged without draining before stepping down.
+ * A batch of tasks released at once makes the queue deep, but drains if
+ * the encoders are keeping up, so only a backlog that persists counts.
+ */
+#define BACKLOG_SECS_TO_STEP    30
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** Most recent rip speed of some drive. */
+typedef struct
+{
+    uint16_t source;
+    float    speed;
+    time_t   when;
+}
+ripspeed_t;
+
+
+/** Work for a calibration thread. */
+typedef struct
+{
+    const FLAC__int32 *samples;
+    uint8_t            level;
+}
+calwork_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+static pthread_mutex_t  levelLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Aggregate encoding speed at each level, as a multiple of real time. */
+static float            levelSpeed[MAX_LEVEL + 1];
+
+/** Set once levelSpeed[] has been measured. */
+static bool             calibrated = false;
+
+/** Latest rip speed of each drive that has reported one. */
+static ripspeed_t      *ripSpeed = NULL;
+static uint16_t         ripSpeedCount = 0;
+
+/** The level chosen from the speeds, before any step down. */
+static uint8_t          speedLevel = MAX_LEVEL;
+
+/** Count of levels stepped down due to a growing queue. */
+static uint8_t          stepDown = 0;
+
+/** Count of encoder threads, beyond which waiting tasks are a backlog. */
+static uint32_t         encThreads = 1;
+
+/** Start of the current backlog, or 0 if none, and its depth at the time. */
+static time_t           backlogSince = 0;
+static uint32_t         backlogDepth = 0;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static FLAC__StreamEncoderWriteStatus discardWrite(const FLAC__StreamEncoder *encoder __attribute__((__unused__)),
+                                                   const FLAC__byte buffer[] __attribute__((__unused__)),
+                                                   size_t bytes __attribute__((__unused__)),
+                                                   uint32_t samples __attribute__((__unused__)),
+                                                   uint32_t current_frame __attribute__((__unused__)),
+                                                   void *client_data __attribute__((__unused__)))
+{
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+/** Encode the synthetic audio at some level, discarding the output.
+ */
+static void *calWorker(void *param)
+{
+    const calwork_t     *w = param;
+    FLAC__StreamEncoder *fse = FLAC__stream_encoder_new();
+
+    FLAC__stream_encoder_set_channels(fse, 2);
+    FLAC__stream_encoder_set_bits_per_sample(fse, 16);
+    FLAC__stream_encoder_set_sample_rate(fse, CAL_RATE_HZ);
+    FLAC__stream_encoder_set_compression_level(fse, w->level);
+
+    if(FLAC__stream_encoder_init_stream(fse, discardWrite, NULL, NULL, NULL, NULL) ==
+       FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+        FLAC__stream_encoder_process_interleaved(fse, w->samples, CAL_SECONDS * CAL_RATE_HZ);
+        FLAC__stream_encoder_finish(fse);
+    }
+
+    FLAC__stream_encoder_delete(fse);
+
+    return NULL;
+}
+
+
+/** Create some stereo audio which compresses roughly like music.
+ * This is a few detuned tones with a slow tremolo, plus a little noise, so
+ * that the encoder neither finds trivial predictions nor pure noise.
+ */
+static FLAC__int32 *makeSynthetic(void)
+{
+    const uint32_t  frames = CAL_SECONDS * CAL_RATE_HZ;
+    FLAC__int32    *s = x_malloc(sizeof(FLAC__int32) * frames * 2);
+    uint32_t        noise = 1;
+
+    for(uint32_t f = 0; f < frames; f++)
+    {
+        const double t = (double)f / CAL_RATE_HZ;
+        const double amp = 6000.0 * (1.0 + 0.5 * sin(2 * M_PI * 0.7 * t));
+
+        for(uint8_t c = 0; c < 2; c++)
+        {
+            double v = amp * (sin(2 * M_PI * (220.0 + c) * t) +
+                              0.6 * sin(2 * M_PI * 331.0 * t) +
+                              0.3 * sin(2 * M_PI * (1250.0 - c * 3) * t));
+
+            noise = noise * 1103515245 + 12345;
+            v += (double)((noise >> 16) & 0x1ff) - 256.0;
+
+            s[(f * 2) + c] = (FLAC__int32)v;
+        }
+    }
+
+    return s;
+}
+
+
+/** Sum the rip speeds of all drives which are currently ripping.
+ */
+static float requiredSpeed(void)
+{
+    const time_t now = time(NULL);
+    float        total = 0;
+
+    for(uint16_t r = 0; r < ripSpeedCount; r++)
+    {
+        if(now - ripSpeed[r].when < RIP_SPEED_STALE_SECS)
+        {
+            total += ripSpeed[r].speed;
+        }
+    }
+
+    return total > 0 ? total : DEFAULT_RIP_SPEED;
+}
+
+
+/** Choose the highest level which keeps up with the required speed.
+ * This must be called with levelLock held.
+ */
+static void chooseLevel(void)
+{
+    const float required = requiredSpeed();
+    uint8_t     level = 0;
+
+    for(uint8_t l = 0; l <= MAX_LEVEL; l++)
+    {
+        if(levelSpeed[l] >= required)
+        {
+            level = l;
+        }
+    }
+
+    if(level != speedLevel)
+    {
+        LogInf("Compression level %" PRIu8 " chosen: encoders %.1fx, ripping %.1fx\n",
+               level, levelSpeed[level], required);
+        speedLevel = level;
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Measure the encoding speed at each compression level.
+ * The synthetic audio is encoded by \a threads threads at once to find the
+ * aggregate throughput of all encoder threads.
+ */
+void EncLevelCalibrate(uint32_t threads)
+{
+    FLAC__int32 *samples = makeSynthetic();
+    pthread_t    tid[threads];
+
+    LogInf("Calibrating compression levels with %" PRIu32 " threads\n", threads);
+
+    for(uint8_t l = 0; l <= MAX_LEVEL; l++)
+    {
+        calwork_t      w = { samples, l };
+        struct timeval timeStart, timeEnd;
+        long           calMs;
+
+        gettimeofday(&timeStart, NULL);
+
+        for(uint32_t t = 0; t < threads; t++)
+        {
+            pthread_create(&tid[t], NULL, calWorker, &w);
+        }
+
+        for(uint32_t t = 0; t < threads; t++)
+        {
+            pthread_join(tid[t], NULL);
+        }
+
+        gettimeofday(&timeEnd, NULL);
+
+        calMs = (timeEnd.tv_sec - timeStart.tv_sec) * 1000;
+        calMs += timeEnd.tv_usec / 1000;
+        calMs -= timeStart.tv_usec / 1000;
+        if(calMs < 1)
+        {
+            calMs = 1;
+        }
+
+        levelSpeed[l] = (float)(threads * CAL_SECONDS * 1000) / (float)calMs;
+
+        LogInf(" level %" PRIu8 ": %8.1fx\n", l, levelSpeed[l]);
+    }
+
+    free(samples);
+
+    pthread_mutex_lock(&levelLock);
+    calibrated = true;
+    encThreads = threads;
+    speedLevel = MAX_LEVEL + 1;
+    chooseLevel();
+    pthread_mutex_unlock(&levelLock);
+}
+
+
+/** Note the speed at which some drive ripped its last track.
+ * \param[in] source  Index of the drive.
+ * \param[in] speed   The rip speed as a multiple of real time.
+ */
+void EncLevelNoteRipSpeed(uint16_t source, float speed)
+{
+    uint16_t r;
+
+    if(!isfinite(speed) || speed <= 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&levelLock);
+
+    for(r = 0; r < ripSpeedCount && ripSpeed[r].source != source; r++)
+        ;
+
+    if(r == ripSpeedCount)
+    {
+        ripSpeed = x_realloc(ripSpeed, sizeof(ripspeed_t) * (ripSpeedCount + 1));
+        ripSpeedCount++;
+    }
+
+    ripSpeed[r].source = source;
+    ripSpeed[r].speed = speed;
+    ripSpeed[r].when = time(NULL);
+
+    if(calibrated)
+    {
+        chooseLevel();
+    }
+
+    pthread_mutex_unlock(&levelLock);
+}
+
+
+/** Note the count of tasks waiting for an encoder.
+ * This is sampled as each encoder takes a task, so a burst of tasks being
+ * queued is not mistaken for the encoders falling behind.  If more tasks
+ * than encoder threads stay waiting, without the queue shrinking, for
+ * BACKLOG_SECS_TO_STEP, the level is stepped down.  Once the queue has
+ * drained, the chosen level is restored.
+ */
+void EncLevelNoteQueueDepth(uint32_t depth)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&levelLock);
+
+    if(depth == 0)
+    {
+        if(stepDown != 0)
+        {
+            LogInf("Encoder queue drained: compression level %" PRIu8 " restored\n", speedLevel);
+        }
+
+        stepDown = 0;
+        backlogSince = 0;
+    }
+    else if(depth <= encThreads)
+    {
+        backlogSince = 0;
+    }
+    else if(backlogSince == 0)
+    {
+        backlogSince = now.tv_sec;
+        backlogDepth = depth;
+    }
+    else if(now.tv_sec - backlogSince >= BACKLOG_SECS_TO_STEP)
+    {
+        /* Step down only if the backlog has not shrunk over the period */
+        if(depth >= backlogDepth && stepDown < speedLevel)
+        {
+            stepDown++;
+
+            LogWarn("Encoder queue backlogged (%" PRIu32 "): compression level stepped down to %" PRIu8 "\n",
+                    depth, speedLevel - stepDown);
+        }
+
+        backlogSince = now.tv_sec;
+        backlogDepth = depth;
+    }
+
+    pthread_mutex_unlock(&levelLock);
+}
+
+
+/** Get the compression level to use for the next encode.
+ */
+uint8_t EncLevelGet(void)
+{
+    uint8_t level;
+
+    pthread_mutex_lock(&levelLock);
+    level = calibrated ? speedLevel - stepDown : MAX_LEVEL;
+    pthread_mutex_unlock(&levelLock);
+
+    return level;
+}
+
+/* END OF FILE */
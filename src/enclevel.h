@@ -0,0 +1,48 @@
+/***************************************************************************
+ * enclevel.h: Interface to the FLAC compression level control.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef ENCLEVEL_H
+#define ENCLEVEL_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdint.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+void    EncLevelCalibrate(uint32_t threads);
+void    EncLevelNoteRipSpeed(uint16_t source, float speed);
+void    EncLevelNoteQueueDepth(uint32_t depth);
+uint8_t EncLevelGet(void);
+
+#endif
+
+/* END OF FILE */
@@ -55,56 +55,113 @@
  * Global Functions
  **************************************************************************/
 
-encodetask_t *EncTaskNew(const char *filename, uint8_t nChannels, uint64_t totalSamples)
+/** Create a new encoding task.
+ * \param[in] rawData  Stream from which the raw audio will be read.  This
+ *                      maybe an intermediate file or a pipe, and is closed
+ *                      when the task is freed.  This may be NULL if the task
+ *                      is only to be described to the encoder process.
+ */
+encodetask_t *EncTaskNew(FILE *rawData, uint8_t nChannels, uint64_t totalSamples)
 {
     encodetask_t *r = x_calloc(sizeof(encodetask_t), 1);
 
-    r->rawData = fopen(filename, "rb");
+    r->rawData = rawData;
     r->nChannels = nChannels;
     r->totalSamples = totalSamples;
 
-    if(r->rawData == NULL)
-    {
-        LogErr("Error: Failed to open encoding intermediate file: %m\n");
-        exit(EXIT_SUCCESS);
-    }
-
     return r;
 }
 
 
+/** Add a new output to the task.
+ * \returns Pointer to the output, which is valid until another output is
+ *           added or the task is freed.
+ */
+encodeoutput_t *EncTaskAddOutput(encodetask_t *et)
+{
+    encodeoutput_t *eo;
+
+    et->output = x_realloc(et->output, sizeof(encodeoutput_t) * (et->outputCount + 1));
+
+    eo = &et->output[et->outputCount++];
+    memset(eo, 0, sizeof(encodeoutput_t));
+
+    return eo;
+}
+
+
 void EncTaskPrint(const encodetask_t *et, FILE *out)
 {
-    printf("%s\n", et->outFilename);
+    for(uint16_t o = 0; o < et->outputCount; o++)
+    {
+        const encodeoutput_t *eo = &et->output[o];
+
+        fprintf(out, "%s\n", eo->outFilename);
+
+        for(uint32_t tag = 0; tag < eo->metaTagCount; tag++)
+        {
+            fprintf(out, "  Tag%" PRIu32 ": %s\n", tag, eo->metaTags[tag]);
+        }
 
-    for(uint32_t tag = 0; tag < et->metaTagCount; tag++)
+        if(eo->coverArt)
+        {
+            fprintf(out, "  Artwork: %ux%u pixels\n",
+                    ArtGetWidth(eo->coverArt), ArtGetHeight(eo->coverArt));
+        }
+
+        fprintf(out, "\n");
+    }
+}
+
+
+FILE *EncTaskGetRawFile(const encodetask_t *et)
+{
+    return et->rawData;
+}
+
+
+void EncTaskFree(encodetask_t *et)
+{
+    if(et->rawData)
     {
-        fprintf(out, "  Tag%" PRIu32 ": %s\n", tag, et->metaTags[tag]);
+        fclose(et->rawData);
     }
 
-    if(et->coverArt)
+    for(uint16_t o = 0; o < et->outputCount; o++)
     {
-        fprintf(out, "  Artwork: %ux%u pixels\n",
-                ArtGetWidth(et->coverArt), ArtGetHeight(et->coverArt));
+        encodeoutput_t *eo = &et->output[o];
+
+        while(eo->metaTagCount > 0)
+        {
+            free(eo->metaTags[--eo->metaTagCount]);
+        }
+
+        if(eo->coverArt)
+        {
+            ArtFree(eo->coverArt);
+        }
+
+        free(eo->outFilename);
+        free(eo->outTempFilename);
     }
 
-    fprintf(out, "\n");
+    free(et->output);
+    free(et);
 }
 
 
-
-void EncTaskSetOutputFilename(encodetask_t *et, const char *filename)
+void EncOutSetFilename(encodeoutput_t *eo, const char *filename)
 {
     char *buf, *c;
 
-    /* Add to the task */
-    if(et->outFilename)
+    /* Add to the output */
+    if(eo->outFilename)
     {
-        free(et->outFilename);
-        free(et->outTempFilename);
+        free(eo->outFilename);
+        free(eo->outTempFilename);
     }
 
-    et->outFilename = x_strdup(filename);
+    eo->outFilename = x_strdup(filename);
 
     /* Copy the name into a temporary buffer */
     buf = x_malloc(strlen(filename) + 7);
@@ -129,11 +186,11 @@ void EncTaskSetOutputFilename(encodetask_t *et, const char *filename)
     strcat(c, ".part");
 
     /* Store the temp filename */
-    et->outTempFilename = buf;
+    eo->outTempFilename = buf;
 }
 
 
-void EncTaskAddTag(encodetask_t *et, const char *fmt, ...)
+void EncOutAddTag(encodeoutput_t *eo, const char *fmt, ...)
 {
     char    buf[4096];
     va_list ap;
@@ -143,45 +200,19 @@ void EncTaskAddTag(encodetask_t *et, const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
-    /* Add to the task */
-    assert(et->metaTagCount < MAX_ENCODE_TASK_TAGS);
-    et->metaTags[et->metaTagCount++] = x_strdup(buf);
+    /* Add to the output */
+    assert(eo->metaTagCount < MAX_ENCODE_TASK_TAGS);
+    eo->metaTags[eo->metaTagCount++] = x_strdup(buf);
 }
 
 
-FILE *EncTaskGetRawFile(const encodetask_t *et)
+void EncOutSetArt(encodeoutput_t *eo, art_t art)
 {
-    return et->rawData;
-}
-
-
-void EncTaskSetArt(encodetask_t *et, art_t art)
-{
-    if(et->coverArt)
+    if(eo->coverArt)
     {
-        ArtFree(et->coverArt);
+        ArtFree(eo->coverArt);
     }
-    et->coverArt = ArtDup(art);
-}
-
-
-void EncTaskFree(encodetask_t *et)
-{
-    fclose(et->rawData);
-
-    while(et->metaTagCount > 0)
-    {
-        free(et->metaTags[--et->metaTagCount]);
-    }
-
-    if(et->coverArt)
-    {
-        ArtFree(et->coverArt);
-    }
-
-    free(et->outFilename);
-    free(et->outTempFilename);
-    free(et);
+    eo->coverArt = ArtDup(art);
 }
 
 /* END OF FILE */
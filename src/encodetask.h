@@ -39,12 +39,10 @@
  * Types
  **************************************************************************/
 
-/** Structure for an audio encoding task.
+/** Structure for a tagged output file of an encoding task.
  */
-typedef struct encodetask
+typedef struct encodeoutput
 {
-    uint32_t  trackNum;
-
     /** Output filename. */
     char     *outFilename;
 
@@ -57,23 +55,56 @@ typedef struct encodetask
     /** List of meta-data tags for the audio. */
     char     *metaTags[MAX_ENCODE_TASK_TAGS];
 
+    /** The cover art if known, else NULL. */
+    art_t     coverArt;
+}
+encodeoutput_t;
+
+
+/** Structure for an audio encoding task.
+ * The audio is encoded once and written to each output with the
+ * output's own tags and cover art.
+ */
+typedef struct encodetask
+{
+    uint32_t        trackNum;
+
+    /** Count of outputs. */
+    uint16_t        outputCount;
+
+    /** Array of outputs. */
+    encodeoutput_t *output;
+
     /** Number of audio channels. */
-    uint8_t   nChannels;
+    uint8_t         nChannels;
 
     /** Bis per sample. */
-    uint8_t   bitsPerSample;
+    uint8_t         bitsPerSample;
 
     /** The audio sample rate in Hz. */
-    uint32_t  sampleRateHz;
+    uint32_t        sampleRateHz;
 
     /** Count of samples per channel in the stream. */
-    uint64_t  totalSamples;
+    uint64_t        totalSamples;
 
-    /** The cover art if known, else NULL. */
-    art_t     coverArt;
+    /** FLAC compression level, set when encoding starts. */
+    uint8_t         level;
+
+    /** Open handle to the actual audio data.
+     * This is either an intermediate file or a pipe from the rip process.
+     */
+    FILE           *rawData;
+
+    /** Index of the drive ripping the audio.
+     * The encoders are shared fairly between the drives using this.
+     */
+    uint16_t        source;
 
-    /** Open handle to the actual audio data. */
-    FILE     *rawData;
+    /** Function to call once the task has been processed, or NULL. */
+    void          (*doneCb)(struct encodetask *et, void *param);
+
+    /** Parameter to pass to doneCb. */
+    void           *doneParam;
 }
 encodetask_t;
 
@@ -81,19 +112,21 @@ encodetask_t;
  * Prototypes
  **************************************************************************/
 
-encodetask_t *EncTaskNew(const char *filename, uint8_t nChannels, uint64_t totalSamples);
+encodetask_t   *EncTaskNew(FILE *rawData, uint8_t nChannels, uint64_t totalSamples);
+
+encodeoutput_t *EncTaskAddOutput(encodetask_t *et);
 
-void          EncTaskSetOutputFilename(encodetask_t *et, const char *filename);
+void            EncTaskPrint(const encodetask_t *et, FILE *out);
 
-void          EncTaskAddTag(encodetask_t *et, const char *fmt, ...);
+FILE           *EncTaskGetRawFile(const encodetask_t *et);
 
-void          EncTaskPrint(const encodetask_t *et, FILE *out);
+void            EncTaskFree(encodetask_t *et);
 
-FILE         *EncTaskGetRawFile(const encodetask_t *et);
+void            EncOutSetFilename(encodeoutput_t *eo, const char *filename);
 
-void          EncTaskSetArt(encodetask_t *et, art_t art);
+void            EncOutAddTag(encodeoutput_t *eo, const char *fmt, ...);
 
-void          EncTaskFree(encodetask_t *et);
+void            EncOutSetArt(encodeoutput_t *eo, art_t art);
 
 #endif /* ENCODETASK */
 
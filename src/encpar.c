@@ -0,0 +1,646 @@
+/***************************************************************************
+ * encpar.c: Parallel encoding of a single track in segments.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <FLAC/stream_encoder.h>
+#include <sys/prctl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "encodetask.h"
+#include "pcmconv.h"
+#include "encpar.h"
+#include "x_mem.h"
+#include "md5.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Count of FLAC blocks in each segment.
+ * Segments are a whole number of blocks, so every frame but the last in
+ * the track is full and the stitched stream has a fixed blocksize.
+ */
+#define SEGMENT_BLOCKS      64
+
+/** Count of segments per thread that may be in memory at once. */
+#define SEGMENTS_PER_THREAD 2
+
+/** Length of the stream marker, STREAMINFO header and STREAMINFO block. */
+#define STREAMINFO_END      (4 + 4 + 34)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** A part of the track which is encoded independently. */
+typedef struct segment
+{
+    struct segment *next;
+
+    /** Interleaved samples, freed once encoded. */
+    FLAC__int32    *samples;
+
+    /** Count of samples per channel. */
+    uint32_t        frames;
+
+    /** Encoded FLAC frames, concatenated. */
+    uint8_t        *data;
+    size_t          dataLen, dataSize;
+
+    /** Length of each encoded frame. */
+    uint32_t       *frameLen;
+    uint32_t        frameCount, frameLenSize;
+
+    bool            done, ok;
+}
+segment_t;
+
+
+/** State for the parallel encode of a track. */
+typedef struct
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+
+    /** Segments waiting for a worker. */
+    segment_t          *head, *tail;
+
+    /** Set when the workers should exit. */
+    bool                stop;
+
+    const encodetask_t *et;
+    uint32_t            blocksize;
+
+    /** Output frame numbering and statistics. */
+    uint32_t            frameNum;
+    uint32_t            minFrameSize, maxFrameSize;
+}
+encpar_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/** Table for the CRC-16 protecting each frame, polynomial 0x8005. */
+static uint16_t       crc16Table[256];
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static void crcInit(void)
+{
+    for(uint16_t b = 0; b < 256; b++)
+    {
+        uint16_t crc = b << 8;
+
+        for(uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+        }
+
+        crc16Table[b] = crc;
+    }
+}
+
+
+/** Compute the CRC-8 protecting a frame header, polynomial 0x07. */
+static uint8_t crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+
+    while(len-- > 0)
+    {
+        crc ^= *data++;
+
+        for(uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    while(len-- > 0)
+    {
+        crc = (crc << 8) ^ crc16Table[(crc >> 8) ^ *data++];
+    }
+
+    return crc;
+}
+
+
+/** Write a frame number with the UTF-8 like coding used in frame headers.
+ * \returns The count of bytes written to \a out.
+ */
+static uint8_t putUtf8(uint8_t *out, uint32_t v)
+{
+    uint8_t len, b;
+
+    if(v < 0x80)
+    {
+        out[0] = v;
+        return 1;
+    }
+
+    for(len = 2; len < 6 && v >= (1u << (5 * len + 1)); len++)
+        ;
+
+    for(b = len - 1; b > 0; b--)
+    {
+        out[b] = 0x80 | (v & 0x3f);
+        v >>= 6;
+    }
+
+    out[0] = (0xff << (8 - len)) | v;
+
+    return len;
+}
+
+
+/** Get the length of a coded number from its first byte, or 0 if invalid. */
+static uint8_t utf8Len(uint8_t first)
+{
+    uint8_t len = 0;
+
+    while(len < 8 && (first & (0x80 >> len)))
+    {
+        len++;
+    }
+
+    return len == 0 ? 1 : (len == 1 || len > 7) ? 0 : len;
+}
+
+
+/** Write a frame from a segment, renumbered for its place in the track.
+ * Each segment is encoded from frame 0, so the frame number in the header
+ * is rewritten, and the header CRC-8 and frame CRC-16 recomputed.
+ */
+static bool writeFrame(encpar_t *p, const uint8_t *f, uint32_t len, FILE *out)
+{
+    uint8_t  hdr[4 + 6 + 4 + 1];
+    uint8_t  hdrLen, numLen, extra = 0;
+    uint32_t in, newLen;
+    uint16_t crc;
+
+    if(len < 6 || f[0] != 0xff || (f[1] & 0xfe) != 0xf8 || (numLen = utf8Len(f[4])) == 0)
+    {
+        return false;
+    }
+
+    /* Optional block size and sample rate fields follow the number */
+    switch(f[2] >> 4)
+    {
+        case 6: extra += 1; break;
+        case 7: extra += 2; break;
+    }
+
+    switch(f[2] & 0xf)
+    {
+        case 12: extra += 1; break;
+        case 13:
+        case 14: extra += 2; break;
+    }
+
+    in = 4 + numLen + extra + 1;
+    if(len < in + 2)
+    {
+        return false;
+    }
+
+    memcpy(hdr, f, 4);
+    hdrLen = 4 + putUtf8(&hdr[4], p->frameNum++);
+    memcpy(&hdr[hdrLen], &f[4 + numLen], extra);
+    hdrLen += extra;
+    hdr[hdrLen] = crc8(hdr, hdrLen);
+    hdrLen++;
+
+    crc = crc16(0, hdr, hdrLen);
+    crc = crc16(crc, &f[in], len - in - 2);
+
+    fwrite(hdr, hdrLen, 1, out);
+    fwrite(&f[in], len - in - 2, 1, out);
+    fputc(crc >> 8, out);
+    fputc(crc & 0xff, out);
+
+    newLen = hdrLen + (len - in);
+    if(newLen < p->minFrameSize)
+    {
+        p->minFrameSize = newLen;
+    }
+    if(newLen > p->maxFrameSize)
+    {
+        p->maxFrameSize = newLen;
+    }
+
+    return true;
+}
+
+
+static FLAC__StreamEncoderWriteStatus segmentWrite(const FLAC__StreamEncoder *encoder __attribute__((__unused__)),
+                                                   const FLAC__byte buffer[],
+                                                   size_t bytes,
+                                                   uint32_t samples,
+                                                   uint32_t current_frame __attribute__((__unused__)),
+                                                   void *client_data)
+{
+    segment_t *s = client_data;
+
+    /* Metadata is written with no samples, and is not needed */
+    if(samples == 0)
+    {
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    /* Each write with samples is exactly one frame */
+    if(s->dataLen + bytes > s->dataSize)
+    {
+        s->dataSize = (s->dataLen + bytes) * 2;
+        s->data = x_realloc(s->data, s->dataSize);
+    }
+
+    if(s->frameCount == s->frameLenSize)
+    {
+        s->frameLenSize = s->frameLenSize ? s->frameLenSize * 2 : SEGMENT_BLOCKS + 1;
+        s->frameLen = x_realloc(s->frameLen, sizeof(uint32_t) * s->frameLenSize);
+    }
+
+    memcpy(&s->data[s->dataLen], buffer, bytes);
+    s->dataLen += bytes;
+    s->frameLen[s->frameCount++] = bytes;
+
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+static bool encodeSegment(const encpar_t *p, segment_t *s)
+{
+    const encodetask_t  *et = p->et;
+    FLAC__StreamEncoder *fse = FLAC__stream_encoder_new();
+    bool                 ok = false;
+
+    FLAC__stream_encoder_set_channels(fse, et->nChannels);
+    FLAC__stream_encoder_set_bits_per_sample(fse, et->bitsPerSample);
+    FLAC__stream_encoder_set_sample_rate(fse, et->sampleRateHz);
+    FLAC__stream_encoder_set_compression_level(fse, et->level);
+    FLAC__stream_encoder_set_blocksize(fse, p->blocksize);
+    FLAC__stream_encoder_set_total_samples_estimate(fse, s->frames);
+
+    /* The signature is computed over the whole track instead */
+    FLAC__stream_encoder_set_do_md5(fse, false);
+
+    if(FLAC__stream_encoder_init_stream(fse, segmentWrite, NULL, NULL, NULL, s) ==
+       FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+        ok = FLAC__stream_encoder_process_interleaved(fse, s->samples, s->frames);
+        ok = FLAC__stream_encoder_finish(fse) && ok;
+    }
+
+    FLAC__stream_encoder_delete(fse);
+
+    return ok;
+}
+
+
+static void *segmentWorker(void *param)
+{
+    encpar_t *p = param;
+
+    prctl(PR_SET_NAME, "ripright: encpar");
+
+    pthread_mutex_lock(&p->lock);
+
+    while(1)
+    {
+        segment_t *s;
+
+        while(p->head == NULL && !p->stop)
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+
+        if(p->head == NULL)
+        {
+            break;
+        }
+
+        s = p->head;
+        p->head = s->next;
+        if(p->head == NULL)
+        {
+            p->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&p->lock);
+
+        s->ok = encodeSegment(p, s);
+        free(s->samples);
+        s->samples = NULL;
+
+        pthread_mutex_lock(&p->lock);
+        s->done = true;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+
+/** Wait for a segment to be encoded, then write and free it.
+ */
+static bool finishSegment(encpar_t *p, segment_t *s, FILE *out)
+{
+    bool   ok;
+    size_t off = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while(!s->done)
+    {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    ok = s->ok;
+
+    for(uint32_t f = 0; f < s->frameCount && ok; f++)
+    {
+        ok = writeFrame(p, &s->data[off], s->frameLen[f], out);
+        off += s->frameLen[f];
+    }
+
+    free(s->data);
+    free(s->frameLen);
+    free(s);
+
+    return ok;
+}
+
+
+/** Write the stream marker and STREAMINFO block.
+ * \param[in] last  If set, flag the STREAMINFO as the last metadata block.
+ */
+static void writeStreamInfo(const encpar_t *p, uint64_t totalSamples, const uint8_t md5[16], bool last, FILE *out)
+{
+    const encodetask_t *et = p->et;
+    uint8_t             si[STREAMINFO_END];
+    uint64_t            v;
+
+    memcpy(si, "fLaC", 4);
+
+    /* Metadata block type STREAMINFO, 34 bytes long */
+    si[4] = last ? 0x80 : 0x00;
+    si[5] = 0;
+    si[6] = 0;
+    si[7] = 34;
+
+    si[8]  = p->blocksize >> 8;
+    si[9]  = p->blocksize;
+    si[10] = p->blocksize >> 8;
+    si[11] = p->blocksize;
+    si[12] = p->minFrameSize >> 16;
+    si[13] = p->minFrameSize >> 8;
+    si[14] = p->minFrameSize;
+    si[15] = p->maxFrameSize >> 16;
+    si[16] = p->maxFrameSize >> 8;
+    si[17] = p->maxFrameSize;
+
+    /* Sample rate (20), channels - 1 (3), bits per sample - 1 (5), samples (36) */
+    v = ((uint64_t)et->sampleRateHz << 44) |
+        ((uint64_t)(et->nChannels - 1) << 41) |
+        ((uint64_t)(et->bitsPerSample - 1) << 36) |
+        (totalSamples & 0xfffffffffULL);
+
+    for(uint8_t b = 0; b < 8; b++)
+    {
+        si[18 + b] = v >> (56 - (b * 8));
+    }
+
+    memcpy(&si[26], md5, 16);
+
+    fwrite(si, sizeof(si), 1, out);
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Encode a track by splitting it into segments encoded in parallel.
+ * The segments are stitched into a single FLAC stream, with the
+ * STREAMINFO computed for the whole track.
+ * \param[in] et        The task, whose level must be set.
+ * \param[in] filename  The file to write.
+ * \param[in] threads   Count of threads to encode on.
+ * \param[in] tags      Serialised metadata blocks to follow the STREAMINFO,
+ *                      the last flagged as such, or NULL for none.
+ * \param[in] tagsLen   Length of \a tags in bytes.
+ * \returns true if the encode was successful.
+ */
+bool EncParEncode(encodetask_t *et, const char *filename, uint32_t threads,
+                  const uint8_t *tags, size_t tagsLen)
+{
+    const uint32_t       inFlight = threads * SEGMENTS_PER_THREAD;
+    segment_t           *pending[inFlight];
+    FLAC__StreamEncoder *fse;
+    pthread_t            tid[threads];
+    uint32_t             segFrames, head = 0, count = 0;
+    uint64_t             sampleCount = 0;
+    int16_t             *buffer16;
+    uint8_t              md5[16];
+    md5_t                md5ctx;
+    encpar_t             p;
+    FILE                *out;
+    bool                 ok = true;
+
+    pthread_once(&crcOnce, crcInit);
+
+    out = fopen(filename, "wb");
+    if(out == NULL)
+    {
+        LogErr("Error: Failed to open encoder output: %m\n");
+        return false;
+    }
+
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.et = et;
+    p.minFrameSize = UINT32_MAX;
+
+    /* Use the blocksize the level would normally choose */
+    fse = FLAC__stream_encoder_new();
+    FLAC__stream_encoder_set_compression_level(fse, et->level);
+    p.blocksize = FLAC__stream_encoder_get_blocksize(fse);
+    FLAC__stream_encoder_delete(fse);
+
+    segFrames = p.blocksize * SEGMENT_BLOCKS;
+    buffer16 = x_malloc(sizeof(int16_t) * et->nChannels * segFrames);
+
+    Md5Init(&md5ctx);
+
+    /* Reserve space for the STREAMINFO, which is written last, and tags */
+    fseek(out, STREAMINFO_END + tagsLen, SEEK_SET);
+
+    for(uint32_t t = 0; t < threads; t++)
+    {
+        pthread_create(&tid[t], NULL, segmentWorker, &p);
+    }
+
+    while(ok)
+    {
+        segment_t *s;
+        size_t     n;
+
+        n = fread(buffer16, sizeof(int16_t) * et->nChannels, segFrames, et->rawData);
+        if(n == 0)
+        {
+            break;
+        }
+
+        /* The signature is over little-endian samples, as ripped on x86 */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for(size_t c = 0; c < n * et->nChannels; c++)
+        {
+            buffer16[c] = __builtin_bswap16(buffer16[c]);
+        }
+        Md5Update(&md5ctx, buffer16, sizeof(int16_t) * et->nChannels * n);
+        for(size_t c = 0; c < n * et->nChannels; c++)
+        {
+            buffer16[c] = __builtin_bswap16(buffer16[c]);
+        }
+#else
+        Md5Update(&md5ctx, buffer16, sizeof(int16_t) * et->nChannels * n);
+#endif
+
+        s = x_calloc(sizeof(segment_t), 1);
+        s->frames = n;
+        s->samples = x_malloc(sizeof(FLAC__int32) * et->nChannels * n);
+        PcmConvS16(s->samples, buffer16, n * et->nChannels, PCM_HOST_ENDIAN);
+
+        sampleCount += n;
+
+        /* Write the oldest segment if the limit in memory is reached */
+        if(count == inFlight)
+        {
+            ok = finishSegment(&p, pending[head], out);
+            head = (head + 1) % inFlight;
+            count--;
+        }
+
+        pending[(head + count) % inFlight] = s;
+        count++;
+
+        pthread_mutex_lock(&p.lock);
+        if(p.tail)
+        {
+            p.tail->next = s;
+        }
+        else
+        {
+            p.head = s;
+        }
+        p.tail = s;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    /* Write the remaining segments in order */
+    while(count > 0)
+    {
+        ok = finishSegment(&p, pending[head], out) && ok;
+        head = (head + 1) % inFlight;
+        count--;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = true;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+
+    for(uint32_t t = 0; t < threads; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+
+    free(buffer16);
+
+    Md5Final(&md5ctx, md5);
+
+    if(p.minFrameSize == UINT32_MAX)
+    {
+        p.minFrameSize = 0;
+    }
+
+    rewind(out);
+    writeStreamInfo(&p, sampleCount, md5, tagsLen == 0, out);
+    if(tagsLen > 0)
+    {
+        fwrite(tags, 1, tagsLen, out);
+    }
+
+    if(ferror(out))
+    {
+        ok = false;
+    }
+
+    if(fclose(out) != 0)
+    {
+        ok = false;
+    }
+
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+
+    if(!ok)
+    {
+        LogErr("Track%02" PRIu32 ": Error: Parallel encode failed\n", et->trackNum);
+        return false;
+    }
+
+    /* The stream ends early if the rip process failed */
+    if(sampleCount != et->totalSamples)
+    {
+        LogErr("Track%02" PRIu32 ": Error: Audio ended after %" PRIu64 " of %" PRIu64 " samples\n",
+               et->trackNum, sampleCount, et->totalSamples);
+        return false;
+    }
+
+    return true;
+}
+
+/* END OF FILE */
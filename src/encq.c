@@ -0,0 +1,494 @@
+/***************************************************************************
+ * encq.c: Scheduler for encoding tasks shared fairly between drives.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "encodetask.h"
+#include "x_mem.h"
+#include "encq.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Initial guess at the encode rate of one thread, in samples per ms.
+ * This is 100x real time and is refined as tasks complete.
+ */
+#define ENCQ_DEFAULT_RATE (44100.0f * 100.0f / 1000.0f)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+struct encqentry
+{
+    struct encqentry *next;
+    encodetask_t     *et;
+
+    /** Order of arrival, used to predict a first-come first-served makespan. */
+    uint32_t          seq;
+
+    /** Set if the audio is still being ripped into a pipe. */
+    bool              streaming;
+};
+
+
+/** Queue of tasks from a single source, highest priority first. */
+struct encqsource
+{
+    uint16_t          source;
+    struct encqentry *head;
+
+    /** Count of samples handed out from this source, for fairness. */
+    uint64_t          served;
+};
+
+
+/** Predicted cost of a queued task. */
+struct encqcost
+{
+    uint32_t seq;
+    uint64_t cost;
+};
+
+
+/** A task being encoded. */
+struct encqrun
+{
+    encodetask_t *et;
+    uint64_t      startMs;
+    bool          streaming;
+};
+
+
+struct encq
+{
+    pthread_mutex_t    lock;
+    pthread_cond_t     notEmpty;
+
+    /** Array of known sources, each with its own queue. */
+    struct encqsource *src;
+    uint16_t           srcCount;
+
+    /** Count of tasks in the queue. */
+    uint32_t           depth;
+
+    /** Tasks being encoded, one slot per encoder thread. */
+    struct encqrun    *run;
+    uint32_t           workers, runCount;
+
+    /** Measured encode rate of one thread, in samples per ms. */
+    float              rate;
+
+    /** Time at which the encoders last became busy, or 0 if idle. */
+    uint64_t           busyStartMs;
+
+    /** Count of tasks queued since the encoders became busy. */
+    uint32_t           busyTasks;
+
+    /** Predicted end of the busy period relative to its start, as of the
+     *  last arrival, if longest first and if in arrival order.
+     */
+    uint64_t           predictMs, predictFifoMs;
+};
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+static struct encqsource *findSource(struct encq *q, uint16_t source)
+{
+    for(uint16_t s = 0; s < q->srcCount; s++)
+    {
+        if(q->src[s].source == source)
+        {
+            return &q->src[s];
+        }
+    }
+
+    q->src = x_realloc(q->src, sizeof(struct encqsource) * (q->srcCount + 1));
+    q->src[q->srcCount].source = source;
+    q->src[q->srcCount].head = NULL;
+    q->src[q->srcCount].served = 0;
+
+    return &q->src[q->srcCount++];
+}
+
+
+/** Get the least count of samples served to any source with queued tasks.
+ * \returns The count, or UINT64_MAX if no source has tasks.
+ */
+static uint64_t minServed(const struct encq *q)
+{
+    uint64_t min = UINT64_MAX;
+
+    for(uint16_t s = 0; s < q->srcCount; s++)
+    {
+        if(q->src[s].head && q->src[s].served < min)
+        {
+            min = q->src[s].served;
+        }
+    }
+
+    return min;
+}
+
+
+/** Check if entry \a a should be encoded before \a b from the same source.
+ * Streaming tasks go first since a ripper is blocked on each, in the order
+ * they arrived, as a track is only ripped once the encoder of the previous
+ * track is reading it.  Taking a later streaming task first could leave an
+ * encoder waiting on a pipe that is not yet written, while the ripper waits
+ * on the earlier task that nobody is reading.  Other tasks go longest
+ * first, so that short tasks fill in around them at the end.
+ */
+static bool before(const struct encqentry *a, const struct encqentry *b)
+{
+    if(a->streaming != b->streaming)
+    {
+        return a->streaming;
+    }
+
+    if(a->streaming)
+    {
+        return a->seq < b->seq;
+    }
+
+    return a->et->totalSamples > b->et->totalSamples;
+}
+
+
+static int cmpCostDesc(const void *a, const void *b)
+{
+    const uint64_t ca = ((const struct encqcost *)a)->cost;
+    const uint64_t cb = ((const struct encqcost *)b)->cost;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+
+static int cmpSeq(const void *a, const void *b)
+{
+    const uint32_t sa = ((const struct encqcost *)a)->seq;
+    const uint32_t sb = ((const struct encqcost *)b)->seq;
+
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+
+/** Predict the makespan of a list of costs, assigned in order.
+ * Each cost is given to the encoder that will be free soonest, which is
+ * how the encoder threads take tasks from the queue.
+ * \param[in] initial  Array of the initial busy time for each encoder.
+ */
+static uint64_t listSchedule(const uint64_t *initial, uint32_t workers, const struct encqcost *c, uint32_t n)
+{
+    uint64_t load[workers], makespan = 0;
+
+    for(uint32_t w = 0; w < workers; w++)
+    {
+        load[w] = initial[w];
+    }
+
+    for(uint32_t t = 0; t < n; t++)
+    {
+        uint32_t min = 0;
+
+        for(uint32_t w = 1; w < workers; w++)
+        {
+            if(load[w] < load[min])
+            {
+                min = w;
+            }
+        }
+
+        load[min] += c[t].cost;
+    }
+
+    for(uint32_t w = 0; w < workers; w++)
+    {
+        if(load[w] > makespan)
+        {
+            makespan = load[w];
+        }
+    }
+
+    return makespan;
+}
+
+
+/** Update the predicted makespans from the tasks currently known.
+ * The caller must hold the lock.
+ */
+static void predict(struct encq *q, uint64_t now)
+{
+    struct encqcost *c = x_malloc(sizeof(struct encqcost) * q->depth);
+    uint64_t         load[q->workers];
+    uint32_t         n = 0;
+
+    /* Encoders are busy until their current task is expected to finish */
+    for(uint32_t w = 0; w < q->workers; w++)
+    {
+        load[w] = 0;
+
+        if(w < q->runCount)
+        {
+            const uint64_t total = q->run[w].et->totalSamples / q->rate;
+            const uint64_t done = now - q->run[w].startMs;
+
+            load[w] = total > done ? total - done : 0;
+        }
+    }
+
+    for(uint16_t s = 0; s < q->srcCount; s++)
+    {
+        for(struct encqentry *e = q->src[s].head; e != NULL; e = e->next)
+        {
+            c[n].seq = e->seq;
+            c[n].cost = e->et->totalSamples / q->rate;
+            n++;
+        }
+    }
+
+    qsort(c, n, sizeof(struct encqcost), cmpSeq);
+    q->predictFifoMs = (now - q->busyStartMs) + listSchedule(load, q->workers, c, n);
+
+    qsort(c, n, sizeof(struct encqcost), cmpCostDesc);
+    q->predictMs = (now - q->busyStartMs) + listSchedule(load, q->workers, c, n);
+
+    free(c);
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Create a new queue.
+ * \param[in] workers  Count of encoder threads which will take tasks.
+ */
+struct encq *EncQNew(uint32_t workers)
+{
+    struct encq *q = x_calloc(sizeof(struct encq), 1);
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+
+    q->run = x_calloc(sizeof(struct encqrun), workers);
+    q->workers = workers;
+    q->rate = ENCQ_DEFAULT_RATE;
+
+    return q;
+}
+
+
+/** Add a task to the queue of its source, as given by et->source.
+ */
+void EncQPut(struct encq *q, encodetask_t *et)
+{
+    struct encqentry   *e = x_malloc(sizeof(struct encqentry));
+    struct encqentry  **p;
+    struct encqsource  *s;
+    struct stat         st;
+    uint64_t            now = nowMs();
+
+    e->next = NULL;
+    e->et = et;
+    e->streaming = fstat(fileno(et->rawData), &st) == 0 && S_ISFIFO(st.st_mode);
+
+    pthread_mutex_lock(&q->lock);
+
+    if(q->busyStartMs == 0)
+    {
+        q->busyStartMs = now;
+        q->busyTasks = 0;
+    }
+
+    e->seq = q->busyTasks++;
+
+    s = findSource(q, et->source);
+
+    /* A source with nothing queued may not claim a backlog of unused share */
+    if(s->head == NULL)
+    {
+        uint64_t min = minServed(q);
+
+        if(min != UINT64_MAX && s->served < min)
+        {
+            s->served = min;
+        }
+    }
+
+    for(p = &s->head; *p != NULL && !before(e, *p); p = &(*p)->next)
+        ;
+    e->next = *p;
+    *p = e;
+    q->depth++;
+
+    predict(q, now);
+
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+/** Wait for and remove the next task.
+ * The source which has had the fewest samples encoded is served next, so
+ * that a drive with many queued tasks, such as tracks captured during a
+ * slow lookup, does not hold up the encoding of the other drives.  From
+ * that source the oldest streaming task is taken, or else the longest
+ * task, which shortens the tail where a single long track is encoded while
+ * the other encoders are idle.
+ */
+encodetask_t *EncQGet(struct encq *q)
+{
+    struct encqsource *s = NULL;
+    struct encqentry  *e;
+    encodetask_t      *et;
+
+    pthread_mutex_lock(&q->lock);
+
+    while(q->depth == 0)
+    {
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    }
+
+    for(uint16_t n = 0; n < q->srcCount; n++)
+    {
+        if(q->src[n].head && (s == NULL || q->src[n].served < s->served))
+        {
+            s = &q->src[n];
+        }
+    }
+
+    e = s->head;
+    s->head = e->next;
+    s->served += e->et->totalSamples;
+    q->depth--;
+
+    et = e->et;
+
+    q->run[q->runCount].et = et;
+    q->run[q->runCount].startMs = nowMs();
+    q->run[q->runCount].streaming = e->streaming;
+    q->runCount++;
+
+    free(e);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return et;
+}
+
+
+/** Note that a task from EncQGet() has been encoded.
+ * This refines the measured encode rate, and logs the makespan once all
+ * queued tasks are complete.
+ */
+void EncQDone(struct encq *q, encodetask_t *et)
+{
+    uint64_t now = nowMs();
+
+    pthread_mutex_lock(&q->lock);
+
+    for(uint32_t r = 0; r < q->runCount; r++)
+    {
+        if(q->run[r].et == et)
+        {
+            const uint64_t ms = now - q->run[r].startMs;
+
+            /* Streamed tasks are limited by the ripper, so are not counted */
+            if(!q->run[r].streaming && ms > 0)
+            {
+                q->rate = (q->rate * 0.75f) + (((float)et->totalSamples / ms) * 0.25f);
+            }
+
+            q->run[r] = q->run[--q->runCount];
+            break;
+        }
+    }
+
+    if(q->runCount == 0 && q->depth == 0 && q->busyStartMs != 0)
+    {
+        LogInf("Encoded %" PRIu32 " tasks in %.1f s, predicted %.1f s (%.1f s in arrival order)\n",
+               q->busyTasks, (now - q->busyStartMs) / 1000.0f,
+               q->predictMs / 1000.0f, q->predictFifoMs / 1000.0f);
+
+        q->busyStartMs = 0;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+/** Get the count of tasks waiting for an encoder.
+ */
+uint32_t EncQDepth(struct encq *q)
+{
+    uint32_t depth;
+
+    pthread_mutex_lock(&q->lock);
+    depth = q->depth;
+    pthread_mutex_unlock(&q->lock);
+
+    return depth;
+}
+
+
+/** Get the count of encoder threads not currently encoding a task.
+ */
+uint32_t EncQIdle(struct encq *q)
+{
+    uint32_t idle;
+
+    pthread_mutex_lock(&q->lock);
+    idle = q->workers > q->runCount ? q->workers - q->runCount : 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return idle;
+}
+
+/* END OF FILE */
@@ -0,0 +1,53 @@
+/***************************************************************************
+ * encq.h: Interface to the scheduler for encoding tasks.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef ENCQ_H
+#define ENCQ_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdint.h>
+#include "encodetask.h"
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef struct encq *encq_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+encq_t        EncQNew(uint32_t workers);
+void          EncQPut(encq_t q, encodetask_t *et);
+encodetask_t *EncQGet(encq_t q);
+void          EncQDone(encq_t q, encodetask_t *et);
+uint32_t      EncQDepth(encq_t q);
+uint32_t      EncQIdle(encq_t q);
+
+#endif
+
+/* END OF FILE */
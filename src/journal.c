@@ -0,0 +1,539 @@
+/***************************************************************************
+ * journal.c: Journal of rip progress, allowing a crashed rip to resume.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "journal.h"
+#include "x_mem.h"
+#include "md5.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Age after which the journal and audio of an abandoned rip are removed. */
+#define JOURNAL_EXPIRY_SECS (7 * 24 * 60 * 60)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef enum
+{
+    TRACK_NONE,
+
+    /** Some audio of the track has been saved. */
+    TRACK_PARTIAL,
+
+    /** All audio of the track has been saved. */
+    TRACK_RIPPED,
+
+    /** The audio of the track has been passed to the encoders. */
+    TRACK_DONE
+}
+jstate_t;
+
+
+/** Progress of some track. */
+typedef struct
+{
+    jstate_t state;
+
+    /** Bytes of audio saved, and their MD5 as a hex string. */
+    uint64_t bytes;
+    char     md5[33];
+}
+jtrack_t;
+
+
+struct journal
+{
+    pthread_mutex_t lock;
+
+    char           *path;
+    char           *spoolPrefix;
+
+    uint16_t        trackCount;
+    jtrack_t       *track;
+
+    /** The track being ripped, and the file saving its audio. */
+    uint16_t        current;
+    FILE           *spool;
+    md5_t           md5;
+    uint64_t        bytes;
+};
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static void spoolName(const journal_t *j, uint16_t track, char *buf, size_t bufLen)
+{
+    snprintf(buf, bufLen, "%s-%02" PRIu16 ".pcm", j->spoolPrefix, track);
+}
+
+
+static void md5Hex(const md5_t *m, char hex[33])
+{
+    md5_t   c = *m;
+    uint8_t digest[16];
+
+    Md5Final(&c, digest);
+
+    for(uint8_t i = 0; i < 16; i++)
+    {
+        sprintf(&hex[i * 2], "%02x", digest[i]);
+    }
+}
+
+
+/** Rewrite the journal file.
+ * This is written under a temporary name then renamed so that a crash
+ * never leaves a partial journal.  Must be called with the lock held.
+ */
+static void save(journal_t *j)
+{
+    char  tmpPath[strlen(j->path) + 8];
+    FILE *f;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", j->path);
+
+    f = fopen(tmpPath, "w");
+    if(f == NULL)
+    {
+        LogWarn("Warning: Failed to write rip journal %s: %m\n", tmpPath);
+        return;
+    }
+
+    for(uint16_t t = 0; t < j->trackCount; t++)
+    {
+        const jtrack_t *jt = &j->track[t];
+
+        switch(jt->state)
+        {
+            case TRACK_NONE:
+                break;
+            case TRACK_PARTIAL:
+            case TRACK_RIPPED:
+                fprintf(f, "track %" PRIu16 " %s %" PRIu64 " %s\n", t + 1,
+                        jt->state == TRACK_PARTIAL ? "partial" : "ripped",
+                        jt->bytes, jt->md5);
+                break;
+            case TRACK_DONE:
+                fprintf(f, "track %" PRIu16 " done\n", t + 1);
+                break;
+        }
+    }
+
+    if(fflush(f) != 0 || fdatasync(fileno(f)) != 0 || fclose(f) != 0 ||
+       rename(tmpPath, j->path) != 0)
+    {
+        LogWarn("Warning: Failed to write rip journal %s: %m\n", j->path);
+    }
+}
+
+
+/** Read the journal of an earlier attempt at the disc, if any.
+ */
+static void load(journal_t *j)
+{
+    FILE *f = fopen(j->path, "r");
+    char  line[128];
+
+    if(f == NULL)
+    {
+        return;
+    }
+
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        uint16_t track;
+        uint64_t bytes;
+        char     state[16], md5[33];
+        int      n;
+
+        n = sscanf(line, "track %" SCNu16 " %15s %" SCNu64 " %32s", &track, state, &bytes, md5);
+
+        if(n < 2 || track < 1 || track > j->trackCount)
+        {
+            continue;
+        }
+
+        jtrack_t *jt = &j->track[track - 1];
+
+        if(n == 4 && (strcmp(state, "partial") == 0 || strcmp(state, "ripped") == 0))
+        {
+            jt->state = state[0] == 'p' ? TRACK_PARTIAL : TRACK_RIPPED;
+            jt->bytes = bytes;
+            strcpy(jt->md5, md5);
+        }
+        else if(strcmp(state, "done") == 0)
+        {
+            jt->state = TRACK_DONE;
+        }
+    }
+
+    fclose(f);
+}
+
+
+/** Remove the journals and audio of rips abandoned long ago.
+ */
+static void prune(const char *stateDir)
+{
+    const time_t   now = time(NULL);
+    struct dirent *de;
+    DIR           *d;
+
+    if((d = opendir(stateDir)) == NULL)
+    {
+        return;
+    }
+
+    while((de = readdir(d)) != NULL)
+    {
+        const size_t len = strlen(de->d_name);
+        char         path[strlen(stateDir) + len + 2];
+        struct stat  sb;
+
+        if((len > 8 && strcmp(&de->d_name[len - 8], ".journal") == 0) ||
+           (len > 4 && strcmp(&de->d_name[len - 4], ".pcm") == 0))
+        {
+            snprintf(path, sizeof(path), "%s/%s", stateDir, de->d_name);
+
+            if(stat(path, &sb) == 0 && now - sb.st_mtime > JOURNAL_EXPIRY_SECS)
+            {
+                LogInf("Removing abandoned rip state %s\n", path);
+                unlink(path);
+            }
+        }
+    }
+
+    closedir(d);
+}
+
+
+/** Check the saved audio of some track against the journal.
+ * \param[in,out] m  MD5 state, updated with the audio.
+ */
+static bool verifySpool(const char *path, const jtrack_t *jt, md5_t *m)
+{
+    uint8_t  buf[64 * 1024];
+    uint64_t left = jt->bytes;
+    char     hex[33];
+    FILE    *f;
+
+    if((f = fopen(path, "rb")) == NULL)
+    {
+        return false;
+    }
+
+    while(left > 0)
+    {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+
+        if(fread(buf, n, 1, f) != 1)
+        {
+            break;
+        }
+
+        Md5Update(m, buf, n);
+        left -= n;
+    }
+
+    fclose(f);
+
+    md5Hex(m, hex);
+
+    return left == 0 && strcmp(hex, jt->md5) == 0 && truncate(path, jt->bytes) == 0;
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Open the journal for some disc.
+ * If an earlier attempt at the disc did not complete, its progress is
+ * loaded so that the rip can resume.
+ * \param[in] stateDir    Directory holding journals and saved audio.
+ * \param[in] discId      The MusicBrainz ID of the disc.
+ * \param[in] trackCount  Count of tracks on the disc.
+ */
+journal_t *JournalOpen(const char *stateDir, const char *discId, uint16_t trackCount)
+{
+    journal_t *j = x_calloc(sizeof(journal_t), 1);
+    uint16_t   done = 0, partial = 0;
+
+    prune(stateDir);
+
+    pthread_mutex_init(&j->lock, NULL);
+
+    j->path = x_malloc(strlen(stateDir) + strlen(discId) + 10);
+    sprintf(j->path, "%s/%s.journal", stateDir, discId);
+
+    j->spoolPrefix = x_malloc(strlen(stateDir) + strlen(discId) + 2);
+    sprintf(j->spoolPrefix, "%s/%s", stateDir, discId);
+
+    j->trackCount = trackCount;
+    j->track = x_calloc(sizeof(jtrack_t), trackCount);
+
+    load(j);
+
+    for(uint16_t t = 0; t < trackCount; t++)
+    {
+        if(j->track[t].state == TRACK_DONE)
+        {
+            done++;
+        }
+        else if(j->track[t].state != TRACK_NONE)
+        {
+            partial++;
+        }
+    }
+
+    if(done > 0 || partial > 0)
+    {
+        LogInf("Resuming rip of %s: %" PRIu16 " track(s) complete, %" PRIu16 " with saved audio\n",
+               discId, done, partial);
+    }
+
+    return j;
+}
+
+
+/** Check if the audio of some track has already been passed to the encoders.
+ * \param[in] j      The journal, or NULL if progress is not being saved.
+ * \param[in] track  The track number, counting from 1.
+ */
+bool JournalIsDone(journal_t *j, uint16_t track)
+{
+    bool done;
+
+    if(j == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    done = j->track[track - 1].state == TRACK_DONE;
+    pthread_mutex_unlock(&j->lock);
+
+    return done;
+}
+
+
+/** Start saving the audio of some track.
+ * If audio from an earlier attempt was saved and is intact, it is returned
+ * to be used before any further audio is read.
+ * \param[in]  track        The track number, counting from 1.
+ * \param[out] resumeBytes  Set to the count of bytes of saved audio.
+ * \param[out] complete     Set true if the saved audio is the whole track.
+ * \returns A file from which the saved audio can be read, or NULL if none.
+ */
+FILE *JournalTrackStart(journal_t *j, uint16_t track, uint64_t *resumeBytes, bool *complete)
+{
+    jtrack_t *jt = &j->track[track - 1];
+    char      path[strlen(j->spoolPrefix) + 16];
+    FILE     *replay = NULL;
+
+    spoolName(j, track, path, sizeof(path));
+
+    *resumeBytes = 0;
+    *complete = false;
+
+    j->current = track;
+    j->bytes = 0;
+    Md5Init(&j->md5);
+
+    if(jt->state == TRACK_PARTIAL || jt->state == TRACK_RIPPED)
+    {
+        if(verifySpool(path, jt, &j->md5) && (replay = fopen(path, "rb")) != NULL)
+        {
+            *resumeBytes = j->bytes = jt->bytes;
+            *complete = (jt->state == TRACK_RIPPED);
+        }
+        else
+        {
+            LogWarn("Track%02" PRIu16 ": Saved audio does not match the journal: discarding\n", track);
+
+            Md5Init(&j->md5);
+        }
+    }
+
+    j->spool = fopen(path, replay ? "ab" : "wb");
+    if(j->spool == NULL)
+    {
+        LogWarn("Warning: Failed to save audio to %s: %m\n", path);
+    }
+
+    return replay;
+}
+
+
+/** Save some audio of the current track.
+ */
+void JournalTrackWrite(journal_t *j, const void *data, size_t len)
+{
+    if(j->spool)
+    {
+        fwrite(data, len, 1, j->spool);
+        Md5Update(&j->md5, data, len);
+        j->bytes += len;
+    }
+}
+
+
+/** Record the audio of the current track saved so far.
+ * A rip that restarts will resume from this point.
+ */
+void JournalTrackCheckpoint(journal_t *j)
+{
+    jtrack_t *jt = &j->track[j->current - 1];
+
+    if(j->spool == NULL || fflush(j->spool) != 0 || fdatasync(fileno(j->spool)) != 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    jt->state = TRACK_PARTIAL;
+    jt->bytes = j->bytes;
+    md5Hex(&j->md5, jt->md5);
+
+    save(j);
+
+    pthread_mutex_unlock(&j->lock);
+}
+
+
+/** Record that all audio of the current track has been saved.
+ */
+void JournalTrackRipped(journal_t *j)
+{
+    jtrack_t *jt = &j->track[j->current - 1];
+
+    JournalTrackCheckpoint(j);
+
+    if(j->spool)
+    {
+        fclose(j->spool);
+        j->spool = NULL;
+
+        pthread_mutex_lock(&j->lock);
+        if(jt->state == TRACK_PARTIAL && jt->bytes == j->bytes)
+        {
+            jt->state = TRACK_RIPPED;
+            save(j);
+        }
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+
+/** Record that the audio of some track has been passed to the encoders.
+ * The saved audio is no longer needed and is removed.  This has no effect
+ * unless all audio of the track was saved.
+ * \param[in] j      The journal, or NULL if progress is not being saved.
+ * \param[in] track  The track number, counting from 1.
+ */
+void JournalTrackDone(journal_t *j, uint16_t track)
+{
+    if(j == NULL)
+    {
+        return;
+    }
+
+    jtrack_t *jt = &j->track[track - 1];
+    char      path[strlen(j->spoolPrefix) + 16];
+
+    pthread_mutex_lock(&j->lock);
+
+    if(jt->state == TRACK_RIPPED)
+    {
+        jt->state = TRACK_DONE;
+        save(j);
+
+        spoolName(j, track, path, sizeof(path));
+        unlink(path);
+    }
+
+    pthread_mutex_unlock(&j->lock);
+}
+
+
+/** Remove the journal and any saved audio once the disc is finished with.
+ * The journal is freed.
+ * \param[in] j  The journal, or NULL if progress is not being saved.
+ */
+void JournalRemove(journal_t *j)
+{
+    if(j == NULL)
+    {
+        return;
+    }
+
+    char path[strlen(j->spoolPrefix) + 16];
+
+    if(j->spool)
+    {
+        fclose(j->spool);
+    }
+
+    for(uint16_t t = 1; t <= j->trackCount; t++)
+    {
+        spoolName(j, t, path, sizeof(path));
+        unlink(path);
+    }
+
+    unlink(j->path);
+
+    pthread_mutex_destroy(&j->lock);
+    free(j->spoolPrefix);
+    free(j->path);
+    free(j->track);
+    free(j);
+}
+
+/* END OF FILE */
@@ -0,0 +1,56 @@
+/***************************************************************************
+ * journal.h: Interface to the rip progress journal.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef struct journal journal_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+journal_t *JournalOpen(const char *stateDir, const char *discId, uint16_t trackCount);
+bool       JournalIsDone(journal_t *j, uint16_t track);
+FILE      *JournalTrackStart(journal_t *j, uint16_t track, uint64_t *resumeBytes, bool *complete);
+void       JournalTrackWrite(journal_t *j, const void *data, size_t len);
+void       JournalTrackCheckpoint(journal_t *j);
+void       JournalTrackRipped(journal_t *j);
+void       JournalTrackDone(journal_t *j, uint16_t track);
+void       JournalRemove(journal_t *j);
+
+#endif
+
+/* END OF FILE */
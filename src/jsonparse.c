@@ -0,0 +1,709 @@
+/***************************************************************************
+ * jsonparse.c: Minimal non-allocating JSON tokeniser.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jsonparse.h"
+#include "x_mem.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** What may next be found while tokenising. */
+typedef enum
+{
+    EXPECT_VALUE,
+    EXPECT_KEY,
+    EXPECT_COLON,
+    EXPECT_COMMA
+}
+expect_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/** Get the value of a hex digit, or -1 if the character is not one.
+ */
+static int8_t hexValue(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    else if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    else if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+
+/** Read the 4 hex digits of a \\u escape.
+ * \returns The value, or -1 if the digits are not valid.
+ */
+static int32_t hex4(const char *s)
+{
+    int32_t v = 0;
+
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        const int8_t h = hexValue(s[i]);
+
+        if(h < 0)
+        {
+            return -1;
+        }
+
+        v = (v << 4) | h;
+    }
+
+    return v;
+}
+
+
+/** Find the quote closing a string.
+ * \param[in] js   The text.
+ * \param[in] len  Length of \a js.
+ * \param[in] pos  Offset of the first character after the opening quote.
+ * \returns The offset of the closing quote, or a JSON_ERROR_ value.
+ */
+static int64_t scanString(const char *js, uint32_t len, uint32_t pos)
+{
+    for(; pos < len; pos++)
+    {
+        const char c = js[pos];
+
+        if(c == '"')
+        {
+            return pos;
+        }
+        else if((unsigned char)c < 0x20)
+        {
+            return JSON_ERROR_INVAL;
+        }
+        else if(c == '\\')
+        {
+            if(++pos >= len)
+            {
+                return JSON_ERROR_PART;
+            }
+
+            if(js[pos] == 'u')
+            {
+                if(pos + 4 >= len)
+                {
+                    return JSON_ERROR_PART;
+                }
+
+                if(hex4(&js[pos + 1]) < 0)
+                {
+                    return JSON_ERROR_INVAL;
+                }
+
+                pos += 4;
+            }
+            else if(strchr("\"\\/bfnrt", js[pos]) == NULL || js[pos] == '\0')
+            {
+                return JSON_ERROR_INVAL;
+            }
+        }
+    }
+
+    return JSON_ERROR_PART;
+}
+
+
+/** Find the end of a number or literal, and check that it is valid.
+ * \returns The offset of the character after the primitive, or a
+ *           JSON_ERROR_ value.
+ */
+static int64_t scanPrimitive(const char *js, uint32_t len, uint32_t pos)
+{
+    static const char *literal[] = { "true", "false", "null" };
+    const uint32_t     start = pos;
+
+    while(pos < len && strchr(" \t\r\n,]}:", js[pos]) == NULL)
+    {
+        pos++;
+    }
+
+    for(uint8_t l = 0; l < sizeof(literal) / sizeof(literal[0]); l++)
+    {
+        if(pos - start == strlen(literal[l]) && memcmp(&js[start], literal[l], pos - start) == 0)
+        {
+            return pos;
+        }
+    }
+
+    /* Numbers are checked for valid characters only */
+    if(js[start] != '-' && (js[start] < '0' || js[start] > '9'))
+    {
+        return JSON_ERROR_INVAL;
+    }
+
+    for(uint32_t p = start; p < pos; p++)
+    {
+        if(strchr("0123456789+-.eE", js[p]) == NULL || js[p] == '\0')
+        {
+            return JSON_ERROR_INVAL;
+        }
+    }
+
+    return pos;
+}
+
+
+/** Encode a Unicode code point as UTF-8.
+ * \returns The number of bytes written to \a out, which is at most 4.
+ */
+static uint8_t utf8Encode(uint32_t cp, char *out)
+{
+    if(cp < 0x80)
+    {
+        out[0] = cp;
+        return 1;
+    }
+    else if(cp < 0x800)
+    {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    else if(cp < 0x10000)
+    {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    else
+    {
+        out[0] = 0xf0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3f);
+        out[2] = 0x80 | ((cp >> 6) & 0x3f);
+        out[3] = 0x80 | (cp & 0x3f);
+        return 4;
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Tokenise some JSON text.
+ * No memory is allocated; the tokens are written to the passed array, and
+ * reference the text rather than copying it.
+ * \param[in]  js        The text to parse, which need not be nul terminated.
+ * \param[in]  len       Length of \a js.
+ * \param[out] tok       Array to receive the tokens.
+ * \param[in]  tokCount  Number of tokens in \a tok.
+ * \returns The number of tokens parsed, or a negative JSON_ERROR_ value.
+ *           If JSON_ERROR_NOMEM is returned, the text may be parsed again
+ *           with a larger array.
+ */
+int32_t JsonParse(const char *js, size_t len, jsontok_t *tok, uint32_t tokCount)
+{
+    expect_t expect = EXPECT_VALUE;
+    int32_t  super = -1;
+    uint32_t count = 0;
+
+    if(len >= INT32_MAX)
+    {
+        return JSON_ERROR_INVAL;
+    }
+
+    for(uint32_t pos = 0; pos < len; pos++)
+    {
+        const char  c = js[pos];
+        jsontok_t  *t;
+        int64_t     end;
+
+        switch(c)
+        {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                continue;
+
+            case ':':
+                if(expect != EXPECT_COLON)
+                {
+                    return JSON_ERROR_INVAL;
+                }
+
+                expect = EXPECT_VALUE;
+                continue;
+
+            case ',':
+                if(expect != EXPECT_COMMA || super < 0)
+                {
+                    return JSON_ERROR_INVAL;
+                }
+
+                expect = tok[super].type == JSON_OBJECT ? EXPECT_KEY : EXPECT_VALUE;
+                continue;
+
+            case '}':
+            case ']':
+            {
+                const jsontype_t type = c == '}' ? JSON_OBJECT : JSON_ARRAY;
+
+                if(super < 0 || tok[super].type != type)
+                {
+                    return JSON_ERROR_INVAL;
+                }
+
+                /* Must follow a value, or be an empty object or array */
+                if(expect != EXPECT_COMMA &&
+                   !(tok[super].size == 0 && expect == (type == JSON_OBJECT ? EXPECT_KEY : EXPECT_VALUE)))
+                {
+                    return JSON_ERROR_INVAL;
+                }
+
+                tok[super].end = pos + 1;
+                tok[super].next = count;
+                super = tok[super].parent;
+                expect = EXPECT_COMMA;
+                continue;
+            }
+        }
+
+        /* Everything else starts a new token */
+        if(expect != EXPECT_VALUE && !(expect == EXPECT_KEY && c == '"'))
+        {
+            return JSON_ERROR_INVAL;
+        }
+
+        if(count == tokCount)
+        {
+            return JSON_ERROR_NOMEM;
+        }
+
+        t = &tok[count];
+        t->start = pos;
+        t->size = 0;
+        t->parent = super;
+
+        if(super >= 0)
+        {
+            tok[super].size++;
+        }
+
+        if(c == '{' || c == '[')
+        {
+            t->type = c == '{' ? JSON_OBJECT : JSON_ARRAY;
+            super = count++;
+            expect = c == '{' ? EXPECT_KEY : EXPECT_VALUE;
+            continue;
+        }
+        else if(c == '"')
+        {
+            if((end = scanString(js, len, pos + 1)) < 0)
+            {
+                return end;
+            }
+
+            t->type = JSON_STRING;
+            t->start = pos + 1;
+            t->end = end;
+            pos = end;
+            expect = expect == EXPECT_KEY ? EXPECT_COLON : EXPECT_COMMA;
+        }
+        else
+        {
+            if((end = scanPrimitive(js, len, pos)) < 0)
+            {
+                return end;
+            }
+
+            t->type = JSON_PRIMITIVE;
+            t->end = end;
+            pos = end - 1;
+            expect = EXPECT_COMMA;
+        }
+
+        t->next = ++count;
+    }
+
+    /* Check that a single complete value was found */
+    if(super >= 0 || expect != EXPECT_COMMA)
+    {
+        return JSON_ERROR_PART;
+    }
+
+    return count;
+}
+
+
+/** Find the value of some member of an object.
+ * \param[in] js   The parsed text.
+ * \param[in] tok  The tokens from JsonParse().
+ * \param[in] obj  Index of the object token, or -1.
+ * \param[in] key  The key of the member to find.
+ * \returns The index of the value, or -1 if \a obj is not an object or has
+ *           no such member.
+ */
+int32_t JsonObjectGet(const char *js, const jsontok_t *tok, int32_t obj, const char *key)
+{
+    uint32_t t;
+
+    if(obj < 0 || tok[obj].type != JSON_OBJECT)
+    {
+        return -1;
+    }
+
+    t = obj + 1;
+    for(uint32_t m = 0; m < tok[obj].size / 2; m++)
+    {
+        if(JsonStrEq(js, tok, t, key))
+        {
+            return t + 1;
+        }
+
+        t = tok[t + 1].next;
+    }
+
+    return -1;
+}
+
+
+/** Find an element of an array.
+ * \param[in] tok    The tokens from JsonParse().
+ * \param[in] arr    Index of the array token, or -1.
+ * \param[in] index  The element to find, counting from 0.
+ * \returns The index of the element, or -1 if \a arr is not an array or has
+ *           too few elements.
+ */
+int32_t JsonArrayGet(const jsontok_t *tok, int32_t arr, uint32_t index)
+{
+    uint32_t t;
+
+    if(arr < 0 || tok[arr].type != JSON_ARRAY || index >= tok[arr].size)
+    {
+        return -1;
+    }
+
+    t = arr + 1;
+    while(index-- > 0)
+    {
+        t = tok[t].next;
+    }
+
+    return t;
+}
+
+
+/** Get the element following some element of an array.
+ * \param[in] tok  The tokens from JsonParse().
+ * \param[in] t    Index of an element of an array.
+ * \returns The index of the next element, or -1 if \a t is the last.
+ */
+int32_t JsonArrayNext(const jsontok_t *tok, int32_t t)
+{
+    const int32_t p = tok[t].parent;
+
+    if(p < 0 || tok[p].type != JSON_ARRAY || tok[t].next >= tok[p].next)
+    {
+        return -1;
+    }
+
+    return tok[t].next;
+}
+
+
+/** Check if some token is a string equal to the passed string.
+ * Escaped characters are not decoded, and so never compare equal.
+ */
+bool JsonStrEq(const char *js, const jsontok_t *tok, int32_t t, const char *str)
+{
+    const size_t l = strlen(str);
+
+    return t >= 0 && tok[t].type == JSON_STRING &&
+           tok[t].end - tok[t].start == l &&
+           memcmp(&js[tok[t].start], str, l) == 0;
+}
+
+
+/** Check if some token is absent or null.
+ */
+bool JsonIsNull(const char *js, const jsontok_t *tok, int32_t t)
+{
+    return t < 0 || (tok[t].type == JSON_PRIMITIVE && js[tok[t].start] == 'n');
+}
+
+
+/** Get the integer value of a number.
+ * \returns The integer part of the number, or 0 if \a t is not a number.
+ */
+long JsonInt(const char *js, const jsontok_t *tok, int32_t t)
+{
+    bool     neg = false;
+    long     v = 0;
+    uint32_t p;
+
+    if(t < 0 || tok[t].type != JSON_PRIMITIVE)
+    {
+        return 0;
+    }
+
+    p = tok[t].start;
+    if(js[p] == '-')
+    {
+        neg = true;
+        p++;
+    }
+
+    for(; p < tok[t].end && js[p] >= '0' && js[p] <= '9'; p++)
+    {
+        v = (v * 10) + (js[p] - '0');
+    }
+
+    return neg ? -v : v;
+}
+
+
+/** Get a string or number in new memory.
+ * Escapes in strings are decoded, with \\u escapes converted to UTF-8.
+ * \returns The value, which must be free()'d, or NULL if \a t is absent,
+ *           null, an object or an array.
+ */
+char *JsonStrDup(const char *js, const jsontok_t *tok, int32_t t)
+{
+    const char *sIn, *sEnd;
+    char       *r, *sOut;
+
+    if(JsonIsNull(js, tok, t) || tok[t].type == JSON_OBJECT || tok[t].type == JSON_ARRAY)
+    {
+        return NULL;
+    }
+
+    sIn = &js[tok[t].start];
+    sEnd = &js[tok[t].end];
+
+    /* Decoding never lengthens the text, so the copy will always fit */
+    r = sOut = x_malloc(sEnd - sIn + 1);
+
+    if(tok[t].type == JSON_PRIMITIVE)
+    {
+        memcpy(r, sIn, sEnd - sIn);
+        r[sEnd - sIn] = '\0';
+        return r;
+    }
+
+    while(sIn < sEnd)
+    {
+        const char *bs = memchr(sIn, '\\', sEnd - sIn);
+        uint32_t    cp;
+
+        if(bs == NULL)
+        {
+            bs = sEnd;
+        }
+
+        memcpy(sOut, sIn, bs - sIn);
+        sOut += bs - sIn;
+        sIn = bs;
+
+        if(sIn == sEnd)
+        {
+            break;
+        }
+
+        /* The escape was checked when tokenising */
+        sIn++;
+        switch(*sIn)
+        {
+            case 'b': *sOut++ = '\b'; break;
+            case 'f': *sOut++ = '\f'; break;
+            case 'n': *sOut++ = '\n'; break;
+            case 'r': *sOut++ = '\r'; break;
+            case 't': *sOut++ = '\t'; break;
+            case 'u':
+                cp = hex4(sIn + 1);
+                sIn += 4;
+
+                /* Combine surrogate pairs */
+                if(cp >= 0xd800 && cp < 0xdc00 && sEnd - sIn >= 7 &&
+                   sIn[1] == '\\' && sIn[2] == 'u')
+                {
+                    const int32_t lo = hex4(sIn + 3);
+
+                    if(lo >= 0xdc00 && lo < 0xe000)
+                    {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        sIn += 6;
+                    }
+                }
+
+                sOut += utf8Encode(cp, sOut);
+                break;
+            default:
+                *sOut++ = *sIn;
+                break;
+        }
+
+        sIn++;
+    }
+
+    *sOut = '\0';
+
+    return r;
+}
+
+/**************************************************************************
+ * Module Test
+ **************************************************************************/
+
+#ifdef JSONPARSE_MODULE_TEST
+
+/*
+ * gcc -std=gnu99 -DJSONPARSE_MODULE_TEST jsonparse.c x_mem.c log.c -lpthread
+ *
+ * ./a.out
+ *   Check the tokeniser and accessors against some documents, returning
+ *   a failure status if any check fails.
+ */
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(c) \
+    do { if(!(c)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c); failures++; } } while(0)
+
+/** Parse a document, returning the token count or error. */
+static int32_t parse(const char *js, jsontok_t *tok, uint32_t tokCount)
+{
+    return JsonParse(js, strlen(js), tok, tokCount);
+}
+
+int main(void)
+{
+    static const struct
+    {
+        const char *js;
+        int32_t     result;
+    }
+    cases[] =
+    {
+        { "{}",                              1 },
+        { "[]",                              1 },
+        { " { \"a\" : 1 } ",                 3 },
+        { "{\"a\":[1,2,{\"b\":null}],\"c\":\"x\"}", 10 },
+        { "[true,false,null,-1.5e3]",        5 },
+        { "{\"a\":\"\\\"}\"}",               3 },
+        { "{\"a\":1,}",                      JSON_ERROR_INVAL },
+        { "{\"a\" 1}",                       JSON_ERROR_INVAL },
+        { "[1]]",                            JSON_ERROR_INVAL },
+        { "{1:2}",                           JSON_ERROR_INVAL },
+        { "{\"a\":[1,2",                     JSON_ERROR_PART },
+        { "{\"a\":\"x",                      JSON_ERROR_PART },
+        { "",                                JSON_ERROR_PART },
+    };
+    const char *doc = "{\"id\":\"r1\",\"n\":42,\"s\":\"\",\"z\":null,"
+                      "\"t\":\"Caf\\u00e9 \\ud83d\\ude00 \\\"q\\\" \\\\ \\/\","
+                      "\"l\":[\"a\",{\"b\":[]},\"c\"]}";
+    jsontok_t   tok[64];
+    int32_t     t, l;
+    char       *str;
+
+    for(uint32_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const int32_t r = parse(cases[c].js, tok, 64);
+
+        if(r != cases[c].result)
+        {
+            printf("FAIL '%s': got %d, expected %d\n", cases[c].js, r, cases[c].result);
+            failures++;
+        }
+    }
+
+    /* Too few tokens can be retried with more */
+    CHECK(parse("[1,2,3]", tok, 3) == JSON_ERROR_NOMEM);
+    CHECK(parse("[1,2,3]", tok, 4) == 4);
+
+    CHECK(parse(doc, tok, 64) == 18);
+    CHECK(tok[0].type == JSON_OBJECT && tok[0].size == 12 && tok[0].parent == -1);
+
+    CHECK(JsonStrEq(doc, tok, JsonObjectGet(doc, tok, 0, "id"), "r1"));
+    CHECK(!JsonStrEq(doc, tok, JsonObjectGet(doc, tok, 0, "id"), "r"));
+    CHECK(JsonInt(doc, tok, JsonObjectGet(doc, tok, 0, "n")) == 42);
+    CHECK(JsonObjectGet(doc, tok, 0, "missing") == -1);
+    CHECK(JsonIsNull(doc, tok, JsonObjectGet(doc, tok, 0, "z")));
+    CHECK(JsonIsNull(doc, tok, -1));
+    CHECK(!JsonIsNull(doc, tok, JsonObjectGet(doc, tok, 0, "n")));
+
+    str = JsonStrDup(doc, tok, JsonObjectGet(doc, tok, 0, "t"));
+    CHECK(str != NULL && strcmp(str, "Caf\xc3\xa9 \xf0\x9f\x98\x80 \"q\" \\ /") == 0);
+    free(str);
+
+    str = JsonStrDup(doc, tok, JsonObjectGet(doc, tok, 0, "s"));
+    CHECK(str != NULL && str[0] == '\0');
+    free(str);
+
+    CHECK(JsonStrDup(doc, tok, JsonObjectGet(doc, tok, 0, "z")) == NULL);
+    CHECK(JsonStrDup(doc, tok, JsonObjectGet(doc, tok, 0, "l")) == NULL);
+
+    /* Elements are found past nested values */
+    l = JsonObjectGet(doc, tok, 0, "l");
+    CHECK(JsonStrEq(doc, tok, JsonArrayGet(tok, l, 0), "a"));
+    CHECK(JsonStrEq(doc, tok, JsonArrayGet(tok, l, 2), "c"));
+    CHECK(JsonArrayGet(tok, l, 3) == -1);
+    CHECK(JsonArrayGet(tok, JsonObjectGet(doc, tok, 0, "id"), 0) == -1);
+
+    t = JsonArrayGet(tok, l, 0);
+    t = JsonArrayNext(tok, t);
+    CHECK(tok[t].type == JSON_OBJECT && JsonArrayGet(tok, JsonObjectGet(doc, tok, t, "b"), 0) == -1);
+    t = JsonArrayNext(tok, t);
+    CHECK(JsonStrEq(doc, tok, t, "c"));
+    CHECK(JsonArrayNext(tok, t) == -1);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+/* END OF FILE */
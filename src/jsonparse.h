@@ -0,0 +1,94 @@
+/***************************************************************************
+ * jsonparse.h: Interface to the JSON tokeniser.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef JSONPARSE_H
+#define JSONPARSE_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/** Errors returned by JsonParse(). */
+#define JSON_ERROR_NOMEM  -1   /**< Not enough tokens were passed. */
+#define JSON_ERROR_INVAL  -2   /**< The text is not valid JSON. */
+#define JSON_ERROR_PART   -3   /**< The text ends part way through a value. */
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef enum
+{
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_PRIMITIVE  /**< Number, true, false or null. */
+}
+jsontype_t;
+
+/** A token, referencing a value within the parsed text.
+ * The members of an object are given by pairs of tokens following it, the
+ * key then the value, and the elements of an array by the tokens following
+ * it.  Each value is followed by the tokens of its own members.
+ */
+typedef struct
+{
+    jsontype_t type;
+
+    /** Offset of the first character, and of the character after the last.
+     * For strings, the quotes are excluded.
+     */
+    uint32_t   start, end;
+
+    /** Count of direct children, which is twice the members of an object. */
+    uint32_t   size;
+
+    /** Index of the containing object or array, or -1. */
+    int32_t    parent;
+
+    /** Index of the token following this value and all its children. */
+    uint32_t   next;
+}
+jsontok_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+int32_t  JsonParse(const char *js, size_t len, jsontok_t *tok, uint32_t tokCount);
+
+int32_t  JsonObjectGet(const char *js, const jsontok_t *tok, int32_t obj, const char *key);
+int32_t  JsonArrayGet(const jsontok_t *tok, int32_t arr, uint32_t index);
+int32_t  JsonArrayNext(const jsontok_t *tok, int32_t t);
+bool     JsonStrEq(const char *js, const jsontok_t *tok, int32_t t, const char *str);
+bool     JsonIsNull(const char *js, const jsontok_t *tok, int32_t t);
+long     JsonInt(const char *js, const jsontok_t *tok, int32_t t);
+char    *JsonStrDup(const char *js, const jsontok_t *tok, int32_t t);
+
+#endif
+
+/* END OF FILE */
@@ -21,6 +21,7 @@
  * Includes
  **************************************************************************/
 
+#include <pthread.h>
 #include <syslog.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -43,10 +44,29 @@
  * Local Variables
  **************************************************************************/
 
+/** Lock held while logging.
+ * Rip processes are forked while the encoder threads may be logging, so
+ * this is also held over fork() to ensure the child does not inherit the
+ * syslog or stdout locks in a held state.
+ */
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
+static void forkPrepare(void)
+{
+    pthread_mutex_lock(&logLock);
+    fflush(stdout);
+}
+
+
+static void forkRelease(void)
+{
+    pthread_mutex_unlock(&logLock);
+}
+
 /**************************************************************************
  * Global Functions
  **************************************************************************/
@@ -54,6 +74,8 @@
 void LogInit(void)
 {
     openlog("ripright", 0, LOG_DAEMON);
+
+    pthread_atfork(forkPrepare, forkRelease, forkRelease);
 }
 
 
@@ -61,6 +83,8 @@ void LogErr(const char *format, ...)
 {
     va_list ap, aq;
 
+    pthread_mutex_lock(&logLock);
+
     va_start(ap, format);
     va_copy(aq, ap);
 
@@ -69,6 +93,8 @@ void LogErr(const char *format, ...)
 
     vfprintf(stdout, format, aq);
     va_end(aq);
+
+    pthread_mutex_unlock(&logLock);
 }
 
 
@@ -76,6 +102,8 @@ void LogWarn(const char *format, ...)
 {
     va_list ap, aq;
 
+    pthread_mutex_lock(&logLock);
+
     va_start(ap, format);
     va_copy(aq, ap);
 
@@ -84,6 +112,8 @@ void LogWarn(const char *format, ...)
 
     vfprintf(stdout, format, aq);
     va_end(aq);
+
+    pthread_mutex_unlock(&logLock);
 }
 
 
@@ -91,6 +121,8 @@ void LogInf(const char *format, ...)
 {
     va_list ap, aq;
 
+    pthread_mutex_lock(&logLock);
+
     va_start(ap, format);
     va_copy(aq, ap);
 
@@ -99,6 +131,8 @@ void LogInf(const char *format, ...)
 
     vfprintf(stdout, format, aq);
     va_end(aq);
+
+    pthread_mutex_unlock(&logLock);
 }
 
 /* END OF FILE */
@@ -0,0 +1,498 @@
+/***************************************************************************
+ * mbcache.c: On-disk cache of MusicBrainz responses.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "mbcache.h"
+#include "x_mem.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Suffixes of cached responses.
+ * Responses are saved as <dir>/<kind>-<id>.<fmt>, where kind is the
+ * MusicBrainz resource, e.g. discid or release, and fmt is the format of
+ * the response, either xml or json.
+ */
+static const char *const cacheSuffix[] = { ".xml", ".json" };
+
+/** Length of the suffix given to a temporary file by mkstemp(). */
+#define CACHE_TMP_SUFFIX_LEN 7
+
+/** Seconds after which a temporary file is left from a crashed writer. */
+#define CACHE_TMP_SECS       3600
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** A response being written to the cache. */
+struct mbcachewriter
+{
+    FILE  *f;
+    char  *path, *tmpPath;
+    size_t size;
+    bool   failed;
+};
+
+/** A cached response, when trimming the cache to size. */
+typedef struct
+{
+    char    *name;
+    time_t   mtime;
+    off_t    size;
+}
+centry_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Directory holding the cache, or NULL if caching is disabled. */
+static char           *cacheDir = NULL;
+
+/** Seconds for which a response is used, and the most bytes kept. */
+static uint32_t        cacheTtl;
+static uint64_t        cacheMax;
+
+/** Bytes of responses in the cache, as of the last trim plus those saved
+ * since.  Replaced responses are counted twice, so this may overestimate.
+ */
+static uint64_t        cacheBytes;
+
+static uint32_t        cacheHits, cacheMisses;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/** Get the path of the cached response for some resource.
+ * \retval false  If the ID cannot be used as a filename.
+ */
+static bool cachePath(const char *kind, const char *id, const char *fmt, char *buf, size_t bufLen)
+{
+    if(strchr(id, '/') != NULL || id[0] == '.')
+    {
+        return false;
+    }
+
+    return snprintf(buf, bufLen, "%s/%s-%s.%s", cacheDir, kind, id, fmt) < (int)bufLen;
+}
+
+
+static int compareAge(const void *a, const void *b)
+{
+    const centry_t *ca = a, *cb = b;
+
+    return ca->mtime < cb->mtime ? -1 : ca->mtime > cb->mtime ? 1 : 0;
+}
+
+
+/** Check if a file name ends with a cache suffix.
+ * \param[in] tmp  If set, check for a temporary file of a response.
+ */
+static bool isCached(const char *name, bool tmp)
+{
+    size_t l = strlen(name);
+
+    if(tmp)
+    {
+        if(l <= CACHE_TMP_SUFFIX_LEN || name[l - CACHE_TMP_SUFFIX_LEN] != '.')
+        {
+            return false;
+        }
+
+        l -= CACHE_TMP_SUFFIX_LEN;
+    }
+
+    for(uint8_t s = 0; s < sizeof(cacheSuffix) / sizeof(cacheSuffix[0]); s++)
+    {
+        const size_t sl = strlen(cacheSuffix[s]);
+
+        if(l > sl && strncmp(&name[l - sl], cacheSuffix[s], sl) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/** Remove expired responses, then the oldest until the cache fits its cap.
+ * Temporary files left by writers which crashed are also removed.  This
+ * reads the whole directory, so is only done when the cache is enabled
+ * and when the responses saved since take it over its cap.
+ * Must be called with the lock held.
+ */
+static void trim(void)
+{
+    const time_t   now = time(NULL);
+    DIR           *dir = opendir(cacheDir);
+    struct dirent *de;
+    centry_t      *entry = NULL;
+    uint32_t       count = 0;
+    uint64_t       total = 0;
+
+    if(dir == NULL)
+    {
+        return;
+    }
+
+    while((de = readdir(dir)) != NULL)
+    {
+        char        path[strlen(cacheDir) + strlen(de->d_name) + 2];
+        struct stat sb;
+        bool        tmp = false;
+
+        if(!isCached(de->d_name, false) && !(tmp = isCached(de->d_name, true)))
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, de->d_name);
+
+        if(stat(path, &sb) != 0)
+        {
+            continue;
+        }
+
+        if(tmp)
+        {
+            if(now - sb.st_mtime > CACHE_TMP_SECS)
+            {
+                unlink(path);
+            }
+        }
+        else if(now - sb.st_mtime > (time_t)cacheTtl)
+        {
+            unlink(path);
+        }
+        else
+        {
+            entry = x_realloc(entry, sizeof(centry_t) * (count + 1));
+            entry[count].name = x_strdup(path);
+            entry[count].mtime = sb.st_mtime;
+            entry[count].size = sb.st_size;
+            total += sb.st_size;
+            count++;
+        }
+    }
+
+    closedir(dir);
+
+    qsort(entry, count, sizeof(centry_t), compareAge);
+
+    for(uint32_t e = 0; e < count; e++)
+    {
+        if(total > cacheMax)
+        {
+            unlink(entry[e].name);
+            total -= entry[e].size;
+        }
+
+        free(entry[e].name);
+    }
+
+    free(entry);
+
+    cacheBytes = total;
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Enable the cache of MusicBrainz responses.
+ * \param[in] dir       The directory in which to save responses.
+ * \param[in] ttlSecs   Seconds for which a response is used, or 0 to
+ *                       disable the cache.
+ * \param[in] maxBytes  The most bytes of responses to keep.
+ * The cache is trimmed to fit, and then only when it grows past the cap.
+ */
+void MbCacheInit(const char *dir, uint32_t ttlSecs, uint64_t maxBytes)
+{
+    pthread_mutex_lock(&cacheLock);
+
+    free(cacheDir);
+    cacheDir = NULL;
+
+    if(ttlSecs > 0)
+    {
+        if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+        {
+            LogWarn("Warning: Failed to create MusicBrainz cache %s: %m\n", dir);
+        }
+        else
+        {
+            cacheDir = x_strdup(dir);
+            cacheTtl = ttlSecs;
+            cacheMax = maxBytes;
+            trim();
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+
+/** Get a cached response, if one has not expired.
+ * \param[in]  kind  The kind of resource, e.g. "release".
+ * \param[in]  id    The MusicBrainz ID of the resource.
+ * \param[in]  fmt   The format of the response, "xml" or "json".
+ * \param[out] size  Pointer to fill with the length of the data, or NULL.
+ * \returns The response, nul terminated, which the caller must free, or
+ *           NULL if it is not cached.
+ */
+void *MbCacheGet(const char *kind, const char *id, const char *fmt, size_t *size)
+{
+    char        path[1024];
+    char       *data = NULL;
+    struct stat sb;
+    FILE       *f;
+
+    pthread_mutex_lock(&cacheLock);
+
+    if(cacheDir == NULL)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return NULL;
+    }
+
+    if(cachePath(kind, id, fmt, path, sizeof(path)) &&
+       (f = fopen(path, "rb")) != NULL)
+    {
+        if(fstat(fileno(f), &sb) == 0 && time(NULL) - sb.st_mtime <= (time_t)cacheTtl)
+        {
+            data = x_malloc(sb.st_size + 1);
+
+            if(fread(data, 1, sb.st_size, f) == (size_t)sb.st_size)
+            {
+                data[sb.st_size] = '\0';
+                if(size != NULL)
+                {
+                    *size = sb.st_size;
+                }
+            }
+            else
+            {
+                free(data);
+                data = NULL;
+            }
+        }
+
+        fclose(f);
+    }
+
+    if(data)
+    {
+        cacheHits++;
+    }
+    else
+    {
+        cacheMisses++;
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+
+    return data;
+}
+
+
+/** Start saving a response to the cache.
+ * The response is written under a unique temporary name then renamed by
+ * MbCacheWriteEnd(), so that a partial response is never read, even if
+ * the same resource is being saved by another rip at the same time.
+ * \param[in] kind  The kind of resource, e.g. "release".
+ * \param[in] id    The MusicBrainz ID of the resource.
+ * \param[in] fmt   The format of the response, "xml" or "json".
+ * \returns A handle for writing the response, or NULL if it cannot be cached.
+ */
+mbcachewriter_t *MbCacheWriteStart(const char *kind, const char *id, const char *fmt)
+{
+    mbcachewriter_t *w;
+    char             path[1024];
+    int              fd;
+
+    pthread_mutex_lock(&cacheLock);
+
+    if(cacheDir == NULL || !cachePath(kind, id, fmt, path, sizeof(path)))
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+
+    w = x_zalloc(sizeof(mbcachewriter_t));
+    w->path = x_strdup(path);
+    w->tmpPath = x_malloc(strlen(path) + 8);
+    sprintf(w->tmpPath, "%s.XXXXXX", path);
+
+    fd = mkstemp(w->tmpPath);
+    if(fd != -1 && (fchmod(fd, 0644) != 0 || (w->f = fdopen(fd, "wb")) == NULL))
+    {
+        close(fd);
+        unlink(w->tmpPath);
+    }
+
+    if(w->f == NULL)
+    {
+        LogWarn("Warning: Failed to write MusicBrainz cache %s: %m\n", w->tmpPath);
+        free(w->tmpPath);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+
+/** Write part of a response to the cache.
+ * \param[in] w     The handle from MbCacheWriteStart(), or NULL.
+ */
+void MbCacheWrite(mbcachewriter_t *w, const void *data, size_t size)
+{
+    if(w != NULL && !w->failed)
+    {
+        if(fwrite(data, 1, size, w->f) != size)
+        {
+            w->failed = true;
+        }
+
+        w->size += size;
+    }
+}
+
+
+/** Finish saving a response to the cache.
+ * \param[in] w       The handle from MbCacheWriteStart(), or NULL.
+ * \param[in] commit  If true, the response is complete and should be saved,
+ *                     otherwise it is discarded.
+ */
+void MbCacheWriteEnd(mbcachewriter_t *w, bool commit)
+{
+    if(w == NULL)
+    {
+        return;
+    }
+
+    if(fclose(w->f) != 0)
+    {
+        w->failed = true;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+
+    if(!commit)
+    {
+        unlink(w->tmpPath);
+    }
+    else if(w->failed || rename(w->tmpPath, w->path) != 0)
+    {
+        LogWarn("Warning: Failed to write MusicBrainz cache %s: %m\n", w->path);
+        unlink(w->tmpPath);
+    }
+    else if(cacheDir != NULL)
+    {
+        cacheBytes += w->size;
+        if(cacheBytes > cacheMax)
+        {
+            trim();
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+
+    free(w->tmpPath);
+    free(w->path);
+    free(w);
+}
+
+
+/** Remove a cached response, such as one which cannot be parsed.
+ * \param[in] kind  The kind of resource, e.g. "release".
+ * \param[in] id    The MusicBrainz ID of the resource.
+ * \param[in] fmt   The format of the response, "xml" or "json".
+ */
+void MbCacheRemove(const char *kind, const char *id, const char *fmt)
+{
+    char path[1024];
+
+    pthread_mutex_lock(&cacheLock);
+
+    if(cacheDir != NULL && cachePath(kind, id, fmt, path, sizeof(path)))
+    {
+        unlink(path);
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+
+/** Save a response to the cache.
+ */
+void MbCachePut(const char *kind, const char *id, const char *fmt, const void *data, size_t size)
+{
+    mbcachewriter_t *w = MbCacheWriteStart(kind, id, fmt);
+
+    MbCacheWrite(w, data, size);
+    MbCacheWriteEnd(w, true);
+}
+
+
+/** Log the count of responses found in the cache and fetched.
+ */
+void MbCacheLogStats(void)
+{
+    pthread_mutex_lock(&cacheLock);
+
+    if(cacheDir != NULL)
+    {
+        LogInf("MusicBrainz cache: %" PRIu32 " hits, %" PRIu32 " misses\n", cacheHits, cacheMisses);
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* END OF FILE */
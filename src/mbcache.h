@@ -0,0 +1,58 @@
+/***************************************************************************
+ * mbcache.h: Interface to the on-disk cache of MusicBrainz responses.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+
+#ifndef MBCACHE_H
+#define MBCACHE_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef struct mbcachewriter mbcachewriter_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+void  MbCacheInit(const char *dir, uint32_t ttlSecs, uint64_t maxBytes);
+void *MbCacheGet(const char *kind, const char *id, const char *fmt, size_t *size);
+void  MbCachePut(const char *kind, const char *id, const char *fmt, const void *data, size_t size);
+void  MbCacheRemove(const char *kind, const char *id, const char *fmt);
+void  MbCacheLogStats(void);
+
+mbcachewriter_t *MbCacheWriteStart(const char *kind, const char *id, const char *fmt);
+void             MbCacheWrite(mbcachewriter_t *w, const void *data, size_t size);
+void             MbCacheWriteEnd(mbcachewriter_t *w, bool commit);
+
+#endif
+
+/* END OF FILE */
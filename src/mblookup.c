@@ -24,6 +24,7 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -32,13 +33,43 @@
 #include <assert.h>
 #include "curlfetch.h"
 #include "xmlparse.h"
+#include "jsonparse.h"
 #include "mblookup.h"
+#include "mbcache.h"
 #include "x_mem.h"
+#include "log.h"
 
 /**************************************************************************
  * Manifest Constants
  **************************************************************************/
 
+/** Most releases fetched at the same time. */
+#define MB_FETCH_THREADS 4
+
+/** Host of the MusicBrainz web service. */
+#define MB_HOST "musicbrainz.org"
+
+/** Least milliseconds between the start of requests to MusicBrainz.
+ * MusicBrainz asks that clients make no more than one request per second.
+ */
+#define MB_REQUEST_INTERVAL_MS 1000
+
+/** Query for the details of a release needed to tag its tracks. */
+#define MB_RELEASE_INC "?inc=recordings+artists+release-groups+discids+artist-credits"
+
+/** Query for a disc giving the same details for all of its releases.
+ * The response to this is cached under the same name as the response to a
+ * plain discid query.  Either can be used in place of the other, as a plain
+ * response still lists the releases, which are then fetched individually.
+ */
+#define MB_DISCID_INC "?inc=recordings+release-groups+discids+artist-credits"
+
+/** Tokens first allocated for a JSON response, per byte of the response. */
+#define MB_JSON_TOKENS_PER_BYTE 16
+
+/** Largest response accepted, beyond which a response is assumed to be bogus. */
+#define MB_RESPONSE_MAX_BYTES (32 * 1024 * 1024)
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -49,10 +80,75 @@
  * Types
  **************************************************************************/
 
+/** Releases of a disc being fetched by a pool of threads.
+ * Releases are added as they are found, with threads started as needed.
+ * Each release is parsed into its own result, so the results can be merged
+ * in the order of the release list whatever order the fetches complete in.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    const char     *discId;
+
+    /** The releases, the next to be fetched, and the result of each.
+     * Releases already parsed from the discid response have a NULL ID, and
+     * are not fetched again.
+     */
+    uint16_t        count, next;
+    char          **releaseId;
+    mbresult_t     *result;
+
+    /** Set once no more releases will be added. */
+    bool            closed;
+
+    pthread_t       tid[MB_FETCH_THREADS];
+    uint16_t        threads;
+}
+fetchpool_t;
+
+/** State while streaming the response to a discid lookup.
+ * Releases are passed to the pool as soon as they are parsed.
+ */
+typedef struct
+{
+    fetchpool_t  pool;
+    xmlsax_t    *sax;
+
+    /** Set when within &lt;metadata&gt;, &lt;disc&gt; and &lt;release-list&gt;. */
+    bool         inMetadata, inDisc, inReleaseList;
+}
+discscan_t;
+
+/** Destination of a streamed response, and the cache to which it is saved. */
+typedef struct
+{
+    curlsink_t       sink;
+    void            *param;
+    mbcachewriter_t *cache;
+}
+mbstream_t;
+
 /**************************************************************************
  * Local Variables
  **************************************************************************/
 
+/** Format of the responses requested from MusicBrainz. */
+static mbformat_t      mbFormat = MB_FORMAT_XML;
+
+/** If set, request the details of all releases in the discid query. */
+static bool            mbCombined = true;
+
+/** Name of each format, as used by the web service and cache. */
+static const char     *const formatName[] = { "xml", "json" };
+
+/** Secondary types of a release group which are given as its type.
+ * The type attribute of an XML release group is the legacy single type,
+ * being any of these secondary types, otherwise the primary type.
+ */
+static const char     *const legacyTypes[] = { "Compilation", "Soundtrack", "Spokenword", "Interview",
+                                               "Audiobook", "Live", "Remix" };
+
 /**************************************************************************
  * Local Functions
  **************************************************************************/
@@ -103,6 +199,7 @@ static void freeMedium(mbmedium_t *md)
     {
         mbtrack_t *td = &md->track[t];
 
+        free(td->trackId);
         free(td->trackName);
         freeArtist(&td->trackArtist);
 
@@ -229,58 +326,220 @@ static void dedupeReleases(mbresult_t *mr)
 }
 
 
-/** Process an %lt;artist-credit&gt; node.
+/** Fetch some MusicBrainz resource, using the cache if possible.
+ * \param[in]  kind  The kind of resource, e.g. "release".
+ * \param[in]  id    The MusicBrainz ID of the resource.
+ * \param[in]  inc   Any query string to add to the URL.
+ * \param[out] size  Pointer to fill with the length of the response.
+ * \returns The response in the current format, which the caller must free,
+ *           or NULL on error.
  */
-static void processArtistCredit(struct xmlnode *artistCreditNode, mbartistcredit_t *cd)
+static char *mbFetchBuf(const char *kind, const char *id, const char *inc, size_t *size)
 {
+    const char *fmt = formatName[mbFormat];
+    char       *buf;
 
-    const char     *s = XmlGetContent(artistCreditNode);
-    struct xmlnode *n = NULL;
+    buf = MbCacheGet(kind, id, fmt, size);
+    if(buf == NULL)
+    {
+        const char *fmtQuery = "";
+        curlbuf_t   b;
 
-    assert(strcmp(XmlGetTag(artistCreditNode), "artist-credit") == 0);
+        if(mbFormat == MB_FORMAT_JSON)
+        {
+            fmtQuery = inc[0] == '\0' ? "?fmt=json" : "&fmt=json";
+        }
 
-    /* Artist credit can have multiple entries... */
-    while((s = XmlParseStr(&n, s)) != NULL)
-    {
-        /* Process name-credits only at present */
-        if(XmlTagStrcmp(n, "name-credit") == 0)
+        memset(&b, 0, sizeof(b));
+        b.limit = MB_RESPONSE_MAX_BYTES;
+
+        if(CurlFetchStream(CURL_CLASS_MB, CurlSinkBuf, &b, "https://" MB_HOST "/ws/2/%s/%s%s%s",
+                           kind, id, inc, fmtQuery) && b.size > 0)
+        {
+            MbCachePut(kind, id, fmt, b.data, b.size);
+            buf = b.data;
+            *size = b.size;
+        }
+        else
         {
-            struct xmlnode *o, *artistNode = XmlFindSubNode(n, "artist");
+            free(b.data);
+            *size = 0;
+        }
+    }
 
-            cd->artistIdCount++;
-            cd->artistId = x_realloc(cd->artistId, sizeof(char *) * cd->artistIdCount);
+    return buf;
+}
 
-            cd->artistId[cd->artistIdCount - 1] = XmlGetAttributeDup(artistNode, "id");
 
-            o = XmlFindSubNode(artistNode, "name");
-            if(o)
-            {
-                const char *aa = XmlGetContent(o);
+/** Fetch and parse some MusicBrainz resource as XML.
+ * A response which cannot be parsed is removed from the cache, so that it
+ * is fetched again next time.
+ * \returns The parsed response, which the caller must destroy, or NULL on error.
+ * \see mbFetchBuf()
+ */
+static xmldoc_t *mbFetch(const char *kind, const char *id, const char *inc)
+{
+    xmldoc_t *doc;
+    size_t    size;
+    char     *buf;
 
-                if(cd->artistName == NULL)
-                {
-                    cd->artistName = x_strdup(aa);
-                }
-                else
-                {
-                    /* Concatenate multiple artists if needed */
-                    cd->artistName = x_realloc(cd->artistName, strlen(aa) + strlen(cd->artistName) + 3);
+    buf = mbFetchBuf(kind, id, inc, &size);
+    if(buf == NULL)
+    {
+        return NULL;
+    }
 
-                    strcat(cd->artistName, ", ");
-                    strcat(cd->artistName, aa);
-                }
+    doc = XmlParseBuf(buf, size);
+    if(doc == NULL)
+    {
+        LogWarn("Warning: Failed to parse MusicBrainz %s %s\n", kind, id);
+        MbCacheRemove(kind, id, formatName[mbFormat]);
+    }
 
-                XmlDestroy(&o);
-            }
+    return doc;
+}
+
+
+/** Fetch some MusicBrainz resource as JSON and tokenise it.
+ * A response which cannot be parsed is removed from the cache.
+ * \param[out] js    Pointer to fill with the response, which must be freed.
+ * \param[out] size  Pointer to fill with the length of the response.
+ * \returns The tokens, which must be freed, or NULL on error.
+ * \see mbFetchBuf()
+ */
+static jsontok_t *mbFetchJson(const char *kind, const char *id, const char *inc, char **js, size_t *size)
+{
+    jsontok_t *tok = NULL;
+    uint32_t   tokCount;
+    int32_t    r;
+
+    *js = mbFetchBuf(kind, id, inc, size);
+    if(*js == NULL)
+    {
+        return NULL;
+    }
+
+    /* Guess the token count, growing the array if it is too small */
+    tokCount = *size / MB_JSON_TOKENS_PER_BYTE + 64;
+
+    do
+    {
+        tokCount *= 2;
+        tok = x_realloc(tok, sizeof(jsontok_t) * tokCount);
+    }
+    while((r = JsonParse(*js, *size, tok, tokCount)) == JSON_ERROR_NOMEM);
 
-            o = XmlFindSubNode(artistNode, "sort-name");
-            if(o)
+    if(r <= 0 || tok[0].type != JSON_OBJECT)
+    {
+        LogWarn("Warning: Failed to parse MusicBrainz %s %s\n", kind, id);
+        MbCacheRemove(kind, id, formatName[mbFormat]);
+        free(tok);
+        free(*js);
+        *js = NULL;
+        return NULL;
+    }
+
+    return tok;
+}
+
+
+/** Pass some streamed data to its sink, and save it to the cache.
+ */
+static bool streamSink(const void *data, size_t len, void *param)
+{
+    mbstream_t *ms = param;
+
+    MbCacheWrite(ms->cache, data, len);
+
+    return ms->sink(data, len, ms->param);
+}
+
+
+/** Stream some MusicBrainz resource, using the cache if possible.
+ * The response is passed to \a sink as it is received, rather than being
+ * held in memory, and saved to the cache if it is completely received.
+ * \param[in] kind   The kind of resource, e.g. "discid".
+ * \param[in] id     The MusicBrainz ID of the resource.
+ * \param[in] inc    Any query string to add to the URL.
+ * \param[in] sink   Function to receive the response.
+ * \param[in] param  Parameter to pass to \a sink.
+ * \retval true   If the whole response was received by the sink.
+ * \retval false  If the fetch failed, or the sink rejected the response.
+ */
+static bool mbStream(const char *kind, const char *id, const char *inc, curlsink_t sink, void *param)
+{
+    mbstream_t ms;
+    size_t     size;
+    void      *buf;
+    bool       r;
+
+    buf = MbCacheGet(kind, id, "xml", &size);
+    if(buf != NULL)
+    {
+        r = sink(buf, size, param);
+        free(buf);
+        return r;
+    }
+
+    ms.sink = sink;
+    ms.param = param;
+    ms.cache = MbCacheWriteStart(kind, id, "xml");
+
+    r = CurlFetchStream(CURL_CLASS_MB, streamSink, &ms, "https://" MB_HOST "/ws/2/%s/%s%s", kind, id, inc);
+
+    MbCacheWriteEnd(ms.cache, r);
+
+    return r;
+}
+
+
+/** Process an %lt;artist-credit&gt; node.
+ */
+static void processArtistCredit(xmldoc_t *doc, const xmlnode_t *artistCreditNode, mbartistcredit_t *cd)
+{
+    const xmlnode_t *n;
+
+    assert(XmlTagStrcmp(doc, artistCreditNode, "artist-credit") == 0);
+
+    /* Artist credit can have multiple entries, process name-credits only at present */
+    for(n = XmlFindSubNode(doc, artistCreditNode, "name-credit"); n; n = XmlFindNextNode(doc, n, "name-credit"))
+    {
+        const xmlnode_t *o, *artistNode = XmlFindSubNode(doc, n, "artist");
+
+        if(artistNode == NULL)
+        {
+            continue;
+        }
+
+        cd->artistIdCount++;
+        cd->artistId = x_realloc(cd->artistId, sizeof(char *) * cd->artistIdCount);
+
+        cd->artistId[cd->artistIdCount - 1] = XmlGetAttributeDup(doc, artistNode, "id");
+
+        o = XmlFindSubNode(doc, artistNode, "name");
+        if(o)
+        {
+            const char *aa = XmlGetContent(doc, o);
+
+            if(cd->artistName == NULL)
+            {
+                cd->artistName = x_strdup(aa);
+            }
+            else
             {
-                cd->artistNameSort = x_strdup(XmlGetContent(o));
-                XmlDestroy(&o);
+                /* Concatenate multiple artists if needed */
+                cd->artistName = x_realloc(cd->artistName, strlen(aa) + strlen(cd->artistName) + 3);
+
+                strcat(cd->artistName, ", ");
+                strcat(cd->artistName, aa);
             }
+        }
 
-            XmlDestroy(&artistNode);
+        o = XmlFindSubNode(doc, artistNode, "sort-name");
+        if(o)
+        {
+            free(cd->artistNameSort);
+            cd->artistNameSort = XmlGetContentDup(doc, o);
         }
     }
 }
@@ -288,135 +547,108 @@ static void processArtistCredit(struct xmlnode *artistCreditNode, mbartistcredit
 
 /** Process a &lt;track&gt; track node.
  */
-static void processTrackNode(struct xmlnode *trackNode, mbmedium_t *md)
+static void processTrackNode(xmldoc_t *doc, const xmlnode_t *trackNode, mbmedium_t *md)
 {
-    struct xmlnode *n = NULL;
+    const xmlnode_t *n;
 
-    assert(strcmp(XmlGetTag(trackNode), "track") == 0);
+    assert(XmlTagStrcmp(doc, trackNode, "track") == 0);
 
-    n = XmlFindSubNode(trackNode, "position");
+    n = XmlFindSubNode(doc, trackNode, "position");
     if(n)
     {
-        uint16_t position = atoi(XmlGetContent(n));
+        uint16_t position = atoi(XmlGetContent(doc, n));
 
         if(position >= 1 && position <= md->trackCount)
         {
-            struct xmlnode *recording;
-            mbtrack_t      *td = &md->track[position - 1];
+            const xmlnode_t *recording;
+            mbtrack_t       *td = &md->track[position - 1];
 
-            recording = XmlFindSubNode(trackNode, "recording");
+            recording = XmlFindSubNode(doc, trackNode, "recording");
             if(recording)
             {
-                struct xmlnode *m = NULL;
+                const xmlnode_t *m;
 
-                td->trackId = XmlGetAttributeDup(recording, "id");
+                td->trackId = XmlGetAttributeDup(doc, recording, "id");
 
-                m = XmlFindSubNode(recording, "title");
+                m = XmlFindSubNode(doc, recording, "title");
                 if(m)
                 {
-                    td->trackName = x_strdup(XmlGetContent(m));
-                    XmlDestroy(&m);
+                    td->trackName = XmlGetContentDup(doc, m);
                 }
 
-                m = XmlFindSubNode(recording, "artist-credit");
+                m = XmlFindSubNode(doc, recording, "artist-credit");
                 if(m)
                 {
-                    processArtistCredit(m, &td->trackArtist);
-                    XmlDestroy(&m);
+                    processArtistCredit(doc, m, &td->trackArtist);
                 }
-
-                XmlDestroy(&recording);
             }
         }
-
-        XmlDestroy(&n);
     }
 }
 
 
 /** Process a &lt;medium&gt; node.
  */
-static bool processMediumNode(struct xmlnode *mediumNode, const char *discId, mbmedium_t *md)
+static bool processMediumNode(xmldoc_t *doc, const xmlnode_t *mediumNode, const char *discId, mbmedium_t *md)
 {
-    bool            mediumValid = false;
-    struct xmlnode *n = NULL;
+    bool             mediumValid = false;
+    const xmlnode_t *n;
 
-    assert(strcmp(XmlGetTag(mediumNode), "medium") == 0);
+    assert(XmlTagStrcmp(doc, mediumNode, "medium") == 0);
 
     memset(md, 0, sizeof(mbmedium_t));
 
     /* First find the disc-list to check if the discId is present */
-    n = XmlFindSubNode(mediumNode, "disc-list");
+    n = XmlFindSubNode(doc, mediumNode, "disc-list");
     if(n)
     {
-        struct xmlnode *disc = NULL;
-        const char     *s;
+        const xmlnode_t *disc;
 
-        s = XmlGetContent(n);
-        while((s = XmlParseStr(&disc, s)) != NULL)
+        for(disc = XmlFindSubNode(doc, n, "disc"); disc && !mediumValid; disc = XmlFindNextNode(doc, disc, "disc"))
         {
-            if(XmlTagStrcmp(disc, "disc") == 0)
-            {
-                const char *id = XmlGetAttribute(disc, "id");
+            const char *id = XmlGetAttribute(doc, disc, "id");
 
-                if(id && strcmp(id, discId) == 0)
-                {
-                    mediumValid = true;
-                }
+            if(id && strcmp(id, discId) == 0)
+            {
+                mediumValid = true;
             }
         }
-
-        XmlDestroy(&disc);
-        XmlDestroy(&n);
     }
 
     /* Check if the medium should be processed */
     if(mediumValid)
     {
-        memset(md, 0, sizeof(mbmedium_t));
-
-        n = XmlFindSubNode(mediumNode, "position");
+        n = XmlFindSubNode(doc, mediumNode, "position");
         if(n)
         {
-            md->discNum = atoi(XmlGetContent(n));
-            XmlDestroy(&n);
+            md->discNum = atoi(XmlGetContent(doc, n));
         }
 
-        n = XmlFindSubNode(mediumNode, "title");
+        n = XmlFindSubNode(doc, mediumNode, "title");
         if(n)
         {
-            md->title = x_strdup(XmlGetContent(n));
-            XmlDestroy(&n);
+            md->title = XmlGetContentDup(doc, n);
         }
 
-        n = XmlFindSubNode(mediumNode, "track-list");
+        n = XmlFindSubNode(doc, mediumNode, "track-list");
         if(n)
         {
-            const char *count = XmlGetAttribute(n, "count");
+            const char *count = XmlGetAttribute(doc, n, "count");
 
             if(count)
             {
-                struct xmlnode *track = NULL;
-                const char     *s;
+                const xmlnode_t *track;
 
                 md->trackCount = atoi(count);
                 md->track = x_calloc(sizeof(mbtrack_t), md->trackCount);
 
-                s = XmlGetContent(n);
-                while((s = XmlParseStr(&track, s)) != NULL)
+                for(track = XmlFindSubNode(doc, n, "track"); track; track = XmlFindNextNode(doc, track, "track"))
                 {
-                    if(XmlTagStrcmp(track, "track") == 0)
-                    {
-                        processTrackNode(track, md);
-                    }
+                    processTrackNode(doc, track, md);
                 }
 
                 mediumValid = true;
-
-                XmlDestroy(&track);
             }
-
-            XmlDestroy(&n);
         }
     }
 
@@ -424,75 +656,63 @@ static bool processMediumNode(struct xmlnode *mediumNode, const char *discId, mb
 }
 
 
-static uint16_t processReleaseNode(struct xmlnode *releaseNode, const char *discId, mbrelease_t *cd, mbmedium_t **md)
+static uint16_t processReleaseNode(xmldoc_t *doc, const xmlnode_t *releaseNode, const char *discId, mbrelease_t *cd, mbmedium_t **md)
 {
-    struct xmlnode *n;
+    const xmlnode_t *n;
 
-    assert(strcmp(XmlGetTag(releaseNode), "release") == 0);
+    assert(XmlTagStrcmp(doc, releaseNode, "release") == 0);
 
     memset(cd, 0, sizeof(mbrelease_t));
 
-    cd->releaseId = XmlGetAttributeDup(releaseNode, "id");
+    cd->releaseId = XmlGetAttributeDup(doc, releaseNode, "id");
 
-    n = XmlFindSubNode(releaseNode, "asin");
+    n = XmlFindSubNode(doc, releaseNode, "asin");
     if(n)
     {
-        cd->asin = x_strdup(XmlGetContent(n));
-        XmlDestroy(&n);
+        cd->asin = XmlGetContentDup(doc, n);
     }
 
-    n = XmlFindSubNode(releaseNode, "title");
+    n = XmlFindSubNode(doc, releaseNode, "title");
     if(n)
     {
-        cd->albumTitle = x_strdup(XmlGetContent(n));
-        XmlDestroy(&n);
+        cd->albumTitle = XmlGetContentDup(doc, n);
     }
 
-    n = XmlFindSubNode(releaseNode, "release-group");
+    n = XmlFindSubNode(doc, releaseNode, "release-group");
     if(n)
     {
-        cd->releaseType = XmlGetAttributeDup(n, "type");
-        cd->releaseGroupId = XmlGetAttributeDup(n, "id");
-        XmlDestroy(&n);
+        cd->releaseType = XmlGetAttributeDup(doc, n, "type");
+        cd->releaseGroupId = XmlGetAttributeDup(doc, n, "id");
     }
 
-    n = XmlFindSubNode(releaseNode, "artist-credit");
+    n = XmlFindSubNode(doc, releaseNode, "artist-credit");
     if(n)
     {
-        processArtistCredit(n, &cd->albumArtist);
-        XmlDestroy(&n);
+        processArtistCredit(doc, n, &cd->albumArtist);
     }
 
-    n = XmlFindSubNode(releaseNode, "medium-list");
+    n = XmlFindSubNode(doc, releaseNode, "medium-list");
     if(n)
     {
-        const char     *s, *count = XmlGetAttribute(n, "count");
-        struct xmlnode *m = NULL;
-        mbmedium_t     *mediums = NULL;
-        uint16_t        mediumCount = 0;
+        const char      *count = XmlGetAttribute(doc, n, "count");
+        const xmlnode_t *m;
+        mbmedium_t      *mediums = NULL;
+        uint16_t         mediumCount = 0;
 
         if(count)
         {
             cd->discTotal = atoi(count);
         }
 
-        s = XmlGetContent(n);
-
-        while((s = XmlParseStr(&m, s)) != NULL)
+        for(m = XmlFindSubNode(doc, n, "medium"); m; m = XmlFindNextNode(doc, m, "medium"))
         {
-            if(XmlTagStrcmp(m, "medium") == 0)
+            mediums = x_realloc(mediums, sizeof(mbmedium_t) * (mediumCount + 1));
+            if(processMediumNode(doc, m, discId, &mediums[mediumCount]))
             {
-                mediums = x_realloc(mediums, sizeof(mbmedium_t) * (mediumCount + 1));
-                if(processMediumNode(m, discId, &mediums[mediumCount]))
-                {
-                    mediumCount++;
-                }
+                mediumCount++;
             }
         }
 
-        XmlDestroy(&n);
-        XmlDestroy(&m);
-
         mediumCount = dedupeMediums(mediumCount, mediums);
 
         *md = mediums;
@@ -506,205 +726,930 @@ static uint16_t processReleaseNode(struct xmlnode *releaseNode, const char *disc
 }
 
 
-/** Process a release.
+/** Get a string member of a JSON object, treating an empty string as absent.
+ * \returns The string, which must be free()'d, or NULL.
  */
-static bool processRelease(const char *releaseId, const char *discId, mbresult_t *res)
+static char *jsonStrDup(const char *js, const jsontok_t *tok, int32_t obj, const char *key)
 {
-    struct xmlnode *metaNode = NULL, *releaseNode = NULL;
-    void           *buf;
-    const char     *s;
+    const int32_t t = JsonObjectGet(js, tok, obj, key);
 
-    s = buf = CurlFetch(NULL, "http://musicbrainz.org/ws/2/release/%s?inc=recordings+artists+release-groups+discids+artist-credits", releaseId);
-    if(buf == NULL)
+    if(t >= 0 && tok[t].type == JSON_STRING && tok[t].start == tok[t].end)
     {
-        return false;
+        return NULL;
     }
 
-    /* Find the metadata node */
-    do
-    {
-        s = XmlParseStr(&metaNode, s);
-    }
-    while(metaNode != NULL && XmlTagStrcmp(metaNode, "metadata") != 0);
+    return JsonStrDup(js, tok, t);
+}
+
 
-    free(buf);
+/** Get the type of a "release-group" object of a JSON response.
+ * This is the same legacy type as given by the type attribute of the XML
+ * release group, which the output paths and tags are based on.
+ * \returns The type, which must be free()'d, or NULL.
+ */
+static char *jsonReleaseType(const char *js, const jsontok_t *tok, int32_t group)
+{
+    const int32_t secondary = JsonObjectGet(js, tok, group, "secondary-types");
 
-    if(metaNode == NULL)
+    for(uint8_t l = 0; l < M_ArrayElem(legacyTypes); l++)
     {
-        return false;
+        for(int32_t t = JsonArrayGet(tok, secondary, 0); t >= 0; t = JsonArrayNext(tok, t))
+        {
+            if(JsonStrEq(js, tok, t, legacyTypes[l]))
+            {
+                return x_strdup(legacyTypes[l]);
+            }
+        }
     }
 
-    releaseNode = XmlFindSubNodeFree(metaNode, "release");
-    if(releaseNode)
-    {
-        mbmedium_t  *medium = NULL;
-        uint16_t     mediumCount;
-        mbrelease_t  release;
+    return jsonStrDup(js, tok, group, "primary-type");
+}
 
-        mediumCount = processReleaseNode(releaseNode, discId, &release, &medium);
 
-        for(uint16_t m = 0; m < mediumCount; m++)
+/** Process an "artist-credit" array of a JSON response.
+ * \see processArtistCredit()
+ */
+static void processArtistCreditJson(const char *js, const jsontok_t *tok, int32_t credit, mbartistcredit_t *cd)
+{
+    for(int32_t c = JsonArrayGet(tok, credit, 0); c >= 0; c = JsonArrayNext(tok, c))
+    {
+        const int32_t artist = JsonObjectGet(js, tok, c, "artist");
+        char         *aa;
+
+        if(artist < 0)
         {
-            mbrelease_t *newRel;
+            continue;
+        }
 
-            res->releaseCount++;
-            res->release = x_realloc(res->release, sizeof(mbrelease_t) * res->releaseCount);
+        cd->artistIdCount++;
+        cd->artistId = x_realloc(cd->artistId, sizeof(char *) * cd->artistIdCount);
 
-            newRel = &res->release[res->releaseCount -1];
+        cd->artistId[cd->artistIdCount - 1] = jsonStrDup(js, tok, artist, "id");
 
-            memcpy(newRel, &release, sizeof(mbrelease_t));
-            memcpy(&newRel->medium, &medium[m], sizeof(mbmedium_t));
-        }
+        aa = jsonStrDup(js, tok, artist, "name");
+        if(aa)
+        {
+            if(cd->artistName == NULL)
+            {
+                cd->artistName = aa;
+            }
+            else
+            {
+                /* Concatenate multiple artists if needed */
+                cd->artistName = x_realloc(cd->artistName, strlen(aa) + strlen(cd->artistName) + 3);
 
-        XmlDestroy(&releaseNode);
+                strcat(cd->artistName, ", ");
+                strcat(cd->artistName, aa);
+                free(aa);
+            }
+        }
 
-        return true;
+        aa = jsonStrDup(js, tok, artist, "sort-name");
+        if(aa)
+        {
+            free(cd->artistNameSort);
+            cd->artistNameSort = aa;
+        }
     }
-
-    return false;
 }
 
-/**************************************************************************
- * Global Functions
- **************************************************************************/
 
-/** Lookup some CD.
- * \param[in] discId  The ID of the CD to lookup.
- * \param[in] res     Pointer to populate with the results.
- * \retval true   If the CD found and the results returned.
- * \retval false  If the CD is unknown to MusicBrainz.
+/** Process a track object of a JSON response.
+ * \see processTrackNode()
  */
-bool MbLookup(const char *discId, mbresult_t *res)
+static void processTrackJson(const char *js, const jsontok_t *tok, int32_t track, mbmedium_t *md)
 {
-    struct xmlnode *metaNode = NULL, *releaseListNode = NULL;
-    void           *buf;
-    const char     *s;
-
-    memset(res, 0, sizeof(mbresult_t));
+    const int32_t position = JsonObjectGet(js, tok, track, "position");
 
-    s = buf = CurlFetch(NULL, "http://musicbrainz.org/ws/2/discid/%s", discId);
-    if(!buf)
+    if(position >= 0)
     {
-        return false;
-    }
+        const long p = JsonInt(js, tok, position);
 
-    /* Find the metadata node */
-    do
-    {
-        s = XmlParseStr(&metaNode, s);
+        if(p >= 1 && p <= md->trackCount)
+        {
+            const int32_t recording = JsonObjectGet(js, tok, track, "recording");
+            mbtrack_t    *td = &md->track[p - 1];
+
+            if(recording >= 0)
+            {
+                int32_t credit;
+
+                td->trackId = jsonStrDup(js, tok, recording, "id");
+                td->trackName = jsonStrDup(js, tok, recording, "title");
+
+                credit = JsonObjectGet(js, tok, recording, "artist-credit");
+                if(credit >= 0)
+                {
+                    processArtistCreditJson(js, tok, credit, &td->trackArtist);
+                }
+            }
+        }
     }
-    while(metaNode != NULL && XmlTagStrcmp(metaNode, "metadata") != 0);
+}
+
+
+/** Process a medium object of a JSON response.
+ * \see processMediumNode()
+ */
+static bool processMediumJson(const char *js, const jsontok_t *tok, int32_t medium, const char *discId, mbmedium_t *md)
+{
+    bool    mediumValid = false;
+    int32_t t;
 
-    free(buf);
+    memset(md, 0, sizeof(mbmedium_t));
 
-    if(metaNode == NULL)
+    /* First check if the discId is present */
+    t = JsonObjectGet(js, tok, medium, "discs");
+    for(int32_t disc = JsonArrayGet(tok, t, 0); disc >= 0 && !mediumValid; disc = JsonArrayNext(tok, disc))
     {
-        return false;
+        if(JsonStrEq(js, tok, JsonObjectGet(js, tok, disc, "id"), discId))
+        {
+            mediumValid = true;
+        }
     }
 
-    releaseListNode = XmlFindSubNodeFree(XmlFindSubNodeFree(metaNode, "disc"), "release-list");
-    if(releaseListNode)
+    /* Check if the medium should be processed */
+    if(mediumValid)
     {
-        struct xmlnode *releaseNode = NULL;
-        const char     *s;
+        md->discNum = JsonInt(js, tok, JsonObjectGet(js, tok, medium, "position"));
+        md->title = jsonStrDup(js, tok, medium, "title");
 
-        s = XmlGetContent(releaseListNode);
-        while((s = XmlParseStr(&releaseNode, s)) != NULL)
+        t = JsonObjectGet(js, tok, medium, "track-count");
+        if(t >= 0)
         {
-            const char *releaseId;
+            md->trackCount = JsonInt(js, tok, t);
+            md->track = x_calloc(sizeof(mbtrack_t), md->trackCount);
 
-            if((releaseId = XmlGetAttribute(releaseNode, "id")) != NULL)
+            t = JsonObjectGet(js, tok, medium, "tracks");
+            for(int32_t track = JsonArrayGet(tok, t, 0); track >= 0; track = JsonArrayNext(tok, track))
             {
-                processRelease(releaseId, discId, res);
+                processTrackJson(js, tok, track, md);
             }
         }
-
-        XmlDestroy(&releaseNode);
-
-        dedupeReleases(res);
     }
 
-    XmlDestroy(&releaseListNode);
-
-    return true;
+    return mediumValid;
 }
 
 
-void MbFree(mbresult_t *res)
+/** Process a release object of a JSON response.
+ * \see processReleaseNode()
+ */
+static uint16_t processReleaseJson(const char *js, const jsontok_t *tok, int32_t release, const char *discId, mbrelease_t *cd, mbmedium_t **md)
 {
-    for(uint16_t r = 0; r < res->releaseCount; r++)
+    mbmedium_t *mediums = NULL;
+    uint16_t    mediumCount = 0;
+    int32_t     t;
+
+    memset(cd, 0, sizeof(mbrelease_t));
+
+    cd->releaseId = jsonStrDup(js, tok, release, "id");
+    cd->asin = jsonStrDup(js, tok, release, "asin");
+    cd->albumTitle = jsonStrDup(js, tok, release, "title");
+
+    t = JsonObjectGet(js, tok, release, "release-group");
+    if(t >= 0)
     {
-        freeRelease(&res->release[r]);
+        cd->releaseType = jsonReleaseType(js, tok, t);
+        cd->releaseGroupId = jsonStrDup(js, tok, t, "id");
     }
 
-    free(res->release);
-}
-
+    t = JsonObjectGet(js, tok, release, "artist-credit");
+    if(t >= 0)
+    {
+        processArtistCreditJson(js, tok, t, &cd->albumArtist);
+    }
 
-/** Print a result structure to stdout.
- */
-void MbPrint(const mbresult_t *res)
-{
-    for(uint16_t r = 0; r < res->releaseCount; r++)
+    t = JsonObjectGet(js, tok, release, "media");
+    if(t < 0)
     {
-        mbrelease_t *rel = &res->release[r];
+        *md = NULL;
+        return 0;
+    }
 
-        printf("Release=%s\n",           rel->releaseId);
-        printf("  ASIN=%s\n",            rel->asin);
-        printf("  Album=%s\n",           rel->albumTitle);
-        printf("  AlbumArtist=%s\n",     rel->albumArtist.artistName);
-        printf("  AlbumArtistSort=%s\n", rel->albumArtist.artistNameSort);
-        printf("  ReleaseType=%s\n",     rel->releaseType);
-        printf("  ReleaseGroupId=%s\n",  rel->releaseGroupId);
+    cd->discTotal = tok[t].size;
 
-        for(uint8_t t = 0; t < rel->albumArtist.artistIdCount; t++)
+    for(int32_t m = JsonArrayGet(tok, t, 0); m >= 0; m = JsonArrayNext(tok, m))
+    {
+        mediums = x_realloc(mediums, sizeof(mbmedium_t) * (mediumCount + 1));
+        if(processMediumJson(js, tok, m, discId, &mediums[mediumCount]))
         {
-            printf("  ArtistId=%s\n", rel->albumArtist.artistId[t]);
+            mediumCount++;
         }
+    }
 
-        printf("  Total Disc=%u\n", rel->discTotal);
+    mediumCount = dedupeMediums(mediumCount, mediums);
 
-        const mbmedium_t *mb = &rel->medium;
+    *md = mediums;
+    return mediumCount;
+}
 
-        printf("  Medium\n");
-        printf("    DiscNum=%u\n", mb->discNum);
-        printf("    Title=%s\n", mb->title);
 
-        for(uint16_t u = 0; u < mb->trackCount; u++)
+/** Fetch a release and parse its mediums matching some disc.
+ * \param[in]  releaseId  The release to fetch.
+ * \param[in]  discId     The disc for which mediums are wanted.
+ * \param[out] release    The release, with no medium set.
+ * \param[out] medium     Pointer to fill with the array of mediums.
+ * \returns The count of mediums, or -1 if the release could not be fetched.
+ */
+static int32_t fetchRelease(const char *releaseId, const char *discId, mbrelease_t *release, mbmedium_t **medium)
+{
+    int32_t mediumCount = -1;
+
+    if(mbFormat == MB_FORMAT_JSON)
+    {
+        jsontok_t *tok;
+        size_t     size;
+        char      *js;
+
+        tok = mbFetchJson("release", releaseId, MB_RELEASE_INC, &js, &size);
+        if(tok != NULL)
         {
-            const mbtrack_t *td = &mb->track[u];
+            mediumCount = processReleaseJson(js, tok, 0, discId, release, medium);
 
-            printf("    Track %u\n", u);
-            printf("      Id=%s\n", td->trackId);
-            printf("      Title=%s\n", td->trackName);
-            printf("      Artist=%s\n", td->trackArtist.artistName);
-            printf("      ArtistSort=%s\n", td->trackArtist.artistNameSort);
-            for(uint8_t t = 0; t < td->trackArtist.artistIdCount; t++)
+            free(tok);
+            free(js);
+        }
+    }
+    else
+    {
+        const xmlnode_t *releaseNode;
+        xmldoc_t        *doc;
+
+        doc = mbFetch("release", releaseId, MB_RELEASE_INC);
+        if(doc != NULL)
+        {
+            releaseNode = XmlFindSubNode(doc, XmlFindSubNode(doc, XmlGetRoot(doc), "metadata"), "release");
+            if(releaseNode)
             {
-                printf("      ArtistId=%s\n", td->trackArtist.artistId[t]);
+                mediumCount = processReleaseNode(doc, releaseNode, discId, release, medium);
             }
+
+            XmlDestroy(&doc);
         }
     }
-}
 
-/**************************************************************************
- * Module Test
- **************************************************************************/
+    return mediumCount;
+}
 
-#ifdef MODULE_TEST
 
-/*
- * gcc -std=gnu99 -ggdb -DMODULE_TEST -DVERSION=\"0.5beta\" mblookup.c xmlparse.c curlfetch.c log.c x_mem.c -lcurl
+/** Add a release to some results, once for each of its matching mediums.
+ * The release and mediums are taken over by the results.
  */
-
-int main(int argc, char *argv[])
+static void addRelease(mbresult_t *res, mbrelease_t *release, mbmedium_t *medium, uint16_t mediumCount)
 {
-    mbresult_t res;
+    for(uint16_t m = 0; m < mediumCount; m++)
+    {
+        mbrelease_t *newRel;
+
+        res->releaseCount++;
+        res->release = x_realloc(res->release, sizeof(mbrelease_t) * res->releaseCount);
+
+        newRel = &res->release[res->releaseCount -1];
+
+        memcpy(newRel, release, sizeof(mbrelease_t));
+        memcpy(&newRel->medium, &medium[m], sizeof(mbmedium_t));
+    }
+
+    if(mediumCount == 0)
+    {
+        freeRelease(release);
+    }
+
+    free(medium);
+}
+
+
+/** Check if a release has all the details needed to tag the disc.
+ * Releases parsed from a discid response lack details if the response
+ * was cached from a plain query, or if MusicBrainz omits some details.
+ */
+static bool releaseIsComplete(const mbrelease_t *release, const mbmedium_t *medium, uint16_t mediumCount)
+{
+    if(release->releaseGroupId == NULL || release->albumArtist.artistIdCount == 0 || mediumCount == 0)
+    {
+        return false;
+    }
+
+    for(uint16_t m = 0; m < mediumCount; m++)
+    {
+        if(medium[m].trackCount == 0)
+        {
+            return false;
+        }
+
+        for(uint16_t t = 0; t < medium[m].trackCount; t++)
+        {
+            if(medium[m].track[t].trackId == NULL)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/** Process a release.
+ */
+static bool processRelease(const char *releaseId, const char *discId, mbresult_t *res)
+{
+    mbmedium_t  *medium = NULL;
+    int32_t      mediumCount;
+    mbrelease_t  release;
+
+    mediumCount = fetchRelease(releaseId, discId, &release, &medium);
+    if(mediumCount >= 0)
+    {
+        addRelease(res, &release, medium, mediumCount);
+        return true;
+    }
+
+    return false;
+}
+
+/** Fetch and process releases from a pool until it is closed and none remain.
+ */
+static void *fetchWorker(void *param)
+{
+    fetchpool_t *fp = param;
+
+    while(1)
+    {
+        mbresult_t  result;
+        const char *id;
+        uint16_t    r;
+
+        pthread_mutex_lock(&fp->lock);
+
+        while(1)
+        {
+            /* Skip releases that need no fetch */
+            while(fp->next < fp->count && fp->releaseId[fp->next] == NULL)
+            {
+                fp->next++;
+            }
+
+            if(fp->next < fp->count || fp->closed)
+            {
+                break;
+            }
+
+            pthread_cond_wait(&fp->cond, &fp->lock);
+        }
+
+        if(fp->next >= fp->count)
+        {
+            pthread_mutex_unlock(&fp->lock);
+            return NULL;
+        }
+
+        r = fp->next++;
+        id = fp->releaseId[r];
+
+        pthread_mutex_unlock(&fp->lock);
+
+        memset(&result, 0, sizeof(result));
+        processRelease(id, fp->discId, &result);
+
+        /* The result array may be moved as releases are added */
+        pthread_mutex_lock(&fp->lock);
+        fp->result[r] = result;
+        pthread_mutex_unlock(&fp->lock);
+    }
+}
+
+
+/** Start a pool for fetching the releases of some disc.
+ */
+static void fetchPoolInit(fetchpool_t *fp, const char *discId)
+{
+    memset(fp, 0, sizeof(fetchpool_t));
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->cond, NULL);
+    fp->discId = discId;
+}
+
+
+/** Add a release to a pool, starting its fetch as soon as a thread is free.
+ */
+static void fetchPoolAdd(fetchpool_t *fp, const char *releaseId)
+{
+    pthread_mutex_lock(&fp->lock);
+
+    fp->releaseId = x_realloc(fp->releaseId, sizeof(char *) * (fp->count + 1));
+    fp->result = x_realloc(fp->result, sizeof(mbresult_t) * (fp->count + 1));
+
+    fp->releaseId[fp->count] = x_strdup(releaseId);
+    memset(&fp->result[fp->count], 0, sizeof(mbresult_t));
+    fp->count++;
+
+    /* Start another thread if all are busy */
+    if(fp->threads < MB_FETCH_THREADS && fp->threads < fp->count - fp->next)
+    {
+        pthread_create(&fp->tid[fp->threads++], NULL, fetchWorker, fp);
+    }
+
+    pthread_cond_signal(&fp->cond);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+
+/** Add a release parsed from a discid response to a pool.
+ * A complete release is placed directly in the results, while one lacking
+ * details is freed and fetched in full instead.  Either way it keeps its
+ * place in the order of the results.
+ */
+static void fetchPoolAddParsed(fetchpool_t *fp, mbrelease_t *release, mbmedium_t *medium, uint16_t mediumCount)
+{
+    mbresult_t result;
+
+    if(!releaseIsComplete(release, medium, mediumCount))
+    {
+        if(release->releaseId != NULL)
+        {
+            LogInf("Fetching incomplete release %s\n", release->releaseId);
+            fetchPoolAdd(fp, release->releaseId);
+        }
+
+        for(uint16_t m = 0; m < mediumCount; m++)
+        {
+            freeMedium(&medium[m]);
+        }
+
+        free(medium);
+        freeRelease(release);
+        return;
+    }
+
+    memset(&result, 0, sizeof(result));
+    addRelease(&result, release, medium, mediumCount);
+
+    pthread_mutex_lock(&fp->lock);
+
+    fp->releaseId = x_realloc(fp->releaseId, sizeof(char *) * (fp->count + 1));
+    fp->result = x_realloc(fp->result, sizeof(mbresult_t) * (fp->count + 1));
+
+    fp->releaseId[fp->count] = NULL;
+    fp->result[fp->count] = result;
+    fp->count++;
+
+    pthread_mutex_unlock(&fp->lock);
+}
+
+
+/** Wait for all the releases in a pool to be fetched, and free the pool.
+ * The results are added to \a res in the order the releases were added,
+ * exactly as if each release had been processed in turn.
+ */
+static void fetchPoolFinish(fetchpool_t *fp, mbresult_t *res)
+{
+    pthread_mutex_lock(&fp->lock);
+    fp->closed = true;
+    pthread_cond_broadcast(&fp->cond);
+    pthread_mutex_unlock(&fp->lock);
+
+    for(uint16_t t = 0; t < fp->threads; t++)
+    {
+        pthread_join(fp->tid[t], NULL);
+    }
+
+    /* Merge the results in order */
+    for(uint16_t r = 0; r < fp->count; r++)
+    {
+        const mbresult_t *rr = &fp->result[r];
+
+        if(rr->releaseCount > 0)
+        {
+            res->release = x_realloc(res->release, sizeof(mbrelease_t) * (res->releaseCount + rr->releaseCount));
+            memcpy(&res->release[res->releaseCount], rr->release, sizeof(mbrelease_t) * rr->releaseCount);
+            res->releaseCount += rr->releaseCount;
+        }
+
+        free(rr->release);
+        free(fp->releaseId[r]);
+    }
+
+    free(fp->result);
+    free(fp->releaseId);
+    pthread_cond_destroy(&fp->cond);
+    pthread_mutex_destroy(&fp->lock);
+}
+
+
+/** Handle an element opening in a discid response.
+ * Each release of the disc is added to the fetch pool as soon as it is
+ * seen, while the rest of the response is still being received.
+ */
+static void discStart(void *param, xmlsax_t *s, const char *tag)
+{
+    discscan_t *ds = param;
+
+    switch(XmlSaxGetDepth(s))
+    {
+        case 1:
+            ds->inMetadata = strcmp(tag, "metadata") == 0;
+            break;
+
+        case 2:
+            ds->inDisc = ds->inMetadata && strcmp(tag, "disc") == 0;
+            break;
+
+        case 3:
+            ds->inReleaseList = ds->inDisc && strcmp(tag, "release-list") == 0;
+            break;
+
+        case 4:
+            if(ds->inReleaseList)
+            {
+                const char *id = XmlSaxGetAttribute(s, "id");
+
+                if(id != NULL)
+                {
+                    fetchPoolAdd(&ds->pool, id);
+                }
+            }
+            break;
+    }
+}
+
+
+/** Handle an element closing in a discid response.
+ */
+static void discEnd(void *param, xmlsax_t *s, const char *tag, const char *content)
+{
+    discscan_t *ds = param;
+
+    (void)tag;
+    (void)content;
+
+    switch(XmlSaxGetDepth(s))
+    {
+        case 2:
+            ds->inDisc = false;
+            break;
+
+        case 3:
+            ds->inReleaseList = false;
+            break;
+    }
+}
+
+
+/** Pass part of a discid response to the parser.
+ */
+static bool discSink(const void *data, size_t len, void *param)
+{
+    discscan_t *ds = param;
+
+    return XmlSaxFeed(ds->sax, data, len);
+}
+
+
+/** Find the releases of a disc and their details from an XML discid response.
+ * \retval false  If the disc could not be looked up.
+ */
+static bool lookupDiscXmlCombined(discscan_t *ds, const char *discId)
+{
+    const xmlnode_t *n, *releaseNode;
+    xmldoc_t        *doc;
+
+    doc = mbFetch("discid", discId, MB_DISCID_INC);
+    if(doc == NULL)
+    {
+        return false;
+    }
+
+    n = XmlFindSubNode(doc, XmlGetRoot(doc), "metadata");
+    if(n == NULL)
+    {
+        XmlDestroy(&doc);
+        return false;
+    }
+
+    n = XmlFindSubNode(doc, XmlFindSubNode(doc, n, "disc"), "release-list");
+
+    for(releaseNode = XmlFindSubNode(doc, n, "release"); releaseNode; releaseNode = XmlFindNextNode(doc, releaseNode, "release"))
+    {
+        mbmedium_t  *medium;
+        uint16_t     mediumCount;
+        mbrelease_t  release;
+
+        mediumCount = processReleaseNode(doc, releaseNode, discId, &release, &medium);
+        fetchPoolAddParsed(&ds->pool, &release, medium, mediumCount);
+    }
+
+    XmlDestroy(&doc);
+
+    return true;
+}
+
+
+/** Find the releases of a disc from the XML discid response.
+ * \retval false  If the disc could not be looked up.
+ */
+static bool lookupDiscXml(discscan_t *ds, const char *discId)
+{
+    bool ok, parsed;
+
+    if(mbCombined)
+    {
+        return lookupDiscXmlCombined(ds, discId);
+    }
+
+    /* Parse the response as it arrives, fetching releases as they are found */
+    ds->sax = XmlSaxNew(discStart, discEnd, ds);
+
+    ok = mbStream("discid", discId, "", discSink, ds);
+    parsed = XmlSaxFinish(&ds->sax);
+
+    /* Do not keep a cached response that cannot be parsed */
+    if(!parsed)
+    {
+        MbCacheRemove("discid", discId, "xml");
+    }
+
+    return parsed && ok && ds->inMetadata;
+}
+
+
+/** Find the releases of a disc from the JSON discid response.
+ * If the response is combined, the details of each release are also parsed.
+ * \retval false  If the disc could not be looked up.
+ */
+static bool lookupDiscJson(discscan_t *ds, const char *discId)
+{
+    jsontok_t *tok;
+    size_t     size;
+    char      *js;
+    int32_t    t;
+
+    tok = mbFetchJson("discid", discId, mbCombined ? MB_DISCID_INC : "", &js, &size);
+    if(tok == NULL)
+    {
+        return false;
+    }
+
+    t = JsonObjectGet(js, tok, 0, "releases");
+    for(int32_t r = JsonArrayGet(tok, t, 0); r >= 0; r = JsonArrayNext(tok, r))
+    {
+        if(mbCombined)
+        {
+            mbmedium_t  *medium;
+            uint16_t     mediumCount;
+            mbrelease_t  release;
+
+            mediumCount = processReleaseJson(js, tok, r, discId, &release, &medium);
+            fetchPoolAddParsed(&ds->pool, &release, medium, mediumCount);
+        }
+        else
+        {
+            char *id = jsonStrDup(js, tok, r, "id");
+
+            if(id != NULL)
+            {
+                fetchPoolAdd(&ds->pool, id);
+                free(id);
+            }
+        }
+    }
+
+    free(tok);
+    free(js);
+
+    return true;
+}
+
+
+/** Print a result structure to some stream.
+ */
+static void printResult(FILE *f, const mbresult_t *res)
+{
+    for(uint16_t r = 0; r < res->releaseCount; r++)
+    {
+        mbrelease_t *rel = &res->release[r];
+
+        fprintf(f, "Release=%s\n",           rel->releaseId);
+        fprintf(f, "  ASIN=%s\n",            rel->asin);
+        fprintf(f, "  Album=%s\n",           rel->albumTitle);
+        fprintf(f, "  AlbumArtist=%s\n",     rel->albumArtist.artistName);
+        fprintf(f, "  AlbumArtistSort=%s\n", rel->albumArtist.artistNameSort);
+        fprintf(f, "  ReleaseType=%s\n",     rel->releaseType);
+        fprintf(f, "  ReleaseGroupId=%s\n",  rel->releaseGroupId);
+
+        for(uint8_t t = 0; t < rel->albumArtist.artistIdCount; t++)
+        {
+            fprintf(f, "  ArtistId=%s\n", rel->albumArtist.artistId[t]);
+        }
+
+        fprintf(f, "  Total Disc=%u\n", rel->discTotal);
+
+        const mbmedium_t *mb = &rel->medium;
+
+        fprintf(f, "  Medium\n");
+        fprintf(f, "    DiscNum=%u\n", mb->discNum);
+        fprintf(f, "    Title=%s\n", mb->title);
+
+        for(uint16_t u = 0; u < mb->trackCount; u++)
+        {
+            const mbtrack_t *td = &mb->track[u];
+
+            fprintf(f, "    Track %u\n", u);
+            fprintf(f, "      Id=%s\n", td->trackId);
+            fprintf(f, "      Title=%s\n", td->trackName);
+            fprintf(f, "      Artist=%s\n", td->trackArtist.artistName);
+            fprintf(f, "      ArtistSort=%s\n", td->trackArtist.artistNameSort);
+            for(uint8_t t = 0; t < td->trackArtist.artistIdCount; t++)
+            {
+                fprintf(f, "      ArtistId=%s\n", td->trackArtist.artistId[t]);
+            }
+        }
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Select the format of responses requested from MusicBrainz.
+ * Both formats give identical results, but JSON responses are smaller and
+ * quicker to parse.
+ */
+void MbSetFormat(mbformat_t fmt)
+{
+    mbFormat = fmt;
+}
+
+
+/** Select whether the details of releases are requested in the discid query.
+ * When set, a disc is normally looked up with a single request, and only
+ * releases lacking details in the response are fetched individually.
+ * Otherwise each release of the disc is fetched in a separate request.
+ */
+void MbSetCombined(bool combined)
+{
+    mbCombined = combined;
+}
+
+
+/** Lookup some CD.
+ * \param[in] discId  The ID of the CD to lookup.
+ * \param[in] res     Pointer to populate with the results.
+ * \retval true   If the CD found and the results returned.
+ * \retval false  If the CD is unknown to MusicBrainz.
+ */
+bool MbLookup(const char *discId, mbresult_t *res)
+{
+    discscan_t ds;
+    bool       ok;
+
+    memset(res, 0, sizeof(mbresult_t));
+    memset(&ds, 0, sizeof(ds));
+
+    CurlSetRateLimit(MB_HOST, MB_REQUEST_INTERVAL_MS, 1);
+
+    fetchPoolInit(&ds.pool, discId);
+
+    if(mbFormat == MB_FORMAT_JSON)
+    {
+        ok = lookupDiscJson(&ds, discId);
+    }
+    else
+    {
+        ok = lookupDiscXml(&ds, discId);
+    }
+
+    fetchPoolFinish(&ds.pool, res);
+
+    if(!ok)
+    {
+        MbFree(res);
+        memset(res, 0, sizeof(mbresult_t));
+        return false;
+    }
+
+    dedupeReleases(res);
+
+    MbCacheLogStats();
+
+    return true;
+}
+
+
+void MbFree(mbresult_t *res)
+{
+    for(uint16_t r = 0; r < res->releaseCount; r++)
+    {
+        freeRelease(&res->release[r]);
+    }
+
+    free(res->release);
+}
+
+
+/** Print a result structure to stdout.
+ */
+void MbPrint(const mbresult_t *res)
+{
+    printResult(stdout, res);
+}
+
+/**************************************************************************
+ * Module Test
+ **************************************************************************/
+
+#ifdef MODULE_TEST
+
+/*
+ * gcc -std=gnu99 -ggdb -DMODULE_TEST -DVERSION=\"0.5beta\" mblookup.c mbcache.c xmlparse.c jsonparse.c curlfetch.c log.c x_mem.c -lcurl -lpthread
+ *
+ * ./a.out [-j] <discid>
+ *   Lookup a disc and print the results, using the JSON web service if -j
+ *   is given.  The timings of each request are also logged.
+ *
+ * ./a.out [-P] -p <dir> <discid>...
+ *   Check that the XML and JSON web services give identical results for
+ *   each disc.  Responses are recorded in the cache <dir> when first
+ *   fetched, after which they are used as fixtures without any lookup.
+ *   Recorded responses are kept in test/mb and checked by make check.
+ *
+ * -P fetches each release separately, as --mb-per-release.
+ */
+
+/** Lookup a disc and print the results to a string.
+ */
+static char *lookupToString(const char *discId, mbformat_t fmt)
+{
+    mbresult_t res;
+    char      *out = NULL;
+    size_t     outLen;
+    FILE      *f = open_memstream(&out, &outLen);
+
+    MbSetFormat(fmt);
+
+    fprintf(f, "Found=%u\n", MbLookup(discId, &res));
+    printResult(f, &res);
+    fclose(f);
+
+    MbFree(&res);
+
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    mbresult_t res;
+
+    if(argc > 1 && strcmp(argv[1], "-P") == 0)
+    {
+        MbSetCombined(false);
+        argv++;
+        argc--;
+    }
+
+    if(argc > 3 && strcmp(argv[1], "-p") == 0)
+    {
+        int failures = 0;
+
+        MbCacheInit(argv[2], UINT32_MAX, UINT64_MAX);
+
+        for(int a = 3; a < argc; a++)
+        {
+            char *xml = lookupToString(argv[a], MB_FORMAT_XML);
+            char *json = lookupToString(argv[a], MB_FORMAT_JSON);
+
+            if(strcmp(xml, json) == 0)
+            {
+                printf("PASS %s\n", argv[a]);
+            }
+            else
+            {
+                printf("FAIL %s\nXML:\n%sJSON:\n%s", argv[a], xml, json);
+                failures++;
+            }
+
+            free(xml);
+            free(json);
+        }
+
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if(argc > 2 && strcmp(argv[1], "-j") == 0)
+    {
+        MbSetFormat(MB_FORMAT_JSON);
+        argv++;
+        argc--;
+    }
 
     if(argc > 1)
     {
+        CurlSetTrace(true);
+
         MbLookup(argv[1], &res);
         MbPrint(&res);
+        CurlLogStats();
 
         MbFree(&res);
     }
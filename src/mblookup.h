@@ -94,6 +94,14 @@ typedef struct
 mbrelease_t;
 
 
+/** Format of the responses requested from MusicBrainz. */
+typedef enum
+{
+    MB_FORMAT_XML,
+    MB_FORMAT_JSON
+}
+mbformat_t;
+
 typedef struct
 {
     uint16_t             releaseCount;
@@ -105,6 +113,8 @@ mbresult_t;
  * Prototypes
  **************************************************************************/
 
+void MbSetFormat(mbformat_t fmt);
+void MbSetCombined(bool combined);
 bool MbLookup(const char *discId, mbresult_t *res);
 void MbPrint(const mbresult_t *res);
 
@@ -0,0 +1,198 @@
+/***************************************************************************
+ * md5.c: MD5 message digest, as used for the FLAC STREAMINFO signature.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include "md5.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+#define ROTL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/** Per-round shift amounts (RFC 1321). */
+static const uint8_t shift[64] =
+{
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+/** Per-round constants, floor(abs(sin(i + 1)) * 2^32). */
+static const uint32_t k[64] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static void transform(uint32_t state[4], const uint8_t block[64])
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t w[16];
+
+    for(uint8_t i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) |
+               ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+    }
+
+    for(uint8_t i = 0; i < 64; i++)
+    {
+        uint32_t f, t;
+        uint8_t  g;
+
+        if(i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if(i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        }
+        else if(i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        t = d;
+        d = c;
+        c = b;
+        b = b + ROTL(a + f + k[i] + w[g], shift[i]);
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+void Md5Init(md5_t *m)
+{
+    m->state[0] = 0x67452301;
+    m->state[1] = 0xefcdab89;
+    m->state[2] = 0x98badcfe;
+    m->state[3] = 0x10325476;
+    m->count = 0;
+}
+
+
+void Md5Update(md5_t *m, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t         used = m->count % 64;
+
+    m->count += len;
+
+    /* Complete any partial block */
+    if(used > 0)
+    {
+        size_t n = 64 - used;
+
+        if(n > len)
+        {
+            n = len;
+        }
+
+        memcpy(&m->buffer[used], p, n);
+        p += n;
+        len -= n;
+
+        if(used + n < 64)
+        {
+            return;
+        }
+
+        transform(m->state, m->buffer);
+    }
+
+    while(len >= 64)
+    {
+        transform(m->state, p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(m->buffer, p, len);
+}
+
+
+void Md5Final(md5_t *m, uint8_t digest[16])
+{
+    const uint64_t bits = m->count * 8;
+    uint8_t        pad[72];
+    size_t         padLen = ((m->count % 64) < 56 ? 56 : 120) - (m->count % 64);
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+
+    for(uint8_t i = 0; i < 8; i++)
+    {
+        pad[padLen + i] = bits >> (i * 8);
+    }
+
+    Md5Update(m, pad, padLen + 8);
+
+    for(uint8_t i = 0; i < 16; i++)
+    {
+        digest[i] = m->state[i / 4] >> ((i % 4) * 8);
+    }
+}
+
+/* END OF FILE */
@@ -0,0 +1,56 @@
+/***************************************************************************
+ * md5.h: Interface to the MD5 message digest.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef MD5_H
+#define MD5_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef struct
+{
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t  buffer[64];
+}
+md5_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+void Md5Init(md5_t *m);
+void Md5Update(md5_t *m, const void *data, size_t len);
+void Md5Final(md5_t *m, uint8_t digest[16]);
+
+#endif
+
+/* END OF FILE */
@@ -0,0 +1,327 @@
+/***************************************************************************
+ * pcmconv.c: Conversion of 16-bit PCM samples for the encoder.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "pcmconv.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+#define M_ArraySize(a)  (sizeof(a) / sizeof(a[0]))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCMCONV_X86
+#endif
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** Function to widen some count of 16-bit samples to 32-bits. */
+typedef void (*convfn_t)(int32_t *out, const uint8_t *in, size_t samples);
+
+/** A set of conversion kernels for some instruction set. */
+typedef struct kernel
+{
+    const char *name;
+
+    /** Check if the host supports the kernels, or NULL if always supported. */
+    bool      (*supported)(void);
+
+    /** Conversion functions indexed by pcmendian_t. */
+    convfn_t    conv[2];
+}
+kernel_t;
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+static pthread_once_t  kernelOnce = PTHREAD_ONCE_INIT;
+
+/** The selected kernel. */
+static const struct kernel *kernel = NULL;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static void convLeC(int32_t *out, const uint8_t *in, size_t samples)
+{
+    for(size_t s = 0; s < samples; s++)
+    {
+        out[s] = (int16_t)(in[s * 2] | (in[s * 2 + 1] << 8));
+    }
+}
+
+
+static void convBeC(int32_t *out, const uint8_t *in, size_t samples)
+{
+    for(size_t s = 0; s < samples; s++)
+    {
+        out[s] = (int16_t)((in[s * 2] << 8) | in[s * 2 + 1]);
+    }
+}
+
+#ifdef PCMCONV_X86
+
+/** Swap the bytes of each 16-bit lane. */
+static inline __m128i swap16Sse2(__m128i x)
+{
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+
+/** Sign extend the 8 samples of x into two vectors of 4.
+ * Each sample is placed in the top half of a 32-bit lane by unpacking
+ * with itself, then shifted down arithmetically.
+ */
+static inline void storeS32Sse2(int32_t *out, __m128i x)
+{
+    _mm_storeu_si128((__m128i *)&out[0], _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+    _mm_storeu_si128((__m128i *)&out[4], _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+}
+
+
+__attribute__((target("sse2")))
+static void convLeSse2(int32_t *out, const uint8_t *in, size_t samples)
+{
+    size_t s = 0;
+
+    for(; s + 8 <= samples; s += 8)
+    {
+        storeS32Sse2(&out[s], _mm_loadu_si128((const __m128i *)&in[s * 2]));
+    }
+
+    convLeC(&out[s], &in[s * 2], samples - s);
+}
+
+
+__attribute__((target("sse2")))
+static void convBeSse2(int32_t *out, const uint8_t *in, size_t samples)
+{
+    size_t s = 0;
+
+    for(; s + 8 <= samples; s += 8)
+    {
+        storeS32Sse2(&out[s], swap16Sse2(_mm_loadu_si128((const __m128i *)&in[s * 2])));
+    }
+
+    convBeC(&out[s], &in[s * 2], samples - s);
+}
+
+
+__attribute__((target("avx2")))
+static void convLeAvx2(int32_t *out, const uint8_t *in, size_t samples)
+{
+    size_t s = 0;
+
+    for(; s + 16 <= samples; s += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&in[s * 2]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&in[s * 2 + 16]);
+
+        _mm256_storeu_si256((__m256i *)&out[s],     _mm256_cvtepi16_epi32(a));
+        _mm256_storeu_si256((__m256i *)&out[s + 8], _mm256_cvtepi16_epi32(b));
+    }
+
+    convLeC(&out[s], &in[s * 2], samples - s);
+}
+
+
+__attribute__((target("avx2")))
+static void convBeAvx2(int32_t *out, const uint8_t *in, size_t samples)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t        s = 0;
+
+    for(; s + 16 <= samples; s += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&in[s * 2]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&in[s * 2 + 16]);
+
+        _mm256_storeu_si256((__m256i *)&out[s],     _mm256_cvtepi16_epi32(_mm_shuffle_epi8(a, swap)));
+        _mm256_storeu_si256((__m256i *)&out[s + 8], _mm256_cvtepi16_epi32(_mm_shuffle_epi8(b, swap)));
+    }
+
+    convBeC(&out[s], &in[s * 2], samples - s);
+}
+
+
+static bool hasSse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+
+static bool hasAvx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/** Kernels in order of preference. */
+static const kernel_t kernels[] =
+{
+#ifdef PCMCONV_X86
+    { "avx2", hasAvx2, { convLeAvx2, convBeAvx2 } },
+    { "sse2", hasSse2, { convLeSse2, convBeSse2 } },
+#endif
+    { "c",    NULL,    { convLeC,    convBeC } }
+};
+
+static bool kernelSupported(const kernel_t *k)
+{
+    return k->supported == NULL || k->supported();
+}
+
+
+static void kernelSelect(void)
+{
+    for(uint8_t k = 0; k < M_ArraySize(kernels) && kernel == NULL; k++)
+    {
+        if(kernelSupported(&kernels[k]))
+        {
+            kernel = &kernels[k];
+        }
+    }
+
+    LogInf("Using %s sample conversion\n", kernel->name);
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Widen 16-bit signed samples to 32-bits, as required by the encoder.
+ * The fastest conversion supported by the host is selected on first use.
+ * \param[in] in       Pointer to the samples, which need not be aligned.
+ * \param[in] samples  Count of samples, over all channels.
+ * \param[in] endian   The byte order of the input samples.
+ */
+void PcmConvS16(int32_t *out, const void *in, size_t samples, pcmendian_t endian)
+{
+    pthread_once(&kernelOnce, kernelSelect);
+
+    kernel->conv[endian](out, in, samples);
+}
+
+
+const char *PcmConvKernelName(void)
+{
+    pthread_once(&kernelOnce, kernelSelect);
+
+    return kernel->name;
+}
+
+
+#ifdef MODULE_TEST
+
+/*
+ * gcc -std=gnu99 -O2 -DMODULE_TEST pcmconv.c log.c x_mem.c -lpthread
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "x_mem.h"
+
+#define TEST_SAMPLES (8 * 1024 * 1024)
+#define TEST_PASSES  20
+
+int main(void)
+{
+    uint8_t *in = x_malloc(TEST_SAMPLES * 2);
+    int32_t *ref = x_malloc(TEST_SAMPLES * sizeof(int32_t));
+    int32_t *out = x_malloc(TEST_SAMPLES * sizeof(int32_t));
+    int      rc = 0;
+
+    srand(1);
+    for(size_t b = 0; b < TEST_SAMPLES * 2; b++)
+    {
+        in[b] = rand();
+    }
+
+    printf("Selected: %s\n", PcmConvKernelName());
+
+    for(uint8_t k = 0; k < M_ArraySize(kernels); k++)
+    {
+        if(!kernelSupported(&kernels[k]))
+        {
+            printf("%-5s: not supported\n", kernels[k].name);
+            continue;
+        }
+
+        for(uint8_t e = 0; e < 2; e++)
+        {
+            struct timespec start, end;
+            double          secs;
+
+            /* Check against the plain C conversion, using an odd length
+             *  and offset to exercise the unaligned tails.
+             */
+            kernels[M_ArraySize(kernels) - 1].conv[e](ref, &in[2], TEST_SAMPLES - 3);
+            kernels[k].conv[e](out, &in[2], TEST_SAMPLES - 3);
+            if(memcmp(ref, out, (TEST_SAMPLES - 3) * sizeof(int32_t)) != 0)
+            {
+                printf("%-5s: %s mismatch\n", kernels[k].name, e ? "be" : "le");
+                rc = 1;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(int p = 0; p < TEST_PASSES; p++)
+            {
+                kernels[k].conv[e](out, in, TEST_SAMPLES);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+            /* Throughput is of the 16-bit input */
+            printf("%-5s: %s %6.2f GB/s\n", kernels[k].name, e ? "be" : "le",
+                   ((double)TEST_SAMPLES * 2 * TEST_PASSES) / secs / 1e9);
+        }
+    }
+
+    free(in);
+    free(ref);
+    free(out);
+
+    return rc;
+}
+#endif
+
+/* END OF FILE */
@@ -0,0 +1,61 @@
+/***************************************************************************
+ * pcmconv.h: Interface to PCM sample conversion.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef PCMCONV_H
+#define PCMCONV_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/** Byte order of samples in the host's memory. */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PCM_HOST_ENDIAN PCM_BIG_ENDIAN
+#else
+#define PCM_HOST_ENDIAN PCM_LITTLE_ENDIAN
+#endif
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+typedef enum
+{
+    PCM_LITTLE_ENDIAN,
+    PCM_BIG_ENDIAN
+}
+pcmendian_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+void        PcmConvS16(int32_t *out, const void *in, size_t samples, pcmendian_t endian);
+const char *PcmConvKernelName(void);
+
+#endif
+
+/* END OF FILE */
@@ -0,0 +1,413 @@
+/***************************************************************************
+ * pcmq.c: Bounded queue of PCM chunks between the ripper and encoders.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "x_mem.h"
+#include "pcmq.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Size of each chunk in the queue.
+ * This is one second of CD audio i.e. 75 sectors of 2352 bytes.
+ */
+#define PCMQ_CHUNK_BYTES (2352 * 75)
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** A chunk of PCM data.
+ * Chunk number idx holds the stream bytes from idx * PCMQ_CHUNK_BYTES
+ * onwards, of which len bytes have been written so far.
+ */
+struct pcmchunk
+{
+    struct pcmchunk *next;
+    uint64_t         idx;
+    size_t           len;
+    uint8_t          data[PCMQ_CHUNK_BYTES];
+};
+
+
+/** State for a reader, which is the cookie for the reader FILE stream. */
+struct pcmqreader
+{
+    struct pcmq       *q;
+    struct pcmqreader *next;
+
+    /** Offset of the next byte to be read in the stream. */
+    uint64_t           pos;
+};
+
+
+struct pcmq
+{
+    pthread_mutex_t    lock;
+    pthread_cond_t     notFull, notEmpty;
+
+    /** List of chunks from oldest to newest. */
+    struct pcmchunk   *head, *tail;
+
+    /** List of all open readers. */
+    struct pcmqreader *readers;
+
+    /** Total count of bytes written to the stream. */
+    uint64_t           written;
+
+    /** Set once the writer has closed the stream. */
+    bool               closed;
+
+    /** Maximum count of chunks that may be held before the writer blocks. */
+    uint16_t           capacity;
+
+    /** Count of references i.e. creator plus open streams. */
+    uint16_t           refs;
+};
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static uint16_t chunkCount(struct pcmq *q)
+{
+    return q->tail ? (q->tail->idx - q->head->idx) + 1 : 0;
+}
+
+
+/** Free any chunks which all open readers have consumed.
+ * If there are no readers, all complete chunks are discarded.
+ */
+static void trimChunks(struct pcmq *q)
+{
+    uint64_t lowWater = q->written;
+
+    for(struct pcmqreader *r = q->readers; r != NULL; r = r->next)
+    {
+        if(r->pos < lowWater)
+        {
+            lowWater = r->pos;
+        }
+    }
+
+    while(q->head != NULL && (q->head->idx + 1) * PCMQ_CHUNK_BYTES <= lowWater)
+    {
+        struct pcmchunk *c = q->head;
+
+        q->head = c->next;
+        if(q->head == NULL)
+        {
+            q->tail = NULL;
+        }
+
+        free(c);
+    }
+}
+
+
+/** Drop a reference, freeing the queue if it was the last.
+ * This must be called with the lock held, and will release the lock.
+ */
+static void unrefUnlock(struct pcmq *q)
+{
+    bool last = (--q->refs == 0);
+
+    pthread_mutex_unlock(&q->lock);
+
+    if(last)
+    {
+        while(q->head != NULL)
+        {
+            struct pcmchunk *c = q->head;
+
+            q->head = c->next;
+            free(c);
+        }
+
+        pthread_cond_destroy(&q->notEmpty);
+        pthread_cond_destroy(&q->notFull);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+    }
+}
+
+
+static ssize_t writerWrite(void *cookie, const char *buf, size_t size)
+{
+    struct pcmq *q = cookie;
+    size_t       remaining = size;
+
+    pthread_mutex_lock(&q->lock);
+
+    while(remaining > 0)
+    {
+        size_t n;
+
+        /* Start a new chunk if needed */
+        if(q->tail == NULL || q->tail->len == PCMQ_CHUNK_BYTES)
+        {
+            struct pcmchunk *c;
+
+            trimChunks(q);
+
+            while(q->readers != NULL && chunkCount(q) >= q->capacity)
+            {
+                pthread_cond_wait(&q->notFull, &q->lock);
+            }
+
+            c = x_malloc(sizeof(struct pcmchunk));
+            c->next = NULL;
+            c->idx  = q->written / PCMQ_CHUNK_BYTES;
+            c->len  = 0;
+
+            if(q->tail)
+            {
+                q->tail->next = c;
+            }
+            else
+            {
+                q->head = c;
+            }
+            q->tail = c;
+        }
+
+        n = PCMQ_CHUNK_BYTES - q->tail->len;
+        if(n > remaining)
+        {
+            n = remaining;
+        }
+
+        memcpy(&q->tail->data[q->tail->len], buf, n);
+        q->tail->len += n;
+        q->written += n;
+
+        buf += n;
+        remaining -= n;
+
+        pthread_cond_broadcast(&q->notEmpty);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return size;
+}
+
+
+static int writerClose(void *cookie)
+{
+    struct pcmq *q = cookie;
+
+    pthread_mutex_lock(&q->lock);
+
+    q->closed = true;
+    pthread_cond_broadcast(&q->notEmpty);
+
+    unrefUnlock(q);
+
+    return 0;
+}
+
+
+static ssize_t readerRead(void *cookie, char *buf, size_t size)
+{
+    struct pcmqreader *r = cookie;
+    struct pcmq       *q = r->q;
+    struct pcmchunk   *c;
+    size_t             off, n;
+
+    pthread_mutex_lock(&q->lock);
+
+    while(r->pos == q->written && !q->closed)
+    {
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    }
+
+    /* Check for the end of the stream */
+    if(r->pos == q->written)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+
+    /* Find the chunk holding the read position */
+    c = q->head;
+    while(c->idx != r->pos / PCMQ_CHUNK_BYTES)
+    {
+        c = c->next;
+    }
+
+    off = r->pos - (c->idx * PCMQ_CHUNK_BYTES);
+    n = c->len - off;
+    if(n > size)
+    {
+        n = size;
+    }
+
+    memcpy(buf, &c->data[off], n);
+    r->pos += n;
+
+    /* Release consumed chunks and wake the writer */
+    trimChunks(q);
+    pthread_cond_signal(&q->notFull);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
+
+static int readerClose(void *cookie)
+{
+    struct pcmqreader  *r = cookie;
+    struct pcmq        *q = r->q;
+    struct pcmqreader **p;
+
+    pthread_mutex_lock(&q->lock);
+
+    /* Unlink the reader so that it no longer holds back the writer */
+    for(p = &q->readers; *p != r; p = &(*p)->next)
+        ;
+    *p = r->next;
+
+    trimChunks(q);
+    pthread_cond_signal(&q->notFull);
+
+    free(r);
+
+    unrefUnlock(q);
+
+    return 0;
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Create a new PCM queue.
+ * \param[in] capacity  Count of chunks, each of 1 second of audio, which may
+ *                       be buffered before the writer blocks.
+ */
+struct pcmq *PcmQNew(uint16_t capacity)
+{
+    struct pcmq *q = x_calloc(sizeof(struct pcmq), 1);
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+
+    q->capacity = capacity;
+    q->refs = 1;
+
+    return q;
+}
+
+
+/** Open the writing end of the queue.
+ * Closing the returned stream marks the end of the data for all readers.
+ */
+FILE *PcmQOpenWriter(struct pcmq *q)
+{
+    static const cookie_io_functions_t writerFuncs =
+    {
+        .read = NULL, .write = writerWrite, .seek = NULL, .close = writerClose
+    };
+    FILE *f;
+
+    pthread_mutex_lock(&q->lock);
+    q->refs++;
+    pthread_mutex_unlock(&q->lock);
+
+    f = fopencookie(q, "wb", writerFuncs);
+    if(f == NULL)
+    {
+        fprintf(stderr, "Fatal: fopencookie() failed: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return f;
+}
+
+
+/** Open a reading end of the queue.
+ * Each reader sees the full stream, so readers must be opened before any
+ * data is written.  The writer blocks when the slowest open reader falls
+ * more than the queue capacity behind, so a reader that will not consume
+ * the stream must be closed.
+ */
+FILE *PcmQOpenReader(struct pcmq *q)
+{
+    static const cookie_io_functions_t readerFuncs =
+    {
+        .read = readerRead, .write = NULL, .seek = NULL, .close = readerClose
+    };
+    struct pcmqreader *r = x_calloc(sizeof(struct pcmqreader), 1);
+    FILE              *f;
+
+    pthread_mutex_lock(&q->lock);
+
+    assert(q->written == 0);
+
+    r->q = q;
+    r->next = q->readers;
+    q->readers = r;
+    q->refs++;
+
+    pthread_mutex_unlock(&q->lock);
+
+    f = fopencookie(r, "rb", readerFuncs);
+    if(f == NULL)
+    {
+        fprintf(stderr, "Fatal: fopencookie() failed: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return f;
+}
+
+
+/** Drop the creator's reference to the queue.
+ * The queue itself is freed once all opened streams are also closed.
+ */
+void PcmQFree(struct pcmq *q)
+{
+    pthread_mutex_lock(&q->lock);
+    unrefUnlock(q);
+}
+
+/* END OF FILE */
@@ -1,5 +1,5 @@
 /***************************************************************************
- * bbuf.h: Interface to bounded buffer ADT
+ * pcmq.h: Interface to the bounded PCM chunk queue.
  * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
  *
  * This program is free software; you can redistribute it and/or
@@ -17,14 +17,15 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  ***************************************************************************/
 
-#ifndef BBUF_H
-#define BBUF_H
+#ifndef PCMQ_H
+#define PCMQ_H
 
 /**************************************************************************
  * Includes
  **************************************************************************/
 
 #include <stdint.h>
+#include <stdio.h>
 
 /**************************************************************************
  * Macros
@@ -34,19 +35,17 @@
  * Types
  **************************************************************************/
 
-typedef struct bbuf *bbuf_t;
+typedef struct pcmq *pcmq_t;
 
 /**************************************************************************
  * Prototypes
  **************************************************************************/
 
-bbuf_t BBufNew(uint16_t capacity);
-void   BBufPut(bbuf_t bb, void *data);
-void  *BBufGet(bbuf_t bb);
-void   BBufWaitUntilEmpty(struct bbuf *bb);
+pcmq_t PcmQNew(uint16_t capacity);
+FILE  *PcmQOpenWriter(pcmq_t q);
+FILE  *PcmQOpenReader(pcmq_t q);
+void   PcmQFree(pcmq_t q);
 
 #endif
 
 /* END OF FILE */
-
-
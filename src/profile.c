@@ -0,0 +1,231 @@
+/***************************************************************************
+ * profile.c: Cache of drive capability profiles.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/file.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "profile.h"
+#include "log.h"
+
+/**************************************************************************
+ * Manifest Constants
+ **************************************************************************/
+
+/** Name of the profile database within the state directory.
+ * Each line gives the drive model, a tab, and then its capabilities,
+ * e.g. "HL-DT-ST DVDRAM GH24NSB0 LM01<TAB>caches=1 speed=24.3 offset=6".
+ */
+#define PROFILE_FILE "drives.profile"
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+/** Take an exclusive lock serialising access to the profile database.
+ * Rips of several drives may finish probing at the same time, and each
+ * rewrites the whole file.
+ */
+static int lockDb(const char *stateDir)
+{
+    char path[strlen(stateDir) + sizeof(PROFILE_FILE) + 8];
+    int  fd;
+
+    snprintf(path, sizeof(path), "%s/" PROFILE_FILE ".lock", stateDir);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd >= 0 && flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+
+static void unlockDb(int fd)
+{
+    if(fd >= 0)
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+
+/** Remove trailing whitespace from the model name.
+ * cdparanoia pads vendor, model and firmware revision with spaces.
+ */
+static void trimModel(const char *model, char *buf, size_t bufLen)
+{
+    size_t l;
+
+    snprintf(buf, bufLen, "%s", model);
+
+    l = strlen(buf);
+    while(l > 0 && (buf[l - 1] == ' ' || buf[l - 1] == '\t' || buf[l - 1] == '\n'))
+    {
+        buf[--l] = '\0';
+    }
+}
+
+
+static void parseFields(const char *s, driveprofile_t *p)
+{
+    float f;
+    int   v;
+
+    p->offsetKnown = false;
+
+    while(*s != '\0')
+    {
+        if(sscanf(s, "caches=%d", &v) == 1)
+        {
+            p->caches = v != 0;
+        }
+        else if(sscanf(s, "speed=%f", &f) == 1)
+        {
+            p->maxSpeed = f;
+        }
+        else if(sscanf(s, "offset=%" SCNd32, &p->readOffset) == 1)
+        {
+            p->offsetKnown = true;
+        }
+
+        s += strcspn(s, " \n");
+        s += strspn(s, " \n");
+    }
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Find the profile for some drive model.
+ * \retval true  If the drive was found and \a p has been filled in.
+ */
+bool ProfileLoad(const char *stateDir, const char *model, driveprofile_t *p)
+{
+    char  path[strlen(stateDir) + sizeof(PROFILE_FILE) + 2];
+    char  key[128], line[256];
+    bool  found = false;
+    FILE *f;
+    int   lock;
+
+    trimModel(model, key, sizeof(key));
+    snprintf(path, sizeof(path), "%s/" PROFILE_FILE, stateDir);
+
+    lock = lockDb(stateDir);
+
+    if((f = fopen(path, "r")) != NULL)
+    {
+        const size_t keyLen = strlen(key);
+
+        while(!found && fgets(line, sizeof(line), f) != NULL)
+        {
+            if(strncmp(line, key, keyLen) == 0 && line[keyLen] == '\t')
+            {
+                memset(p, 0, sizeof(*p));
+                parseFields(&line[keyLen + 1], p);
+                found = true;
+            }
+        }
+
+        fclose(f);
+    }
+
+    unlockDb(lock);
+
+    return found;
+}
+
+
+/** Add or replace the profile for some drive model.
+ * The database is written under a temporary name then renamed, so that
+ * readers never see a partial file.
+ */
+void ProfileSave(const char *stateDir, const char *model, const driveprofile_t *p)
+{
+    char  path[strlen(stateDir) + sizeof(PROFILE_FILE) + 2];
+    char  tmpPath[sizeof(path) + 4];
+    char  key[128], line[256];
+    FILE *in, *out;
+    int   lock;
+
+    trimModel(model, key, sizeof(key));
+    snprintf(path, sizeof(path), "%s/" PROFILE_FILE, stateDir);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+    lock = lockDb(stateDir);
+
+    if((out = fopen(tmpPath, "w")) == NULL)
+    {
+        LogWarn("Warning: Failed to write drive profiles %s: %m\n", tmpPath);
+        unlockDb(lock);
+        return;
+    }
+
+    /* Copy the profiles of other drives */
+    if((in = fopen(path, "r")) != NULL)
+    {
+        const size_t keyLen = strlen(key);
+
+        while(fgets(line, sizeof(line), in) != NULL)
+        {
+            if(strncmp(line, key, keyLen) != 0 || line[keyLen] != '\t')
+            {
+                fputs(line, out);
+            }
+        }
+
+        fclose(in);
+    }
+
+    fprintf(out, "%s\tcaches=%d speed=%.1f ", key, p->caches ? 1 : 0, p->maxSpeed);
+    if(p->offsetKnown)
+    {
+        fprintf(out, "offset=%" PRId32 "\n", p->readOffset);
+    }
+    else
+    {
+        fprintf(out, "offset=?\n");
+    }
+
+    if(fclose(out) != 0 || rename(tmpPath, path) != 0)
+    {
+        LogWarn("Warning: Failed to write drive profiles %s: %m\n", path);
+        unlink(tmpPath);
+    }
+
+    unlockDb(lock);
+}
+
+/* END OF FILE */
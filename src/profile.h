@@ -0,0 +1,62 @@
+/***************************************************************************
+ * profile.h: Interface to the cache of drive capability profiles.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**************************************************************************
+ * Macros
+ **************************************************************************/
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** Measured capabilities of some model and firmware of drive. */
+typedef struct
+{
+    /** True if re-reading a sector is served from the drive's cache. */
+    bool     caches;
+
+    /** Measured maximum read speed, as a multiple of real time. */
+    float    maxSpeed;
+
+    /** Read offset in samples, only valid if offsetKnown is set. */
+    bool     offsetKnown;
+    int32_t  readOffset;
+}
+driveprofile_t;
+
+/**************************************************************************
+ * Prototypes
+ **************************************************************************/
+
+bool ProfileLoad(const char *stateDir, const char *model, driveprofile_t *p);
+void ProfileSave(const char *stateDir, const char *model, const driveprofile_t *p);
+
+#endif
+
+/* END OF FILE */
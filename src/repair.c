@@ -0,0 +1,313 @@
+/***************************************************************************
+ * repair.c: Repair of the damaged sectors of an output.
+ * Copyright (C) 2011-2015 Michael C McTernan, mike@mcternan.uk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ ***************************************************************************/
+
+
+/**************************************************************************
+ * Includes
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <FLAC/stream_decoder.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "encodetask.h"
+#include "damage.h"
+#include "x_mem.h"
+#include "repair.h"
+#include "enc.h"
+#include "art.h"
+#include "rip.h"
+#include "log.h"
+
+/**************************************************************************
+ * Types
+ **************************************************************************/
+
+/** An output being decoded. */
+typedef struct
+{
+    /** File to which the audio is written as raw PCM. */
+    FILE     *pcm;
+    bool      ok;
+
+    /** Format of the audio. */
+    uint8_t   nChannels;
+    uint8_t   bitsPerSample;
+    uint32_t  sampleRateHz;
+    uint64_t  totalSamples;
+
+    /** Count of samples per channel decoded so far. */
+    uint64_t  decoded;
+
+    /** Tags and cover art to write to the repaired output. */
+    char     *tags[MAX_ENCODE_TASK_TAGS];
+    uint32_t  tagCount;
+    art_t     art;
+}
+decode_t;
+
+/**************************************************************************
+ * Local Functions
+ **************************************************************************/
+
+static FLAC__StreamDecoderWriteStatus decodeWrite(const FLAC__StreamDecoder *decoder __attribute__((__unused__)),
+                                                  const FLAC__Frame         *frame,
+                                                  const FLAC__int32 * const  buffer[],
+                                                  void                      *param)
+{
+    decode_t      *dc = param;
+    const uint32_t n = frame->header.blocksize, ch = frame->header.channels;
+    int16_t        samples[n * ch];
+
+    /* Write samples in host byte order, as the ripper does */
+    for(uint32_t s = 0; s < n; s++)
+    {
+        for(uint32_t c = 0; c < ch; c++)
+        {
+            samples[s * ch + c] = buffer[c][s];
+        }
+    }
+
+    if(fwrite(samples, sizeof(int16_t) * ch, n, dc->pcm) != n)
+    {
+        dc->ok = false;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    dc->decoded += n;
+
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+
+static void decodeMetadata(const FLAC__StreamDecoder  *decoder __attribute__((__unused__)),
+                           const FLAC__StreamMetadata *md,
+                           void                       *param)
+{
+    decode_t *dc = param;
+
+    switch(md->type)
+    {
+        case FLAC__METADATA_TYPE_STREAMINFO:
+            dc->nChannels = md->data.stream_info.channels;
+            dc->bitsPerSample = md->data.stream_info.bits_per_sample;
+            dc->sampleRateHz = md->data.stream_info.sample_rate;
+            dc->totalSamples = md->data.stream_info.total_samples;
+            break;
+
+        case FLAC__METADATA_TYPE_VORBIS_COMMENT:
+            for(uint32_t c = 0; c < md->data.vorbis_comment.num_comments; c++)
+            {
+                const FLAC__StreamMetadata_VorbisComment_Entry *e = &md->data.vorbis_comment.comments[c];
+
+                if(dc->tagCount < MAX_ENCODE_TASK_TAGS)
+                {
+                    dc->tags[dc->tagCount] = x_malloc(e->length + 1);
+                    memcpy(dc->tags[dc->tagCount], e->entry, e->length);
+                    dc->tags[dc->tagCount][e->length] = '\0';
+                    dc->tagCount++;
+                }
+                else
+                {
+                    LogWarn("Warning: Too many tags: dropping '%.*s'\n", (int)e->length, e->entry);
+                }
+            }
+            break;
+
+        case FLAC__METADATA_TYPE_PICTURE:
+            if(dc->art == NULL)
+            {
+                const FLAC__StreamMetadata_Picture *p = &md->data.picture;
+
+                dc->art = ArtNew(p->data, p->data_length, p->width, p->height, p->depth);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+static void decodeError(const FLAC__StreamDecoder     *decoder __attribute__((__unused__)),
+                        FLAC__StreamDecoderErrorStatus status,
+                        void                          *param)
+{
+    decode_t *dc = param;
+
+    LogErr("Error: Failed to decode output: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+    dc->ok = false;
+}
+
+
+/** Decode an output to raw PCM, keeping its tags and cover art.
+ */
+static bool decode(const char *filename, decode_t *dc)
+{
+    FLAC__StreamDecoderInitStatus  status;
+    FLAC__StreamDecoder           *fsd;
+
+    fsd = FLAC__stream_decoder_new();
+    FLAC__stream_decoder_set_metadata_respond(fsd, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    FLAC__stream_decoder_set_metadata_respond(fsd, FLAC__METADATA_TYPE_PICTURE);
+
+    status = FLAC__stream_decoder_init_file(fsd, filename, decodeWrite, decodeMetadata, decodeError, dc);
+    if(status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+    {
+        LogErr("Error: Failed to open %s: %s\n", filename, FLAC__StreamDecoderInitStatusString[status]);
+        FLAC__stream_decoder_delete(fsd);
+        return false;
+    }
+
+    dc->ok = true;
+
+    if(!FLAC__stream_decoder_process_until_end_of_stream(fsd))
+    {
+        dc->ok = false;
+    }
+
+    FLAC__stream_decoder_finish(fsd);
+    FLAC__stream_decoder_delete(fsd);
+
+    if(dc->ok && (dc->bitsPerSample != 16 || dc->decoded != dc->totalSamples))
+    {
+        LogErr("Error: %s does not hold the audio of a whole CD track\n", filename);
+        dc->ok = false;
+    }
+
+    return dc->ok && fflush(dc->pcm) == 0;
+}
+
+/**************************************************************************
+ * Global Functions
+ **************************************************************************/
+
+/** Read the damaged sectors of an output again and patch them into it.
+ * The sectors are listed in the damage map saved with the output, which is
+ * updated with any damage that remains, or removed if none does.
+ * \param[in] discId    The ID of the disc in the drive, which must match
+ *                       that from which the output was ripped.
+ * \param[in] filename  The FLAC output to repair.
+ * \retval true  If the output was repaired.
+ */
+bool RepairOutput(rip_t *r, const char *discId, const char *filename)
+{
+    const ripdamage_t *remaining;
+    ripdamage_t       *damage;
+    encodetask_t      *et;
+    encodeoutput_t    *eo;
+    uint32_t           count, remainingCount;
+    uint64_t           trackSamples;
+    uint16_t           track;
+    uint8_t            nChannels;
+    decode_t           dc;
+    char              *mapDisc;
+    bool               ok = false;
+
+    damage = DamageLoad(filename, &mapDisc, &track, &count);
+    if(damage == NULL)
+    {
+        return false;
+    }
+
+    memset(&dc, 0, sizeof(dc));
+
+    if(strcmp(mapDisc, discId) != 0)
+    {
+        LogErr("Error: %s was ripped from disc %s, not %s\n", filename, mapDisc, discId);
+    }
+    else if(track > RipGetTrackCount(r) || !RipGetTrackInfo(r, track, &nChannels, &trackSamples))
+    {
+        LogErr("Error: %s was ripped from track %" PRIu16 ", which is not an audio track\n",
+               filename, track);
+    }
+    else if((dc.pcm = tmpfile()) == NULL)
+    {
+        LogErr("Error: Failed to open temporary file: %m\n");
+    }
+    else if(decode(filename, &dc) &&
+            (dc.nChannels != nChannels || dc.totalSamples != trackSamples))
+    {
+        LogErr("Error: %s does not match the length of track %" PRIu16 "\n", filename, track);
+    }
+    else if(dc.ok && RipRepair(r, track, damage, count, dc.pcm))
+    {
+        remaining = RipGetDamage(r, &remainingCount);
+
+        rewind(dc.pcm);
+
+        /* Encode the patched audio in place of the output */
+        et = EncTaskNew(dc.pcm, dc.nChannels, dc.totalSamples);
+        et->trackNum = track;
+        et->bitsPerSample = dc.bitsPerSample;
+        et->sampleRateHz = dc.sampleRateHz;
+        dc.pcm = NULL;
+
+        eo = EncTaskAddOutput(et);
+        EncOutSetFilename(eo, filename);
+
+        for(uint32_t t = 0; t < dc.tagCount; t++)
+        {
+            EncOutAddTag(eo, "%s", dc.tags[t]);
+        }
+
+        if(dc.art)
+        {
+            EncOutSetArt(eo, dc.art);
+        }
+
+        ok = EncEncode(et);
+        EncTaskFree(et);
+
+        if(ok)
+        {
+            LogInf("Track%02" PRIu16 ": Repaired %s, %" PRIu32 " damaged range%s remaining\n",
+                   track, filename, remainingCount, remainingCount == 1 ? "" : "s");
+
+            DamageSave(filename, discId, track, remaining, remainingCount);
+        }
+    }
+
+    if(dc.pcm)
+    {
+        fclose(dc.pcm);
+    }
+
+    while(dc.tagCount > 0)
+    {
+        free(dc.tags[--dc.tagCount]);
+    }
+
+    if(dc.art)
+    {
+        ArtFree(dc.art);
+    }
+
+    free(mapDisc);
+    free(damage);
+
+    return ok;
+}
+
+/* END OF FILE */
@@ -22,7 +22,6 @@
  **************************************************************************/
 
 #include "config.h"
-#include <pthread.h>
 #ifdef HAVE_CDDA_INTERFACE_H
 #include <cdda_interface.h>
 #include <cdda_paranoia.h>
@@ -33,12 +32,17 @@
 #endif
 #include <sys/time.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include "ripright.h"
+#include "accurip.h"
+#include "journal.h"
+#include "profile.h"
 #include "x_mem.h"
 #include "rip.h"
 #include "log.h"
@@ -47,6 +51,52 @@
  * Manifest Constants
  **************************************************************************/
 
+/** Most sectors read by each request in burst mode. */
+#define BURST_SECTORS 26
+
+/** Sectors between the start of a data track and the end of the audio
+ *  session on an enhanced CD.
+ */
+#define SESSION_GAP_SECTORS 11400
+
+/** Sectors read with paranoia between each save of the rip progress. */
+#define CHECKPOINT_SECTORS (75 * 5)
+
+/** Sectors over which read problems are counted to govern the speed. */
+#define GOV_WINDOW_SECTORS 75
+
+/** Count of read problems in a window that causes the speed to drop. */
+#define GOV_BAD_EVENTS 3
+
+/** Sectors read without problems before the speed is raised again. */
+#define GOV_CLEAN_SECTORS (75 * 20)
+
+/** Seconds over which the read rate is measured by the stall watchdog. */
+#define WATCHDOG_WINDOW_SECS 5
+
+/** Read rate, as a multiple of real time, below which reading is stalled. */
+#define WATCHDOG_MIN_SPEED 0.1f
+
+/** Seconds that reading may stall before the watchdog acts. */
+#define WATCHDOG_STALL_SECS 60
+
+/** Time under which a repeated read is taken to come from the drive cache. */
+#define PROBE_CACHED_US 2000
+
+/** Sectors read in burst mode to measure the maximum read speed. */
+#define PROBE_SPEED_SECTORS 2000
+
+/** Sectors either side of the AccurateRip checksummed sector that are
+ *  read to find the read offset, allowing offsets of +/-2940 samples.
+ */
+#define PROBE_OFFSET_SECTORS 5
+
+/** Sector of each track with a separate AccurateRip checksum. */
+#define AR_FRAME450 450
+
+/** Stereo samples in each sector. */
+#define SECTOR_SAMPLES (CD_FRAMESIZE_RAW / (sizeof(int16_t) * 2))
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -62,8 +112,82 @@ struct rip
     cdrom_drive *cdrd;
 
     uint32_t eventCount[NUM_EVENTS];
+
+    /** Speed of the last rip, as a multiple of real time. */
+    float    speed;
+
+    /** The last audio track, and the range of sectors holding audio. */
+    int32_t  lastAudioTrack;
+    long     audioFirstSec, audioLastSec;
+
+    /** AccurateRip data for the disc, or NULL if not known. */
+    accurip_t *accuRip;
+    bool       accuRipLoaded;
+
+    /** Journal in which the audio and progress are saved, or NULL. */
+    journal_t *journal;
+
+    /** Paranoia session for the whole disc, and the next sector it reads. */
+    cdrom_paranoia *pn;
+    long            pnNextSec;
+
+    /** Last sector read by paranoia for the previous track. */
+    long            sharedSec;
+    uint8_t         sharedData[CD_FRAMESIZE_RAW];
+
+    /** Read speed governor state.
+     * Skips, scratches and read errors are counted, and the speed stepped
+     * down if too many occur within a window of sectors.
+     */
+    bool            speedControl;
+    uint8_t         speedStep;
+    uint32_t        badEvents, govBadMark;
+    long            govSectors, govCleanSectors;
+
+    /** First sector of the track being ripped, and its speed history. */
+    long            trackFirstSec;
+    char            speedHistory[256];
+
+    /** Measured capabilities of the drive, and the read offset in use. */
+    driveprofile_t  profile;
+    int32_t         readOffset;
+
+    /** Sectors in which problems were found while ripping the last track. */
+    ripdamage_t    *damage;
+    uint32_t        damageCount;
+
+    /** Stall watchdog state.
+     * The sectors read with paranoia are counted, and the rate checked from
+     * the paranoia callback, which is called even while a sector is retried.
+     */
+    struct timeval  discStart, wdMark;
+    uint32_t        wdSectors, wdMarkSectors, wdStallSecs;
+    int16_t         pnMode;
+    bool            wdSkip, wdAbandon;
 };
 
+
+/** Destination of the audio of a track.
+ * The sectors read are shifted by the drive read offset, so the first and
+ * last sectors are partly outside the track.
+ */
+typedef struct
+{
+    FILE     *out;
+
+    /** Bytes to discard from the first sector. */
+    uint32_t  skip;
+
+    /** Bytes of the track still to be output. */
+    uint64_t  remaining;
+
+    arcrc_t   crc;
+
+    /** Journal to which the audio is also saved, or NULL. */
+    journal_t *journal;
+}
+trackout_t;
+
 /**************************************************************************
  * Local Variables
  **************************************************************************/
@@ -91,25 +215,773 @@ paranoiaCodes[NUM_EVENTS] =
   /*{ PARANOIA_CB_CACHEERR,      "cache error" }*/
 };
 
-static rip_t            *ripTask = NULL;
+/** The rip in progress on the calling thread.
+ * Paranoia callbacks carry no context, so this finds the rip_t for the
+ * event counts, allowing several drives to be ripped at once.
+ */
+static __thread rip_t *ripTask = NULL;
 
-static pthread_mutex_t   ripLock = PTHREAD_MUTEX_INITIALIZER;
+/** Audio output in place of sectors outside the audio on the disc. */
+static const uint8_t silence[CD_FRAMESIZE_RAW];
+
+/** Read speeds used by the governor, fastest first, where -1 is the
+ *  maximum speed of the drive.
+ */
+static const int speedSteps[] = { -1, 32, 24, 16, 12, 8, 4 };
 
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
-static void ripCallback(long inpos __attribute__((__unused__)),
-                        int  function)
+/** Add a sector to the damage map of the track being ripped.
+ * Problems are usually found in runs of sectors, so the sector is merged
+ * into any range it touches.
+ */
+static void damageNote(rip_t *r, long sec)
+{
+    for(uint32_t d = 0; d < r->damageCount; d++)
+    {
+        ripdamage_t *rd = &r->damage[d];
+
+        if(sec >= rd->first - 1 && sec <= rd->last + 1)
+        {
+            if(sec < rd->first)
+            {
+                rd->first = sec;
+            }
+            else if(sec > rd->last)
+            {
+                rd->last = sec;
+            }
+
+            return;
+        }
+    }
+
+    r->damage = x_realloc(r->damage, sizeof(ripdamage_t) * (r->damageCount + 1));
+    r->damage[r->damageCount].first = sec;
+    r->damage[r->damageCount].last = sec;
+    r->damageCount++;
+}
+
+
+/** Seconds elapsed since some time. */
+static long secsSince(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return now.tv_sec - start->tv_sec - (now.tv_usec < start->tv_usec ? 1 : 0);
+}
+
+
+/** Start measuring the read rate afresh. */
+static void watchdogReset(rip_t *r)
+{
+    gettimeofday(&r->wdMark, NULL);
+    r->wdMarkSectors = r->wdSectors;
+    r->wdStallSecs = 0;
+}
+
+
+/** Check that paranoia is making progress.
+ * If the read rate stays below WATCHDOG_MIN_SPEED for WATCHDOG_STALL_SECS,
+ * skips are allowed for the rest of the track so that paranoia gives up on
+ * the sectors it cannot read.  If the time budget for the disc has already
+ * been spent, the track is abandoned instead.
+ */
+static void watchdog(rip_t *r)
+{
+    const long secs = secsSince(&r->wdMark);
+
+    if(secs < WATCHDOG_WINDOW_SECS)
+    {
+        return;
+    }
+
+    const float speed = (float)(r->wdSectors - r->wdMarkSectors) / (75.0f * secs);
+
+    gettimeofday(&r->wdMark, NULL);
+    r->wdMarkSectors = r->wdSectors;
+
+    if(speed >= WATCHDOG_MIN_SPEED)
+    {
+        r->wdStallSecs = 0;
+        return;
+    }
+
+    r->wdStallSecs += secs;
+    if(r->wdStallSecs < WATCHDOG_STALL_SECS || r->wdAbandon)
+    {
+        return;
+    }
+
+    r->wdStallSecs = 0;
+
+    if(gRipTimeBudget != 0 && secsSince(&r->discStart) >= (long)gRipTimeBudget)
+    {
+        LogErr("Watchdog: Reading stalled below %.1fx and the disc time budget of %" PRIu32
+               "s is spent: abandoning track\n", WATCHDOG_MIN_SPEED, gRipTimeBudget);
+        r->wdAbandon = true;
+
+        /* Let paranoia give up on the sector being read */
+        r->pnMode &= ~PARANOIA_MODE_NEVERSKIP;
+        paranoia_modeset(r->pn, r->pnMode);
+    }
+    else if(r->pnMode & PARANOIA_MODE_NEVERSKIP)
+    {
+        LogWarn("Watchdog: Reading stalled below %.1fx for %ds: allowing skips\n",
+                WATCHDOG_MIN_SPEED, WATCHDOG_STALL_SECS);
+
+        /* The mode is checked between retries, so applies to the sector being read */
+        r->pnMode &= ~PARANOIA_MODE_NEVERSKIP;
+        paranoia_modeset(r->pn, r->pnMode);
+        r->wdSkip = true;
+    }
+}
+
+
+/** Note each event reported by paranoia.
+ * \param[in] inpos  The position of the event, in 16-bit words from the
+ *                    start of the disc.
+ */
+static void ripCallback(long inpos, int function)
 {
     for(uint16_t t = 0; t < NUM_EVENTS; t++)
     {
         if(paranoiaCodes[t].code == function)
         {
             ripTask->eventCount[t]++;
+            break;
+        }
+    }
+
+    if(function == PARANOIA_CB_SKIP || function == PARANOIA_CB_SCRATCH ||
+       function == PARANOIA_CB_READERR)
+    {
+        ripTask->badEvents++;
+
+        if(inpos >= 0)
+        {
+            damageNote(ripTask, inpos / CD_FRAMEWORDS);
+        }
+    }
+
+    watchdog(ripTask);
+}
+
+
+/** Set the read speed to some step, noting the change in the speed history.
+ * \param[in] sec  The sector at which the speed changes.
+ */
+static void speedSet(rip_t *r, uint8_t step, long sec)
+{
+    const size_t len = strlen(r->speedHistory);
+    const long   secs = (sec - r->trackFirstSec) / 75;
+
+    if(cdda_speed_set(r->cdrd, speedSteps[step]) != 0)
+    {
+        LogWarn("Failed to set the read speed: speed control disabled\n");
+        r->speedControl = false;
+        return;
+    }
+
+    r->speedStep = step;
+
+    if(step == 0)
+    {
+        snprintf(&r->speedHistory[len], sizeof(r->speedHistory) - len,
+                 " -> max at %ld:%02ld", secs / 60, secs % 60);
+    }
+    else
+    {
+        snprintf(&r->speedHistory[len], sizeof(r->speedHistory) - len,
+                 " -> %dx at %ld:%02ld", speedSteps[step], secs / 60, secs % 60);
+    }
+}
+
+
+/** Adjust the read speed after each sector read with paranoia.
+ * The speed steps down if read problems rise, and back up after a run of
+ * sectors read without problems.
+ */
+static void speedGovern(rip_t *r, long sec)
+{
+    if(!r->speedControl || ++r->govSectors < GOV_WINDOW_SECTORS)
+    {
+        return;
+    }
+
+    const uint32_t bad = r->badEvents - r->govBadMark;
+
+    r->govBadMark = r->badEvents;
+    r->govSectors = 0;
+
+    if(bad >= GOV_BAD_EVENTS)
+    {
+        const uint8_t lastStep = sizeof(speedSteps) / sizeof(speedSteps[0]) - 1;
+        uint8_t       step = r->speedStep + 1;
+
+        r->govCleanSectors = 0;
+
+        /* Skip steps at or above the real maximum, which change nothing */
+        while(step < lastStep && r->profile.maxSpeed > 0 &&
+              speedSteps[step] >= r->profile.maxSpeed)
+        {
+            step++;
+        }
+
+        if(r->speedStep < lastStep)
+        {
+            speedSet(r, step, sec);
+        }
+    }
+    else if(bad == 0)
+    {
+        r->govCleanSectors += GOV_WINDOW_SECTORS;
+
+        if(r->govCleanSectors >= GOV_CLEAN_SECTORS && r->speedStep > 0)
+        {
+            uint8_t step = r->speedStep - 1;
+
+            if(r->profile.maxSpeed > 0 && speedSteps[step] >= r->profile.maxSpeed)
+            {
+                step = 0;
+            }
+
+            r->govCleanSectors = 0;
+            speedSet(r, step, sec);
+        }
+    }
+    else
+    {
+        r->govCleanSectors = 0;
+    }
+}
+
+
+/** Division rounding towards minus infinity. */
+static int64_t floorDiv(int64_t n, int64_t d)
+{
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+
+/** Prepare the output of a track.
+ * \param[out] readFirst  Set to the first sector to read.
+ * \param[out] readLast   Set to the last sector to read.
+ */
+static void trackOutInit(rip_t *r, const int32_t track, FILE *out, trackout_t *to,
+                         long *readFirst, long *readLast)
+{
+    const int64_t shift = (int64_t)r->readOffset * sizeof(int16_t) * 2;
+    const int64_t start = (int64_t)cdda_track_firstsector(r->cdrd, track) * CD_FRAMESIZE_RAW + shift;
+    const int64_t end = ((int64_t)cdda_track_lastsector(r->cdrd, track) + 1) * CD_FRAMESIZE_RAW + shift;
+
+    *readFirst = floorDiv(start, CD_FRAMESIZE_RAW);
+    *readLast = floorDiv(end - 1, CD_FRAMESIZE_RAW);
+
+    to->out = out;
+    to->skip = start - (int64_t)*readFirst * CD_FRAMESIZE_RAW;
+    to->remaining = end - start;
+    to->journal = NULL;
+
+    AccuRipCrcInit(&to->crc, track == 1, track == r->lastAudioTrack,
+                   to->remaining / (sizeof(int16_t) * 2));
+}
+
+
+/** Output the part of some sector that lies within the track.
+ */
+static void trackOut(trackout_t *to, const void *sector)
+{
+    const uint8_t *s = sector;
+    size_t         n = CD_FRAMESIZE_RAW - to->skip;
+
+    s += to->skip;
+    to->skip = 0;
+
+    if(n > to->remaining)
+    {
+        n = to->remaining;
+    }
+
+    AccuRipCrcUpdate(&to->crc, (const int16_t *)s, n / (sizeof(int16_t) * 2));
+    fwrite(s, n, 1, to->out);
+
+    if(to->journal)
+    {
+        JournalTrackWrite(to->journal, s, n);
+    }
+
+    to->remaining -= n;
+}
+
+
+/** Output audio saved by an earlier attempt at the track.
+ * \param[in] bytes  Count of bytes of saved audio to output.
+ */
+static void trackReplay(trackout_t *to, FILE *replay, uint64_t bytes)
+{
+    uint8_t buf[64 * 1024];
+
+    while(bytes > 0)
+    {
+        size_t n = bytes < sizeof(buf) ? bytes : sizeof(buf);
+
+        if(fread(buf, n, 1, replay) != 1)
+        {
+            LogErr("Error: Failed to read saved audio: %m\n");
             return;
         }
+
+        AccuRipCrcUpdate(&to->crc, (const int16_t *)buf, n / (sizeof(int16_t) * 2));
+        fwrite(buf, n, 1, to->out);
+
+        to->remaining -= n;
+        bytes -= n;
+    }
+
+    to->skip = 0;
+}
+
+
+/** Get the AccurateRip data for the disc, loading it on first use.
+ * \retval true  If the disc is known to AccurateRip.
+ */
+static bool accuRipLoad(rip_t *r)
+{
+    if(!r->accuRipLoaded)
+    {
+        const int32_t tracks = cdda_tracks(r->cdrd);
+        uint32_t      lba[tracks];
+        uint32_t      leadOut = cdda_disc_lastsector(r->cdrd) + 1;
+        uint32_t      cddbId;
+
+        r->accuRipLoaded = true;
+
+        for(int32_t t = 0; t < tracks; t++)
+        {
+            lba[t] = cdda_track_firstsector(r->cdrd, t + 1);
+        }
+
+        cddbId = AccuRipCddbId(tracks, lba, leadOut);
+
+        /* Only the data track of an enhanced CD can be handled */
+        if(r->lastAudioTrack < tracks - 1 || r->lastAudioTrack < 1)
+        {
+            LogInf("Not an audio or enhanced CD: AccurateRip not supported\n");
+            return false;
+        }
+        else if(r->lastAudioTrack == tracks - 1)
+        {
+            leadOut = lba[tracks - 1] - SESSION_GAP_SECTORS;
+        }
+
+        for(int32_t t = 0; t < r->lastAudioTrack; t++)
+        {
+            if(!cdda_track_audiop(r->cdrd, t + 1))
+            {
+                LogInf("Not an audio or enhanced CD: AccurateRip not supported\n");
+                return false;
+            }
+        }
+
+        r->accuRip = AccuRipLoad(r->lastAudioTrack, lba, leadOut, cddbId, gAccurateRipDir);
+    }
+
+    return r->accuRip != NULL;
+}
+
+
+/** Microseconds elapsed since some time. */
+static long usSince(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+}
+
+
+/** Find if the drive caches audio sectors.
+ * A sector is read, and then read again.  A drive that caches returns the
+ * second read at once, while one that doesn't must wait for the disc to
+ * turn.  This is tried at three places on the disc and the majority taken.
+ */
+static bool probeCache(rip_t *r)
+{
+    const long span = r->audioLastSec - r->audioFirstSec;
+    uint8_t    buf[CD_FRAMESIZE_RAW];
+    uint8_t    cached = 0, tried = 0;
+
+    for(uint8_t t = 1; t <= 3; t++)
+    {
+        const long     sec = r->audioFirstSec + (span * t) / 4;
+        struct timeval start;
+
+        if(cdda_read(r->cdrd, buf, sec, 1) != 1)
+        {
+            continue;
+        }
+
+        gettimeofday(&start, NULL);
+
+        if(cdda_read(r->cdrd, buf, sec, 1) == 1)
+        {
+            tried++;
+            if(usSince(&start) < PROBE_CACHED_US)
+            {
+                cached++;
+            }
+        }
+    }
+
+    /* Assume the worst if it could not be measured */
+    return tried == 0 || cached * 2 > tried;
+}
+
+
+/** Measure the maximum read speed of the drive.
+ * Sectors near the end of the audio, where a CAV drive reads fastest, are
+ * read in burst mode after a first read to spin the disc up and seek.
+ * \returns The speed as a multiple of real time, or 0 if not measured.
+ */
+static float probeSpeed(rip_t *r)
+{
+    uint8_t       *buf = x_malloc(BURST_SECTORS * CD_FRAMESIZE_RAW);
+    struct timeval start;
+    long           sec, read = 0, us = 0;
+
+    sec = r->audioLastSec - PROBE_SPEED_SECTORS;
+    if(sec < r->audioFirstSec)
+    {
+        sec = r->audioFirstSec;
+    }
+
+    if(cdda_read(r->cdrd, buf, sec, BURST_SECTORS) == BURST_SECTORS)
+    {
+        sec += BURST_SECTORS;
+
+        gettimeofday(&start, NULL);
+
+        while(sec + BURST_SECTORS - 1 <= r->audioLastSec &&
+              cdda_read(r->cdrd, buf, sec, BURST_SECTORS) == BURST_SECTORS)
+        {
+            sec += BURST_SECTORS;
+            read += BURST_SECTORS;
+        }
+
+        us = usSince(&start);
+    }
+
+    free(buf);
+
+    /* Too few sectors give no useful measure */
+    if(read < PROBE_SPEED_SECTORS / 4 || us <= 0)
+    {
+        return 0;
+    }
+
+    return ((float)read / 75.0f) / ((float)us / 1000000.0f);
+}
+
+
+/** Find the read offset of the drive using AccurateRip.
+ * The database holds a checksum of one sector of each track, which is
+ * compared against the sectors read with each possible offset.  The offset
+ * is only accepted if a single offset matches.
+ * \param[out] offset  Set to the read offset in samples, if found.
+ * \retval true  If the offset was found.
+ */
+static bool probeOffset(rip_t *r, int32_t *offset)
+{
+    const long     secs = PROBE_OFFSET_SECTORS * 2 + 1;
+    const int32_t  range = PROBE_OFFSET_SECTORS * SECTOR_SAMPLES;
+    int16_t       *buf = x_malloc(secs * CD_FRAMESIZE_RAW);
+    bool           found = false;
+
+    for(int32_t t = 1; !found && t <= r->lastAudioTrack && t <= 3; t++)
+    {
+        const long first = cdda_track_firstsector(r->cdrd, t) + AR_FRAME450 - PROBE_OFFSET_SECTORS;
+        uint32_t   matches = 0, confidence = 0;
+
+        if(first + secs - 1 > cdda_track_lastsector(r->cdrd, t) ||
+           cdda_read(r->cdrd, buf, first, secs) != secs)
+        {
+            continue;
+        }
+
+        for(int32_t o = -range; o <= range; o++)
+        {
+            const int16_t *pcm = &buf[(range + o) * 2];
+            const uint32_t c = AccuRipFrame450Confidence(r->accuRip, t, pcm);
+
+            if(c > 0)
+            {
+                matches++;
+                confidence = c;
+                *offset = o;
+            }
+        }
+
+        if(matches == 1)
+        {
+            LogInf("Read offset %+" PRId32 " found by AccurateRip (track %" PRId32 ", confidence %" PRIu32 ")\n",
+                   *offset, t, confidence);
+            found = true;
+        }
     }
+
+    free(buf);
+
+    return found;
+}
+
+
+/** Read the sectors of a track in burst mode, without any verification.
+ * \retval true   If all sectors were read.
+ * \retval false  If the drive reported an error.
+ */
+static bool ripBurst(rip_t *r, long readFirst, long readLast, trackout_t *to)
+{
+    uint8_t *buf = x_malloc(BURST_SECTORS * CD_FRAMESIZE_RAW);
+    bool     ok = true;
+
+    for(long sec = readFirst; ok && sec <= readLast; )
+    {
+        if(sec < r->audioFirstSec || sec > r->audioLastSec)
+        {
+            trackOut(to, silence);
+            sec++;
+        }
+        else
+        {
+            long n = BURST_SECTORS, got;
+
+            if(n > readLast - sec + 1)
+            {
+                n = readLast - sec + 1;
+            }
+
+            if(n > r->audioLastSec - sec + 1)
+            {
+                n = r->audioLastSec - sec + 1;
+            }
+
+            got = cdda_read(r->cdrd, buf, sec, n);
+            if(got <= 0)
+            {
+                LogWarn("Burst read failed at sector %ld\n", sec);
+                ok = false;
+            }
+
+            for(long s = 0; s < got; s++)
+            {
+                trackOut(to, &buf[s * CD_FRAMESIZE_RAW]);
+            }
+
+            sec += got;
+        }
+    }
+
+    free(buf);
+
+    return ok;
+}
+
+
+/** Read the sectors of a track with full paranoia verification.
+ * A single paranoia session is used for the whole disc, so that reading
+ * continues across track boundaries without a seek or the loss of the
+ * paranoia cache.  A seek is only made if the sectors do not follow on from
+ * those last read.
+ */
+static bool ripParanoia(rip_t *r, long readFirst, long readLast, trackout_t *to)
+{
+    const int       maxRetries = 20;    /* Must be a multiple of 5 */
+    bool            ok = true;
+    long            sec = readFirst;
+
+    if(r->pn == NULL)
+    {
+        r->pn = paranoia_init(r->cdrd);
+        if(!r->pn)
+        {
+            return false;
+        }
+
+        r->pnNextSec = -1;
+
+#ifdef HAVE_PARANOIA_CACHEMODEL_SIZE
+        /* No reads are needed to defeat the cache of a drive without one */
+        if(!r->profile.caches)
+        {
+            paranoia_cachemodel_size(r->pn, 0);
+        }
+#endif
+    }
+
+    /* Skips may also have been allowed for the track by the watchdog */
+    r->pnMode = PARANOIA_MODE_FULL;
+    if(gRipAllowSkip || r->wdSkip)
+    {
+        r->pnMode &= ~PARANOIA_MODE_NEVERSKIP;
+    }
+    paranoia_modeset(r->pn, r->pnMode);
+
+    watchdogReset(r);
+
+    /* With a read offset, the last sector of the previous track is shared */
+    if(sec == r->sharedSec)
+    {
+        trackOut(to, r->sharedData);
+        sec++;
+    }
+
+    /* Read each sector */
+    for(; ok && sec <= readLast; sec++)
+    {
+        if(r->wdAbandon)
+        {
+            LogErr("Abandoned reading at sector %ld\n", sec);
+            ok = false;
+        }
+        else if(sec < r->audioFirstSec || sec > r->audioLastSec)
+        {
+            trackOut(to, silence);
+        }
+        else if(sec != r->pnNextSec && paranoia_seek(r->pn, sec, SEEK_SET) == -1)
+        {
+            LogErr("Failed to seek to sector %ld: skipping track", sec);
+            r->pnNextSec = -1;
+            ok = false;
+        }
+        else
+        {
+            int16_t *data = paranoia_read_limited(r->pn, ripCallback, maxRetries);
+
+            if(data == NULL)
+            {
+                LogErr("Failed to read sector %ld\n", sec);
+                r->pnNextSec = -1;
+                ok = false;
+            }
+            else
+            {
+                r->pnNextSec = sec + 1;
+                r->wdSectors++;
+
+                if(sec == readLast)
+                {
+                    memcpy(r->sharedData, data, CD_FRAMESIZE_RAW);
+                    r->sharedSec = sec;
+                }
+
+                trackOut(to, data);
+                speedGovern(r, sec);
+            }
+        }
+
+        if(to->journal && (sec - readFirst) % CHECKPOINT_SECTORS == CHECKPOINT_SECTORS - 1)
+        {
+            JournalTrackCheckpoint(to->journal);
+        }
+    }
+
+    return ok;
+}
+
+
+/** Find the capabilities and read offset of the drive.
+ * The drive is measured the first time that some model and firmware is
+ * seen, and the profile saved so that later rips need not measure it again.
+ */
+static void probeDrive(rip_t *r)
+{
+    const char *model = r->cdrd->drive_model;
+    const bool  known = ProfileLoad(gStateDir, model, &r->profile);
+    bool        changed = false;
+
+    if(!known && r->lastAudioTrack < 1)
+    {
+        /* Nothing to measure with, so assume the worst */
+        r->profile.caches = true;
+    }
+    else if(!known)
+    {
+        LogInf("Measuring new drive %s\n", model);
+
+        r->profile.caches = probeCache(r);
+        r->profile.maxSpeed = probeSpeed(r);
+        changed = true;
+    }
+
+    /* An offset given by the user overrides any found */
+    if(gRipReadOffset != RIP_OFFSET_UNKNOWN)
+    {
+        r->readOffset = gRipReadOffset;
+    }
+    else if(r->profile.offsetKnown)
+    {
+        r->readOffset = r->profile.readOffset;
+    }
+    else if(gRipBurst && accuRipLoad(r) && probeOffset(r, &r->profile.readOffset))
+    {
+        r->profile.offsetKnown = true;
+        r->readOffset = r->profile.readOffset;
+        changed = true;
+    }
+    else
+    {
+        LogWarn("Read offset of drive %s is not known: using 0\n", model);
+    }
+
+    if(changed)
+    {
+        ProfileSave(gStateDir, model, &r->profile);
+    }
+
+    LogInf("Drive %s: %s, max speed %.1fx, read offset %+" PRId32 "\n", model,
+           r->profile.caches ? "caches audio" : "no audio cache",
+           r->profile.maxSpeed, r->readOffset);
+}
+
+
+/** Copy the audio read in burst mode to the output, and any journal.
+ * \param[out] written  Set if any audio was written before a failure.
+ */
+static bool copyOut(FILE *from, FILE *to, journal_t *journal, bool *written)
+{
+    uint8_t buf[64 * 1024];
+    size_t  n;
+
+    *written = false;
+
+    if(fseek(from, 0, SEEK_SET) != 0)
+    {
+        return false;
+    }
+
+    while((n = fread(buf, 1, sizeof(buf), from)) > 0)
+    {
+        /* A failed write may still have passed part of the data on */
+        *written = true;
+
+        if(fwrite(buf, n, 1, to) != 1)
+        {
+            return false;
+        }
+
+        if(journal)
+        {
+            JournalTrackWrite(journal, buf, n);
+        }
+    }
+
+    return !ferror(from);
 }
 
 /**************************************************************************
@@ -128,6 +1000,34 @@ rip_t *RipNew(const char *dev)
         return NULL;
     }
 
+    cdda_verbose_set(r->cdrd, CDDA_MESSAGE_LOGIT, CDDA_MESSAGE_LOGIT);
+
+    /* Find the sectors that can be read as audio */
+    for(int32_t t = cdda_tracks(r->cdrd); t > 0; t--)
+    {
+        if(cdda_track_audiop(r->cdrd, t))
+        {
+            r->lastAudioTrack = t;
+            r->audioLastSec = cdda_track_lastsector(r->cdrd, t);
+            break;
+        }
+    }
+
+    r->audioFirstSec = cdda_disc_firstsector(r->cdrd);
+    r->sharedSec = LONG_MIN;
+
+    /* The time budget runs from when the disc is first opened */
+    gettimeofday(&r->discStart, NULL);
+
+    /* Start at full speed if the drive allows the speed to be set */
+    r->speedControl = (cdda_speed_set(r->cdrd, speedSteps[0]) == 0);
+    if(!r->speedControl)
+    {
+        LogInf("Drive does not support setting the read speed\n");
+    }
+
+    probeDrive(r);
+
     return r;
 }
 
@@ -136,100 +1036,347 @@ uint16_t RipGetTrackCount(rip_t *r)
     return cdda_tracks(r->cdrd);
 }
 
-bool RipTrack(rip_t *r, const int32_t track, FILE *outfile, uint8_t *nChannels, uint64_t *samplesPerChannel)
+/** Get the format of some track.
+ * \param[in]  track              The track number, counting from 1.
+ * \param[out] nChannels          Pointer to fill with the count of channels.
+ * \param[out] samplesPerChannel  Pointer to fill with the count of samples.
+ * \retval true   If the track is an audio track and the outputs are set.
+ * \retval false  If the track is not an audio track.
+ */
+bool RipGetTrackInfo(rip_t *r, const int32_t track, uint8_t *nChannels, uint64_t *samplesPerChannel)
 {
-    const int       maxRetries = 20;    /* Must be a multiple of 5 */
-    struct timeval  timeStart, timeEnd;
-    int16_t         mode;
-    cdrom_paranoia *pn;
+    assert(track > 0 && track < cdda_tracks(r->cdrd) + 1);
 
-    pn = paranoia_init(r->cdrd);
-    if(!pn)
+    if(!cdda_track_audiop(r->cdrd, track))
     {
         return false;
     }
 
-    mode = PARANOIA_MODE_FULL;
-    if(gRipAllowSkip)
-    {
-        mode &= ~PARANOIA_MODE_NEVERSKIP;
-    }
-    paranoia_modeset(pn, mode);
+    const long totalSec = (cdda_track_lastsector(r->cdrd, track) -
+                           cdda_track_firstsector(r->cdrd, track)) + 1;
 
-    cdda_verbose_set(r->cdrd, CDDA_MESSAGE_LOGIT, CDDA_MESSAGE_LOGIT);
+    *nChannels = cdda_track_channels(r->cdrd, track);
+    *samplesPerChannel = (totalSec * CD_FRAMESIZE_RAW) / (sizeof(uint16_t) * *nChannels);
+
+    return true;
+}
+
+
+/** Rip some track.
+ * In burst mode the track is first read without verification and checked
+ * against AccurateRip, only being read again with full paranoia if it does
+ * not match.  If a journal is set, audio saved by an earlier attempt at the
+ * track is used and reading resumes after it.
+ * \param[in] track    The track number, counting from 1.
+ * \param[in] outfile  File to which the audio is written.
+ */
+bool RipTrack(rip_t *r, const int32_t track, FILE *outfile)
+{
+    struct timeval  timeStart, timeEnd;
+    trackout_t      to;
+    long            readFirst, readLast, readSecs = 0;
+    bool            done = false, resumed = false, verified = false, failed = false;
 
     assert(track > 0 && track < cdda_tracks(r->cdrd) + 1);
 
     /* Check it is an audio track */
-    if(cdda_track_audiop(r->cdrd, track))
+    if(!cdda_track_audiop(r->cdrd, track))
+    {
+        return true;
+    }
+
+    const long firstSec = cdda_track_firstsector(r->cdrd, track);
+    const long lastSec = cdda_track_lastsector(r->cdrd, track);
+    const long totalSec = (lastSec - firstSec) + 1;
+    const long trackMs = (totalSec * 1000) / 75;
+
+    LogInf("Track%02" PRIu32 ": Ripping %lu sectors, %5.1f seconds of audio\n", track, totalSec, (float)trackMs / 1000.0f);
+
+    /* Report the events, damage and speeds of each track separately */
+    memset(r->eventCount, 0, sizeof(r->eventCount));
+    r->damageCount = 0;
+    r->wdSkip = false;
+    r->wdAbandon = false;
+
+    r->trackFirstSec = firstSec;
+    if(r->speedStep == 0)
+    {
+        strcpy(r->speedHistory, "max");
+    }
+    else
+    {
+        snprintf(r->speedHistory, sizeof(r->speedHistory), "%dx", speedSteps[r->speedStep]);
+    }
+
+    ripTask = r;
+
+    gettimeofday(&timeStart, NULL);
+
+    if(r->journal)
     {
-        const long firstSec = cdda_track_firstsector(r->cdrd, track);
-        const long lastSec = cdda_track_lastsector(r->cdrd, track);
-        const long totalSec = (lastSec - firstSec) + 1;
-        const long trackMs = (totalSec * 1000) / 75;
+        uint64_t resumeBytes;
+        FILE    *replay;
+
+        replay = JournalTrackStart(r->journal, track, &resumeBytes, &done);
+        if(replay)
+        {
+            trackOutInit(r, track, outfile, &to, &readFirst, &readLast);
 
-        LogInf("Track%02" PRIu32 ": Ripping %lu sectors, %5.1f seconds of audio\n", track, totalSec, (float)trackMs / 1000.0f);
+            /* Saved audio always ends on a sector boundary */
+            readFirst += (to.skip + resumeBytes) / CD_FRAMESIZE_RAW;
 
-        /* Get the number of channels and compute the sample count */
-        *nChannels = cdda_track_channels(r->cdrd, track);
-        *samplesPerChannel = (totalSec * CD_FRAMESIZE_RAW) / (sizeof(uint16_t) * *nChannels);
+            trackReplay(&to, replay, resumeBytes);
+            fclose(replay);
 
-        /* Seek to the first sector */
-        if(paranoia_seek(pn, firstSec, SEEK_SET) == -1)
+            LogInf("Track%02" PRIu32 ": Resuming from saved audio, %ld sectors to read\n",
+                   track, done ? 0 : readLast - readFirst + 1);
+
+            resumed = true;
+        }
+    }
+
+    if(!resumed && gRipBurst && accuRipLoad(r))
+    {
+        FILE *burst = tmpfile();
+
+        if(burst == NULL)
         {
-            LogErr("Failed to seek to sector %ld: skipping track", firstSec);
+            LogErr("Error: Failed to open temporary file: %m\n");
         }
         else
         {
-            pthread_mutex_lock(&ripLock);
+            trackOutInit(r, track, burst, &to, &readFirst, &readLast);
+
+            if(ripBurst(r, readFirst, readLast, &to))
+            {
+                const uint32_t confidence = AccuRipConfidence(r->accuRip, track, &to.crc);
 
-            ripTask = r;
+                if(confidence > 0)
+                {
+                    LogInf("Track%02" PRIu32 ": Burst read verified by AccurateRip (confidence %" PRIu32 ")\n",
+                           track, confidence);
 
-            gettimeofday(&timeStart, NULL);
+                    bool written;
 
-            /* Read each sector */
-            for(long sec = firstSec; sec <= lastSec; sec++)
-            {
-                int16_t *data = paranoia_read_limited(pn, ripCallback, maxRetries);
-                fwrite(data, CD_FRAMESIZE_RAW, 1, outfile);
+                    if(copyOut(burst, outfile, r->journal, &written))
+                    {
+                        done = true;
+                        verified = true;
+                    }
+                    else if(written)
+                    {
+                        /* The audio is partly output, so cannot be read again */
+                        LogErr("Track%02" PRIu32 ": Failed to output the burst read audio: %m\n", track);
+                        failed = true;
+                    }
+                    else
+                    {
+                        LogWarn("Track%02" PRIu32 ": Failed to output the burst read audio: "
+                                "re-reading with paranoia\n", track);
+                    }
+                }
+                else
+                {
+                    LogWarn("Track%02" PRIu32 ": Burst read not verified by AccurateRip "
+                            "(v1=%08" PRIx32 " v2=%08" PRIx32 "): re-reading with paranoia\n",
+                            track, to.crc.v1, to.crc.v2);
+                }
             }
 
-            gettimeofday(&timeEnd, NULL);
+            readSecs += readLast - readFirst + 1;
+
+            fclose(burst);
+        }
+    }
+
+    if(!done && !verified && !failed)
+    {
+        if(!resumed)
+        {
+            trackOutInit(r, track, outfile, &to, &readFirst, &readLast);
+        }
+
+        to.journal = r->journal;
+
+        done = ripParanoia(r, readFirst, readLast, &to);
+
+        readSecs += readLast - readFirst + 1;
+    }
 
-            ripTask = NULL;
+    if(done && r->accuRip)
+    {
+        LogInf("Track%02" PRIu32 ": AccurateRip confidence %" PRIu32 "\n",
+               track, AccuRipConfidence(r->accuRip, track, &to.crc));
+    }
 
-            pthread_mutex_unlock(&ripLock);
+    if(done && r->journal)
+    {
+        JournalTrackRipped(r->journal);
+    }
 
-            long ripMs;
+    gettimeofday(&timeEnd, NULL);
 
-            /* Compute how long the rip took */
-            ripMs = (timeEnd.tv_sec - timeStart.tv_sec) * 1000;
-            ripMs += timeEnd.tv_usec / 1000;
-            ripMs -= timeStart.tv_usec / 1000;
+    ripTask = NULL;
 
-            /* Display rip speed and stats */
-            LogInf("Track%02" PRIu32 ": Ripped at %3.1fx\n", track, (float)trackMs / (float)ripMs);
+    long ripMs;
 
-            for(uint8_t t = 0; t < NUM_EVENTS; t++)
-            {
-                if(r->eventCount[t] != 0)
-                {
-                    LogInf(" %-24s: %6" PRIu32 "\n",
-                           paranoiaCodes[t].description, r->eventCount[t]);
-                }
-            }
+    /* Compute how long the rip took */
+    ripMs = (timeEnd.tv_sec - timeStart.tv_sec) * 1000;
+    ripMs += timeEnd.tv_usec / 1000;
+    ripMs -= timeStart.tv_usec / 1000;
+
+    if(ripMs < 1)
+    {
+        ripMs = 1;
+    }
+
+    /* The speed is only known if sectors were read */
+    r->speed = (float)(readSecs * 1000 / 75) / (float)ripMs;
+
+    /* Display rip speed and stats */
+    if(readSecs > 0)
+    {
+        LogInf("Track%02" PRIu32 ": Ripped at %3.1fx\n", track, r->speed);
+    }
+
+    if(r->speedControl)
+    {
+        LogInf("Track%02" PRIu32 ": Read speed %s\n", track, r->speedHistory);
+    }
+
+    for(uint8_t t = 0; t < NUM_EVENTS; t++)
+    {
+        if(r->eventCount[t] != 0)
+        {
+            LogInf(" %-24s: %6" PRIu32 "\n",
+                   paranoiaCodes[t].description, r->eventCount[t]);
         }
     }
 
-    paranoia_free(pn);
+    for(uint32_t d = 0; d < r->damageCount; d++)
+    {
+        LogInf("Track%02" PRIu32 ": Damaged sectors %ld-%ld\n",
+               track, r->damage[d].first, r->damage[d].last);
+    }
 
-    return true;
+    if(r->wdAbandon)
+    {
+        LogErr("Track%02" PRIu32 ": Abandoned by the watchdog: reading stalled after the "
+               "disc time budget was spent\n", track);
+    }
+    else if(r->wdSkip)
+    {
+        LogWarn("Track%02" PRIu32 ": Skips allowed by the watchdog: reading stalled\n", track);
+    }
+
+    return done;
+}
+
+
+/** Set the journal in which the audio and progress of each track are saved.
+ */
+void RipSetJournal(rip_t *r, journal_t *j)
+{
+    r->journal = j;
+}
+
+
+/** Get the speed at which the last track was ripped.
+ * \returns The speed as a multiple of real time, or 0 if unknown.
+ */
+float RipGetSpeed(rip_t *r)
+{
+    return r->speed;
+}
+
+
+/** Get the damage map of the last track ripped or repaired.
+ * \param[out] count  Set to the count of damaged ranges.
+ * \returns The damaged ranges of sectors, valid until the next rip.
+ */
+const ripdamage_t *RipGetDamage(rip_t *r, uint32_t *count)
+{
+    *count = r->damageCount;
+
+    return r->damage;
+}
+
+
+/** Read some damaged ranges of a track again, patching the audio.
+ * Each range is read with full paranoia and the audio it holds written
+ * over the same part of the track in \a pcm.  Any damage found while
+ * reading is then given by RipGetDamage().
+ * \param[in] track  The track number, counting from 1.
+ * \param[in] pcm    The audio of the whole track, which must be seekable.
+ * \retval true   If all ranges were read.
+ */
+bool RipRepair(rip_t *r, const int32_t track, const ripdamage_t *damage, uint32_t count, FILE *pcm)
+{
+    bool ok = true;
+
+    assert(track > 0 && track <= r->lastAudioTrack);
+
+    memset(r->eventCount, 0, sizeof(r->eventCount));
+    r->damageCount = 0;
+    r->wdSkip = false;
+    r->wdAbandon = false;
+    r->trackFirstSec = cdda_track_firstsector(r->cdrd, track);
+    r->speedHistory[0] = '\0';
+
+    ripTask = r;
+
+    for(uint32_t d = 0; ok && d < count; d++)
+    {
+        trackout_t to;
+        long       readFirst, readLast, first, last;
+        int64_t    pos = 0;
+
+        trackOutInit(r, track, pcm, &to, &readFirst, &readLast);
+
+        first = damage[d].first > readFirst ? damage[d].first : readFirst;
+        last = damage[d].last < readLast ? damage[d].last : readLast;
+        if(first > last)
+        {
+            continue;
+        }
+
+        /* Start output at the first byte of the track in the range */
+        if(first > readFirst)
+        {
+            pos = (int64_t)(first - readFirst) * CD_FRAMESIZE_RAW - to.skip;
+            to.skip = 0;
+            to.remaining -= pos;
+        }
+
+        LogInf("Track%02" PRIu32 ": Re-reading sectors %ld-%ld\n", track, first, last);
+
+        if(fseeko(pcm, pos, SEEK_SET) != 0)
+        {
+            LogErr("Error: Failed to seek in track audio: %m\n");
+            ok = false;
+        }
+        else
+        {
+            ok = ripParanoia(r, first, last, &to);
+        }
+    }
+
+    ripTask = NULL;
+
+    return ok && fflush(pcm) == 0;
 }
 
 
 void RipFree(rip_t *r)
 {
+    if(r->pn)
+    {
+        paranoia_free(r->pn);
+    }
+
+    AccuRipFree(r->accuRip);
     cdda_close(r->cdrd);
+    free(r->damage);
     free(r);
 }
 
@@ -26,6 +26,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include "journal.h"
 
 /**************************************************************************
  * Macros
@@ -37,13 +39,26 @@
 
 typedef struct rip rip_t;
 
+
+/** A range of sectors, inclusive, in which paranoia reported problems. */
+typedef struct
+{
+    long first, last;
+}
+ripdamage_t;
+
 /**************************************************************************
  * Prototypes
  **************************************************************************/
 
 rip_t   *RipNew(const char *dev);
 uint16_t RipGetTrackCount(rip_t *r);
-bool     RipTrack(rip_t *r, const int32_t track, FILE *outfile, uint8_t *nChannels, uint64_t *samplesPerChannel);
+bool     RipGetTrackInfo(rip_t *r, const int32_t track, uint8_t *nChannels, uint64_t *samplesPerChannel);
+bool     RipTrack(rip_t *r, const int32_t track, FILE *outfile);
+float    RipGetSpeed(rip_t *r);
+const ripdamage_t *RipGetDamage(rip_t *r, uint32_t *count);
+bool     RipRepair(rip_t *r, const int32_t track, const ripdamage_t *damage, uint32_t count, FILE *pcm);
+void     RipSetJournal(rip_t *r, journal_t *j);
 void     RipFree(rip_t *r);
 
 #endif
@@ -21,14 +21,19 @@
  * Includes
  **************************************************************************/
 
+#define _GNU_SOURCE
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 #include <discid/discid.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -40,10 +45,18 @@
 #include "encodetask.h"
 #include "ripright.h"
 #include "mblookup.h"
+#include "mbcache.h"
+#include "curlfetch.h"
 #include "format.h"
 #include "eject.h"
+#include "encipc.h"
 #include "x_mem.h"
-#include "bbuf.h"
+#include "pcmq.h"
+#include "journal.h"
+#include "damage.h"
+#include "repair.h"
+#include "enclevel.h"
+#include "encq.h"
 #include "enc.h"
 #include "art.h"
 #include "rip.h"
@@ -59,10 +72,116 @@
 
 #define M_ArraySize(a) (sizeof(a) / sizeof(a[1]))
 
+/** Seconds of audio that may be buffered between the ripper and encoders. */
+#define PCM_QUEUE_SECONDS 64
+
 /**************************************************************************
  * Types
  **************************************************************************/
 
+/** Result of capturing a track, kept until its outputs are known. */
+typedef struct
+{
+    /** Damage found while ripping. */
+    ripdamage_t  *range;
+    uint32_t      count;
+
+    /** Set if the whole track was ripped. */
+    bool          ripped;
+}
+capture_t;
+
+
+/** State for the rip of a single disc. */
+typedef struct
+{
+    DiscId       *disc;
+    const char   *discId;
+
+    /** Thread performing the MusicBrainz lookup and art retrieval. */
+    pthread_t     lookupTid;
+
+    /** Set once the lookup thread has been joined. */
+    bool          lookupDone;
+
+    /** Results of the lookup, only valid once lookupDone is set. */
+    bool          found;
+    mbresult_t    mbresult;
+    art_t        *coverArt;
+    bool          noArt;
+
+    /** The device from which the disc is ripped. */
+    const char   *device;
+
+    /** Socket to the encoders in the parent process. */
+    int           encSock;
+
+    /** Journal of the rip progress, allowing a crashed rip to resume. */
+    journal_t    *journal;
+
+    /** Result of each captured track, indexed by track. */
+    capture_t    *capture;
+
+    /** Thread passing the audio of the last streamed track to the encoders. */
+    pthread_t     pumpTid;
+    bool          pumpActive;
+
+    // track logging
+    bool          logTracks;
+    char          trackLogName[42]; // sufficient, since musicbrainz disc-ids are 28 chars long
+    FILE         *trackLogfp;
+}
+discrip_t;
+
+
+/** Audio being passed from a PCM queue to an encoder pipe. */
+typedef struct
+{
+    FILE         *in;
+    int           fd;
+
+    /** Journal to update once the track is passed, and the track number. */
+    journal_t    *journal;
+    uint16_t      track;
+
+    /** Set before the end of the audio if the whole track was ripped. */
+    bool          ripped;
+}
+pump_t;
+
+
+/** State for a CD drive, held in the parent process. */
+typedef struct
+{
+    const char     *device;
+    uint16_t        index;
+
+    /** Queue of tasks for the encoders, shared by all drives. */
+    encq_t          encQueue;
+
+    /** Socket to the process ripping from the drive, or -1. */
+    int             sock;
+}
+drive_t;
+
+
+/** State for the encoding of a disc, held in the parent process. */
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    /** References held while receiving tasks, and by each task not yet
+     *  encoded.
+     */
+    uint32_t        refs;
+
+    /** Track log to pass to the exec-after script, or NULL.
+     * This is only set if the rip process completed the disc.
+     */
+    char           *trackLogName;
+}
+discenc_t;
+
 /**************************************************************************
  * Local Variables
  **************************************************************************/
@@ -107,27 +226,79 @@ static char *gFilenameFormat = "%Y/%B - %D/%N-%T.flac";
 /** If set, allow skipping of bad sectors when ripping. */
 bool gRipAllowSkip = false;
 
+/** Seconds that reading a disc may take before a track on which reading
+ *  stalls is abandoned, or 0 for no limit.
+ */
+uint32_t gRipTimeBudget = 0;
+
+/** If set, read tracks in burst mode, using paranoia only if AccurateRip
+ *  does not verify the audio.
+ */
+bool gRipBurst = false;
+
+/** Directory in which AccurateRip database dumps are cached, or NULL. */
+const char *gAccurateRipDir = NULL;
+
+/** Read offset of the drive in samples, or RIP_OFFSET_UNKNOWN to use the
+ *  offset found for the drive.
+ */
+int32_t gRipReadOffset = RIP_OFFSET_UNKNOWN;
+
+/** Directory holding state which persists between rips. */
+const char *gStateDir = "/var/tmp/ripright";
+
+/** If set, save the progress and audio of each rip so that it can resume. */
+static bool gJournal = false;
+
+/** Days for which MusicBrainz responses are cached, or 0 to disable. */
+static uint32_t gMbCacheDays = 30;
+
+/** Most megabytes of MusicBrainz responses to cache. */
+static uint32_t gMbCacheMb = 64;
+
+/** If set, use the JSON form of the MusicBrainz web service. */
+static bool gMbJson = false;
+
+/** If set, fetch each MusicBrainz release in its own request. */
+static bool gMbPerRelease = false;
+
+/** If set, duplicate slow cover art requests. */
+static bool gHttpHedge = false;
+
 /** execute external script after completion */
 static char *gExecAfterComplPath = "";
 
-/** The CD-ROM device used for reading. */
-const char *gCdromDevice = "/dev/cdrom";
+/** Outputs to repair from their damage maps, instead of ripping. */
+static const char **gRepairFile = NULL;
+static uint16_t     gRepairFileCount = 0;
+
+/** The CD-ROM devices used for reading. */
+static const char **gCdromDevice = NULL;
+static uint16_t     gCdromDeviceCount = 0;
+
+/** State for each of the CD-ROM devices. */
+static drive_t     *gDrive = NULL;
+
+/** Lock held while forking, so that rip processes do not inherit sockets
+ *  intended for processes forked by other drives.
+ */
+static pthread_mutex_t gForkLock = PTHREAD_MUTEX_INITIALIZER;
 
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
-static bool cdromDevIsReadable(void)
+static bool cdromDevIsReadable(const char *device)
 {
     int fd;
 
-    fd = open(gCdromDevice, O_RDONLY);
+    fd = open(device, O_RDONLY);
 
     if(fd == -1)
     {
         if(errno != ENOMEDIUM)
         {
-            LogErr("Failed to open %s: %s\n", gCdromDevice, strerror(errno));
+            LogErr("Failed to open %s: %s\n", device, strerror(errno));
             return false;
         }
     }
@@ -139,440 +310,1085 @@ static bool cdromDevIsReadable(void)
     return true;
 }
 
-static int doRip(void)
+/** Open a temporary file for an encoder to read.
+ */
+static FILE *openTempFile(const char *tempFile)
 {
-    DiscId         *disc = discid_new();
-    mbresult_t      mbresult;
-    bbuf_t          encTaskBBuf;
+    FILE *f = fopen(tempFile, "rb");
 
-    // track logging
-    bool    logTracks = false;
-    char    trackLogName[42]; // sufficient, since musicbrainz disc-ids are 28 chars long
+    if(f == NULL)
+    {
+        LogErr("Error: Failed to open encoding intermediate file: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return f;
+}
+
+
+/** Create a temporary file into which a track can be ripped.
+ * \param[in,out] tempFile  Template for mkstemp(), updated with the filename.
+ */
+static FILE *openCaptureFile(char *tempFile)
+{
+    FILE *f = fdopen(mkstemp(tempFile), "wb");
+
+    if(f == NULL)
+    {
+        LogErr("Error: Failed to open temporary file: %s\n", tempFile);
+        exit(EXIT_FAILURE);
+    }
+
+    return f;
+}
+
+
+/** Background lookup of the disc meta-data and cover art.
+ * This runs while the first tracks are captured so that the drive is not
+ * idle during slow or rate-limited lookups.
+ */
+static void *lookupWorker(void *param)
+{
+    discrip_t *d = param;
+
+    prctl(PR_SET_NAME, "ripright: lookup");
+
+    d->found = MbLookup(d->discId, &d->mbresult);
+
+    /* Only fetch art if the result could be accepted */
+    if(d->found && d->mbresult.releaseCount > 0 &&
+       (d->mbresult.releaseCount == 1 || gRipAsAll))
+    {
+        d->coverArt = x_calloc(sizeof(art_t), d->mbresult.releaseCount);
+
+        for(int32_t i = 0; i < d->mbresult.releaseCount; i++)
+        {
+            d->coverArt[i] = ArtGet(d->mbresult.release[i].asin);
+            if(d->coverArt[i] != NULL)
+            {
+                d->noArt = false;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/** Decide if the lookup result allows the disc to be ripped.
+ * This logs the reason if the disc is refused.
+ */
+static bool lookupAccept(discrip_t *d)
+{
+    if(!d->found)
+    {
+        LogErr("No result for discid=%s: Skipping rip\n"
+               "Please submit this disc to Musicbrainz: %s\n",
+               d->discId, discid_get_submission_url(d->disc));
+        return false;
+    }
+    else if(d->mbresult.releaseCount != 1 && !gRipAsAll)
+    {
+        LogErr("No unique result for disc: results=%u (discid=%s): skipping rip\n",
+               d->mbresult.releaseCount, d->discId);
+
+        MbPrint(&d->mbresult);
+        return false;
+    }
+    else if(d->mbresult.releaseCount == 0)
+    {
+        LogErr("Only a CD Stub for discid=%s: Skipping rip\n"
+               "Please submit this disc to Musicbrainz: %s\n",
+               d->discId, discid_get_submission_url(d->disc));
+        return false;
+    }
+    else if(gNeedArt && d->noArt)
+    {
+        LogWarn("Warning: No cover art found for disk %s: skipping rip\n", d->discId);
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Create the encoding task for some track, with an output per accepted release.
+ * The task describes the outputs only, and is passed to the encoders with
+ * the stream of raw audio by sendTask().
+ * \returns The task, or NULL if no release requires the track.
+ */
+static encodetask_t *newTrackTask(discrip_t *d,
+                                  uint16_t   cdTrack,
+                                  uint8_t    nChannels,
+                                  uint64_t   totalSamples)
+{
+    encodetask_t *etask = NULL;
+
+    /* Process the results in turn */
+    for(int32_t i = 0; i < d->mbresult.releaseCount; i++)
+    {
+        const mbrelease_t *release = &d->mbresult.release[i];
+        char               albumTitle[1024];
+        const char        *albumType = validReleaseTypes[0].path;
+        char              *outputPrefix;
+
+        /* Print a note if ripping multiple times */
+        if(d->mbresult.releaseCount != 1 && gRipAsAll)
+        {
+            static char prefixBuf[64];
+
+            LogWarn("Rip-to-all specified, tagging as result %u/%u\n",
+                    i + 1, d->mbresult.releaseCount);
+
+            snprintf(prefixBuf, sizeof(prefixBuf), "Ambiguous/%s/", release->releaseId);
+            outputPrefix = prefixBuf;
+        }
+        else
+        {
+            outputPrefix = NULL;
+        }
+
+        /* Construct the album title */
+        if(release->medium.title)
+        {
+            if(release->discTotal == 1)
+            {
+                snprintf(albumTitle, sizeof(albumTitle), "%s (%s)",
+                        release->albumTitle, release->medium.title);
+            }
+            else
+            {
+                snprintf(albumTitle, sizeof(albumTitle), "%s (disc %" PRIu16 ": %s)",
+                        release->albumTitle, release->medium.discNum, release->medium.title);
+            }
+        }
+        else if(release->discTotal == 1)
+        {
+            snprintf(albumTitle, sizeof(albumTitle), "%s",
+                    release->albumTitle);
+        }
+        else
+        {
+            snprintf(albumTitle, sizeof(albumTitle), "%s (disc %" PRIu16 ")",
+                    release->albumTitle, release->medium.discNum);
+        }
+
+        /* Check if we have a release type */
+        if(release->releaseType)
+        {
+            /* Check which valid type matches */
+            for(uint8_t vt = 0; vt < M_ArraySize(validReleaseTypes); vt++)
+            {
+                if(strcmp(validReleaseTypes[vt].key, release->releaseType) == 0)
+                {
+                    albumType = validReleaseTypes[vt].path;
+                }
+            }
+        }
+
+        /* Log some information about the CD */
+        if(release->albumArtist.artistName)
+        {
+            LogInf("     Artist: %s\n", release->albumArtist.artistName);
+        }
+        LogInf("      Album: %s\n", albumTitle);
+        LogInf("     Tracks: %u\n", release->medium.trackCount);
+
+        if(d->coverArt[i] == NULL && gNeedArt)
+        {
+            LogWarn("Warning: No cover art found: skipping\n");
+        }
+        else if(cdTrack < release->medium.trackCount)
+        {
+            const mbtrack_t *track = &release->medium.track[cdTrack];
+            encodeoutput_t  *eo;
+
+            /* Allocate the encoding task for the first output */
+            if(etask == NULL)
+            {
+                etask = EncTaskNew(NULL, nChannels, totalSamples);
+
+                etask->trackNum = cdTrack + 1;
+                etask->bitsPerSample = 16;
+                etask->sampleRateHz = 44100;
+            }
+
+            eo = EncTaskAddOutput(etask);
+
+            if(d->coverArt[i])
+            {
+                EncOutSetArt(eo, d->coverArt[i]);
+            }
+
+            /* Add tags */
+            EncOutAddTag(eo, "TRACKNUMBER=%" PRIu32 "/%" PRIu32,
+                        cdTrack + 1, release->medium.trackCount);
+            EncOutAddTag(eo, "DISCNUMBER=%" PRIu32 "/%" PRIu32,
+                        release->medium.discNum, release->discTotal);
+
+            EncOutAddTag(eo, "TITLE=%s", track->trackName);
+            if(release->asin)
+            {
+                EncOutAddTag(eo, "ASIN=%s", release->asin);
+            }
+
+            EncOutAddTag(eo, "ALBUM=%s", albumTitle);
+
+            if(track->trackId)
+            {
+                EncOutAddTag(eo, "MUSICBRAINZ_TRACKID=%s", track->trackId);
+            }
+
+            if(release->releaseGroupId)
+            {
+                EncOutAddTag(eo, "MUSICBRAINZ_ALBUMID=%s", release->releaseGroupId);
+            }
+
+            EncOutAddTag(eo, "MUSICBRAINZ_DISCID=%s", d->discId);
+
+            /* Check if we have a release type */
+            if(release->releaseType)
+            {
+                EncOutAddTag(eo, "MUSICBRAINZ_TYPE=%s", release->releaseType);
+
+                if(strcmp("Compilation", release->releaseType) == 0)
+                {
+                    EncOutAddTag(eo, "COMPILATION=1");
+                }
+            }
+
+            if(track->trackArtist.artistName)
+            {
+                EncOutAddTag(eo, "ARTIST=%s", track->trackArtist.artistName);
+                EncOutAddTag(eo, "ARTISTSORT=%s", track->trackArtist.artistNameSort);
+
+                for(uint8_t a = 0; a < track->trackArtist.artistIdCount; a++)
+                {
+                    EncOutAddTag(eo, "MUSICBRAINZ_ARTISTID=%s", track->trackArtist.artistId[a]);
+                }
+
+                if(release->albumArtist.artistName)
+                {
+                    EncOutAddTag(eo, "ALBUMARTIST=%s", release->albumArtist.artistName);
+                    EncOutAddTag(eo, "ALBUMARTISTSORT=%s", release->albumArtist.artistNameSort);
+
+                    for(uint8_t a = 0; a < release->albumArtist.artistIdCount; a++)
+                    {
+                        EncOutAddTag(eo, "MUSICBRAINZ_ALBUMARTISTID=%s", release->albumArtist.artistId[a]);
+                    }
+                }
+            }
+            else if(release->albumArtist.artistName)
+            {
+                EncOutAddTag(eo, "ARTIST=%s", release->albumArtist.artistName);
+                EncOutAddTag(eo, "ARTISTSORT=%s", release->albumArtist.artistNameSort);
+                EncOutAddTag(eo, "ALBUMARTIST=%s", release->albumArtist.artistName);
+                EncOutAddTag(eo, "ALBUMARTISTSORT=%s", release->albumArtist.artistNameSort);
+
+                for(uint8_t a = 0; a < release->albumArtist.artistIdCount; a++)
+                {
+                    EncOutAddTag(eo, "MUSICBRAINZ_ARTISTID=%s", release->albumArtist.artistId[a]);
+                    EncOutAddTag(eo, "MUSICBRAINZ_ALBUMARTISTID=%s", release->albumArtist.artistId[a]);
+                }
+            }
+
+            /* Escape the trackname and artist*/
+            char *fileName = Format(outputPrefix,
+                                    gFilenameFormat,
+                                    cdTrack + 1,
+                                    track->trackArtist.artistName,
+                                    track->trackArtist.artistNameSort,
+                                    release->albumArtist.artistName,
+                                    release->albumArtist.artistNameSort,
+                                    albumTitle,
+                                    track->trackName,
+                                    albumType);
+
+            /* log fileName to tracklog */
+            if (d->logTracks) {
+                int res = -1;
+                res = fprintf(d->trackLogfp, "%s\n", fileName);
+                if (res < 0) {
+                    LogWarn("Could not print to tracklog!\n");
+                } else {
+                    LogInf("tracklog new entry: %s\n", fileName);
+                }
+            }
+
+            EncOutSetFilename(eo, fileName);
+
+            /* Check if the art file should be saved to the output directory */
+            if(gFolderArt && !d->noArt && d->coverArt[i] != NULL)
+            {
+                char        *end = &fileName[strlen(fileName)];
+                char         artName[strlen(fileName) + strlen(gFolderArt) + 1];
+                struct stat  sb;
+
+                /* Find last '/' in the string */
+                while(end >= fileName && *end != '/')
+                {
+                    end--;
+                }
+
+                if(end >= fileName)
+                {
+                    *end = '\0';
+                }
+
+                /* Format the filename for the cover art */
+                snprintf(artName, sizeof(artName), "%s/%s", fileName, gFolderArt);
+
+                /* Output the cover art if the file doesn't already exist */
+                if(stat(artName, &sb))
+                {
+                    if(ArtDumpToFile(d->coverArt[i], artName))
+                    {
+                        LogInf("Cover art saved to %s\n", artName);
+                    }
+                    else
+                    {
+                        LogErr("Failed to save cover art to %s\n", artName);
+                    }
+                }
+            }
+
+            free(fileName);
+        }
+    }
+
+    if(etask)
+    {
+        EncTaskPrint(etask, stdout);
+    }
+
+    return etask;
+}
+
+
+/** Pass an encoding task to the encoders in the parent process.
+ * \param[in] rawFd  The descriptor from which the audio should be read.
+ */
+static void sendTask(discrip_t *d, const encodetask_t *etask, int rawFd)
+{
+    if(!EncIpcSendTask(d->encSock, etask, rawFd))
+    {
+        LogErr("Error: Failed to pass track %" PRIu32 " to the encoders: %m\n", etask->trackNum);
+    }
+}
+
+
+/** Save the damage map of a track next to each of its outputs.
+ * The outputs may not yet have been written, so their directories are
+ * created here.
+ */
+static void saveDamage(discrip_t *d, const encodetask_t *etask,
+                       const ripdamage_t *damage, uint32_t count)
+{
+    for(uint16_t o = 0; o < etask->outputCount; o++)
+    {
+        const char *name = etask->output[o].outFilename;
+
+        if(count > 0)
+        {
+            char path[strlen(name) + 1];
+
+            strcpy(path, name);
+            EncCreatePath(path);
+        }
+
+        DamageSave(name, d->discId, etask->trackNum, damage, count);
+    }
+}
+
+
+/** Copy audio from a PCM queue into the pipe to an encoder.
+ * If the encoder goes away, the audio is discarded so that ripping can
+ * complete.
+ */
+static void *pumpWorker(void *param)
+{
+    pump_t  *pump = param;
+    uint8_t  buf[64 * 1024];
+    size_t   n;
+    bool     ok = true;
+
+    prctl(PR_SET_NAME, "ripright: pump");
+
+    while((n = fread(buf, 1, sizeof(buf), pump->in)) > 0)
+    {
+        for(size_t off = 0; ok && off < n; )
+        {
+            ssize_t w = write(pump->fd, &buf[off], n - off);
+
+            if(w > 0)
+            {
+                off += w;
+            }
+            else if(errno != EINTR)
+            {
+                LogErr("Error: Failed to pass audio to the encoder: %m\n");
+                ok = false;
+            }
+        }
+    }
+
+    fclose(pump->in);
+    close(pump->fd);
+
+    /* The saved audio is not needed once the whole track is passed */
+    if(ok && pump->ripped)
+    {
+        JournalTrackDone(pump->journal, pump->track);
+    }
+
+    free(pump);
+
+    return NULL;
+}
+
+
+/** Wait for the audio of the last streamed track to be passed to the encoder.
+ */
+static void pumpJoin(discrip_t *d)
+{
+    if(d->pumpActive)
+    {
+        pthread_join(d->pumpTid, NULL);
+        d->pumpActive = false;
+    }
+}
+
+
+/** Rip a track once the lookup has been accepted.
+ * The audio is streamed to the encoders as it is ripped, via a PCM queue
+ * which absorbs any wait for a free encoder, then a pipe to the parent.
+ */
+static void ripTrackToEncoders(discrip_t *d, rip_t *ripper, uint16_t cdTrack,
+                               uint8_t nChannels, uint64_t totalSamples)
+{
+    encodetask_t *etask;
+    pcmq_t        pcmQueue;
+    pump_t       *pump;
+    int           pipeFd[2];
+    FILE         *out;
+
+    etask = newTrackTask(d, cdTrack, nChannels, totalSamples);
+    if(etask == NULL)
+    {
+        LogInf("Track%02" PRIu16 ": No release requires the track: skipping\n", cdTrack + 1);
+        return;
+    }
+
+    if(pipe(pipeFd) != 0)
+    {
+        LogErr("Error: Failed to create pipe: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start the encoder before ripping */
+    sendTask(d, etask, pipeFd[0]);
+    close(pipeFd[0]);
+
+    /* Limit buffering to the previous track and this one */
+    pumpJoin(d);
+
+    pcmQueue = PcmQNew(PCM_QUEUE_SECONDS);
+
+    pump = x_malloc(sizeof(pump_t));
+    pump->in = PcmQOpenReader(pcmQueue);
+    pump->fd = pipeFd[1];
+    pump->journal = d->journal;
+    pump->track = cdTrack + 1;
+    pump->ripped = false;
+
+    out = PcmQOpenWriter(pcmQueue);
+    PcmQFree(pcmQueue);
+
+    pthread_create(&d->pumpTid, NULL, pumpWorker, pump);
+    d->pumpActive = true;
+
+    /* Rip the track (counting from track '1'), the pump only ending once
+     *  the output is closed
+     */
+    pump->ripped = RipTrack(ripper, cdTrack + 1, out);
+    fclose(out);
+
+    EncIpcSendRipSpeed(d->encSock, RipGetSpeed(ripper));
+
+    const ripdamage_t *damage;
+    uint32_t           damageCount;
+
+    damage = RipGetDamage(ripper, &damageCount);
+    saveDamage(d, etask, damage, damageCount);
+
+    EncTaskFree(etask);
+}
+
+
+/** Note a track passed to the encoders by an earlier attempt at the disc.
+ * No task is sent, but the outputs are added to the track log.
+ */
+static void noteDoneTrack(discrip_t *d, uint16_t cdTrack, uint8_t nChannels, uint64_t totalSamples)
+{
+    encodetask_t *etask = newTrackTask(d, cdTrack, nChannels, totalSamples);
+
+    if(etask)
+    {
+        EncTaskFree(etask);
+    }
+}
+
+
+/** Apply the result of the lookup once it has completed.
+ * If the disc is accepted, encoding tasks are released for all tracks which
+ * were captured while waiting for the lookup.
+ * \param[in,out] captured  Names of the temporary files holding the captured
+ *                           tracks, indexed by track, or NULL for tracks not
+ *                           yet captured.  The files are removed and freed.
+ * \param[in]     reached   Count of tracks processed so far.
+ * \retval true   If the disc was accepted.
+ * \retval false  If the disc was refused.
+ */
+static bool lookupResolve(discrip_t *d, rip_t *ripper, char *captured[], uint16_t reached)
+{
+    d->lookupDone = true;
+
+    if(!lookupAccept(d))
+    {
+        return false;
+    }
+
+    /* if needed, open tracklog */
+    if(d->logTracks)
+    {
+        d->trackLogfp = fopen(d->trackLogName, "w");
+        if(d->trackLogfp == NULL)
+        {
+            LogErr("Could not open %s!\n", d->trackLogName);
+            return false;
+        }
+    }
+
+    for(uint16_t cdTrack = 0; cdTrack < reached; cdTrack++)
+    {
+        uint8_t  nChannels;
+        uint64_t totalSamples;
+
+        if(captured[cdTrack] != NULL)
+        {
+            encodetask_t *etask;
+
+            RipGetTrackInfo(ripper, cdTrack + 1, &nChannels, &totalSamples);
+
+            etask = newTrackTask(d, cdTrack, nChannels, totalSamples);
+            if(etask)
+            {
+                FILE *f = openTempFile(captured[cdTrack]);
+
+                /* The encoder reads via its own descriptor after the unlink */
+                sendTask(d, etask, fileno(f));
+                fclose(f);
+
+                if(d->capture[cdTrack].ripped)
+                {
+                    JournalTrackDone(d->journal, cdTrack + 1);
+                }
+
+                saveDamage(d, etask, d->capture[cdTrack].range, d->capture[cdTrack].count);
+                EncTaskFree(etask);
+            }
+
+            unlink(captured[cdTrack]);
+            free(captured[cdTrack]);
+            captured[cdTrack] = NULL;
+        }
+        else if(JournalIsDone(d->journal, cdTrack + 1) &&
+                RipGetTrackInfo(ripper, cdTrack + 1, &nChannels, &totalSamples))
+        {
+            noteDoneTrack(d, cdTrack, nChannels, totalSamples);
+        }
+    }
+
+    return true;
+}
+
+
+/** Rip a disc from some drive.
+ * This runs in a child process per disc.
+ * \param[in] device   The CD-ROM device.
+ * \param[in] encSock  Socket to the encoders in the parent process.
+ */
+static int doRip(const char *device, int encSock)
+{
+    discrip_t d;
+    rip_t    *ripper;
+    uint16_t  cdTrack, cdTrackCount;
+    bool      accepted = true;
+
+    prctl(PR_SET_NAME, "ripright: rip");
+
+    memset(&d, 0, sizeof(d));
+    d.disc = discid_new();
+    d.noArt = true;
+    d.device = device;
+    d.encSock = encSock;
 
     /* check if we must log the tracks to a log file */
     if (strlen(gExecAfterComplPath) > 0) {
-        logTracks = true;
+        d.logTracks = true;
         LogInf("Tracklog enabled\n");
     }
 
 	/* Ensure we have a structure */
-    if(disc == NULL)
+    if(d.disc == NULL)
     {
         LogErr("Failed to allocate for a disc ID: skipping rip\n");
         return EXIT_FAILURE;
     }
 
-    /* Create a bounded buffer */
-    encTaskBBuf = BBufNew(16);
-
-    /* Create encoder threads */
-    for(uint32_t c = sysconf(_SC_NPROCESSORS_ONLN); c > 0; c--)
-    {
-        EncNew(encTaskBBuf);
-    }
-
-    LogInf("Waiting for a CD (%s)\n", gCdromDevice);
+    LogInf("Waiting for a CD (%s)\n", device);
 
     /* Poll until a CD is found */
-    while(!discid_read(disc, gCdromDevice))
+    while(!discid_read(d.disc, device))
     {
         sleep(3);
     }
 
     /* Get the discId */
-    const char *discId = discid_get_id(disc);
+    d.discId = discid_get_id(d.disc);
 
-    LogInf("Got disk Id %s\n", discId);
+    LogInf("Got disk Id %s (%s)\n", d.discId, device);
 
     /* set tracklog filename */
     int res;
-    res = snprintf(trackLogName, 42, "./%s.tracklog", discId);
+    res = snprintf(d.trackLogName, 42, "./%s.tracklog", d.discId);
     if(res < 0 || res > 42) {
         LogErr("trackLogName could not be set. Call snprintf returned %d.\n", res);
         return EXIT_FAILURE;
     }
 
-    if(!MbLookup(discId, &mbresult))
-    {
-        LogErr("No result for discid=%s: Skipping rip\n"
-               "Please submit this disc to Musicbrainz: %s\n",
-               discId, discid_get_submission_url(disc));
-        Eject(gCdromDevice);
-        MbFree(&mbresult);
-        return EXIT_FAILURE;
+    /* Start the lookup in the background */
+    pthread_create(&d.lookupTid, NULL, lookupWorker, &d);
+
+    /* Create the ripper and get the count of tracks on the CD */
+    ripper = RipNew(device);
+    cdTrackCount = RipGetTrackCount(ripper);
+
+    /* Resume any earlier attempt at the disc that did not complete */
+    if(gJournal)
+    {
+        d.journal = JournalOpen(gStateDir, d.discId, cdTrackCount);
+        RipSetJournal(ripper, d.journal);
+    }
+
+    char *captured[cdTrackCount];
+
+    memset(captured, 0, sizeof(captured));
+    d.capture = x_calloc(sizeof(capture_t), cdTrackCount);
+
+    /* Process each track in turn */
+    for(cdTrack = 0; cdTrack < cdTrackCount; cdTrack++)
+    {
+        uint8_t  nChannels;
+        uint64_t totalSamples;
+
+        /* Get the track format (counting from track '1') */
+        if(!RipGetTrackInfo(ripper, cdTrack + 1, &nChannels, &totalSamples))
+        {
+            LogInf("Track%02" PRIu16 ": Not an audio track: skipping\n", cdTrack + 1);
+            continue;
+        }
+
+        /* Check if the lookup has completed */
+        if(!d.lookupDone && pthread_tryjoin_np(d.lookupTid, NULL) == 0)
+        {
+            accepted = lookupResolve(&d, ripper, captured, cdTrack);
+        }
+
+        if(!accepted)
+        {
+            break;
+        }
+        else if(JournalIsDone(d.journal, cdTrack + 1))
+        {
+            LogInf("Track%02" PRIu16 ": Passed to the encoders by an earlier attempt: skipping\n", cdTrack + 1);
+
+            if(d.lookupDone)
+            {
+                noteDoneTrack(&d, cdTrack, nChannels, totalSamples);
+            }
+        }
+        else if(d.lookupDone)
+        {
+            ripTrackToEncoders(&d, ripper, cdTrack, nChannels, totalSamples);
+        }
+        else
+        {
+            char  tempFile[] = "/tmp/rrXXXXXX";
+            FILE *out = openCaptureFile(tempFile);
+
+            /* Capture the audio until the tags are known */
+            LogInf("Track%02" PRIu16 ": Capturing while the lookup completes\n", cdTrack + 1);
+
+            capture_t *cd = &d.capture[cdTrack];
+
+            cd->ripped = RipTrack(ripper, cdTrack + 1, out);
+            fclose(out);
+
+            EncIpcSendRipSpeed(d.encSock, RipGetSpeed(ripper));
+
+            captured[cdTrack] = x_strdup(tempFile);
+
+            /* Keep the damage until the output filenames are known */
+            const ripdamage_t *damage = RipGetDamage(ripper, &cd->count);
+
+            if(cd->count > 0)
+            {
+                cd->range = x_malloc(sizeof(ripdamage_t) * cd->count);
+                memcpy(cd->range, damage, sizeof(ripdamage_t) * cd->count);
+            }
+        }
+    }
+
+    /* Wait for the lookup if all tracks were captured before it completed */
+    if(!d.lookupDone)
+    {
+        LogInf("Waiting for the lookup to complete\n");
+
+        pthread_join(d.lookupTid, NULL);
+
+        accepted = lookupResolve(&d, ripper, captured, cdTrackCount);
+    }
+
+    RipFree(ripper);
+
+    /* Discard any captured audio if the disc was refused */
+    for(cdTrack = 0; cdTrack < cdTrackCount; cdTrack++)
+    {
+        if(captured[cdTrack] != NULL)
+        {
+            unlink(captured[cdTrack]);
+            free(captured[cdTrack]);
+        }
+
+        free(d.capture[cdTrack].range);
+    }
+
+    free(d.capture);
+
+    /* close tracklog */
+    if (d.trackLogfp) {
+        fclose(d.trackLogfp);
+    }
+
+    /* Free any art */
+    if(d.coverArt)
+    {
+        for(int32_t i = 0; i < d.mbresult.releaseCount; i++)
+        {
+            if(d.coverArt[i] != NULL)
+            {
+                ArtFree(d.coverArt[i]);
+            }
+        }
+
+        free(d.coverArt);
+    }
+
+    MbFree(&d.mbresult);
+
+    /* Log the latency of the hosts used for the disc */
+    CurlLogStats();
+
+    /* Try to eject the CD
+     *  If this fails, keep trying, otherwise we might end up trying to
+     *  re-rip the CD.
+     */
+    while(!Eject(device))
+    {
+        LogErr("Error: Failed to eject CD: retrying in 3 seconds");
+        sleep(3);
+    }
+
+    /* Pass the exec-after script to the encoders to run once the disc is
+     *  complete, freeing the drive to be polled for the next disc.
+     */
+    if(accepted && !EncIpcSendEnd(encSock, d.logTracks ? d.trackLogName : NULL))
+    {
+        LogErr("Error: Lost contact with the encoders\n");
+    }
+
+    /* Finish passing the last track to the encoders */
+    pumpJoin(&d);
 
-    }
-    else if(mbresult.releaseCount != 1 && !gRipAsAll)
-    {
-        LogErr("No unique result for disc: results=%u (discid=%s): skipping rip\n",
-               mbresult.releaseCount, discId);
+    /* The disc is complete, so there is nothing to resume */
+    JournalRemove(d.journal);
 
-        MbPrint(&mbresult);
-        MbFree(&mbresult);
+    return accepted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/** Repair outputs from their damage maps, by reading the disc again.
+ * \param[in] device  The CD-ROM device holding the disc.
+ */
+static int doRepair(const char *device)
+{
+    DiscId *disc = discid_new();
+    rip_t  *ripper;
+    bool    ok = true;
 
-        Eject(gCdromDevice);
+    if(disc == NULL || !discid_read(disc, device))
+    {
+        LogErr("Error: Failed to read the disc in %s\n", device);
         return EXIT_FAILURE;
     }
-    else if(mbresult.releaseCount == 0)
+
+    ripper = RipNew(device);
+    if(ripper == NULL)
     {
-        LogErr("Only a CD Stub for discid=%s: Skipping rip\n"
-               "Please submit this disc to Musicbrainz: %s\n",
-               discId, discid_get_submission_url(disc));
-        Eject(gCdromDevice);
-        MbFree(&mbresult);
+        LogErr("Error: Failed to open %s\n", device);
+        discid_free(disc);
         return EXIT_FAILURE;
     }
 
-    art_t *coverArt = x_calloc(sizeof(art_t), mbresult.releaseCount);
-    bool   noArt = true;
-
-    for(int32_t i = 0; i < mbresult.releaseCount; i++)
+    for(uint16_t f = 0; f < gRepairFileCount; f++)
     {
-        coverArt[i] = ArtGet(mbresult.release[i].asin);
-        if(coverArt[i] != NULL)
+        if(!RepairOutput(ripper, discid_get_id(disc), gRepairFile[f]))
         {
-            noArt = false;
+            LogErr("Error: Failed to repair %s\n", gRepairFile[f]);
+            ok = false;
         }
     }
 
-    if(gNeedArt && noArt)
-    {
-        LogWarn("Warning: No cover art found for disk %s: skipping rip\n", discId);
-    }
-    else
-    {
-        rip_t   *ripper;
-        uint8_t  nChannels;
-        uint64_t totalSamples;
-        uint16_t cdTrack, cdTrackCount;
+    RipFree(ripper);
+    discid_free(disc);
 
-        FILE *trackLogfp = NULL;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-        /* if needed, open tracklog */
-        if (logTracks) {
-            trackLogfp = fopen(trackLogName, "w");
-            if (trackLogfp == NULL) {
-                LogErr("Could not open %s!\n", trackLogName);
-                return EXIT_FAILURE;
-            }
-        }
 
-        /* Create the ripper and get the count of tracks on the CD */
-        ripper = RipNew(gCdromDevice);
-        cdTrackCount = RipGetTrackCount(ripper);
+/** Run the user-defined script for a completed disc.
+ */
+static void *execAfterWorker(void *param)
+{
+    char *trackLogName = param;
+    char  execcmd[1024];
+    int   n;
 
-        /* Process each track in turn */
-        for(cdTrack = 0; cdTrack < cdTrackCount; cdTrack++)
-        {
-            char  tempFile[] = "/tmp/rrXXXXXX";
-            FILE *out;
+    prctl(PR_SET_NAME, "ripright: exec");
 
-            out = fdopen(mkstemp(tempFile), "wb");
-            if(out == NULL)
-            {
-                LogErr("Error: Failed to open temporary file: %s\n", tempFile);
-                exit(EXIT_FAILURE);
-            }
+    n = snprintf(execcmd, 1024, "%s %s >> ./out.log", gExecAfterComplPath, trackLogName);
+    if (n < 0 || n > 1024) {
+        LogErr("Could not execute user-defined command. Note that a maximum of 1024 chars in the command are supported!\n");
+    }
+    n = system(execcmd);
+    LogInf("User-defined script returned %d.\n", n);
 
-            /* Rip the track (counting from track '1') */
-            RipTrack(ripper, cdTrack + 1, out, &nChannels, &totalSamples);
-            fclose(out);
+    free(trackLogName);
 
-            /* Process the results in turn */
-            for(int32_t i = 0; i < mbresult.releaseCount; i++)
-            {
-                const mbrelease_t *release = &mbresult.release[i];
-                char               albumTitle[1024];
-                const char        *albumType = validReleaseTypes[0].path;
-                char              *outputPrefix;
+    return NULL;
+}
 
-                /* Print a note if ripping multiple times */
-                if(mbresult.releaseCount != 1 && gRipAsAll)
-                {
-                    static char prefixBuf[64];
 
-                    LogWarn("Rip-to-all specified, encoding as result %u/%u\n",
-                            i + 1, mbresult.releaseCount);
+/** Drop a reference to the encoding state of a disc.
+ * When the last reference is dropped, all tasks for the disc have been
+ * encoded and the exec-after script is started if needed.
+ */
+static void discEncUnref(discenc_t *de)
+{
+    bool last;
 
-                    snprintf(prefixBuf, sizeof(prefixBuf), "Ambiguous/%s/", release->releaseId);
-                    outputPrefix = prefixBuf;
-                }
-                else
-                {
-                    outputPrefix = NULL;
-                }
+    pthread_mutex_lock(&de->lock);
+    last = (--de->refs == 0);
+    pthread_mutex_unlock(&de->lock);
 
-                /* Construct the album title */
-                if(release->medium.title)
-                {
-                    if(release->discTotal == 1)
-                    {
-                        snprintf(albumTitle, sizeof(albumTitle), "%s (%s)",
-                                release->albumTitle, release->medium.title);
-                    }
-                    else
-                    {
-                        snprintf(albumTitle, sizeof(albumTitle), "%s (disc %" PRIu16 ": %s)",
-                                release->albumTitle, release->medium.discNum, release->medium.title);
-                    }
-                }
-                else if(release->discTotal == 1)
-                {
-                    snprintf(albumTitle, sizeof(albumTitle), "%s",
-                            release->albumTitle);
-                }
-                else
-                {
-                    snprintf(albumTitle, sizeof(albumTitle), "%s (disc %" PRIu16 ")",
-                            release->albumTitle, release->medium.discNum);
-                }
+    if(last)
+    {
+        /* Run the script on its own thread so as not to hold an encoder */
+        if(de->trackLogName)
+        {
+            pthread_t tid;
 
-                /* Check if we have a release type */
-                if(release->releaseType)
-                {
-                    /* Check which valid type matches */
-                    for(uint8_t vt = 0; vt < M_ArraySize(validReleaseTypes); vt++)
-                    {
-                        if(strcmp(validReleaseTypes[vt].key, release->releaseType) == 0)
-                        {
-                            albumType = validReleaseTypes[vt].path;
-                        }
-                    }
-                }
+            pthread_create(&tid, NULL, execAfterWorker, de->trackLogName);
+            pthread_detach(tid);
+        }
 
-                /* Log some information about the CD */
-                if(release->albumArtist.artistName)
-                {
-                    LogInf("     Artist: %s\n", release->albumArtist.artistName);
-                }
-                LogInf("      Album: %s\n", albumTitle);
-                LogInf("     Tracks: %u\n", release->medium.trackCount);
+        pthread_mutex_destroy(&de->lock);
+        free(de);
+    }
+}
 
-                if(coverArt[i] == NULL && gNeedArt)
-                {
-                    LogWarn("Warning: No cover art found: skipping\n");
-                }
-                else if(cdTrack < release->medium.trackCount)
-                {
-                    const mbtrack_t *track = &release->medium.track[cdTrack];
-                    encodetask_t    *etask;
 
-                    /* Allocate the encoding task */
-                    etask = EncTaskNew(tempFile, nChannels, totalSamples);
+static void taskDone(encodetask_t *et __attribute__((__unused__)), void *param)
+{
+    discEncUnref(param);
+}
 
-                    if(coverArt[i])
-                    {
-                        EncTaskSetArt(etask, coverArt[i]);
-                    }
 
-                    etask->trackNum = cdTrack + 1;
-                    etask->bitsPerSample = 16;
-                    etask->sampleRateHz = 44100;
+/** Queue the tasks sent by the rip process of some drive.
+ * This returns once the rip process has sent all of its tasks or closed
+ * its socket.
+ */
+static void receiveTasks(drive_t *dr, discenc_t *de)
+{
+    encipcdata_t  data;
+    encipcmsg_t   msg;
 
-                    /* Add tags */
-                    EncTaskAddTag(etask, "TRACKNUMBER=%" PRIu32 "/%" PRIu32,
-                                cdTrack + 1, release->medium.trackCount);
-                    EncTaskAddTag(etask, "DISCNUMBER=%" PRIu32 "/%" PRIu32,
-                                release->medium.discNum, release->discTotal);
+    while((msg = EncIpcRecv(dr->sock, &data)) == ENCIPC_TASK || msg == ENCIPC_RIP_SPEED)
+    {
+        if(msg == ENCIPC_RIP_SPEED)
+        {
+            EncLevelNoteRipSpeed(dr->index, data.ripSpeed);
+        }
+        else
+        {
+            encodetask_t *et = data.task;
 
-                    EncTaskAddTag(etask, "TITLE=%s", track->trackName);
-                    if(release->asin)
-                    {
-                        EncTaskAddTag(etask, "ASIN=%s", release->asin);
-                    }
+            et->source = dr->index;
+            et->doneCb = taskDone;
+            et->doneParam = de;
 
-                    EncTaskAddTag(etask, "ALBUM=%s", albumTitle);
+            pthread_mutex_lock(&de->lock);
+            de->refs++;
+            pthread_mutex_unlock(&de->lock);
 
-                    if(track->trackId)
-                    {
-                        EncTaskAddTag(etask, "MUSICBRAINZ_TRACKID=%s", track->trackId);
-                    }
+            EncQPut(dr->encQueue, et);
+        }
+    }
 
-                    if(release->releaseGroupId)
-                    {
-                        EncTaskAddTag(etask, "MUSICBRAINZ_ALBUMID=%s", release->releaseGroupId);
-                    }
+    if(msg == ENCIPC_END)
+    {
+        de->trackLogName = data.trackLog;
+    }
+}
 
-                    EncTaskAddTag(etask, "MUSICBRAINZ_DISCID=%s", discId);
 
-                    /* Check if we have a release type */
-                    if(release->releaseType)
-                    {
-                        EncTaskAddTag(etask, "MUSICBRAINZ_TYPE=%s", release->releaseType);
+/** Thread managing a drive.
+ * A process is spawned per CD to rip.
+ *  This shouldn't be required, but it ensures 2 things:
+ *   1) Memory leaks don't accumulate.
+ *   2) A crashed CD rip doesn't hose the ripright.
+ *
+ * Some of the sub-libraries appear to leak memory so point 1 is
+ *  particularly pertinent.  The encoders are shared by all drives and
+ *  run in this process, with the rip process passing each task over a
+ *  socket.  Once the rip process has ejected the disc and sent its last
+ *  task, the next disc is polled for while the encoding completes.
+ */
+static void *driveWorker(void *param)
+{
+    drive_t *dr = param;
+    pid_t    prevPid = -1;
 
-                        if(strcmp("Compilation", release->releaseType) == 0)
-                        {
-                            EncTaskAddTag(etask, "COMPILATION=1");
-                        }
-                    }
+    prctl(PR_SET_NAME, "ripright: drive");
 
-                    if(track->trackArtist.artistName)
-                    {
-                        EncTaskAddTag(etask, "ARTIST=%s", track->trackArtist.artistName);
-                        EncTaskAddTag(etask, "ARTISTSORT=%s", track->trackArtist.artistNameSort);
-
-                        for(uint8_t a = 0; a < track->trackArtist.artistIdCount; a++)
-                        {
-                            EncTaskAddTag(etask, "MUSICBRAINZ_ARTISTID=%s", track->trackArtist.artistId[a]);
-                        }
-
-                        if(release->albumArtist.artistName)
-                        {
-                            EncTaskAddTag(etask, "ALBUMARTIST=%s", release->albumArtist.artistName);
-                            EncTaskAddTag(etask, "ALBUMARTISTSORT=%s", release->albumArtist.artistNameSort);
-
-                            for(uint8_t a = 0; a < release->albumArtist.artistIdCount; a++)
-                            {
-                                EncTaskAddTag(etask, "MUSICBRAINZ_ALBUMARTISTID=%s", release->albumArtist.artistId[a]);
-                            }
-                        }
-                    }
-                    else if(release->albumArtist.artistName)
-                    {
-                        EncTaskAddTag(etask, "ARTIST=%s", release->albumArtist.artistName);
-                        EncTaskAddTag(etask, "ARTISTSORT=%s", release->albumArtist.artistNameSort);
-                        EncTaskAddTag(etask, "ALBUMARTIST=%s", release->albumArtist.artistName);
-                        EncTaskAddTag(etask, "ALBUMARTISTSORT=%s", release->albumArtist.artistNameSort);
-
-                        for(uint8_t a = 0; a < release->albumArtist.artistIdCount; a++)
-                        {
-                            EncTaskAddTag(etask, "MUSICBRAINZ_ARTISTID=%s", release->albumArtist.artistId[a]);
-                            EncTaskAddTag(etask, "MUSICBRAINZ_ALBUMARTISTID=%s", release->albumArtist.artistId[a]);
-                        }
-                    }
+    while(1)
+    {
+        int   sv[2];
+        pid_t p;
 
-                    /* Escape the trackname and artist*/
-                    char *fileName = Format(outputPrefix,
-                                            gFilenameFormat,
-                                            cdTrack + 1,
-                                            track->trackArtist.artistName,
-                                            track->trackArtist.artistNameSort,
-                                            release->albumArtist.artistName,
-                                            release->albumArtist.artistNameSort,
-                                            albumTitle,
-                                            track->trackName,
-                                            albumType);
-
-                    /* log fileName to tracklog */
-                    if (logTracks) {
-                        int res = -1;
-                        res = fprintf(trackLogfp, "%s\n", fileName);
-                        if (res < 0) {
-                            LogWarn("Could not print to tracklog!\n");
-                        } else {
-                            LogInf("tracklog new entry: %s\n", fileName);
-                        }
-                    }
+        pthread_mutex_lock(&gForkLock);
 
-                    EncTaskSetOutputFilename(etask, fileName);
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        {
+            pthread_mutex_unlock(&gForkLock);
+            LogErr("Error: Failed to create socket: %m\n");
+            sleep(3);
+            continue;
+        }
+
+        p = fork();
+        if(p == 0)
+        {
+            /* Child: drop the sockets of the other drives */
+            for(uint16_t c = 0; c < gCdromDeviceCount; c++)
+            {
+                if(gDrive[c].sock != -1)
+                {
+                    close(gDrive[c].sock);
+                }
+            }
 
+            close(sv[0]);
+            exit(doRip(dr->device, sv[1]));
+        }
 
-                    EncTaskPrint(etask, stdout);
+        close(sv[1]);
+        dr->sock = sv[0];
 
-                    /* Add to the encoding queue */
-                    BBufPut(encTaskBBuf, etask);
+        pthread_mutex_unlock(&gForkLock);
 
-                    /* Check if the art file should be saved to the output directory */
-                    if(gFolderArt && !noArt && coverArt[i] != NULL)
-                    {
-                        char        *end = &fileName[strlen(fileName)];
-                        char         artName[strlen(fileName) + strlen(gFolderArt) + 1];
-                        struct stat  sb;
-
-                        /* Find last '/' in the string */
-                        while(end >= fileName && *end != '/')
-                        {
-                            end--;
-                        }
-
-                        if(end >= fileName)
-                        {
-                            *end = '\0';
-                        }
-
-                        /* Format the filename for the cover art */
-                        snprintf(artName, sizeof(artName), "%s/%s", fileName, gFolderArt);
-
-                        /* Output the cover art if the file doesn't already exist */
-                        if(stat(artName, &sb))
-                        {
-                            if(ArtDumpToFile(coverArt[i], artName))
-                            {
-                                LogInf("Cover art saved to %s\n", artName);
-                            }
-                            else
-                            {
-                                LogErr("Failed to save cover art to %s\n", artName);
-                            }
-                        }
-                    }
+        if(p == -1)
+        {
+            LogErr("Error: Failed to fork: %m\n");
+        }
+        else
+        {
+            discenc_t *de = x_calloc(sizeof(discenc_t), 1);
 
-                    free(fileName);
-                }
-            }
+            pthread_mutex_init(&de->lock, NULL);
+            de->refs = 1;
 
-            /* Remove the raw file */
-            unlink(tempFile);
+            receiveTasks(dr, de);
+            discEncUnref(de);
         }
 
-        RipFree(ripper);
+        pthread_mutex_lock(&gForkLock);
+        dr->sock = -1;
+        pthread_mutex_unlock(&gForkLock);
 
-        /* close tracklog */
-        if (logTracks) {
-            fclose(trackLogfp);
+        close(sv[0]);
+
+        /* Wait for the previous child.
+         *  The child just finished with may still be passing the audio of
+         *  its last track to the encoders, so is reaped next time around.
+         */
+        if(prevPid != -1)
+        {
+            waitpid(prevPid, NULL, 0);
         }
-    }
 
-    /* Free any art */
-    for(int32_t i = 0; i < mbresult.releaseCount; i++)
-    {
-        if(coverArt[i] != NULL)
+        prevPid = p;
+
+        if(p == -1)
         {
-            ArtFree(coverArt[i]);
+            sleep(3);
         }
     }
 
-    free(coverArt);
+    return NULL;
+}
 
-    MbFree(&mbresult);
 
-    /* Try to eject the CD
-     *  If this fails, keep trying, otherwise we might end up trying to
-     *  re-rip the CD.
-     */
-    while(!Eject(gCdromDevice))
+/** Set the timeout of a class of HTTP request from a <class>=<seconds> option.
+ * \retval false  If the class is not known.
+ */
+static bool setHttpTimeout(const char *arg)
+{
+    for(curlclass_t c = 0; c < CURL_CLASS_COUNT; c++)
     {
-        LogErr("Error: Failed to eject CD: retrying in 3 seconds");
-        sleep(3);
-    }
+        const char  *name = CurlClassName(c);
+        const size_t len = strlen(name);
 
-    /* Create encoder threads */
-    for(uint32_t c = sysconf(_SC_NPROCESSORS_ONLN); c > 0; c--)
-    {
-        BBufPut(encTaskBBuf, NULL);
-    }
+        if(strncmp(arg, name, len) == 0 && arg[len] == '=')
+        {
+            curlpolicy_t p;
 
-    BBufWaitUntilEmpty(encTaskBBuf);
+            CurlGetPolicy(c, &p);
+            p.totalMs = atoi(&arg[len + 1]) * 1000;
+            CurlSetPolicy(c, &p);
 
-    /* call external script desired */
-    if (logTracks) {
-        char execcmd[1024];
-        int n;
-        n = snprintf(execcmd, 1024, "%s %s >> ./out.log", gExecAfterComplPath, trackLogName);
-        if (n < 0 || n > 1024) {
-            LogErr("Could not execute user-defined command. Note that a maximum of 1024 chars in the command are supported!\n");
+            return true;
         }
-        n = system(execcmd);
-        LogInf("User-defined script returned %d.\n", n);
     }
 
-    return EXIT_SUCCESS;
+    return false;
 }
 
 
 static void usage(void)
 {
-    printf("Usage: ripright [-d] [-a] [-r] [-s] [-e exec-script] [-c device] [-o format] [outpath]\n"
+    printf("Usage: ripright [-d] [-a] [-r] [-f file] [-s] [-T minutes] [-b] [-A dir] [-O offset] [-S dir] [-J] [-t days] [-z MB] [-j] [-P] [-H class=seconds]... [-G] [-R file]... [-w] [-e exec-script] [-c device]... [-o format] [outpath]\n"
            "\n"
            "Where:\n"
            "  -d, --daemon\n"
@@ -598,7 +1414,75 @@ static void usage(void)
            "     library.  With this option, each bad sectors will be skipped after\n"
            "     20 failed attempts to read the data.  Without this option, ripping\n"
            "     of scratched or damaged CDs may take a very long time and possibly\n"
-           "     may not complete.\n"
+           "     may not complete.  Even without this option, skips are allowed\n"
+           "     for the rest of a track if reading stalls for a minute.\n"
+           "\n"
+           "  -T <minutes>, --time-budget <minutes>\n"
+           "     Time allowed for reading each disc.  Once this has passed, a\n"
+           "     track on which reading stalls is abandoned rather than read\n"
+           "     with skips.  By default there is no limit.\n"
+           "\n"
+           "  -b, --burst\n"
+           "     Read each track quickly without verification, and check the audio\n"
+           "     against the AccurateRip database.  Only tracks which cannot be\n"
+           "     verified are read again using cdparanoia.\n"
+           "\n"
+           "  -A <dir>, --accuraterip-dir <dir>\n"
+           "     Directory holding AccurateRip database dumps (dBAR-*.bin files).\n"
+           "     Dumps not found in the directory are fetched from AccurateRip\n"
+           "     and saved to it.\n"
+           "\n"
+           "  -O <samples>, --read-offset <samples>\n"
+           "     Read offset correction of the drive, in samples.  This must be\n"
+           "     correct for AccurateRip to verify the audio.  If not given, the\n"
+           "     offset is found using AccurateRip the first time a drive is\n"
+           "     used in burst mode.\n"
+           "\n"
+           "  -S <dir>, --state-dir <dir>\n"
+           "     Directory in which the measured capabilities of each drive, any\n"
+           "     saved rips and MusicBrainz responses are kept.  This defaults to\n"
+           "     /var/tmp/ripright.\n"
+           "\n"
+           "  -J, --journal\n"
+           "     Save the progress and audio of each rip in the state directory,\n"
+           "     so that a rip which crashes resumes from where it stopped.  This\n"
+           "     writes all the audio of each disc to disk.\n"
+           "\n"
+           "  -t <days>, --mb-cache-ttl <days>\n"
+           "     Days for which MusicBrainz responses are saved in the state\n"
+           "     directory and used again without a lookup.  0 disables the\n"
+           "     cache.  This defaults to 30.\n"
+           "\n"
+           "  -z <MB>, --mb-cache-size <MB>\n"
+           "     Most megabytes of MusicBrainz responses to save, after which the\n"
+           "     oldest are removed.  This defaults to 64.\n"
+           "\n"
+           "  -j, --mb-json\n"
+           "     Use the JSON form of the MusicBrainz web service instead of XML.\n"
+           "     The results are the same, but responses are smaller and quicker\n"
+           "     to parse.\n"
+           "\n"
+           "  -P, --mb-per-release\n"
+           "     Fetch each release of a disc from MusicBrainz in a separate\n"
+           "     request.  By default the details of all releases are requested\n"
+           "     with the disc, and only releases lacking details are fetched.\n"
+           "\n"
+           "  -H <class>=<seconds>, --http-timeout <class>=<seconds>\n"
+           "     Most seconds allowed for each attempt at a request of the given\n"
+           "     class, where <class> is one of mb, art or accurip, or 0 for no\n"
+           "     limit.  Failed requests are retried a few times.  These default\n"
+           "     to 60 seconds for mb and 30 seconds for the others.\n"
+           "\n"
+           "  -G, --http-hedge\n"
+           "     Make a second request for cover art if the first is slower than\n"
+           "     most to the same host, using whichever completes first.\n"
+           "\n"
+           "  -R <file>, --repair <file>\n"
+           "     Read the sectors listed in the damage map <file>.damage again,\n"
+           "     such as after cleaning the disc, and patch them into the FLAC\n"
+           "     <file>.  A damage map is saved next to each output whose track\n"
+           "     had read problems.  The disc must be in the first drive.  This\n"
+           "     may be given more than once, and no other discs are ripped.\n"
            "\n"
            "  -a, --rip-to-all\n"
            "     Normally exactly 1 result is required from Musicbrainz,\n"
@@ -610,7 +1494,9 @@ static void usage(void)
            "\n"
            "  -c, --cd-device\n"
            "     Path to the CD-ROM device to use.  This defaults to /dev/cdrom if\n"
-           "     not otherwise specified.\n"
+           "     not otherwise specified.  This may be given more than once to rip\n"
+           "     from several drives at the same time, in which case the encoders\n"
+           "     are shared equally between the drives.\n"
            "\n"
            "  -o, --output-file\n"
            "     Set the format used to produce output filenames and paths.  This\n"
@@ -709,10 +1595,102 @@ int main(int argc, char *argv[])
             argc--;
             argv++;
         }
+        else if((strcmp(argv[1], "-T") == 0 || strcmp(argv[1], "--time-budget") == 0) &&
+                argc > 2)
+        {
+            gRipTimeBudget = atoi(argv[2]) * 60;
+            argc -= 2;
+            argv += 2;
+        }
+        else if(strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "--burst") == 0)
+        {
+            gRipBurst = true;
+            argc--;
+            argv++;
+        }
+        else if((strcmp(argv[1], "-A") == 0 || strcmp(argv[1], "--accuraterip-dir") == 0) &&
+                argc > 2)
+        {
+            gAccurateRipDir = argv[2];
+            argc -= 2;
+            argv += 2;
+        }
+        else if((strcmp(argv[1], "-O") == 0 || strcmp(argv[1], "--read-offset") == 0) &&
+                argc > 2)
+        {
+            gRipReadOffset = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if((strcmp(argv[1], "-S") == 0 || strcmp(argv[1], "--state-dir") == 0) &&
+                argc > 2)
+        {
+            gStateDir = argv[2];
+            argc -= 2;
+            argv += 2;
+        }
+        else if(strcmp(argv[1], "-J") == 0 || strcmp(argv[1], "--journal") == 0)
+        {
+            gJournal = true;
+            argc--;
+            argv++;
+        }
+        else if((strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "--mb-cache-ttl") == 0) &&
+                argc > 2)
+        {
+            gMbCacheDays = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if((strcmp(argv[1], "-z") == 0 || strcmp(argv[1], "--mb-cache-size") == 0) &&
+                argc > 2)
+        {
+            gMbCacheMb = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if(strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "--mb-json") == 0)
+        {
+            gMbJson = true;
+            argc--;
+            argv++;
+        }
+        else if(strcmp(argv[1], "-P") == 0 || strcmp(argv[1], "--mb-per-release") == 0)
+        {
+            gMbPerRelease = true;
+            argc--;
+            argv++;
+        }
+        else if((strcmp(argv[1], "-H") == 0 || strcmp(argv[1], "--http-timeout") == 0) &&
+                argc > 2)
+        {
+            if(!setHttpTimeout(argv[2]))
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if(strcmp(argv[1], "-G") == 0 || strcmp(argv[1], "--http-hedge") == 0)
+        {
+            gHttpHedge = true;
+            argc--;
+            argv++;
+        }
+        else if((strcmp(argv[1], "-R") == 0 || strcmp(argv[1], "--repair") == 0) &&
+                argc > 2)
+        {
+            gRepairFile = x_realloc(gRepairFile, sizeof(char *) * (gRepairFileCount + 1));
+            gRepairFile[gRepairFileCount++] = argv[2];
+            argc -= 2;
+            argv += 2;
+        }
         else if((strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--cd-device") == 0) &&
                 argc > 2)
         {
-            gCdromDevice = argv[2];
+            gCdromDevice = x_realloc(gCdromDevice, sizeof(char *) * (gCdromDeviceCount + 1));
+            gCdromDevice[gCdromDeviceCount++] = argv[2];
             argc -= 2;
             argv += 2;
         }
@@ -755,12 +1733,55 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    /* Check the CD-ROM device can be opened for read */
-    if(!cdromDevIsReadable())
+    if(gCdromDeviceCount == 0)
+    {
+        static const char *defaultDevice = "/dev/cdrom";
+
+        gCdromDevice = &defaultDevice;
+        gCdromDeviceCount = 1;
+    }
+
+    if(mkdir(gStateDir, 0755) != 0 && errno != EEXIST)
     {
+        fprintf(stderr, "Error: Failed to create state directory %s: %m\n", gStateDir);
         return EXIT_FAILURE;
     }
 
+    /* Cache MusicBrainz responses in the state directory */
+    char mbCacheDir[strlen(gStateDir) + 16];
+
+    snprintf(mbCacheDir, sizeof(mbCacheDir), "%s/mbcache", gStateDir);
+    MbCacheInit(mbCacheDir, gMbCacheDays * 24 * 60 * 60, (uint64_t)gMbCacheMb * 1024 * 1024);
+    MbSetFormat(gMbJson ? MB_FORMAT_JSON : MB_FORMAT_XML);
+    MbSetCombined(!gMbPerRelease);
+
+    /* Share rate limits between the processes ripping each drive */
+    CurlSetStateDir(gStateDir);
+
+    if(gHttpHedge)
+    {
+        curlpolicy_t p;
+
+        CurlGetPolicy(CURL_CLASS_ART, &p);
+        p.hedge = true;
+        CurlSetPolicy(CURL_CLASS_ART, &p);
+    }
+
+    /* Check the CD-ROM devices can be opened for read */
+    for(uint16_t c = 0; c < gCdromDeviceCount; c++)
+    {
+        if(!cdromDevIsReadable(gCdromDevice[c]))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Repair outputs from the first drive, instead of ripping */
+    if(gRepairFileCount > 0)
+    {
+        return doRepair(gCdromDevice[0]);
+    }
+
     /* Daemonise if requested to do so */
     if(gDaemon)
     {
@@ -774,26 +1795,46 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* We spawn a process per CD to rip.
-     *  This shouldn't be required, but it ensures 2 things:
-     *   1) Memory leaks don't accumulate.
-     *   2) A crashed CD rip doesn't hose the ripright.
-     *
-     * Some of the sub-libraries appear to leak memory so point 1 is
-     *  particularly pertinent.
-     */
-    while(1)
+    /* Encoder pipes and sockets are checked for errors instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Create the encoder threads, shared by all drives */
+    uint32_t encThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    encq_t   encQueue = EncQNew(encThreads);
+
+    /* Measure the encoding speed before any rip competes for the CPU */
+    EncLevelCalibrate(encThreads);
+
+    for(uint32_t c = encThreads; c > 0; c--)
     {
-        pid_t p = fork();
+        EncNew(encQueue);
+    }
 
-        if(p == 0)
-        {
-            /* Child */
-            return doRip();
-        }
+    LogInf("Ripping from %" PRIu16 " drive(s) with %" PRIu32 " encoder threads\n",
+           gCdromDeviceCount, encThreads);
+
+    /* Start a thread for each drive */
+    gDrive = x_calloc(sizeof(drive_t), gCdromDeviceCount);
 
-        /* Wait for the child */
-        waitpid(p, NULL, 0);
+    for(uint16_t c = 0; c < gCdromDeviceCount; c++)
+    {
+        gDrive[c].device = gCdromDevice[c];
+        gDrive[c].index = c;
+        gDrive[c].encQueue = encQueue;
+        gDrive[c].sock = -1;
+    }
+
+    pthread_t driveTid[gCdromDeviceCount];
+
+    for(uint16_t c = 0; c < gCdromDeviceCount; c++)
+    {
+        pthread_create(&driveTid[c], NULL, driveWorker, &gDrive[c]);
+    }
+
+    /* The drive threads run forever */
+    for(uint16_t c = 0; c < gCdromDeviceCount; c++)
+    {
+        pthread_join(driveTid[c], NULL);
     }
 
     return EXIT_SUCCESS;
@@ -25,11 +25,15 @@
  **************************************************************************/
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**************************************************************************
  * Macros
  **************************************************************************/
 
+/** Value of gRipReadOffset if no offset has been given. */
+#define RIP_OFFSET_UNKNOWN INT32_MIN
+
 /**************************************************************************
  * Types
  **************************************************************************/
@@ -38,7 +42,12 @@
  * Global Variables
  **************************************************************************/
 
-extern bool gRipAllowSkip;
+extern bool        gRipAllowSkip;
+extern bool        gRipBurst;
+extern const char *gAccurateRipDir;
+extern int32_t     gRipReadOffset;
+extern const char *gStateDir;
+extern uint32_t    gRipTimeBudget;
 
 /**************************************************************************
  * Prototypes
@@ -35,6 +35,19 @@
  * Manifest Constants
  **************************************************************************/
 
+/** Index used to mark the absence of a child or sibling node.
+ * Node 0 is the document root, which is never the child or sibling of
+ * another node.
+ */
+#define NODE_NONE 0
+
+/** Size of the blocks from which decoded strings are allocated. */
+#define ARENA_BLOCK_SIZE 4096
+
+/** Initial number of nodes, and nesting depth, allocated when parsing. */
+#define INITIAL_NODES 256
+#define INITIAL_DEPTH 16
+
 /**************************************************************************
  * Macros
  **************************************************************************/
@@ -51,459 +64,1282 @@
  * Types
  **************************************************************************/
 
-/**************************************************************************
- * Local Variables
- **************************************************************************/
+/** A string within the document text, given as an offset and length. */
+typedef struct
+{
+    uint32_t off, len;
+}
+xmlview_t;
+
+/** Element that is open while parsing. */
+typedef struct
+{
+    /** Index of the open node. */
+    uint32_t node;
+
+    /** Index of the most recent child node added, or NODE_NONE. */
+    uint32_t last;
+}
+openlevel_t;
+
+/** Block of memory from which decoded strings are allocated. */
+typedef struct arenablock
+{
+    struct arenablock *next;
+    size_t             used, size;
+    char               data[];
+}
+arenablock_t;
 
-struct xmlnode {
-    char *tag;
-    char *content;
-    char *attributes;
+/** Kinds of markup found by scanMarkup(). */
+typedef enum
+{
+    MARKUP_INCOMPLETE,  /**< The end of the markup has not been seen. */
+    MARKUP_SKIP,        /**< Comment, CDATA, processing instruction etc. */
+    MARKUP_OPEN,        /**< Opening tag, &lt;tag&gt;. */
+    MARKUP_EMPTY,       /**< Empty element tag, &lt;tag/&gt;. */
+    MARKUP_CLOSE        /**< Closing tag, &lt;/tag&gt;. */
+}
+markup_t;
+
+struct xmlnode
+{
+    xmlview_t tag;
+    xmlview_t attributes;
+    xmlview_t content;
+
+    /** Index of the first child node, or NODE_NONE. */
+    uint32_t  child;
+
+    /** Index of the next sibling node, or NODE_NONE. */
+    uint32_t  next;
+};
+
+struct xmldoc
+{
+    /** The document text, which all the node views index into. */
+    char         *text;
+    uint32_t      len;
 
-    void    *freeList[16];
-    uint32_t freeListLen;
+    /** Node array, with the document root at index 0. */
+    xmlnode_t    *node;
+    uint32_t      nodeCount, nodeSize;
 
-    bool        converted;
-    int         fd;
-    const char *array;
+    /** Storage for strings returned to the caller. */
+    arenablock_t *arena;
 };
 
+struct xmlsax
+{
+    xmlsaxstart_t start;
+    xmlsaxend_t   end;
+    void         *param;
+
+    /** Text carried over between calls to XmlSaxFeed(), starting with some
+     * incomplete markup.
+     */
+    char         *buf;
+    uint32_t      len, size;
+
+    /** Raw text since the last tag. */
+    char         *text;
+    uint32_t      textLen, textSize;
+
+    /** Depth of the current element, with 1 being the document element. */
+    uint32_t      depth;
+
+    /** Set if the current element has not yet had a child element. */
+    bool          leaf;
+
+    /** Set once the document element has been closed. */
+    bool          done;
+
+    bool          failed;
+
+    /** Attributes of the tag being passed to the start callback. */
+    xmlview_t     attributes;
+
+    /** Storage for strings passed to the callbacks. */
+    arenablock_t *arena;
+};
+
+/**************************************************************************
+ * Local Variables
+ **************************************************************************/
+
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
-/** Skip space characters in the passed string.
- *
- * \returns Pointer to the first non-space character in \a s, which maybe a nul.
+/** Allocate memory from an arena.
+ * The memory remains valid until the arena is reset or freed.
  */
-static const char *skipSpace(const char *s)
+static char *arenaAlloc(arenablock_t **arena, size_t size)
 {
-    while(isspace(*s))
+    arenablock_t *b = *arena;
+    char         *r;
+
+    if(size > ARENA_BLOCK_SIZE / 4)
     {
-        s++;
+        /* Give large strings their own block, keeping the current one */
+        b = x_malloc(sizeof(arenablock_t) + size);
+        b->size = b->used = size;
+
+        if(*arena)
+        {
+            b->next = (*arena)->next;
+            (*arena)->next = b;
+        }
+        else
+        {
+            b->next = NULL;
+            *arena = b;
+        }
+
+        return b->data;
     }
 
-    return s;
+    if(b == NULL || b->size - b->used < size)
+    {
+        b = x_malloc(sizeof(arenablock_t) + ARENA_BLOCK_SIZE);
+        b->next = *arena;
+        b->size = ARENA_BLOCK_SIZE;
+        b->used = 0;
+        *arena = b;
+    }
+
+    r = &b->data[b->used];
+    b->used += size;
+
+    return r;
 }
 
 
-static void convert(char *s)
+/** Free all the blocks of an arena.
+ */
+static void arenaFree(arenablock_t **arena)
 {
-    char *sIn = s;
-    char *sOut = s;
+    while(*arena)
+    {
+        arenablock_t *next = (*arena)->next;
 
-    do
+        free(*arena);
+        *arena = next;
+    }
+}
+
+
+/** Release everything allocated from an arena, keeping one block for reuse.
+ */
+static void arenaReset(arenablock_t **arena)
+{
+    if(*arena)
     {
-        while(*sIn != '&' && *sIn != '\0')
+        arenaFree(&(*arena)->next);
+
+        if((*arena)->size == ARENA_BLOCK_SIZE)
+        {
+            (*arena)->used = 0;
+        }
+        else
         {
-            *sOut = *sIn;
-            sIn++;
-            sOut++;
+            arenaFree(arena);
         }
+    }
+}
+
+
+/** Encode a Unicode code point as UTF-8.
+ * \returns The number of bytes written to \a out, which is at most 4.
+ */
+static uint8_t utf8Encode(uint32_t cp, char *out)
+{
+    if(cp < 0x80)
+    {
+        out[0] = cp;
+        return 1;
+    }
+    else if(cp < 0x800)
+    {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    else if(cp < 0x10000)
+    {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    else
+    {
+        out[0] = 0xf0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3f);
+        out[2] = 0x80 | ((cp >> 6) & 0x3f);
+        out[3] = 0x80 | (cp & 0x3f);
+        return 4;
+    }
+}
+
+
+/** Try to decode a character reference such as &amp;#233; or &amp;#xe9;.
+ * \param[in]  s    Pointer to the '&'.
+ * \param[in]  len  Number of characters available at \a s.
+ * \param[out] out  Buffer to receive the UTF-8 encoding.
+ * \param[out] outLen  Number of bytes written to \a out.
+ * \returns The length of the reference, or 0 if it is not valid.
+ */
+static uint32_t decodeCharRef(const char *s, uint32_t len, char *out, uint8_t *outLen)
+{
+    uint32_t cp = 0, i = 2;
+    bool     hex = false;
+
+    if(len < 4 || s[1] != '#')
+    {
+        return 0;
+    }
+
+    if(s[2] == 'x' || s[2] == 'X')
+    {
+        hex = true;
+        i++;
+    }
+
+    for(; i < len && i < 12 && s[i] != ';'; i++)
+    {
+        const char c = s[i];
 
-        if(*sIn == '&')
+        if(hex && isxdigit(c))
         {
-            static const struct {
-                const char    *token;
-                const uint8_t  len;
-                const char    *substitution;
-            }
-            replacements[] =
-            {
-                { "&quot;",  6, "\"" },
-                { "&apos;",  6, "'" },
-                { "&amp;",   5, "&" },
-                { "&lt;",    4, "<" },
-                { "&gt;",    4, ">" }
-            };
+            cp = (cp << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+        }
+        else if(!hex && isdigit(c))
+        {
+            cp = (cp * 10) + (c - '0');
+        }
+        else
+        {
+            return 0;
+        }
+    }
 
-            uint8_t t;
+    if(i >= len || s[i] != ';' || cp == 0 || cp > 0x10ffff)
+    {
+        return 0;
+    }
 
-            for(t = 0; t < M_ArrayLen(replacements); t++)
-            {
-                if(strncasecmp(sIn, replacements[t].token, replacements[t].len) == 0)
-                {
-                    break;
-                }
-            }
+    *outLen = utf8Encode(cp, out);
 
-            if(t < M_ArrayLen(replacements))
-            {
-                sIn += replacements[t].len;
-                strcpy(sOut, replacements[t].substitution);
-                sOut += strlen(replacements[t].substitution);
-            }
-            else
+    return i + 1;
+}
+
+
+/** Copy some text into an arena, replacing entity references.
+ * \param[in,out] arena  The arena from which to allocate the copy.
+ * \param[in]     in     The text to decode.
+ * \param[in]     len    Length of \a in.
+ * \returns A nul terminated copy of the decoded string.
+ */
+static const char *decode(arenablock_t **arena, const char *in, uint32_t len)
+{
+    const char *sIn = in;
+    const char *sEnd = sIn + len;
+    char       *r = arenaAlloc(arena, len + 1), *sOut = r;
+
+    /* Decoding never lengthens the text, so the copy will always fit */
+    while(sIn < sEnd)
+    {
+        const char *amp = memchr(sIn, '&', sEnd - sIn);
+        uint32_t    t, refLen = 0;
+        uint8_t     outLen;
+        char        utf8[4];
+
+        if(amp == NULL)
+        {
+            amp = sEnd;
+        }
+
+        memcpy(sOut, sIn, amp - sIn);
+        sOut += amp - sIn;
+        sIn = amp;
+
+        if(sIn == sEnd)
+        {
+            break;
+        }
+
+        static const struct {
+            const char    *token;
+            const uint8_t  len;
+            const char     substitution;
+        }
+        replacements[] =
+        {
+            { "&quot;",  6, '"' },
+            { "&apos;",  6, '\'' },
+            { "&amp;",   5, '&' },
+            { "&lt;",    4, '<' },
+            { "&gt;",    4, '>' }
+        };
+
+        for(t = 0; t < M_ArrayLen(replacements); t++)
+        {
+            if(replacements[t].len <= sEnd - sIn &&
+               strncasecmp(sIn, replacements[t].token, replacements[t].len) == 0)
             {
-                *sOut = *sIn;
-                sIn++;
-                sOut++;
+                break;
             }
         }
+
+        if(t < M_ArrayLen(replacements))
+        {
+            *sOut++ = replacements[t].substitution;
+            sIn += replacements[t].len;
+        }
+        else if((refLen = decodeCharRef(sIn, sEnd - sIn, utf8, &outLen)) > 0)
+        {
+            memcpy(sOut, utf8, outLen);
+            sOut += outLen;
+            sIn += refLen;
+        }
+        else
+        {
+            *sOut++ = *sIn++;
+        }
     }
-    while(*sIn != '\0');
 
     *sOut = '\0';
+
+    return r;
 }
 
 
-/** Get another character from wherever we are reading.
+/** Find the first occurrence of some string in some text.
+ * \param[in] t    The text to search.
+ * \param[in] len  Length of \a t.
+ * \param[in] pos  Offset from which to start searching.
+ * \param[in] str  The string to find.
+ * \returns The offset of the end of the match, or 0 if it was not found.
  */
-static int getnextchar(struct xmlnode *n,char *c)
+static uint32_t findEnd(const char *t, uint32_t len, uint32_t pos, const char *str)
 {
-    /* Reading from fd */
-    if(n->fd!=-1 && n->array==NULL)
-        return read(n->fd,c,sizeof(char));
+    const uint32_t strLen = strlen(str);
+    const char    *s;
 
-    /* Reading from array */
-    if(n->fd == -1 && n->array != NULL)
+    while(pos + strLen <= len &&
+          (s = memchr(&t[pos], str[0], len - pos - strLen + 1)) != NULL)
     {
-        *c=*(n->array);
-        n->array++;
-        return (*c=='\0') ? 0 : 1;
+        pos = s - t;
+
+        if(memcmp(s, str, strLen) == 0)
+        {
+            return pos + strLen;
+        }
+
+        pos++;
     }
 
     return 0;
 }
 
 
-/** Parse to find a tag enclosure.
+/** Find the '>' that closes a tag, skipping any in quoted attribute values.
+ * \returns The offset of the '>', or 0 if it was not found.
  */
-static bool Parse(struct xmlnode *n)
+static uint32_t findTagClose(const char *t, uint32_t len, uint32_t pos)
 {
-    char c;
-    int  r,l,m;
-    int  tagcount;
+    char quote = '\0';
 
-    /* Search for a < */
-    do
+    for(; pos < len; pos++)
     {
-        r = getnextchar(n,&c);
+        const char c = t[pos];
+
+        if(quote)
+        {
+            if(c == quote)
+            {
+                quote = '\0';
+            }
+        }
+        else if(c == '"' || c == '\'')
+        {
+            quote = c;
+        }
+        else if(c == '>')
+        {
+            return pos;
+        }
     }
-    while(r == 1 && c != '<');
 
-    if(c != '<')
+    return 0;
+}
+
+
+/** Determine the kind and extent of some markup.
+ * \param[in]  t      The text.
+ * \param[in]  len    Length of \a t.
+ * \param[in]  pos    Offset of the '<' starting the markup.
+ * \param[out] close  Set to the offset of the final '>' of the markup.
+ * \returns The kind of markup, or MARKUP_INCOMPLETE if \a t ends before the
+ *           markup does.
+ */
+static markup_t scanMarkup(const char *t, uint32_t len, uint32_t pos, uint32_t *close)
+{
+    static const struct
     {
-        return false;
+        const char *open, *close;
     }
+    skip[] =
+    {
+        { "<?",         "?>" },
+        { "<!--",       "-->" },
+        { "<![CDATA[",  "]]>" }
+    };
 
-    n->tag = x_malloc(l = 64);
-    m = 0;
+    const uint32_t avail = len - pos;
+    uint32_t       end;
 
-    /* Read until a > */
-    do
+    if(avail < 2)
     {
-        r = getnextchar(n, &n->tag[m++]);
+        return MARKUP_INCOMPLETE;
+    }
 
-        /* Skip space at the start of a tag eg. < tag> */
-        if(m == 1 && isspace(n->tag[0]))
-            m = 0;
+    for(uint8_t k = 0; k < M_ArrayLen(skip); k++)
+    {
+        const uint32_t l = strlen(skip[k].open);
 
-        if(m == l)
-            n->tag = x_realloc(n->tag, l += 256);
+        if(memcmp(&t[pos], skip[k].open, avail < l ? avail : l) == 0)
+        {
+            if(avail < l || (end = findEnd(t, len, pos + l, skip[k].close)) == 0)
+            {
+                return MARKUP_INCOMPLETE;
+            }
 
+            *close = end - 1;
+            return MARKUP_SKIP;
+        }
     }
-    while(r == 1 && n->tag[m-1] != '>');
 
-    if(n->tag[m-1] != '>')
+    end = findTagClose(t, len, pos + 1);
+    if(end == 0)
     {
-        dprintf("Failed to find closing '>'");
-        free(n->tag);
-        return false;
+        return MARKUP_INCOMPLETE;
     }
 
-    /* Null terminate the tag */
-    n->tag[m-1] = '\0';
+    *close = end;
 
-    /* Check if it is a <?...> or <!...> tag */
-    if(*n->tag == '?' || *n->tag == '!')
+    if(t[pos + 1] == '!')
+    {
+        /* <!DOCTYPE ...> or similar */
+        return MARKUP_SKIP;
+    }
+    else if(t[pos + 1] == '/')
+    {
+        return MARKUP_CLOSE;
+    }
+    else if(t[end - 1] == '/')
     {
-        dprintf("Found '<? ...>' or '<! ...>' tag");
-        dprintf(n->tag);
-        n->content=NULL;
-        return true;
+        return MARKUP_EMPTY;
     }
 
-    /* Check if it is a < /> tag */
-    if(m >= 2 && n->tag[m - 2] == '/')
+    return MARKUP_OPEN;
+}
+
+
+/** Split an opening or closing tag into its name and attributes.
+ * \param[in]  t      The text.
+ * \param[in]  pos    Offset of the '<' starting the tag.
+ * \param[in]  close  Offset of the '>' ending the tag.
+ * \param[out] tag    Set to the tag name.
+ * \param[out] attributes  Set to the text following the tag name.
+ */
+static void splitTag(const char *t, uint32_t pos, uint32_t close, xmlview_t *tag, xmlview_t *attributes)
+{
+    uint32_t start = pos + 1, end = close;
+
+    if(t[start] == '/')
     {
-        n->tag[m-2] = '\0';
-        dprintf("Found '<.../>' tag");
-        dprintf(n->tag);
-        n->content = NULL;
-        return true;
+        start++;
     }
 
-    /* May need to truncate tag to remove attributes */
-    r = 0;
-    do
+    if(t[end - 1] == '/')
     {
-        r++;
+        end--;
     }
-    while(n->tag[r] != '\0' && !isspace(n->tag[r]));
-    n->tag[r] = '\0';
-    n->attributes = &n->tag[r + 1];
 
-    dprintf("Found tag:");
-    dprintf(n->tag);
+    /* Skip space at the start of a tag eg. < tag> */
+    while(start < end && isspace(t[start]))
+    {
+        start++;
+    }
 
-    n->content = x_malloc(l = 256);
-    tagcount = 1;
-    m = 0;
+    tag->off = start;
+    while(start < end && !isspace(t[start]))
+    {
+        start++;
+    }
+    tag->len = start - tag->off;
 
-    /* Now read until the closing tag */
-    do
+    attributes->off = start;
+    attributes->len = end - start;
+}
+
+
+/** Find and decode the value of some attribute.
+ * \param[in,out] arena  Arena from which to allocate the value.
+ * \param[in]     t      The text.
+ * \param[in]     a      The attributes of a tag, as found by splitTag().
+ * \param[in]     attr   The name of the attribute to find.
+ * \returns The decoded value, or NULL if the attribute is not present.
+ */
+static const char *findAttribute(arenablock_t **arena, const char *t, const xmlview_t *a, const char *attr)
+{
+    const uint32_t attrLen = strlen(attr);
+    uint32_t       pos = a->off;
+    const uint32_t end = pos + a->len;
+
+    while(pos < end)
     {
-        r = getnextchar(n,&n->content[m++]);
+        uint32_t name, nameLen, value;
+        char     quote;
 
-        if(m > 1)
+        while(pos < end && isspace(t[pos]))
         {
-            /* Is there a new tag opening? */
-            if(n->content[m-2]=='<')
-            {
-                /* Is the tag opening or closing */
-                if(n->content[m-1]=='/')
-                    tagcount--;
+            pos++;
+        }
+
+        name = pos;
+        while(pos < end && !isspace(t[pos]) && t[pos] != '=')
+        {
+            pos++;
+        }
+        nameLen = pos - name;
+
+        while(pos < end && isspace(t[pos]))
+        {
+            pos++;
+        }
+
+        /* Ignore any attribute without a value */
+        if(pos >= end || t[pos] != '=')
+        {
+            continue;
+        }
+
+        pos++;
+        while(pos < end && isspace(t[pos]))
+        {
+            pos++;
+        }
+
+        if(pos >= end || (t[pos] != '"' && t[pos] != '\''))
+        {
+            break;
+        }
+
+        quote = t[pos++];
+        value = pos;
+
+        while(pos < end && t[pos] != quote)
+        {
+            pos++;
+        }
+
+        if(nameLen == attrLen && memcmp(&t[name], attr, attrLen) == 0)
+        {
+            return decode(arena, &t[value], pos - value);
+        }
+
+        pos++;
+    }
+
+    return NULL;
+}
+
+
+/** Add a new node to the document, returning its index.
+ */
+static uint32_t addNode(xmldoc_t *d)
+{
+    if(d->nodeCount == d->nodeSize)
+    {
+        d->nodeSize *= 2;
+        d->node = x_realloc(d->node, sizeof(xmlnode_t) * d->nodeSize);
+    }
+
+    memset(&d->node[d->nodeCount], 0, sizeof(xmlnode_t));
+
+    return d->nodeCount++;
+}
+
+
+/** Tokenise the whole document into the node array.
+ * Each element is visited exactly once, with its tag, attributes and
+ * content recorded as views into the document text.
+ */
+static bool tokenise(xmldoc_t *d)
+{
+    const char  *t = d->text;
+    openlevel_t *open;
+    uint32_t     depth, openSize, pos = 0;
+    const char  *lt;
+    bool         ok = true;
+
+    d->nodeSize = INITIAL_NODES;
+    d->node = x_malloc(sizeof(xmlnode_t) * d->nodeSize);
+
+    /* The root node contains the whole document */
+    addNode(d);
+    d->node[0].content.len = d->len;
+
+    openSize = INITIAL_DEPTH;
+    open = x_malloc(sizeof(openlevel_t) * openSize);
+    open[0].node = 0;
+    open[0].last = NODE_NONE;
+    depth = 1;
+
+    while(pos < d->len && (lt = memchr(&t[pos], '<', d->len - pos)) != NULL)
+    {
+        openlevel_t *parent = &open[depth - 1];
+        uint32_t     close, n;
+
+        pos = lt - t;
+
+        switch(scanMarkup(t, d->len, pos, &close))
+        {
+            case MARKUP_INCOMPLETE:
+                dprintf("Failed to find end of markup");
+                ok = false;
+                break;
+
+            case MARKUP_SKIP:
+                break;
+
+            case MARKUP_CLOSE:
+                if(depth <= 1)
+                {
+                    dprintf("Unexpected closing tag");
+                    ok = false;
+                    break;
+                }
+
+                /* Close the innermost element */
+                depth--;
+                d->node[open[depth].node].content.len = pos - d->node[open[depth].node].content.off;
+                break;
+
+            case MARKUP_OPEN:
+            case MARKUP_EMPTY:
+                n = addNode(d);
+                splitTag(t, pos, close, &d->node[n].tag, &d->node[n].attributes);
+                d->node[n].content.off = close + 1;
+
+                /* Link into the parent */
+                if(parent->last == NODE_NONE)
+                {
+                    d->node[parent->node].child = n;
+                }
                 else
-                    tagcount++;
-            }
+                {
+                    d->node[parent->last].next = n;
+                }
+                parent->last = n;
 
-            /* Catch any <blah/> style tags */
-            if(n->content[m-2]=='/' && n->content[m-1]=='>')
-            {
-                tagcount--;
-            }
+                if(t[close - 1] != '/')
+                {
+                    if(depth == openSize)
+                    {
+                        openSize *= 2;
+                        open = x_realloc(open, sizeof(openlevel_t) * openSize);
+                    }
+
+                    open[depth].node = n;
+                    open[depth].last = NODE_NONE;
+                    depth++;
+                }
+                break;
         }
 
-        if(m==l)
-            n->content = x_realloc(n->content, l += 256);
+        if(!ok)
+        {
+            break;
+        }
 
+        pos = close + 1;
     }
-    while(r == 1 && tagcount > 0);
 
-    if(r != 1)
+    free(open);
+
+    /* Check that everything was closed */
+    if(ok && depth != 1)
     {
         dprintf("Failed to find closing tag");
-        dprintf(n->tag);
-        free(n->tag);
-        free(n->content);
-        return false;
+        ok = false;
     }
 
-    /* Null terminate the content */
-    n->content[m-2] = '\0';
+    return ok;
+}
+
+
+/** Append some text to that held for the current SAX element.
+ */
+static void saxAddText(xmlsax_t *s, const char *text, uint32_t len)
+{
+    if(s->textLen + len > s->textSize)
+    {
+        while(s->textLen + len > s->textSize)
+        {
+            s->textSize = s->textSize ? s->textSize * 2 : 256;
+        }
+
+        s->text = x_realloc(s->text, s->textSize);
+    }
 
-    return true;
+    memcpy(&s->text[s->textLen], text, len);
+    s->textLen += len;
+}
+
+
+/** Report an opening, closing or empty element tag to the SAX callbacks.
+ */
+static void saxTag(xmlsax_t *s, markup_t kind, uint32_t pos, uint32_t close)
+{
+    const char *tag;
+    xmlview_t   tagView;
+
+    splitTag(s->buf, pos, close, &tagView, &s->attributes);
+    tag = decode(&s->arena, &s->buf[tagView.off], tagView.len);
+
+    if(kind == MARKUP_OPEN || kind == MARKUP_EMPTY)
+    {
+        if(s->done)
+        {
+            dprintf("Unexpected second document element");
+            s->failed = true;
+            return;
+        }
+
+        s->depth++;
+        s->leaf = true;
+
+        if(s->start)
+        {
+            s->start(s->param, s, tag);
+        }
+    }
+
+    if(kind == MARKUP_CLOSE || kind == MARKUP_EMPTY)
+    {
+        if(s->depth == 0)
+        {
+            dprintf("Unexpected closing tag");
+            s->failed = true;
+            return;
+        }
+
+        if(s->end)
+        {
+            const char *content = "";
+
+            if(s->leaf && kind == MARKUP_CLOSE)
+            {
+                content = decode(&s->arena, s->text, s->textLen);
+            }
+
+            s->end(s->param, s, tag, content);
+        }
+
+        s->depth--;
+        s->leaf = false;
+        s->done = s->depth == 0;
+    }
+
+    s->textLen = 0;
+    arenaReset(&s->arena);
 }
 
 /**************************************************************************
  * Global Functions
  **************************************************************************/
 
-/** Return some attribute value for a node in new memory.
- * This is the same as XmlGetAttribute(), but the returned string has been
- * allocated by malloc() and so must be free()'d at some point in the future.
- * \see XmlGetAttribute()
+/** Parse a document from a buffer.
+ * The document is tokenised in a single pass, with nodes referencing the
+ * buffer rather than copies of it.
+ * \param[in] buf  Buffer allocated by malloc(), which is owned by the
+ *                  returned document, or freed if parsing fails.
+ * \param[in] len  Length of the text in \a buf.
+ * \returns The parsed document, or NULL if the text is not well formed.
  */
-char *XmlGetAttributeDup(struct xmlnode *n, const char *attr)
+xmldoc_t *XmlParseBuf(char *buf, size_t len)
 {
-    const char *a = XmlGetAttribute(n, attr);
+    xmldoc_t *d;
 
-    if(a)
+    if(buf == NULL)
     {
-        return x_strdup(a);
+        return NULL;
     }
 
-    return NULL;
+    if(len >= UINT32_MAX)
+    {
+        free(buf);
+        return NULL;
+    }
+
+    d = x_zalloc(sizeof(xmldoc_t));
+    d->text = buf;
+    d->len = len;
+
+    if(!tokenise(d))
+    {
+        XmlDestroy(&d);
+    }
+
+    return d;
 }
 
 
-/** Return some attribute value for a node.
+/** Parse a document from a nul terminated string.
+ * The string is copied and so need not remain valid after the call.
  */
-const char *XmlGetAttribute(struct xmlnode *n, const char *attr)
+xmldoc_t *XmlParseStr(const char *s)
 {
-    const char    *s = n->attributes;
-    const uint32_t attrLen = strlen(attr);
-
-    while((s = strstr(s, attr)) != NULL)
+    if(s == NULL)
     {
-        const char *preS = s - 1;
-        const char *postS = s + attrLen;
-
-        /* Check if the attribute was found in isolation
-         *  i.e. not part of another attribute name.
-         */
-        if((s == n->attributes || isspace(*preS)) && (*postS == '=' || isspace(*postS)))
-        {
-            postS = skipSpace(postS);
+        return NULL;
+    }
 
-            if(*postS == '=')
-            {
-                postS++;
-                postS = skipSpace(postS);
-                if(*postS == '"')
-                {
-                    char *c, *r = x_strdup(postS + 1);
+    return XmlParseBuf(x_strdup(s), strlen(s));
+}
 
-                    if((c = strchr(r, '"')) != NULL)
-                        *c = '\0';
 
-                    n->freeList[n->freeListLen++] = r;
+/** Parse a document read from a file descriptor until end of file.
+ */
+xmldoc_t *XmlParseFd(int fd)
+{
+    size_t  len = 0, size = 4096;
+    char   *buf = x_malloc(size);
+    ssize_t r;
 
-                    return r;
-                }
-            }
+    while((r = read(fd, &buf[len], size - len)) > 0)
+    {
+        len += r;
+        if(len == size)
+        {
+            buf = x_realloc(buf, size *= 2);
         }
+    }
 
-        /* Skip the match */
-        s++;
+    if(r < 0)
+    {
+        free(buf);
+        return NULL;
     }
 
-    return NULL;
+    return XmlParseBuf(buf, len);
+}
+
+
+/** Get the document root.
+ * The root is not an element itself, but has the top level elements of the
+ * document as its children.
+ */
+const xmlnode_t *XmlGetRoot(const xmldoc_t *d)
+{
+    return &d->node[0];
+}
+
+
+/** Get the first child element of a node, or NULL if it has none.
+ */
+const xmlnode_t *XmlGetChild(const xmldoc_t *d, const xmlnode_t *n)
+{
+    return n->child == NODE_NONE ? NULL : &d->node[n->child];
 }
 
-/** Return the tag.
+
+/** Get the next sibling element of a node, or NULL if it has none.
  */
-const char *XmlGetTag(struct xmlnode *n)
+const xmlnode_t *XmlGetNext(const xmldoc_t *d, const xmlnode_t *n)
 {
-  return n->tag;
+    return n->next == NODE_NONE ? NULL : &d->node[n->next];
 }
 
 
 /** Compare the tag name with some string.
  */
-int XmlTagStrcmp(struct xmlnode *n, const char *str)
+int XmlTagStrcmp(const xmldoc_t *d, const xmlnode_t *n, const char *str)
 {
-    return strcmp(n->tag, str);
+    int r = strncmp(&d->text[n->tag.off], str, n->tag.len);
+
+    if(r == 0 && str[n->tag.len] != '\0')
+    {
+        r = -1;
+    }
+
+    return r;
 }
 
-/** Get the content.
+
+/** Find the first child of a node whose name matches the passed tag.
  */
-const char *XmlGetContent(struct xmlnode *n)
+const xmlnode_t *XmlFindSubNode(const xmldoc_t *d, const xmlnode_t *n, const char *tag)
 {
-    if(!n->converted)
+    if(n == NULL)
+    {
+        return NULL;
+    }
+
+    n = XmlGetChild(d, n);
+    while(n && XmlTagStrcmp(d, n, tag) != 0)
     {
-        convert(n->content);
-        n->converted = true;
+        n = XmlGetNext(d, n);
     }
-    return n->content;
+
+    return n;
 }
 
-/** Free a node and its storage.
- * \param[in,out] n  Pointer to node pointer to be freed.  If *n == NULL,
- *                    no action is taken.  *n is always set to NULL when
+
+/** Find the next sibling of a node whose name matches the passed tag.
+ */
+const xmlnode_t *XmlFindNextNode(const xmldoc_t *d, const xmlnode_t *n, const char *tag)
+{
+    do
+    {
+        n = XmlGetNext(d, n);
+    }
+    while(n && XmlTagStrcmp(d, n, tag) != 0);
+
+    return n;
+}
+
+
+/** Return some attribute value for a node.
+ * The returned string has had entities decoded and remains valid until the
+ * document is destroyed.
+ */
+const char *XmlGetAttribute(xmldoc_t *d, const xmlnode_t *n, const char *attr)
+{
+    return findAttribute(&d->arena, d->text, &n->attributes, attr);
+}
+
+
+/** Get the content of a node.
+ * The returned string has had entities decoded and remains valid until the
+ * document is destroyed.
+ */
+const char *XmlGetContent(xmldoc_t *d, const xmlnode_t *n)
+{
+    return decode(&d->arena, &d->text[n->content.off], n->content.len);
+}
+
+
+/** Return some attribute value for a node in new memory.
+ * This is the same as XmlGetAttribute(), but the returned string has been
+ * allocated by malloc() and so must be free()'d at some point in the future.
+ * \see XmlGetAttribute()
+ */
+char *XmlGetAttributeDup(xmldoc_t *d, const xmlnode_t *n, const char *attr)
+{
+    const char *a = XmlGetAttribute(d, n, attr);
+
+    if(a)
+    {
+        return x_strdup(a);
+    }
+
+    return NULL;
+}
+
+
+/** Return the content of a node in new memory.
+ * \see XmlGetContent()
+ */
+char *XmlGetContentDup(xmldoc_t *d, const xmlnode_t *n)
+{
+    return x_strdup(XmlGetContent(d, n));
+}
+
+
+/** Free a document and its storage.
+ * \param[in,out] d  Pointer to document pointer to be freed.  If *d == NULL,
+ *                    no action is taken.  *d is always set to NULL when
  *                    returning.
  */
-void XmlDestroy(struct xmlnode **n)
+void XmlDestroy(xmldoc_t **d)
+{
+    xmldoc_t *dd = *d;
+
+    if(dd)
+    {
+        arenaFree(&dd->arena);
+
+        free(dd->node);
+        free(dd->text);
+        free(dd);
+        *d = NULL;
+    }
+}
+
+/** Create a streaming parser.
+ * \param[in] start  Function to call as each element is opened, or NULL.
+ * \param[in] end    Function to call as each element is closed, or NULL.
+ * \param[in] param  Parameter to pass to the callbacks.
+ */
+xmlsax_t *XmlSaxNew(xmlsaxstart_t start, xmlsaxend_t end, void *param)
+{
+    xmlsax_t *s = x_zalloc(sizeof(xmlsax_t));
+
+    s->start = start;
+    s->end = end;
+    s->param = param;
+
+    return s;
+}
+
+
+/** Feed the next piece of a document to a streaming parser.
+ * Callbacks are made for every element tag completed by \a data.  Only
+ * incomplete markup and the text of the current element are kept until
+ * the next call.
+ * \returns false if the document is not well formed.
+ */
+bool XmlSaxFeed(xmlsax_t *s, const void *data, size_t len)
 {
-    struct xmlnode *nn = *n;
+    uint32_t pos = 0;
+
+    if(s->failed)
+    {
+        return false;
+    }
 
-    if(nn)
+    if(s->len + len > s->size)
     {
-        if(nn->tag)
+        if((uint64_t)s->len + len >= UINT32_MAX)
         {
-            free(nn->tag);
+            s->failed = true;
+            return false;
         }
 
-        if(nn->content)
+        while(s->len + len > s->size)
         {
-            free(nn->content);
+            s->size = s->size ? s->size * 2 : 4096;
         }
 
-        while(nn->freeListLen-- > 0)
+        s->buf = x_realloc(s->buf, s->size);
+    }
+
+    memcpy(&s->buf[s->len], data, len);
+    s->len += len;
+
+    while(pos < s->len && !s->failed)
+    {
+        const char *lt = memchr(&s->buf[pos], '<', s->len - pos);
+        uint32_t    close;
+        markup_t    kind;
+
+        if(lt == NULL || lt != &s->buf[pos])
         {
-            free(nn->freeList[nn->freeListLen]);
+            const uint32_t textLen = lt ? lt - &s->buf[pos] : s->len - pos;
+
+            /* Text outside the document element is ignored */
+            if(s->depth > 0)
+            {
+                saxAddText(s, &s->buf[pos], textLen);
+            }
+
+            pos += textLen;
+            continue;
         }
 
-        free(nn);
-        *n = NULL;
+        kind = scanMarkup(s->buf, s->len, pos, &close);
+        if(kind == MARKUP_INCOMPLETE)
+        {
+            /* Wait for more data */
+            break;
+        }
+
+        if(kind != MARKUP_SKIP)
+        {
+            saxTag(s, kind, pos, close);
+        }
+
+        pos = close + 1;
     }
+
+    /* Keep anything not yet parsed */
+    memmove(s->buf, &s->buf[pos], s->len - pos);
+    s->len -= pos;
+
+    return !s->failed;
 }
 
-/** Parse some XML from a file descriptor.
- * \param[in,out] n  Pointer to a node pointer. If *n != NULL, it will be freed.
+
+/** Return some attribute value for the element being opened.
+ * This may only be called from the start callback, and the returned string
+ * is valid until the callback returns.
+ */
+const char *XmlSaxGetAttribute(xmlsax_t *s, const char *attr)
+{
+    return findAttribute(&s->arena, s->buf, &s->attributes, attr);
+}
+
+
+/** Get the depth of the element being opened or closed.
+ * The document element has a depth of 1, its children 2, and so on.
  */
-bool XmlParseFd(struct xmlnode **n, int fd)
+unsigned int XmlSaxGetDepth(const xmlsax_t *s)
 {
-    XmlDestroy(n);
+    return s->depth;
+}
+
 
-    *n = x_zalloc(sizeof(struct xmlnode));
-    (*n)->fd = fd;
+/** Finish with a streaming parser, and free it.
+ * \param[in,out] s  Pointer to the parser, which is set to NULL.
+ * \returns true if a complete and well formed document was parsed.
+ */
+bool XmlSaxFinish(xmlsax_t **s)
+{
+    xmlsax_t *ss = *s;
+    bool      ok;
 
-    if(!Parse(*n))
+    if(ss == NULL)
     {
-        free(*n);
-        *n=NULL;
         return false;
     }
 
-    return true;
+    ok = !ss->failed && ss->done && ss->len == 0;
+
+    arenaFree(&ss->arena);
+    free(ss->buf);
+    free(ss->text);
+    free(ss);
+    *s = NULL;
+
+    return ok;
 }
 
+/**************************************************************************
+ * Module Test
+ **************************************************************************/
 
-/** Parse from a string buffer.
- * Parse some XML in a string, returning the position in the string reached,
- * or NULL if the string was exhausted and no node was found.
- * \param[in,out] n  Pointer to a node pointer. If *n != NULL, it will be freed.
+#ifdef XMLPARSE_MODULE_TEST
+
+/*
+ * Benchmark parsing of some large document, such as a release with many
+ * mediums, by repeatedly parsing it and decoding every tag and attribute.
+ * The document is parsed into a tree, then streamed in pieces of the given
+ * size.
+ *
+ * gcc -std=gnu99 -O2 -DXMLPARSE_MODULE_TEST xmlparse.c x_mem.c
+ * ./a.out release.xml 100 4096
  */
-const char *XmlParseStr(struct xmlnode **n, const char *s)
+
+#include <fcntl.h>
+#include <time.h>
+
+static uint32_t walk(xmldoc_t *d, const xmlnode_t *n)
 {
-    XmlDestroy(n);
+    uint32_t count = 0;
 
-    if(s == NULL)
+    for(n = XmlGetChild(d, n); n; n = XmlGetNext(d, n))
     {
-        return NULL;
+        XmlGetAttribute(d, n, "id");
+        if(n->child == NODE_NONE)
+        {
+            XmlGetContent(d, n);
+        }
+
+        count += 1 + walk(d, n);
     }
 
-    *n = x_zalloc(sizeof(struct xmlnode));
-    (*n)->fd = -1;
-    (*n)->array = s;
-    if(!Parse(*n))
+    return count;
+}
+
+static void saxStart(void *param, xmlsax_t *s, const char *tag)
+{
+    (void)tag;
+
+    XmlSaxGetAttribute(s, "id");
+    (*(uint32_t *)param)++;
+}
+
+static double msSince(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec start;
+    uint32_t        nodes = 0, saxNodes = 0, chunk;
+    xmldoc_t       *d;
+    char           *buf;
+    int             fd, iterations;
+
+    if(argc < 4 || (fd = open(argv[1], O_RDONLY)) < 0)
     {
-        free(*n);
-        *n = NULL;
-        return NULL;
+        fprintf(stderr, "Usage: %s <file.xml> <iterations> <chunk size>\n", argv[0]);
+        return EXIT_FAILURE;
     }
-    else
+
+    d = XmlParseFd(fd);
+    close(fd);
+    if(d == NULL)
     {
-        return (*n)->array;
+        fprintf(stderr, "Failed to parse %s\n", argv[1]);
+        return EXIT_FAILURE;
     }
-}
 
+    iterations = atoi(argv[2]);
+    chunk = atoi(argv[3]);
 
-/** Find a sub-node whose name matches the passed tag.
- */
-struct xmlnode *XmlFindSubNode(struct xmlnode *n, const char *tag)
-{
-    struct xmlnode *r = NULL;
-    const char     *s;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if(n == NULL)
+    for(int i = 0; i < iterations; i++)
     {
-        return NULL;
+        xmldoc_t *dd;
+
+        buf = x_malloc(d->len);
+        memcpy(buf, d->text, d->len);
+
+        dd = XmlParseBuf(buf, d->len);
+        nodes = walk(dd, XmlGetRoot(dd));
+        XmlDestroy(&dd);
     }
 
-    s = XmlGetContent(n);
-    do
+    printf("%u bytes, %u nodes: %.3f ms per parse\n", d->len, nodes, msSince(&start) / iterations);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(int i = 0; i < iterations; i++)
     {
-        XmlDestroy(&r);
-        s = XmlParseStr(&r, s);
-    }
-    while(r && XmlTagStrcmp(r, tag) != 0);
+        xmlsax_t *s = XmlSaxNew(saxStart, NULL, &saxNodes);
 
-    return r;
-}
+        saxNodes = 0;
 
+        for(uint32_t pos = 0; pos < d->len; pos += chunk)
+        {
+            XmlSaxFeed(s, &d->text[pos], d->len - pos < chunk ? d->len - pos : chunk);
+        }
 
-/** Same as XmlFindSubNode(), but frees the past node before returning.
- */
-struct xmlnode *XmlFindSubNodeFree(struct xmlnode *n, const char *tag)
-{
-    struct xmlnode *r = XmlFindSubNode(n, tag);
+        if(!XmlSaxFinish(&s))
+        {
+            fprintf(stderr, "Failed to stream %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    XmlDestroy(&n);
+    printf("%u bytes, %u nodes: %.3f ms per stream\n", d->len, saxNodes, msSince(&start) / iterations);
 
-    return r;
+    XmlDestroy(&d);
+
+    return EXIT_SUCCESS;
 }
+#endif
 
 /* END OF FILE */
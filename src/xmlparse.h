@@ -23,23 +23,60 @@
 #define XMLPARSE_HEADER
 
 #include <stdbool.h>
+#include <stddef.h>
 
-typedef struct xmlnode *xmlnode_t;
+/** A parsed XML document.
+ * The document owns the text it was parsed from together with a compact
+ * array of nodes that index into it, and an arena from which decoded
+ * strings are returned.  Everything is released by XmlDestroy().
+ */
+typedef struct xmldoc xmldoc_t;
+
+/** A single element within a document. */
+typedef struct xmlnode xmlnode_t;
+
+/** A streaming parser, to which a document is fed in pieces.
+ * Callbacks are made as each element is opened and closed, without the
+ * document ever being held in memory.
+ */
+typedef struct xmlsax xmlsax_t;
+
+/** Callback for the opening of an element.
+ * The attributes of the element may be read with XmlSaxGetAttribute().
+ */
+typedef void (*xmlsaxstart_t)(void *param, xmlsax_t *s, const char *tag);
+
+/** Callback for the closing of an element.
+ *  content is the decoded text of an element without child elements, or
+ * an empty string otherwise.
+ */
+typedef void (*xmlsaxend_t)(void *param, xmlsax_t *s, const char *tag, const char *content);
+
+xmldoc_t        *XmlParseFd(int fd);
+xmldoc_t        *XmlParseBuf(char *buf, size_t len);
+xmldoc_t        *XmlParseStr(const char *s);
+
+const xmlnode_t *XmlGetRoot(const xmldoc_t *d);
+const xmlnode_t *XmlGetChild(const xmldoc_t *d, const xmlnode_t *n);
+const xmlnode_t *XmlGetNext(const xmldoc_t *d, const xmlnode_t *n);
 
-bool        XmlParseFd(struct xmlnode **n,int fd);
-const char *XmlParseStr(struct xmlnode **n,const char *s);
+int              XmlTagStrcmp(const xmldoc_t *d, const xmlnode_t *n, const char *str);
+const xmlnode_t *XmlFindSubNode(const xmldoc_t *d, const xmlnode_t *n, const char *tag);
+const xmlnode_t *XmlFindNextNode(const xmldoc_t *d, const xmlnode_t *n, const char *tag);
 
-const char *XmlGetTag(struct xmlnode *n);
-const char *XmlGetAttribute(struct xmlnode *n, const char *attr);
-const char *XmlGetContent(struct xmlnode *n);
+const char      *XmlGetAttribute(xmldoc_t *d, const xmlnode_t *n, const char *attr);
+const char      *XmlGetContent(xmldoc_t *d, const xmlnode_t *n);
 
-char       *XmlGetAttributeDup(struct xmlnode *n, const char *attr);
+char            *XmlGetAttributeDup(xmldoc_t *d, const xmlnode_t *n, const char *attr);
+char            *XmlGetContentDup(xmldoc_t *d, const xmlnode_t *n);
 
-int         XmlTagStrcmp(struct xmlnode *n, const char *str);
-struct xmlnode *XmlFindSubNode(struct xmlnode *n, const char *tag);
-struct xmlnode *XmlFindSubNodeFree(struct xmlnode *n, const char *tag);
+void             XmlDestroy(xmldoc_t **d);
 
-void XmlDestroy(struct xmlnode **n);
+xmlsax_t        *XmlSaxNew(xmlsaxstart_t start, xmlsaxend_t end, void *param);
+bool             XmlSaxFeed(xmlsax_t *s, const void *data, size_t len);
+const char      *XmlSaxGetAttribute(xmlsax_t *s, const char *attr);
+unsigned int     XmlSaxGetDepth(const xmlsax_t *s);
+bool             XmlSaxFinish(xmlsax_t **s);
 
 #endif
 
@@ -0,0 +1,22 @@
+#!/bin/bash
+#
+# Run the JSON tokenizer module test.
+#
+
+SRC=${TOP:-./}../src
+CC=${CC:-cc}
+
+if ! $CC -std=gnu99 -DJSONPARSE_MODULE_TEST -I$SRC -o jsonparse.test \
+       $SRC/jsonparse.c $SRC/log.c $SRC/x_mem.c -lpthread ; then
+  echo "Failed to build the jsonparse module test."
+  exit 1
+fi
+
+./jsonparse.test
+RC=$?
+
+rm -f jsonparse.test
+
+exit $RC
+
+# END OF SCRIPT
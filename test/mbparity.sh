@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Check that the XML and JSON MusicBrainz backends give identical results
+# for the recorded responses in mb/, both combined and per-release.
+#
+
+SRC=${TOP:-./}../src
+CC=${CC:-cc}
+DISCS="Xl2Yw8cI1nq2QTmJb.sbRYU0wwA- aTr0Qe7m2vLmzGf5UfC_Pq8hJbc-"
+
+CURL=`pkg-config --cflags --libs libcurl 2> /dev/null`
+
+# A missing dependency skips the test, but a failure to build does not
+if [ -z "$CURL" ] ; then
+  echo "Could not find libcurl.  Skipping test."
+  exit 77
+fi
+
+if ! $CC -std=gnu99 -DMODULE_TEST -DVERSION=\"test\" -I$SRC -o mbparity.test \
+       $SRC/mblookup.c $SRC/mbcache.c $SRC/xmlparse.c $SRC/jsonparse.c \
+       $SRC/curlfetch.c $SRC/log.c $SRC/x_mem.c $CURL -lpthread ; then
+  echo "Failed to build the mblookup module test."
+  exit 1
+fi
+
+# Work on a copy so that the fixtures are never altered or evicted
+rm -rf mbparity.d
+cp -r ${TOP:-./}mb mbparity.d &&
+chmod -R u+w mbparity.d &&
+./mbparity.test -p mbparity.d $DISCS &&
+./mbparity.test -P -p mbparity.d $DISCS
+RC=$?
+
+rm -rf mbparity.test mbparity.d
+
+exit $RC
+
+# END OF SCRIPT